@@ -41,12 +41,14 @@ check_include_file(signal.h HAVE_SIGNAL_H)
 check_include_file(stdint.h HAVE_STDINT_H)
 check_include_file(unistd.h HAVE_UNISTD_H)
 check_include_file(pthread.h HAVE_PTHREAD_H)
+check_include_file(sys/eventfd.h HAVE_SYS_EVENTFD_H)
 check_include_file(sys/ioctl.h HAVE_SYS_IOCTL_H)
 check_include_file(sys/param.h HAVE_SYS_PARAM_H)
 check_include_file(sys/resource.h HAVE_SYS_RESOURCE_H)
 check_include_file(sys/socket.h HAVE_SYS_SOCKET_H)
 check_include_file(sys/stat.h HAVE_SYS_STAT_H)
 check_include_file(sys/time.h HAVE_SYS_TIME_H)
+check_include_file(sys/uio.h HAVE_SYS_UIO_H)
 check_include_file(sys/un.h HAVE_SYS_UN_H)
 check_include_file(poll.h HAVE_POLL_H)
 check_include_file(sys/poll.h HAVE_SYS_POLL_H)
@@ -86,6 +88,11 @@ set(PACKAGE ${PACKAGE_NAME})
 set(PACKAGE_STRING "${PACKAGE_NAME} ${PACKAGE_VERSION}")
 set(VERSION ${thrift_VERSION})
 
+# optional compression libraries of THeaderTransport
+set(HAVE_ZSTD ${WITH_ZSTD})
+set(HAVE_LZ4 ${WITH_LZ4})
+set(HAVE_LIBDEFLATE ${WITH_LIBDEFLATE})
+
 # generate a config.h file
 configure_file("${CMAKE_CURRENT_SOURCE_DIR}/build/cmake/config.h.in" "${CMAKE_CURRENT_BINARY_DIR}/thrift/config.h")
 
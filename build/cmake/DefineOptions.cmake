@@ -58,6 +58,15 @@ if(WITH_CPP)
     find_package(ZLIB QUIET)
     CMAKE_DEPENDENT_OPTION(WITH_ZLIB "Build with ZLIB support" ON
                            "ZLIB_FOUND" OFF)
+    find_package(Zstd QUIET)
+    CMAKE_DEPENDENT_OPTION(WITH_ZSTD "Build THeaderTransport with zstd support" ON
+                           "WITH_ZLIB;Zstd_FOUND" OFF)
+    find_package(LZ4 QUIET)
+    CMAKE_DEPENDENT_OPTION(WITH_LZ4 "Build THeaderTransport with LZ4 support" ON
+                           "WITH_ZLIB;LZ4_FOUND" OFF)
+    find_package(Libdeflate QUIET)
+    CMAKE_DEPENDENT_OPTION(WITH_LIBDEFLATE "Build THeaderTransport with libdeflate for zlib frames" ON
+                           "WITH_ZLIB;Libdeflate_FOUND" OFF)
     find_package(Libevent QUIET)
     CMAKE_DEPENDENT_OPTION(WITH_LIBEVENT "Build with libevent support" ON
                            "Libevent_FOUND" OFF)
@@ -175,6 +184,9 @@ if (BUILD_CPP)
     message(STATUS "    Build with libevent support:              ${WITH_LIBEVENT}")
     message(STATUS "    Build with Qt5 support:                   ${WITH_QT5}")
     message(STATUS "    Build with ZLIB support:                  ${WITH_ZLIB}")
+    message(STATUS "    Build with zstd support:                  ${WITH_ZSTD}")
+    message(STATUS "    Build with LZ4 support:                   ${WITH_LZ4}")
+    message(STATUS "    Build with libdeflate support:            ${WITH_LIBDEFLATE}")
 endif ()
 message(STATUS)
 message(STATUS "  Build C (GLib) library:                     ${BUILD_C_GLIB}")
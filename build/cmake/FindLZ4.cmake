@@ -0,0 +1,36 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements. See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership. The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License. You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied. See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+# find LZ4, a very fast compression library (https://lz4.org/)
+#
+# Usage:
+# LZ4_INCLUDE_DIRS, where to find lz4.h
+# LZ4_LIBRARIES, LZ4 library
+# LZ4_FOUND, If false, do not try to use LZ4
+
+find_path(LZ4_INCLUDE_DIRS lz4.h)
+find_library(LZ4_LIBRARIES NAMES lz4 liblz4)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LZ4 DEFAULT_MSG LZ4_LIBRARIES LZ4_INCLUDE_DIRS)
+
+mark_as_advanced(
+    LZ4_LIBRARIES
+    LZ4_INCLUDE_DIRS
+  )
@@ -0,0 +1,36 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements. See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership. The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License. You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied. See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+# find libdeflate, a fast whole-buffer DEFLATE library (https://github.com/ebiggers/libdeflate)
+#
+# Usage:
+# LIBDEFLATE_INCLUDE_DIRS, where to find libdeflate.h
+# LIBDEFLATE_LIBRARIES, libdeflate library
+# Libdeflate_FOUND, If false, do not try to use libdeflate
+
+find_path(LIBDEFLATE_INCLUDE_DIRS libdeflate.h)
+find_library(LIBDEFLATE_LIBRARIES NAMES deflate libdeflate)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Libdeflate DEFAULT_MSG LIBDEFLATE_LIBRARIES LIBDEFLATE_INCLUDE_DIRS)
+
+mark_as_advanced(
+    LIBDEFLATE_LIBRARIES
+    LIBDEFLATE_INCLUDE_DIRS
+  )
@@ -192,6 +192,11 @@ public:
   void generate_service_multiface(t_service* tservice);
   void generate_service_helpers(t_service* tservice);
   void generate_service_client(t_service* tservice, string style);
+  void generate_cob_client_future(std::ostream& out,
+                                  t_function* tfunction,
+                                  string scope,
+                                  string template_header,
+                                  string _this);
   void generate_service_processor(t_service* tservice, string style);
   void generate_service_skeleton(t_service* tservice);
   void generate_process_function(t_service* tservice,
@@ -268,6 +273,7 @@ public:
                                  std::string style,
                                  std::string prefix = "",
                                  bool name_params = true);
+  std::string future_signature(t_function* tfunction, std::string prefix);
   std::string cob_function_signature(t_function* tfunction,
                                      std::string prefix = "",
                                      bool name_params = true);
@@ -2255,6 +2261,7 @@ void t_cpp_generator::generate_service(t_service* tservice) {
   if (gen_cob_style_) {
     f_header_ << "#include <thrift/transport/TBufferTransports.h>" << '\n' // TMemoryBuffer
               << "#include <functional>" << '\n'
+              << "#include <future>" << '\n'
               << "namespace apache { namespace thrift { namespace async {" << '\n'
               << "class TAsyncChannel;" << '\n' << "}}}" << '\n';
   }
@@ -2948,7 +2955,7 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
       f_header_ << indent() << "  channel_(channel)," << '\n' << indent()
                 << "  itrans_(new ::apache::thrift::transport::TMemoryBuffer())," << '\n'
                 << indent() << "  otrans_(new ::apache::thrift::transport::TMemoryBuffer()),"
-                << '\n';
+                << '\n' << indent() << "  protocolFactory_(protocolFactory)," << '\n';
       if (gen_templates_) {
         // TProtocolFactory classes return generic TProtocol pointers.
         // We have to dynamic cast to the Protocol_ type we are expecting.
@@ -2991,6 +2998,11 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
     generate_java_doc(f_header_, *f_iter);
     indent(f_header_) << function_signature(*f_iter, ifstyle)
                       << " override;" << '\n';
+    if (style == "Cob" && !(*f_iter)->is_oneway()) {
+      // the same call, completing a future instead of calling back; any
+      // number of them may be in flight on the channel
+      indent(f_header_) << future_signature(*f_iter, "") << ";" << '\n';
+    }
     // TODO(dreiss): Use private inheritance to avoid generating thise in cob-style.
     if (style == "Concurrent" && !(*f_iter)->is_oneway()) {
       // concurrent clients need to move the seqid from the send function to the
@@ -3037,7 +3049,8 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
                 << "::std::shared_ptr< ::apache::thrift::transport::TMemoryBuffer> itrans_;" << '\n'
                 << indent()
                 << "::std::shared_ptr< ::apache::thrift::transport::TMemoryBuffer> otrans_;"
-                << '\n';
+                << '\n' << indent()
+                << "::apache::thrift::protocol::TProtocolFactory* protocolFactory_;" << '\n';
     }
     f_header_ <<
       indent() << prot_ptr << " piprot_;" << '\n' <<
@@ -3130,6 +3143,10 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
     scope_down(out);
     out << '\n';
 
+    if (style == "Cob" && !(*f_iter)->is_oneway()) {
+      generate_cob_client_future(out, *f_iter, scope, template_header, _this);
+    }
+
     // if (style != "Cob") // TODO(dreiss): Libify the client and don't generate this for cob-style
     if (true) {
       t_type* send_func_return_type = g_type_void;
@@ -3225,8 +3242,8 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
           indent() << "::apache::thrift::protocol::TMessageType mtype;" << '\n';
         if(style == "Concurrent") {
           out << '\n' <<
-            indent() << "// the read mutex gets dropped and reacquired as part of waitForWork()" << '\n' <<
-            indent() << "// The destructor of this sentry wakes up other clients" << '\n' <<
+            indent() << "// The read baton is handed between callers as part of waitForWork()," << '\n' <<
+            indent() << "// and the destructor of this sentry passes it on and frees the call's slot" << '\n' <<
             indent() << "::apache::thrift::async::TConcurrentRecvSentry sentry(this->sync_.get(), seqid);" << '\n';
         }
         if (style == "Cob" && !gen_no_client_completion_) {
@@ -3383,7 +3400,7 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
               << indent() << "  this->sync_->updatePending(fname, mtype, rseqid);" << '\n'
               << '\n'
               << indent()
-              << "  // this will temporarily unlock the readMutex, and let other clients get work done" << '\n'
+              << "  // this hands the read baton to the caller the response is for, and waits to get it back" << '\n'
               << indent() << "  this->sync_->waitForWork(seqid);" << '\n'
               << indent() << "} // end while(true)" << '\n';
         }
@@ -3795,6 +3812,65 @@ void ProcessorGenerator::generate_factory() {
   f_out_ << indent() << "}" << '\n' << '\n';
 }
 
+/**
+ * Generates the future-returning variant of a cob client function.  It makes
+ * the call with a client of its own sharing the channel, so that any number
+ * of them can be outstanding at once, and completes the future from the
+ * callback.
+ *
+ * @param tfunction The function
+ */
+void t_cpp_generator::generate_cob_client_future(std::ostream& out,
+                                                 t_function* tfunction,
+                                                 string scope,
+                                                 string template_header,
+                                                 string _this) {
+  string client_type = service_name_ + "CobClient" + (gen_templates_ ? "T<Protocol_>" : "");
+  t_type* ttype = tfunction->get_returntype();
+  string funname = tfunction->get_name();
+
+  if (gen_templates_) {
+    indent(out) << template_header;
+  }
+  indent(out) << future_signature(tfunction, scope) << '\n';
+  scope_up(out);
+  indent(out) << "::std::shared_ptr< ::std::promise<" << type_name(ttype)
+              << " > > promise(new ::std::promise<" << type_name(ttype) << " >());" << '\n';
+  indent(out) << "::std::shared_ptr<" << client_type << " > client(new " << client_type << "("
+              << _this << "channel_, " << _this << "protocolFactory_));" << '\n';
+  indent(out) << "client->" << funname << "([promise, client](" << client_type << "* c) {"
+              << '\n';
+  indent_up();
+  indent(out) << "try {" << '\n';
+  indent_up();
+  if (ttype->is_void()) {
+    indent(out) << "c->recv_" << funname << "();" << '\n';
+    indent(out) << "promise->set_value();" << '\n';
+  } else if (is_complex_type(ttype)) {
+    indent(out) << type_name(ttype) << " _return;" << '\n';
+    indent(out) << "c->recv_" << funname << "(_return);" << '\n';
+    indent(out) << "promise->set_value(::std::move(_return));" << '\n';
+  } else {
+    indent(out) << "promise->set_value(c->recv_" << funname << "());" << '\n';
+  }
+  indent_down();
+  indent(out) << "} catch (...) {" << '\n';
+  indent(out) << "  promise->set_exception(::std::current_exception());" << '\n';
+  indent(out) << "}" << '\n';
+  indent_down();
+  indent(out) << "}";
+
+  const vector<t_field*>& fields = tfunction->get_arglist()->get_members();
+  vector<t_field*>::const_iterator fld_iter;
+  for (fld_iter = fields.begin(); fld_iter != fields.end(); ++fld_iter) {
+    out << ", " << (*fld_iter)->get_name();
+  }
+  out << ");" << '\n';
+  indent(out) << "return promise->get_future();" << '\n';
+  scope_down(out);
+  out << '\n';
+}
+
 /**
  * Generates a service processor definition.
  *
@@ -5012,6 +5088,18 @@ string t_cpp_generator::function_signature(t_function* tfunction,
   }
 }
 
+/**
+ * Renders the signature of the future-returning variant of a cob client
+ * function, of the form 'std::future<type> future_name(args)'
+ *
+ * @param tfunction Function definition
+ * @return String of rendered function definition
+ */
+string t_cpp_generator::future_signature(t_function* tfunction, string prefix) {
+  return "::std::future<" + type_name(tfunction->get_returntype()) + " > " + prefix + "future_"
+         + tfunction->get_name() + "(" + argument_list(tfunction->get_arglist()) + ")";
+}
+
 /**
  * Renders a field list
  *
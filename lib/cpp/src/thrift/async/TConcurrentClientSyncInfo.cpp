@@ -17,6 +17,7 @@
  * under the License.
  */
 
+#include <algorithm>
 #include <limits>
 #include <memory>
 #include <thrift/TApplicationException.h>
@@ -27,22 +28,27 @@ namespace apache { namespace thrift { namespace async {
 
 using namespace ::apache::thrift::concurrency;
 
-TConcurrentClientSyncInfo::TConcurrentClientSyncInfo() :
+TConcurrentClientSyncInfo::TConcurrentClientSyncInfo(size_t maxPendingCalls) :
   stop_(false),
-  seqidMutex_(),
   // test rollover all the time
   nextseqid_((std::numeric_limits<int32_t>::max)()-10),
-  seqidToMonitorMap_(),
-  freeMonitors_(),
+  slots_(),
+  slotMask_(0),
   writeMutex_(),
-  readMutex_(),
+  batonMutex_(),
+  reading_(false),
+  reader_(0),
+  waiters_(),
   recvPending_(false),
-  wakeupSomeone_(false),
   seqidPending_(0),
   fnamePending_(),
   mtypePending_(::apache::thrift::protocol::T_CALL)
 {
-  freeMonitors_.reserve(MONITOR_CACHE_SIZE);
+  size_t size = 1;
+  while(size < maxPendingCalls && size < (1u << 30))
+    size <<= 1;
+  slots_.reset(new Slot[size]);
+  slotMask_ = static_cast<uint32_t>(size - 1);
 }
 
 bool TConcurrentClientSyncInfo::getPending(
@@ -52,7 +58,6 @@ bool TConcurrentClientSyncInfo::getPending(
 {
   if(stop_)
     throwDeadConnection_();
-  wakeupSomeone_ = false;
   if(recvPending_)
   {
     recvPending_ = false;
@@ -69,128 +74,142 @@ void TConcurrentClientSyncInfo::updatePending(
   ::apache::thrift::protocol::TMessageType mtype,
   int32_t rseqid)
 {
+  if(!isPending_(rseqid))
+    throwBadSeqId_();
   recvPending_ = true;
   seqidPending_ = rseqid;
   fnamePending_ = fname;
   mtypePending_ = mtype;
-  MonitorPtr monitor;
-  {
-    Guard seqidGuard(seqidMutex_);
-    auto i = seqidToMonitorMap_.find(rseqid);
-    if(i == seqidToMonitorMap_.end())
-      throwBadSeqId_();
-    monitor = i->second;
-  }
-  monitor->notify();
 }
 
 void TConcurrentClientSyncInfo::waitForWork(int32_t seqid)
 {
-  MonitorPtr m;
-  {
-    Guard seqidGuard(seqidMutex_);
-    m = seqidToMonitorMap_[seqid];
-  }
-  while(true)
+  std::unique_lock<std::mutex> lock(batonMutex_);
+  if(stop_)
+    throwDeadConnection_();
+  // the parked response goes straight to its owner
+  passBaton_();
+  if(!waitForBaton_(lock, seqid))
+    throwDeadConnection_();
+}
+
+bool TConcurrentClientSyncInfo::isPending_(int32_t seqid)
+{
+  Slot &slot = slot_(seqid);
+  return slot.used && slot.seqid == seqid;
+}
+
+bool TConcurrentClientSyncInfo::acquireBaton_(int32_t seqid)
+{
+  std::unique_lock<std::mutex> lock(batonMutex_);
+  if(stop_)
+    return false;
+  if(!reading_)
   {
-    // be very careful about setting state in this loop that affects waking up.  You may exit
-    // this function, attempt to grab some work, and someone else could have beaten you (or not
-    // left) the read mutex, and that will put you right back in this loop, with the mangled
-    // state you left behind.
-    if(stop_)
-      throwDeadConnection_();
-    if(wakeupSomeone_)
-      return;
-    if(recvPending_ && seqidPending_ == seqid)
-      return;
-    m->waitForever();
+    reading_ = true;
+    reader_ = seqid;
+    return true;
   }
+  return waitForBaton_(lock, seqid);
 }
 
-void TConcurrentClientSyncInfo::throwBadSeqId_()
+void TConcurrentClientSyncInfo::releaseBaton_(int32_t seqid, bool committed)
 {
-  throw apache::thrift::TApplicationException(
-    TApplicationException::BAD_SEQUENCE_ID,
-    "server sent a bad seqid");
+  std::unique_lock<std::mutex> lock(batonMutex_);
+  slot_(seqid).used = false;
+  if(!committed)
+    markBad_();
+  if(reading_ && reader_ == seqid)
+    passBaton_();
 }
 
-void TConcurrentClientSyncInfo::throwDeadConnection_()
+bool TConcurrentClientSyncInfo::waitForBaton_(std::unique_lock<std::mutex> &lock, int32_t seqid)
 {
-  throw apache::thrift::transport::TTransportException(
-    apache::thrift::transport::TTransportException::NOT_OPEN,
-    "this client died on another thread, and is now in an unusable state");
+  Waiter waiter(seqid);
+  Slot &slot = slot_(seqid);
+  slot.waiter = &waiter;
+  waiters_.push_back(&waiter);
+  while(!waiter.baton && !stop_)
+    waiter.cv.wait(lock);
+  slot.waiter = nullptr;
+  if(!waiter.baton)
+    waiters_.erase(std::find(waiters_.begin(), waiters_.end(), &waiter));
+  return waiter.baton;
 }
 
-void TConcurrentClientSyncInfo::wakeupAnyone_(const Guard &)
+void TConcurrentClientSyncInfo::passBaton_()
 {
-  wakeupSomeone_ = true;
-  if(!seqidToMonitorMap_.empty())
+  Waiter *next = nullptr;
+  if(recvPending_)
+  {
+    // If the owner of the parked response isn't waiting yet, nobody reads
+    // until it comes for the baton.
+    Waiter *owner = slot_(seqidPending_).waiter;
+    if(owner && owner->seqid == seqidPending_)
+      next = owner;
+  }
+  else if(!waiters_.empty())
   {
-    // The monitor map maps integers to monitors.  Larger integers are more recent
-    // messages.  Since this is ordered, it means that the last element is the most recent.
     // We are trying to guess which thread will have its message complete next, so we are picking
     // the most recent. The oldest message is likely to be some polling, long lived message.
-    // If we guess right, the thread we wake up will handle the message that comes in.
-    // If we guess wrong, the thread we wake up will hand off the work to the correct thread,
-    // costing us an extra context switch.
-    seqidToMonitorMap_.rbegin()->second->notify();
+    // If we guess wrong, the thread we wake up will hand off the work to the correct thread.
+    next = waiters_.back();
+  }
+
+  if(!next)
+  {
+    reading_ = false;
+    return;
   }
+  waiters_.erase(std::find(waiters_.begin(), waiters_.end(), next));
+  reader_ = next->seqid;
+  next->baton = true;
+  next->cv.notify_one();
 }
 
-void TConcurrentClientSyncInfo::markBad_(const Guard &)
+void TConcurrentClientSyncInfo::throwBadSeqId_()
 {
-  wakeupSomeone_ = true;
-  stop_ = true;
-  for(auto & i : seqidToMonitorMap_)
-    i.second->notify();
+  throw apache::thrift::TApplicationException(
+    TApplicationException::BAD_SEQUENCE_ID,
+    "server sent a bad seqid");
 }
 
-TConcurrentClientSyncInfo::MonitorPtr
-TConcurrentClientSyncInfo::newMonitor_(const Guard &)
+void TConcurrentClientSyncInfo::throwDeadConnection_()
 {
-  if(freeMonitors_.empty())
-    return std::make_shared<Monitor>(&readMutex_);
-  MonitorPtr retval;
-  //swapping to avoid an atomic operation
-  retval.swap(freeMonitors_.back());
-  freeMonitors_.pop_back();
-  return retval;
+  throw apache::thrift::transport::TTransportException(
+    apache::thrift::transport::TTransportException::NOT_OPEN,
+    "this client died on another thread, and is now in an unusable state");
 }
 
-void TConcurrentClientSyncInfo::deleteMonitor_(
-  const Guard &,
-  TConcurrentClientSyncInfo::MonitorPtr &m) /*noexcept*/
+void TConcurrentClientSyncInfo::markBad_()
 {
-  if(freeMonitors_.size() > MONITOR_CACHE_SIZE)
-  {
-    m.reset();
-    return;
-  }
-  //freeMonitors_ was reserved up to MONITOR_CACHE_SIZE in the ctor,
-  //so this shouldn't throw
-  freeMonitors_.push_back(TConcurrentClientSyncInfo::MonitorPtr());
-  //swapping to avoid an atomic operation
-  m.swap(freeMonitors_.back());
+  stop_ = true;
+  for(auto waiter : waiters_)
+    waiter->cv.notify_one();
 }
 
 int32_t TConcurrentClientSyncInfo::generateSeqId()
 {
-  Guard seqidGuard(seqidMutex_);
   if(stop_)
     throwDeadConnection_();
 
-  if(!seqidToMonitorMap_.empty())
-    if(nextseqid_ == seqidToMonitorMap_.begin()->first)
-      throw apache::thrift::TApplicationException(
-        TApplicationException::BAD_SEQUENCE_ID,
-        "about to repeat a seqid");
-  int32_t newSeqId = nextseqid_;
-  if (nextseqid_ == (std::numeric_limits<int32_t>::max)())
-    nextseqid_ = (std::numeric_limits<int32_t>::min)();
-  else
-    ++nextseqid_;
-  seqidToMonitorMap_[newSeqId] = newMonitor_(seqidGuard);
-  return newSeqId;
+  // A seqid whose slot is taken by a call still in flight is skipped, so
+  // seqids in flight never repeat.
+  for(uint32_t i = 0; i <= slotMask_; ++i)
+  {
+    // wraps around, atomic arithmetic is two's complement
+    int32_t newSeqId = nextseqid_.fetch_add(1);
+    Slot &slot = slot_(newSeqId);
+    bool expected = false;
+    if(slot.used.compare_exchange_strong(expected, true))
+    {
+      slot.seqid = newSeqId;
+      return newSeqId;
+    }
+  }
+  throw apache::thrift::TApplicationException(
+    TApplicationException::BAD_SEQUENCE_ID,
+    "too many calls in flight");
 }
 
 TConcurrentRecvSentry::TConcurrentRecvSentry(TConcurrentClientSyncInfo *sync, int32_t seqid) :
@@ -198,22 +217,13 @@ TConcurrentRecvSentry::TConcurrentRecvSentry(TConcurrentClientSyncInfo *sync, in
   seqid_(seqid),
   committed_(false)
 {
-  sync_.getReadMutex().lock();
+  // if the client died, getPending() reports it
+  sync_.acquireBaton_(seqid_);
 }
 
 TConcurrentRecvSentry::~TConcurrentRecvSentry()
 {
-  {
-    Guard seqidGuard(sync_.seqidMutex_);
-    sync_.deleteMonitor_(seqidGuard, sync_.seqidToMonitorMap_[seqid_]);
-
-    sync_.seqidToMonitorMap_.erase(seqid_);
-    if(committed_)
-      sync_.wakeupAnyone_(seqidGuard);
-    else
-      sync_.markBad_(seqidGuard);
-  }
-  sync_.getReadMutex().unlock();
+  sync_.releaseBaton_(seqid_, committed_);
 }
 
 void TConcurrentRecvSentry::commit()
@@ -232,8 +242,8 @@ TConcurrentSendSentry::~TConcurrentSendSentry()
 {
   if(!committed_)
   {
-    Guard seqidGuard(sync_.seqidMutex_);
-    sync_.markBad_(seqidGuard);
+    std::lock_guard<std::mutex> batonGuard(sync_.batonMutex_);
+    sync_.markBad_();
   }
   sync_.getWriteMutex().unlock();
 }
@@ -21,11 +21,12 @@
 
 #include <thrift/protocol/TProtocol.h>
 #include <thrift/concurrency/Mutex.h>
-#include <thrift/concurrency/Monitor.h>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
-#include <map>
 
 namespace apache {
 namespace thrift {
@@ -58,63 +59,106 @@ private:
   bool committed_;
 };
 
+/**
+ * Coordinates the threads sharing a concurrent client, i.e. one connection.
+ *
+ * Each call in flight holds a slot of a fixed table, indexed by its seqid,
+ * which is claimed and released without locking.  Responses are read by
+ * one thread at a time, the one holding the read baton.  When it reads the
+ * header of another call's response, it parks the header and hands the
+ * baton straight to the thread waiting for that call, waking only it.  When
+ * it is done, the baton goes to the thread whose response is parked, or to
+ * the most recent caller waiting to read.
+ */
 class TConcurrentClientSyncInfo {
-private: // typedefs
-  typedef std::shared_ptr< ::apache::thrift::concurrency::Monitor> MonitorPtr;
-  typedef std::map<int32_t, MonitorPtr> MonitorMap;
-
 public:
-  TConcurrentClientSyncInfo();
+  /// Default # of calls that can be in flight at once
+  static const size_t MAX_PENDING_CALLS = 1024;
+
+  /**
+   * @param maxPendingCalls the # of calls that can be in flight at once,
+   *        rounded up to a power of two.
+   */
+  explicit TConcurrentClientSyncInfo(size_t maxPendingCalls = MAX_PENDING_CALLS);
 
   int32_t generateSeqId();
 
   bool getPending(std::string& fname,
                   ::apache::thrift::protocol::TMessageType& mtype,
-                  int32_t& rseqid); /* requires readMutex_ */
+                  int32_t& rseqid); /* requires the read baton */
 
   void updatePending(const std::string& fname,
                      ::apache::thrift::protocol::TMessageType mtype,
-                     int32_t rseqid); /* requires readMutex_ */
+                     int32_t rseqid); /* requires the read baton */
 
-  void waitForWork(int32_t seqid); /* requires readMutex_ */
+  void waitForWork(int32_t seqid); /* requires the read baton */
 
-  ::apache::thrift::concurrency::Mutex& getReadMutex() { return readMutex_; }
   ::apache::thrift::concurrency::Mutex& getWriteMutex() { return writeMutex_; }
 
-private: // constants
-  enum { MONITOR_CACHE_SIZE = 10 };
+  /**
+   * @deprecated Responses are read under the read baton, which callers get
+   *             through TConcurrentRecvSentry, and this mutex is not used
+   *             any more.  It is kept for code written against older
+   *             versions and will be removed.
+   */
+  ::apache::thrift::concurrency::Mutex& getReadMutex() { return readMutex_; }
+
+private: // types
+  /// A thread waiting for the read baton
+  struct Waiter {
+    explicit Waiter(int32_t id) : seqid(id), baton(false) {}
+    int32_t seqid;
+    bool baton;
+    std::condition_variable cv;
+  };
+
+  /// The state of one call in flight
+  struct Slot {
+    Slot() : used(false), seqid(0), waiter(nullptr) {}
+    std::atomic<bool> used;
+    std::atomic<int32_t> seqid;
+    Waiter* waiter; /* requires batonMutex_ */
+  };
 
 private: // functions
-  MonitorPtr newMonitor_(
-      const ::apache::thrift::concurrency::Guard& seqidGuard); /* requires seqidMutex_ */
-  void deleteMonitor_(const ::apache::thrift::concurrency::Guard& seqidGuard, MonitorPtr& m);
-      /*noexcept*/ /* requires seqidMutex_ */
-  void wakeupAnyone_(
-      const ::apache::thrift::concurrency::Guard& seqidGuard);           /* requires seqidMutex_ */
-  void markBad_(const ::apache::thrift::concurrency::Guard& seqidGuard); /* requires seqidMutex_ */
+  Slot& slot_(int32_t seqid) { return slots_[static_cast<uint32_t>(seqid) & slotMask_]; }
+  bool isPending_(int32_t seqid);
+
+  /// Take the read baton, or wait for it.  Returns false if the client died.
+  bool acquireBaton_(int32_t seqid);
+
+  /// Give up the read baton if held, and the slot of the call.
+  void releaseBaton_(int32_t seqid, bool committed);
+
+  bool waitForBaton_(std::unique_lock<std::mutex>& lock, int32_t seqid); /* requires batonMutex_ */
+  void passBaton_(); /* requires batonMutex_ */
+  void markBad_();   /* requires batonMutex_ */
   void throwBadSeqId_();
   void throwDeadConnection_();
 
 private: // data members
-  volatile bool stop_;
+  std::atomic<bool> stop_;
 
-  ::apache::thrift::concurrency::Mutex seqidMutex_;
-  // begin seqidMutex_ protected members
-  int32_t nextseqid_;
-  MonitorMap seqidToMonitorMap_;
-  std::vector<MonitorPtr> freeMonitors_;
-  // end seqidMutex_ protected members
+  std::atomic<int32_t> nextseqid_;
+  std::unique_ptr<Slot[]> slots_;
+  uint32_t slotMask_;
 
   ::apache::thrift::concurrency::Mutex writeMutex_;
+  ::apache::thrift::concurrency::Mutex readMutex_; // unused, see getReadMutex()
+
+  std::mutex batonMutex_;
+  // begin batonMutex_ protected members
+  bool reading_;
+  int32_t reader_;
+  std::vector<Waiter*> waiters_;
+  // end batonMutex_ protected members
 
-  ::apache::thrift::concurrency::Mutex readMutex_;
-  // begin readMutex_ protected members
+  // begin read baton protected members
   bool recvPending_;
-  bool wakeupSomeone_;
   int32_t seqidPending_;
   std::string fnamePending_;
   ::apache::thrift::protocol::TMessageType mtypePending_;
-  // end readMutex_ protected members
+  // end read baton protected members
 
   friend class TConcurrentSendSentry;
   friend class TConcurrentRecvSentry;
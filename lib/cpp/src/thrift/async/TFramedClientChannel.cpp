@@ -0,0 +1,436 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/async/TFramedClientChannel.h>
+#include <thrift/TConfiguration.h>
+#include <thrift/TOutput.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TProtocolException.h>
+#include <thrift/transport/PlatformSocket.h>
+#include <thrift/transport/TBufferTransports.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+using apache::thrift::protocol::TBinaryProtocolFactory;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::protocol::TProtocolException;
+using apache::thrift::protocol::TProtocolFactory;
+using apache::thrift::transport::TMemoryBuffer;
+
+namespace apache {
+namespace thrift {
+namespace async {
+
+namespace {
+
+/// Size of the frame length in front of each message
+const uint32_t FRAME_HEADER_SIZE = 4;
+
+void putFrameSize(uint8_t* buf, uint32_t size) {
+  buf[0] = static_cast<uint8_t>(size >> 24);
+  buf[1] = static_cast<uint8_t>(size >> 16);
+  buf[2] = static_cast<uint8_t>(size >> 8);
+  buf[3] = static_cast<uint8_t>(size);
+}
+
+uint32_t getFrameSize(const uint8_t* buf) {
+  return (static_cast<uint32_t>(buf[0]) << 24) | (static_cast<uint32_t>(buf[1]) << 16)
+         | (static_cast<uint32_t>(buf[2]) << 8) | static_cast<uint32_t>(buf[3]);
+}
+}
+
+TFramedClientChannel::TFramedClientChannel(const std::string& host,
+                                           int port,
+                                           struct event_base* eb,
+                                           std::shared_ptr<TProtocolFactory> protocolFactory)
+  : host_(host),
+    port_(port),
+    eb_(eb),
+    protocolFactory_(protocolFactory),
+    bev_(nullptr),
+    notifyEvent_(nullptr),
+    timeoutEvent_(nullptr),
+    callTimeout_(0),
+    nextSeqid_(0),
+    error_(false),
+    timedOut_(false),
+    numPending_(0),
+    numTimeouts_(0),
+    notified_(false),
+    timerArmed_(false),
+    frameBuf_(new TMemoryBuffer()) {
+  if (!protocolFactory_) {
+    protocolFactory_.reset(new TBinaryProtocolFactory());
+  }
+  frameProtocol_ = protocolFactory_->getProtocol(frameBuf_);
+
+  if (evutil_socketpair(AF_LOCAL, SOCK_STREAM, 0, notifyFds_) == -1) {
+    throw TException("TFramedClientChannel: socketpair failed");
+  }
+  if (evutil_make_socket_nonblocking(notifyFds_[0]) < 0
+      || evutil_make_socket_nonblocking(notifyFds_[1]) < 0) {
+    evutil_closesocket(notifyFds_[0]);
+    evutil_closesocket(notifyFds_[1]);
+    throw TException("TFramedClientChannel: could not make notification socket non-blocking");
+  }
+
+  notifyEvent_ = event_new(eb_, notifyFds_[0], EV_READ | EV_PERSIST, notifyHandler, this);
+  timeoutEvent_ = evtimer_new(eb_, timeoutHandler, this);
+  if (notifyEvent_ == nullptr || timeoutEvent_ == nullptr || event_add(notifyEvent_, nullptr) != 0) {
+    if (notifyEvent_ != nullptr) {
+      event_free(notifyEvent_);
+    }
+    if (timeoutEvent_ != nullptr) {
+      event_free(timeoutEvent_);
+    }
+    evutil_closesocket(notifyFds_[0]);
+    evutil_closesocket(notifyFds_[1]);
+    throw TException("TFramedClientChannel: could not add events");
+  }
+}
+
+TFramedClientChannel::~TFramedClientChannel() {
+  if (bev_ != nullptr) {
+    bufferevent_free(bev_);
+  }
+  event_free(timeoutEvent_);
+  event_free(notifyEvent_);
+  evutil_closesocket(notifyFds_[0]);
+  evutil_closesocket(notifyFds_[1]);
+}
+
+void TFramedClientChannel::sendAndRecvMessage(const VoidCallback& cob,
+                                              TMemoryBuffer* sendBuf,
+                                              TMemoryBuffer* recvBuf) {
+  submit(cob, sendBuf, recvBuf, callTimeout_);
+}
+
+void TFramedClientChannel::sendAndRecvMessage(const VoidCallback& cob,
+                                              TMemoryBuffer* sendBuf,
+                                              TMemoryBuffer* recvBuf,
+                                              int timeoutMs) {
+  submit(cob, sendBuf, recvBuf, timeoutMs);
+}
+
+void TFramedClientChannel::sendMessage(const VoidCallback& cob, TMemoryBuffer* message) {
+  submit(cob, message, nullptr, 0);
+}
+
+void TFramedClientChannel::recvMessage(const VoidCallback& cob, TMemoryBuffer* message) {
+  (void)cob;
+  (void)message;
+  throw TProtocolException(TProtocolException::NOT_IMPLEMENTED,
+                           "Unexpected call to TFramedClientChannel::recvMessage");
+}
+
+void TFramedClientChannel::submit(const VoidCallback& cob,
+                                  TMemoryBuffer* sendBuf,
+                                  TMemoryBuffer* recvBuf,
+                                  int timeoutMs) {
+  uint8_t* obuf;
+  uint32_t sz;
+  sendBuf->getBuffer(&obuf, &sz);
+
+  Request request;
+  request.oneway = (recvBuf == nullptr);
+  request.seqid = 0;
+  request.call.cob = cob;
+  request.call.recvBuf = recvBuf;
+  request.call.hasDeadline = (timeoutMs > 0);
+  if (request.call.hasDeadline) {
+    request.call.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  }
+
+  if (request.oneway) {
+    // nothing will come back, so there is no need for a sequence id of our own
+    request.frame.resize(FRAME_HEADER_SIZE);
+    putFrameSize(reinterpret_cast<uint8_t*>(&request.frame[0]), sz);
+    request.frame.append(reinterpret_cast<const char*>(obuf), sz);
+  } else {
+    // write the message header again with a sequence id unique to the channel
+    std::shared_ptr<TMemoryBuffer> in(new TMemoryBuffer(obuf, sz));
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    protocolFactory_->getProtocol(in)->readMessageBegin(name, type, seqid);
+    uint32_t headerSize = sz - in->available_read();
+
+    request.seqid = nextSeqid_++;
+    std::shared_ptr<TMemoryBuffer> out(new TMemoryBuffer(sz + 2 * FRAME_HEADER_SIZE));
+    uint8_t frameHeader[FRAME_HEADER_SIZE] = {0};
+    out->write(frameHeader, FRAME_HEADER_SIZE);
+    protocolFactory_->getProtocol(out)->writeMessageBegin(name, type, request.seqid);
+    out->write(obuf + headerSize, sz - headerSize);
+
+    uint8_t* frame;
+    uint32_t frameSize;
+    out->getBuffer(&frame, &frameSize);
+    putFrameSize(frame, frameSize - FRAME_HEADER_SIZE);
+    request.frame.assign(reinterpret_cast<const char*>(frame), frameSize);
+  }
+
+  bool notify;
+  {
+    concurrency::Guard g(mutex_);
+    requests_.push_back(std::move(request));
+    notify = !notified_;
+    notified_ = true;
+  }
+  if (notify) {
+    char byte = 0;
+    if (::send(notifyFds_[1], &byte, 1, 0) != 1) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      // the loop is woken already if the socket is full
+      if (errno_copy != THRIFT_EAGAIN) {
+        TOutput::instance().perror("TFramedClientChannel::submit() send() ", errno_copy);
+      }
+    }
+  }
+}
+
+void TFramedClientChannel::notifyHandler(evutil_socket_t fd, short which, void* arg) {
+  (void)which;
+  TFramedClientChannel* self = static_cast<TFramedClientChannel*>(arg);
+
+  char buf[64];
+  while (::recv(fd, buf, sizeof(buf), 0) > 0) {
+  }
+
+  std::vector<Request> requests;
+  {
+    concurrency::Guard g(self->mutex_);
+    requests.swap(self->requests_);
+    self->notified_ = false;
+  }
+  for (auto& request : requests) {
+    self->sendRequest(request);
+  }
+  self->armTimer();
+}
+
+void TFramedClientChannel::sendRequest(Request& request) {
+  if ((bev_ == nullptr && !connect())
+      || bufferevent_write(bev_, request.frame.data(), request.frame.size()) != 0) {
+    if (request.oneway) {
+      complete(request.call);
+    } else {
+      fail(request.call);
+    }
+    return;
+  }
+
+  if (request.oneway) {
+    complete(request.call);
+    return;
+  }
+  if (request.call.hasDeadline) {
+    expiries_.push(Expiry(request.call.deadline, request.seqid));
+  }
+  pending_[request.seqid] = std::move(request.call);
+  numPending_ = pending_.size();
+}
+
+bool TFramedClientChannel::connect() {
+  // callbacks are deferred so that none runs while we are in the middle of
+  // sending, or of running a cob
+  bev_ = bufferevent_socket_new(eb_, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+  if (bev_ == nullptr) {
+    TOutput::instance().printf("TFramedClientChannel: bufferevent_socket_new failed");
+    error_ = true;
+    return false;
+  }
+  bufferevent_setcb(bev_, readHandler, nullptr, eventHandler, this);
+  bufferevent_enable(bev_, EV_READ | EV_WRITE);
+  if (bufferevent_socket_connect_hostname(bev_, nullptr, AF_UNSPEC, host_.c_str(), port_) != 0) {
+    TOutput::instance().printf("TFramedClientChannel: could not connect to %s:%d", host_.c_str(), port_);
+    bufferevent_free(bev_);
+    bev_ = nullptr;
+    error_ = true;
+    return false;
+  }
+  error_ = false;
+  return true;
+}
+
+void TFramedClientChannel::disconnect() {
+  if (bev_ != nullptr) {
+    bufferevent_free(bev_);
+    bev_ = nullptr;
+  }
+  error_ = true;
+
+  std::unordered_map<int32_t, Call> failed;
+  failed.swap(pending_);
+  expiries_ = std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry> >();
+  numPending_ = 0;
+  for (auto& entry : failed) {
+    fail(entry.second);
+  }
+}
+
+void TFramedClientChannel::readHandler(struct bufferevent* bev, void* arg) {
+  (void)bev;
+  static_cast<TFramedClientChannel*>(arg)->readFrames();
+}
+
+void TFramedClientChannel::eventHandler(struct bufferevent* bev, short what, void* arg) {
+  TFramedClientChannel* self = static_cast<TFramedClientChannel*>(arg);
+  if (bev != self->bev_ || !(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT))) {
+    return;
+  }
+  if (what & BEV_EVENT_ERROR) {
+    int errno_copy = EVUTIL_SOCKET_ERROR();
+    TOutput::instance().perror("TFramedClientChannel: connection failed: ", errno_copy);
+  }
+  self->disconnect();
+}
+
+void TFramedClientChannel::readFrames() {
+  struct evbuffer* input = bufferevent_get_input(bev_);
+  for (;;) {
+    size_t available = evbuffer_get_length(input);
+    if (available < FRAME_HEADER_SIZE) {
+      return;
+    }
+    uint8_t frameHeader[FRAME_HEADER_SIZE];
+    evbuffer_copyout(input, frameHeader, FRAME_HEADER_SIZE);
+    uint32_t size = getFrameSize(frameHeader);
+    if (size == 0 || size > static_cast<uint32_t>(TConfiguration::DEFAULT_MAX_FRAME_SIZE)) {
+      TOutput::instance().printf("TFramedClientChannel: bad frame size %u", size);
+      disconnect();
+      return;
+    }
+    if (available < FRAME_HEADER_SIZE + size) {
+      return;
+    }
+    evbuffer_drain(input, FRAME_HEADER_SIZE);
+    uint8_t* frame = evbuffer_pullup(input, size);
+
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    try {
+      frameBuf_->resetBuffer(frame, size);
+      frameProtocol_->readMessageBegin(name, type, seqid);
+    } catch (const TException& e) {
+      TOutput::instance().printf("TFramedClientChannel: bad response: %s", e.what());
+      disconnect();
+      return;
+    }
+
+    auto it = pending_.find(seqid);
+    if (it == pending_.end()) {
+      // the response to a call that timed out
+      evbuffer_drain(input, size);
+      continue;
+    }
+    Call call = std::move(it->second);
+    pending_.erase(it);
+    numPending_ = pending_.size();
+    timedOut_ = false;
+
+    call.recvBuf->resetBuffer();
+    call.recvBuf->write(frame, size);
+    evbuffer_drain(input, size);
+    complete(call);
+  }
+}
+
+void TFramedClientChannel::timeoutHandler(evutil_socket_t fd, short which, void* arg) {
+  (void)fd;
+  (void)which;
+  TFramedClientChannel* self = static_cast<TFramedClientChannel*>(arg);
+  self->timerArmed_ = false;
+  self->expireCalls();
+  self->armTimer();
+}
+
+void TFramedClientChannel::expireCalls() {
+  // expiries of calls that have completed are only dropped here, when they
+  // come up
+  Deadline now = std::chrono::steady_clock::now();
+  while (!expiries_.empty() && expiries_.top().first <= now) {
+    int32_t seqid = expiries_.top().second;
+    expiries_.pop();
+    auto it = pending_.find(seqid);
+    if (it == pending_.end()) {
+      continue;
+    }
+    Call call = std::move(it->second);
+    pending_.erase(it);
+    numPending_ = pending_.size();
+    ++numTimeouts_;
+    timedOut_ = true;
+    fail(call);
+  }
+}
+
+void TFramedClientChannel::armTimer() {
+  if (expiries_.empty()) {
+    return;
+  }
+  Deadline earliest = expiries_.top().first;
+  if (timerArmed_ && timerDeadline_ <= earliest) {
+    return;
+  }
+
+  int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                   earliest - std::chrono::steady_clock::now()).count();
+  if (us < 0) {
+    us = 0;
+  }
+  struct timeval tv;
+  tv.tv_sec = static_cast<long>(us / 1000000);
+  tv.tv_usec = static_cast<long>(us % 1000000);
+  if (evtimer_add(timeoutEvent_, &tv) != 0) {
+    TOutput::instance().printf("TFramedClientChannel: evtimer_add failed");
+    return;
+  }
+  timerArmed_ = true;
+  timerDeadline_ = earliest;
+}
+
+void TFramedClientChannel::fail(Call& call) {
+  // an empty response makes recv_ throw
+  call.recvBuf->resetBuffer();
+  complete(call);
+}
+
+void TFramedClientChannel::complete(Call& call) {
+  // exceptions must not propagate into libevent
+  try {
+    call.cob();
+  } catch (const std::exception& e) {
+    TOutput::instance().printf("TFramedClientChannel: callback threw: %s", e.what());
+  } catch (...) {
+    TOutput::instance().printf("TFramedClientChannel: callback threw");
+  }
+}
+}
+}
+} // apache::thrift::async
@@ -0,0 +1,200 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TFRAMED_CLIENT_CHANNEL_H_
+#define _THRIFT_TFRAMED_CLIENT_CHANNEL_H_ 1
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <event2/util.h>
+#include <thrift/async/TAsyncChannel.h>
+#include <thrift/concurrency/Mutex.h>
+#include <thrift/protocol/TProtocol.h>
+
+struct event;
+struct event_base;
+struct bufferevent;
+
+namespace apache {
+namespace thrift {
+namespace transport {
+class TMemoryBuffer;
+}
+}
+}
+
+namespace apache {
+namespace thrift {
+namespace async {
+
+/**
+ * A TAsyncChannel talking framed Thrift over one TCP connection, driven by
+ * a libevent event_base that may be shared by any number of channels.
+ *
+ * Any number of calls may be outstanding on the connection.  The sequence
+ * id of each call is replaced with one unique to the channel, and responses
+ * are matched to their calls by it, in whatever order they arrive; so a
+ * cob client per call, or the future_ methods of a generated cob client,
+ * pipeline calls over the one connection.  The sequence ids of responses
+ * are left as the channel sent them, which generated cob clients ignore.
+ *
+ * Calls may be made from any thread; they are handed to the event loop,
+ * which sends them and runs their callbacks.  A call that times out or
+ * whose connection fails completes with an empty response, on which recv_
+ * throws a TTransportException.  The connection is made when the first call
+ * is sent, and made again by the first call after it failed.
+ *
+ * The channel must be destroyed while its event loop is not running it,
+ * e.g. from the loop thread; callbacks of calls still pending then are
+ * dropped without being run.
+ */
+class TFramedClientChannel : public TAsyncChannel {
+public:
+  using TAsyncChannel::VoidCallback;
+
+  TFramedClientChannel(const std::string& host,
+                       int port,
+                       struct event_base* eb,
+                       std::shared_ptr<protocol::TProtocolFactory> protocolFactory
+                       = std::shared_ptr<protocol::TProtocolFactory>());
+  ~TFramedClientChannel() override;
+
+  void sendAndRecvMessage(const VoidCallback& cob,
+                          apache::thrift::transport::TMemoryBuffer* sendBuf,
+                          apache::thrift::transport::TMemoryBuffer* recvBuf) override;
+
+  /**
+   * Send a call and receive its response, failing the call if the response
+   * has not arrived within timeoutMs milliseconds (0 waits forever).
+   */
+  void sendAndRecvMessage(const VoidCallback& cob,
+                          apache::thrift::transport::TMemoryBuffer* sendBuf,
+                          apache::thrift::transport::TMemoryBuffer* recvBuf,
+                          int timeoutMs);
+
+  /// Send a oneway call; cob runs once it has been queued on the connection.
+  void sendMessage(const VoidCallback& cob,
+                   apache::thrift::transport::TMemoryBuffer* message) override;
+
+  /// Not supported, responses only come with sendAndRecvMessage.
+  void recvMessage(const VoidCallback& cob,
+                   apache::thrift::transport::TMemoryBuffer* message) override;
+
+  bool good() const override { return !error_; }
+  bool error() const override { return error_; }
+  bool timedOut() const override { return timedOut_; }
+
+  /**
+   * Sets the timeout of calls made without one, in milliseconds; 0, the
+   * default, waits forever.
+   */
+  void setCallTimeout(int timeoutMs) { callTimeout_ = timeoutMs; }
+
+  int getCallTimeout() const { return callTimeout_; }
+
+  /// # of calls sent and waiting for their response
+  size_t getNumPendingCalls() const { return numPending_; }
+
+  /// # of calls that have timed out
+  uint64_t getNumTimeouts() const { return numTimeouts_; }
+
+private:
+  typedef std::chrono::steady_clock::time_point Deadline;
+
+  struct Call {
+    VoidCallback cob;
+    apache::thrift::transport::TMemoryBuffer* recvBuf;
+    Deadline deadline;
+    bool hasDeadline;
+  };
+
+  /// A call handed to the event loop
+  struct Request {
+    std::string frame;
+    bool oneway;
+    int32_t seqid;
+    Call call;
+  };
+
+  TFramedClientChannel(const TFramedClientChannel&);
+  TFramedClientChannel& operator=(const TFramedClientChannel&);
+
+  void submit(const VoidCallback& cob,
+              apache::thrift::transport::TMemoryBuffer* sendBuf,
+              apache::thrift::transport::TMemoryBuffer* recvBuf,
+              int timeoutMs);
+  void sendRequest(Request& request);
+  bool connect();
+  void disconnect();
+  void readFrames();
+  void expireCalls();
+  void armTimer();
+  void fail(Call& call);
+  void complete(Call& call);
+
+  static void notifyHandler(evutil_socket_t fd, short which, void* arg);
+  static void timeoutHandler(evutil_socket_t fd, short which, void* arg);
+  static void readHandler(struct bufferevent* bev, void* arg);
+  static void eventHandler(struct bufferevent* bev, short what, void* arg);
+
+  std::string host_;
+  int port_;
+  struct event_base* eb_;
+  std::shared_ptr<protocol::TProtocolFactory> protocolFactory_;
+  struct bufferevent* bev_;
+  struct event* notifyEvent_;
+  struct event* timeoutEvent_;
+  evutil_socket_t notifyFds_[2];
+
+  std::atomic<int> callTimeout_;
+  std::atomic<int32_t> nextSeqid_;
+  std::atomic<bool> error_;
+  std::atomic<bool> timedOut_;
+  std::atomic<size_t> numPending_;
+  std::atomic<uint64_t> numTimeouts_;
+
+  /// Calls not yet taken by the event loop, and whether it has been woken
+  concurrency::Mutex mutex_;
+  std::vector<Request> requests_;
+  bool notified_;
+
+  /// Sent calls by their sequence id, and their deadlines, earliest first
+  std::unordered_map<int32_t, Call> pending_;
+  typedef std::pair<Deadline, int32_t> Expiry;
+  std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry> > expiries_;
+  Deadline timerDeadline_;
+  bool timerArmed_;
+
+  /// For reading the sequence ids of responses
+  std::shared_ptr<apache::thrift::transport::TMemoryBuffer> frameBuf_;
+  std::shared_ptr<protocol::TProtocol> frameProtocol_;
+};
+}
+}
+} // apache::thrift::async
+
+#endif // #ifndef _THRIFT_TFRAMED_CLIENT_CHANNEL_H_
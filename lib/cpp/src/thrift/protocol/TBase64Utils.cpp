@@ -19,6 +19,13 @@
 
 #include <thrift/protocol/TBase64Utils.h>
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 using std::string;
 
 namespace apache {
@@ -310,6 +317,164 @@ void base64_decode(uint8_t* buf, uint32_t len) {
     }
   }
 }
+
+// The whole buffer versions encode 12 or 24 bytes at a time with SSSE3 or
+// AVX2 and decode 16 characters at a time with SSSE3, where the target
+// enables them, and use the tables above for the rest. Decoding 32
+// characters at a time with AVX2 measured no faster.
+
+#if defined(__SSSE3__)
+// Return the base64 values of the 16 characters in x, with 0xff bytes in
+// valid where the characters are in the base64 alphabet
+static __m128i decodeValues(__m128i x, __m128i& valid) {
+  const __m128i zero = _mm_setzero_si128();
+  // x - lo <= span, unsigned, for each range of the alphabet
+  const __m128i upper = _mm_cmpeq_epi8(
+      _mm_subs_epu8(_mm_sub_epi8(x, _mm_set1_epi8('A')), _mm_set1_epi8(25)), zero);
+  const __m128i lower = _mm_cmpeq_epi8(
+      _mm_subs_epu8(_mm_sub_epi8(x, _mm_set1_epi8('a')), _mm_set1_epi8(25)), zero);
+  const __m128i digit = _mm_cmpeq_epi8(
+      _mm_subs_epu8(_mm_sub_epi8(x, _mm_set1_epi8('0')), _mm_set1_epi8(9)), zero);
+  const __m128i plus = _mm_cmpeq_epi8(x, _mm_set1_epi8('+'));
+  const __m128i slash = _mm_cmpeq_epi8(x, _mm_set1_epi8('/'));
+  valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)),
+                       slash);
+  __m128i values = _mm_and_si128(upper, _mm_sub_epi8(x, _mm_set1_epi8('A')));
+  values = _mm_or_si128(values, _mm_and_si128(lower, _mm_sub_epi8(x, _mm_set1_epi8('a' - 26))));
+  values = _mm_or_si128(values, _mm_and_si128(digit, _mm_add_epi8(x, _mm_set1_epi8(52 - '0'))));
+  values = _mm_or_si128(values, _mm_and_si128(plus, _mm_set1_epi8(62)));
+  return _mm_or_si128(values, _mm_and_si128(slash, _mm_set1_epi8(63)));
+}
+
+// Encode the 12 bytes at the start of in, which must have 16 readable
+// bytes, into 16 characters at buf
+static void encodeBlock(const uint8_t* in, uint8_t* buf) {
+  __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+  // Each 4 byte lane gets the 3 input bytes as b1 b0 b2 b1
+  x = _mm_shuffle_epi8(x, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  // Move the four 6 bit values of each lane into bytes of their own
+  const __m128i hi = _mm_mulhi_epu16(_mm_and_si128(x, _mm_set1_epi32(0x0fc0fc00)),
+                                     _mm_set1_epi32(0x04000040));
+  const __m128i lo = _mm_mullo_epi16(_mm_and_si128(x, _mm_set1_epi32(0x003f03f0)),
+                                     _mm_set1_epi32(0x01000010));
+  const __m128i values = _mm_or_si128(hi, lo);
+  // Add the offset of the alphabet range of each value: 0-25, 26-51, 52-61,
+  // 62 and 63 map to indexes 13, 0, 1-10, 11 and 12 of the offset table
+  __m128i range = _mm_subs_epu8(values, _mm_set1_epi8(51));
+  range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), values),
+                                            _mm_set1_epi8(13)));
+  const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  x = _mm_add_epi8(values, _mm_shuffle_epi8(offsets, range));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(buf), x);
+}
+
+// Decode the 16 characters at in into 12 bytes at out, storing 16 bytes.
+// Returns false, storing nothing, if any character is not in the alphabet.
+static bool decodeBlock(const uint8_t* in, uint8_t* out) {
+  __m128i valid;
+  const __m128i values = decodeValues(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)),
+                                      valid);
+  if (_mm_movemask_epi8(valid) != 0xffff) {
+    return false;
+  }
+  // Join each lane's four 6 bit values into 24 bits, then put the bytes in order
+  const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  __m128i x = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+  x = _mm_shuffle_epi8(x, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out), x);
+  return true;
+}
+#endif
+
+#if defined(__AVX2__)
+// As encodeBlock, for the 24 bytes at the start of in, which must have 28
+// readable bytes, into 32 characters at buf
+static void encodeBlock2(const uint8_t* in, uint8_t* buf) {
+  __m256i x = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in))),
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 12)),
+      1);
+  x = _mm256_shuffle_epi8(x, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                             10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  const __m256i hi = _mm256_mulhi_epu16(_mm256_and_si256(x, _mm256_set1_epi32(0x0fc0fc00)),
+                                        _mm256_set1_epi32(0x04000040));
+  const __m256i lo = _mm256_mullo_epi16(_mm256_and_si256(x, _mm256_set1_epi32(0x003f03f0)),
+                                        _mm256_set1_epi32(0x01000010));
+  const __m256i values = _mm256_or_si256(hi, lo);
+  __m256i range = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+  range = _mm256_or_si256(range,
+                          _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), values),
+                                           _mm256_set1_epi8(13)));
+  const __m256i offsets = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0, 'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63,
+      'A', 0, 0);
+  x = _mm256_add_epi8(values, _mm256_shuffle_epi8(offsets, range));
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(buf), x);
+}
+#endif
+
+uint32_t base64_encode_buffer(const uint8_t* in, uint32_t len, uint8_t* buf) {
+  uint8_t* start = buf;
+  uint32_t i = 0;
+#if defined(__AVX2__)
+  for (; len - i >= 28; i += 24) {
+    encodeBlock2(in + i, buf);
+    buf += 32;
+  }
+#endif
+#if defined(__SSSE3__)
+  for (; len - i >= 16; i += 12) {
+    encodeBlock(in + i, buf);
+    buf += 16;
+  }
+#endif
+  for (; len - i >= 3; i += 3) {
+    base64_encode(in + i, 3, buf);
+    buf += 4;
+  }
+  if (i < len) {
+    base64_encode(in + i, len - i, buf);
+    buf += len - i + 1;
+  }
+  return static_cast<uint32_t>(buf - start);
+}
+
+uint32_t base64_decode_buffer(uint8_t* buf, uint32_t len) {
+  // Output never overtakes input, so blocks may store past their output
+  uint8_t* out = buf;
+  uint32_t i = 0;
+#if defined(__SSSE3__)
+  for (; len - i >= 16 && decodeBlock(buf + i, out); i += 16) {
+    out += 12;
+  }
+#endif
+  for (; len - i >= 4; i += 4) {
+    uint8_t a = kBase64DecodeTable[buf[i]];
+    uint8_t b = kBase64DecodeTable[buf[i + 1]];
+    uint8_t c = kBase64DecodeTable[buf[i + 2]];
+    uint8_t d = kBase64DecodeTable[buf[i + 3]];
+    out[0] = (a << 2) | (b >> 4);
+    out[1] = ((b << 4) & 0xf0) | (c >> 2);
+    out[2] = ((c << 6) & 0xc0) | d;
+    out += 3;
+  }
+  // Don't decode a single leftover value, which holds no whole byte
+  if (len - i > 1) {
+    uint8_t a = kBase64DecodeTable[buf[i]];
+    uint8_t b = kBase64DecodeTable[buf[i + 1]];
+    out[0] = (a << 2) | (b >> 4);
+    if (len - i > 2) {
+      uint8_t c = kBase64DecodeTable[buf[i + 2]];
+      out[1] = ((b << 4) & 0xf0) | (c >> 2);
+    }
+    out += len - i - 1;
+  }
+  return static_cast<uint32_t>(out - buf);
+}
 }
 }
 } // apache::thrift::protocol
@@ -38,6 +38,21 @@ void base64_encode(const uint8_t* in, uint32_t len, uint8_t* buf);
 // len is number of bytes to consume from input (must be 2, 3, or 4)
 // no '=' padding should be included in the input
 void base64_decode(uint8_t* buf, uint32_t len);
+
+// in must be at least len bytes
+// buf must be a buffer of at least ((len + 2) / 3) * 4 bytes and may not
+// overlap in
+// the data is not padded with '='; the caller can do this if desired
+// returns the number of bytes written to buf
+uint32_t base64_encode_buffer(const uint8_t* in, uint32_t len, uint8_t* buf);
+
+// buf must contain len base64 encoded values
+// buf will be changed to contain output bytes, decoded in place
+// no '=' padding should be included in the input
+// a single value left over after the last group of 4 is ignored
+// values outside the base64 alphabet decode as base64_decode() does
+// returns the number of output bytes
+uint32_t base64_decode_buffer(uint8_t* buf, uint32_t len);
 }
 }
 } // apache::thrift::protocol
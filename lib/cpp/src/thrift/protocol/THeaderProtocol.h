@@ -28,6 +28,7 @@
 #include <memory>
 
 using apache::thrift::transport::THeaderTransport;
+using apache::thrift::transport::THeaderMap;
 
 namespace apache {
 namespace thrift {
@@ -87,6 +88,8 @@ public:
   // these work with read headers
   const StringToStringMap& getHeaders() const { return trans_->getHeaders(); }
 
+  const THeaderMap& getHeaderMap() const { return trans_->getHeaderMap(); }
+
   /**
    * Writing functions.
    */
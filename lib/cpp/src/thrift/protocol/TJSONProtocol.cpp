@@ -21,11 +21,22 @@
 
 #include <boost/locale.hpp>
 
+#include <algorithm>
+#include <cerrno>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <locale>
 #include <sstream>
 #include <stdexcept>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #include <thrift/protocol/TBase64Utils.h>
 #include <thrift/transport/TTransportException.h>
@@ -49,8 +60,6 @@ static const uint8_t kJSONBackslash = '\\';
 static const uint8_t kJSONStringDelimiter = '"';
 static const uint8_t kJSONEscapeChar = 'u';
 
-static const std::string kJSONEscapePrefix("\\u00");
-
 static const uint32_t kThriftVersion1 = 1;
 
 static const std::string kThriftNan("NaN");
@@ -227,6 +236,19 @@ const static uint8_t kEscapeCharVals[7] = {
     '\t',
 };
 
+// Digits of the numbers 00 to 99, for formatting integers two digits at a time
+static const char kDigitPairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
 // Static helper functions
 
 // Read 1 character from the transport trans and verify that it is the
@@ -290,6 +312,100 @@ static bool isJSONNumeric(uint8_t ch) {
   return false;
 }
 
+// Return true if the 8 bytes in word include '"' or '\\', or a control
+// character if StopAtControl. Bytes from 0x80 up never match.
+template <bool StopAtControl>
+static bool hasJSONStringStop(uint64_t word) {
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  uint64_t quote = word ^ (ones * kJSONStringDelimiter);
+  uint64_t backslash = word ^ (ones * kJSONBackslash);
+  uint64_t hits = ((quote - ones) & ~quote) | ((backslash - ones) & ~backslash);
+  if (StopAtControl) {
+    hits |= (word - ones * 0x20) & ~word;
+  }
+  return (hits & highs) != 0;
+}
+
+// Return the number of bytes at the start of buf before the first '"' or
+// '\\', or the first control character if StopAtControl. Scans 32, 16 or 8
+// bytes at a time, as the target allows.
+template <bool StopAtControl>
+static uint32_t scanJSONString(const uint8_t* buf, uint32_t len) {
+  uint32_t i = 0;
+#if defined(__AVX2__)
+  const __m256i quote32 = _mm256_set1_epi8(kJSONStringDelimiter);
+  const __m256i backslash32 = _mm256_set1_epi8(kJSONBackslash);
+  const __m256i control32 = _mm256_set1_epi8(0x1F);
+  for (; len - i >= 32; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i));
+    __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote32),
+                                   _mm256_cmpeq_epi8(v, backslash32));
+    if (StopAtControl) {
+      hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(_mm256_max_epu8(v, control32), control32));
+    }
+    auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(hits));
+    if (mask != 0) {
+      return i + static_cast<uint32_t>(__builtin_ctz(mask));
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i quote16 = _mm_set1_epi8(kJSONStringDelimiter);
+  const __m128i backslash16 = _mm_set1_epi8(kJSONBackslash);
+  const __m128i control16 = _mm_set1_epi8(0x1F);
+  for (; len - i >= 16; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i));
+    __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(v, quote16), _mm_cmpeq_epi8(v, backslash16));
+    if (StopAtControl) {
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(_mm_max_epu8(v, control16), control16));
+    }
+    auto mask = static_cast<uint32_t>(_mm_movemask_epi8(hits));
+    if (mask != 0) {
+      return i + static_cast<uint32_t>(__builtin_ctz(mask));
+    }
+  }
+#endif
+  for (; len - i >= 8; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, buf + i, sizeof(word));
+    if (hasJSONStringStop<StopAtControl>(word)) {
+      break;
+    }
+  }
+  for (; i < len; ++i) {
+    uint8_t ch = buf[i];
+    if (ch == kJSONStringDelimiter || ch == kJSONBackslash || (StopAtControl && ch < 0x20)) {
+      break;
+    }
+  }
+  return i;
+}
+
+// Write the decimal digits of num to the bytes before end, returning where
+// they start. Needs 20 bytes for any int64_t.
+static char* formatJSONInteger(int64_t num, char* end) {
+  uint64_t mag = num < 0 ? 0 - static_cast<uint64_t>(num) : static_cast<uint64_t>(num);
+  char* pos = end;
+  while (mag >= 100) {
+    const char* pair = kDigitPairs + (mag % 100) * 2;
+    mag /= 100;
+    *--pos = pair[1];
+    *--pos = pair[0];
+  }
+  if (mag >= 10) {
+    const char* pair = kDigitPairs + mag * 2;
+    *--pos = pair[1];
+    *--pos = pair[0];
+  } else {
+    *--pos = static_cast<char>('0' + mag);
+  }
+  if (num < 0) {
+    *--pos = '-';
+  }
+  return pos;
+}
+
 // Return true if the code unit is high surrogate
 static bool isHighSurrogate(uint16_t val) {
   return val >= 0xD800 && val <= 0xDBFF;
@@ -422,12 +538,9 @@ void TJSONProtocol::popContext() {
 
 // Write the character ch as a JSON escape sequence ("\u00xx")
 uint32_t TJSONProtocol::writeJSONEscapeChar(uint8_t ch) {
-  trans_->write((const uint8_t*)kJSONEscapePrefix.c_str(),
-                static_cast<uint32_t>(kJSONEscapePrefix.length()));
-  uint8_t outCh = hexChar(ch >> 4);
-  trans_->write(&outCh, 1);
-  outCh = hexChar(ch);
-  trans_->write(&outCh, 1);
+  const uint8_t escape[6] = {kJSONBackslash, kJSONEscapeChar, '0', '0', hexChar(ch >> 4),
+                             hexChar(ch)};
+  trans_->write(escape, 6);
   return 6;
 }
 
@@ -459,15 +572,28 @@ uint32_t TJSONProtocol::writeJSONChar(uint8_t ch) {
 }
 
 // Write out the contents of the string str as a JSON string, escaping
-// characters as appropriate.
+// characters as appropriate. Runs of characters that need no escaping are
+// written with one call.
 uint32_t TJSONProtocol::writeJSONString(const std::string& str) {
   uint32_t result = context_->write(*trans_);
   result += 2; // For quotes
   trans_->write(&kJSONStringDelimiter, 1);
-  std::string::const_iterator iter(str.begin());
-  std::string::const_iterator end(str.end());
-  while (iter != end) {
-    result += writeJSONChar(*iter++);
+  if (str.length() > (std::numeric_limits<uint32_t>::max)())
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  const auto* pos = (const uint8_t*)str.data();
+  auto left = static_cast<uint32_t>(str.length());
+  while (left > 0) {
+    uint32_t run = scanJSONString<true>(pos, left);
+    if (run > 0) {
+      trans_->write(pos, run);
+      result += run;
+      pos += run;
+      left -= run;
+    }
+    if (left > 0) {
+      result += writeJSONChar(*pos++);
+      --left;
+    }
   }
   trans_->write(&kJSONStringDelimiter, 1);
   return result;
@@ -479,23 +605,19 @@ uint32_t TJSONProtocol::writeJSONBase64(const std::string& str) {
   uint32_t result = context_->write(*trans_);
   result += 2; // For quotes
   trans_->write(&kJSONStringDelimiter, 1);
-  uint8_t b[4];
+  uint8_t b[4096];
   const auto* bytes = (const uint8_t*)str.c_str();
   if (str.length() > (std::numeric_limits<uint32_t>::max)())
     throw TProtocolException(TProtocolException::SIZE_LIMIT);
   auto len = static_cast<uint32_t>(str.length());
-  while (len >= 3) {
-    // Encode 3 bytes at a time
-    base64_encode(bytes, 3, b);
-    trans_->write(b, 4);
-    result += 4;
-    bytes += 3;
-    len -= 3;
-  }
-  if (len) { // Handle remainder
-    base64_encode(bytes, len, b);
-    trans_->write(b, len + 1);
-    result += len + 1;
+  while (len > 0) {
+    // Encode as many whole groups of 3 bytes as fit in b at a time
+    uint32_t chunk = (std::min)(len, static_cast<uint32_t>(sizeof(b) / 4 * 3));
+    uint32_t encoded = base64_encode_buffer(bytes, chunk, b);
+    trans_->write(b, encoded);
+    result += encoded;
+    bytes += chunk;
+    len -= chunk;
   }
   trans_->write(&kJSONStringDelimiter, 1);
   return result;
@@ -503,71 +625,97 @@ uint32_t TJSONProtocol::writeJSONBase64(const std::string& str) {
 
 // Convert the given integer type to a JSON number, or a string
 // if the context requires it (eg: key in a map pair).
+// All the integer types written fit in int64_t.
 template <typename NumberType>
 uint32_t TJSONProtocol::writeJSONInteger(NumberType num) {
   uint32_t result = context_->write(*trans_);
-  std::string val(to_string(num));
+  // The digits of any int64_t, and quotes
+  char buf[24];
+  char* end = buf + sizeof(buf);
+  char* pos = end;
   bool escapeNum = context_->escapeNum();
   if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
+    *--pos = kJSONStringDelimiter;
   }
-  if (val.length() > (std::numeric_limits<uint32_t>::max)())
-    throw TProtocolException(TProtocolException::SIZE_LIMIT);
-  trans_->write((const uint8_t*)val.c_str(), static_cast<uint32_t>(val.length()));
-  result += static_cast<uint32_t>(val.length());
+  pos = formatJSONInteger(static_cast<int64_t>(num), pos);
   if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
+    *--pos = kJSONStringDelimiter;
   }
-  return result;
+  auto len = static_cast<uint32_t>(end - pos);
+  trans_->write((const uint8_t*)pos, len);
+  return result + len;
 }
 
 namespace {
+const int kDoublePrecision = 2 + std::numeric_limits<double>::digits10;
+
 std::string doubleToString(double d) {
   std::ostringstream str;
   str.imbue(std::locale::classic());
-  const std::streamsize max_digits10 = 2 + std::numeric_limits<double>::digits10;
-  str.precision(max_digits10);
+  str.precision(kDoublePrecision);
   str << d;
   return str.str();
 }
+
+// Format the finite d into buf as doubleToString() does, and return the
+// length. Returns 0 if the C library does not use '.' as the decimal point.
+uint32_t formatDouble(double d, char (&buf)[32]) {
+  int len = std::snprintf(buf, sizeof(buf), "%.*g", kDoublePrecision, d);
+  if (len <= 0 || len >= static_cast<int>(sizeof(buf))) {
+    return 0;
+  }
+  for (int i = 0; i < len; ++i) {
+    char ch = buf[i];
+    if ((ch < '0' || ch > '9') && ch != '-' && ch != '+' && ch != '.' && ch != 'e') {
+      return 0;
+    }
+  }
+  return static_cast<uint32_t>(len);
+}
 }
 
 // Convert the given double to a JSON string, which is either the number,
 // "NaN" or "Infinity" or "-Infinity".
 uint32_t TJSONProtocol::writeJSONDouble(double num) {
   uint32_t result = context_->write(*trans_);
-  std::string val;
+  char buf[32];
+  const char* val = buf;
+  uint32_t len = 0;
+  std::string str;
 
   bool special = false;
   switch (std::fpclassify(num)) {
   case FP_INFINITE:
     if (std::signbit(num)) {
-      val = kThriftNegativeInfinity;
+      str = kThriftNegativeInfinity;
     } else {
-      val = kThriftInfinity;
+      str = kThriftInfinity;
     }
     special = true;
     break;
   case FP_NAN:
-    val = kThriftNan;
+    str = kThriftNan;
     special = true;
     break;
   default:
-    val = doubleToString(num);
+    len = formatDouble(num, buf);
+    if (len == 0) {
+      str = doubleToString(num);
+    }
     break;
   }
+  if (len == 0) {
+    val = str.c_str();
+    len = static_cast<uint32_t>(str.length());
+  }
 
   bool escapeNum = special || context_->escapeNum();
   if (escapeNum) {
     trans_->write(&kJSONStringDelimiter, 1);
     result += 1;
   }
-  if (val.length() > (std::numeric_limits<uint32_t>::max)())
-    throw TProtocolException(TProtocolException::SIZE_LIMIT);
-  trans_->write((const uint8_t*)val.c_str(), static_cast<uint32_t>(val.length()));
-  result += static_cast<uint32_t>(val.length());
+  trans_->write((const uint8_t*)val, len);
+  result += len;
   if (escapeNum) {
     trans_->write(&kJSONStringDelimiter, 1);
     result += 1;
@@ -744,7 +892,9 @@ uint32_t TJSONProtocol::readJSONEscapeChar(uint16_t* out) {
   return 4;
 }
 
-// Decodes a JSON string, including unescaping, and returns the string via str
+// Decodes a JSON string, including unescaping, and returns the string via str.
+// Runs of characters that need no unescaping are found in the transport's
+// buffer where it lends it, and read in one go.
 uint32_t TJSONProtocol::readJSONString(std::string& str, bool skipContext) {
   uint32_t result = (skipContext ? 0 : context_->read(reader_));
   result += readJSONSyntaxChar(kJSONStringDelimiter);
@@ -752,6 +902,21 @@ uint32_t TJSONProtocol::readJSONString(std::string& str, bool skipContext) {
   uint8_t ch;
   str.clear();
   while (true) {
+    uint32_t len = 0;
+    const uint8_t* buf = reader_.borrow(&len);
+    if (buf != nullptr) {
+      uint32_t run = scanJSONString<false>(buf, len);
+      if (run > 0) {
+        if (!codeunits.empty()) {
+          throw TProtocolException(TProtocolException::INVALID_DATA,
+                                   "Missing UTF-16 low surrogate pair.");
+        }
+        size_t size = str.size();
+        str.resize(size + run);
+        reader_.read((uint8_t*)&str[size], run);
+        result += run;
+      }
+    }
     ch = reader_.read();
     ++result;
     if (ch == kJSONStringDelimiter) {
@@ -801,33 +966,24 @@ uint32_t TJSONProtocol::readJSONString(std::string& str, bool skipContext) {
   return result;
 }
 
-// Reads a block of base64 characters, decoding it, and returns via str
+// Reads a block of base64 characters, decoding it in place, and returns via str
 uint32_t TJSONProtocol::readJSONBase64(std::string& str) {
-  std::string tmp;
-  uint32_t result = readJSONString(tmp);
-  auto* b = (uint8_t*)tmp.c_str();
-  if (tmp.length() > (std::numeric_limits<uint32_t>::max)())
+  uint32_t result = readJSONString(str);
+  if (str.length() > (std::numeric_limits<uint32_t>::max)())
     throw TProtocolException(TProtocolException::SIZE_LIMIT);
-  auto len = static_cast<uint32_t>(tmp.length());
-  str.clear();
+  auto len = static_cast<uint32_t>(str.length());
   // Ignore padding
   uint32_t padding_count = 0;
-  while (len > 0 && b[len - 1] == '=' && padding_count < 2) {
+  while (len > 0 && str[len - 1] == '=' && padding_count < 2) {
     --len;
     ++padding_count;
   }
-  while (len >= 4) {
-    base64_decode(b, 4);
-    str.append((const char*)b, 3);
-    b += 4;
-    len -= 4;
-  }
-  // Don't decode if we hit the end or got a single leftover byte (invalid
-  // base64 but legal for skip of regular string type)
-  if (len > 1) {
-    base64_decode(b, len);
-    str.append((const char*)b, len - 1);
+  // A single leftover byte is not decoded (invalid base64 but legal for skip
+  // of regular string type)
+  if (len > 0) {
+    len = base64_decode_buffer((uint8_t*)&str[0], len);
   }
+  str.resize(len);
   return result;
 }
 
@@ -837,6 +993,21 @@ uint32_t TJSONProtocol::readJSONNumericChars(std::string& str) {
   uint32_t result = 0;
   str.clear();
   while (true) {
+    uint32_t len = 0;
+    const uint8_t* buf = reader_.borrow(&len);
+    if (buf != nullptr) {
+      uint32_t run = 0;
+      while (run < len && isJSONNumeric(buf[run])) {
+        ++run;
+      }
+      size_t size = str.size();
+      str.resize(size + run);
+      reader_.read((uint8_t*)&str[size], run);
+      result += run;
+      if (run < len) {
+        break;
+      }
+    }
     uint8_t ch = reader_.peek();
     if (!isJSONNumeric(ch)) {
       break;
@@ -859,6 +1030,45 @@ T fromString(const std::string& s) {
     throw std::runtime_error(s);
   return t;
 }
+
+// Parse an optionally signed run of decimal digits that fits in T without
+// streams, leaving everything else to fromString() so that results and
+// errors stay the same
+template <typename T>
+T integerFromString(const std::string& s) {
+  const char* pos = s.c_str();
+  const char* end = pos + s.length();
+  bool negative = false;
+  if (pos != end && (*pos == '-' || *pos == '+')) {
+    negative = *pos == '-';
+    ++pos;
+  }
+  const auto limit = negative ? 0 - static_cast<uint64_t>((std::numeric_limits<T>::min)())
+                              : static_cast<uint64_t>((std::numeric_limits<T>::max)());
+  uint64_t mag = 0;
+  bool valid = pos != end && end - pos <= std::numeric_limits<uint64_t>::digits10;
+  for (; valid && pos != end; ++pos) {
+    valid = *pos >= '0' && *pos <= '9';
+    mag = mag * 10 + static_cast<uint64_t>(*pos - '0');
+  }
+  if (!valid || mag > limit) {
+    return fromString<T>(s);
+  }
+  return negative ? static_cast<T>(0 - mag) : static_cast<T>(mag);
+}
+
+// strtod() for the common case, which agrees with fromString() wherever it
+// consumes the whole string without a range error
+double doubleFromString(const std::string& s) {
+  const char* begin = s.c_str();
+  char* end = nullptr;
+  errno = 0;
+  double d = std::strtod(begin, &end);
+  if (s.empty() || end != begin + s.length() || errno == ERANGE) {
+    return fromString<double>(s);
+  }
+  return d;
+}
 }
 
 // Reads a sequence of characters and assembles them into a number,
@@ -872,7 +1082,7 @@ uint32_t TJSONProtocol::readJSONInteger(NumberType& num) {
   std::string str;
   result += readJSONNumericChars(str);
   try {
-    num = fromString<NumberType>(str);
+    num = integerFromString<NumberType>(str);
   } catch (const std::runtime_error&) {
     throw TProtocolException(TProtocolException::INVALID_DATA,
                              "Expected numeric value; got \"" + str + "\"");
@@ -903,7 +1113,7 @@ uint32_t TJSONProtocol::readJSONDouble(double& num) {
                                      "Numeric data unexpectedly quoted");
       }
       try {
-        num = fromString<double>(str);
+        num = doubleFromString(str);
       } catch (const std::runtime_error&) {
         throw TProtocolException(TProtocolException::INVALID_DATA,
                                      "Expected numeric value; got \"" + str + "\"");
@@ -916,7 +1126,7 @@ uint32_t TJSONProtocol::readJSONDouble(double& num) {
     }
     result += readJSONNumericChars(str);
     try {
-      num = fromString<double>(str);
+      num = doubleFromString(str);
     } catch (const std::runtime_error&) {
       throw TProtocolException(TProtocolException::INVALID_DATA,
                                    "Expected numeric value; got \"" + str + "\"");
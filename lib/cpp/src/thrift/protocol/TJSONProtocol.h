@@ -289,6 +289,29 @@ public:
       return data_;
     }
 
+    /**
+     * Returns the bytes the transport has buffered without consuming them,
+     * or nullptr if it cannot lend any, in which case read() and peek()
+     * still work. Never lends past a peeked byte.
+     */
+    const uint8_t* borrow(uint32_t* len) {
+      if (hasData_) {
+        return nullptr;
+      }
+      *len = 1;
+      return trans_->borrow(nullptr, len);
+    }
+
+    /**
+     * Reads len bytes lent by borrow() into buf.  This goes through the
+     * transport's readAll() as read() and peek() do, so the bytes are
+     * counted against the maximum message size exactly as theirs are: not
+     * at all where a buffered transport serves them from its buffer.
+     * consume() would count them there, and so stop a message in the middle
+     * of a string that byte-wise reading lets through.
+     */
+    void read(uint8_t* buf, uint32_t len) { trans_->readAll(buf, len); }
+
   private:
     TTransport* trans_;
     bool hasData_;
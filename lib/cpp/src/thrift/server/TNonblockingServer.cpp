@@ -20,12 +20,15 @@
 #include <thrift/thrift-config.h>
 
 #include <thrift/server/TNonblockingServer.h>
+#include <thrift/TApplicationException.h>
 #include <thrift/concurrency/Exception.h>
+#include <thrift/transport/THeaderTransport.h>
 #include <thrift/transport/TSocket.h>
 #include <thrift/concurrency/ThreadFactory.h>
 #include <thrift/transport/PlatformSocket.h>
 
 #include <algorithm>
+#include <deque>
 #include <iostream>
 
 #ifdef HAVE_POLL_H
@@ -40,6 +43,10 @@
 #include <sys/socket.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -59,6 +66,10 @@
 
 #include <assert.h>
 
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #ifdef HAVE_SCHED_H
 #include <sched.h>
 #endif
@@ -89,13 +100,17 @@ using std::shared_ptr;
 /// Three states for sockets: recv frame size, recv data, and send mode
 enum TSocketState { SOCKET_RECV_FRAMING, SOCKET_RECV, SOCKET_SEND };
 
+/// Where the request handed to an asynchronous processor is
+enum TAsyncState { ASYNC_DISPATCHING, ASYNC_COMPLETED, ASYNC_DEFERRED, ASYNC_FAILED };
+
 /**
- * Five states for the nonblocking server:
+ * Six states for the nonblocking server:
  *  1) initialize
  *  2) read 4 byte frame size
  *  3) read frame of data
  *  4) send back data (if any)
  *  5) force immediate connection close
+ *  6) wait for a handshake thread to complete the handshake
  */
 enum TAppState {
   APP_INIT,
@@ -103,7 +118,65 @@ enum TAppState {
   APP_READ_REQUEST,
   APP_WAIT_TASK,
   APP_SEND_RESULT,
-  APP_CLOSE_CONNECTION
+  APP_CLOSE_CONNECTION,
+  APP_HANDSHAKE
+};
+
+/**
+ * An entry in the notification queue of an IO thread: either a connection
+ * that is due for its next transition(), or (if pipelined is set) a
+ * TConnection::PipelinedRequest whose processing has completed.
+ */
+struct TNonblockingServer::TNotification {
+  TNotification() : next(nullptr), connection(nullptr), pipelined(false) {}
+
+  TNotification* next;
+  TConnection* connection;
+  bool pipelined;
+};
+
+/**
+ * A TMemoryBuffer that borrows its storage from the buffer pool of an IO
+ * thread while a request is handled, and gives it back afterwards.  The
+ * processor may still grow the buffer with realloc() meanwhile; account()
+ * tells the pool about that.
+ */
+class TPooledMemoryBuffer : public TMemoryBuffer {
+public:
+  TPooledMemoryBuffer() : TMemoryBuffer(nullptr, 0, TAKE_OWNERSHIP), accountedSize_(0) {}
+
+  /// Take an empty buffer of at least the given size from the pool.
+  void attach(TNonblockingBufferPool& pool, uint32_t size) {
+    detach(pool);
+    buffer_ = pool.allocate(size, &bufferSize_);
+    rBase_ = rBound_ = wBase_ = buffer_;
+    wBound_ = buffer_ + bufferSize_;
+    accountedSize_ = bufferSize_;
+  }
+
+  /// Tell the pool if the buffer has grown since it was attached.
+  void account(TNonblockingBufferPool& pool) {
+    if (bufferSize_ != accountedSize_) {
+      pool.resized(accountedSize_, bufferSize_);
+      accountedSize_ = bufferSize_;
+    }
+  }
+
+  /// Give the buffer back to the pool, leaving this one empty.
+  void detach(TNonblockingBufferPool& pool) {
+    if (buffer_ == nullptr) {
+      return;
+    }
+    account(pool);
+    pool.release(buffer_, bufferSize_);
+    buffer_ = nullptr;
+    bufferSize_ = 0;
+    rBase_ = rBound_ = wBase_ = wBound_ = nullptr;
+    accountedSize_ = 0;
+  }
+
+private:
+  uint32_t accountedSize_;
 };
 
 /**
@@ -142,7 +215,7 @@ private:
   /// Where in the read buffer are we
   uint32_t readBufferPos_;
 
-  /// Read buffer
+  /// Read buffer, from the IO thread's pool while a request is read
   uint8_t* readBuffer_;
 
   /// Read buffer size
@@ -157,17 +230,11 @@ private:
   /// How far through writing are we?
   uint32_t writeBufferPos_;
 
-  /// Largest size of write buffer seen since buffer was constructed
-  size_t largestWriteBufferSize_;
-
-  /// Count of the number of calls for use with getResizeBufferEveryN().
-  int32_t callsForResize_;
-
   /// Transport to read from
   std::shared_ptr<TMemoryBuffer> inputTransport_;
 
   /// Transport that processor writes to
-  std::shared_ptr<TMemoryBuffer> outputTransport_;
+  std::shared_ptr<TPooledMemoryBuffer> outputTransport_;
 
   /// extra transport generated by transport factory (e.g. BufferedRouterTransport)
   std::shared_ptr<TTransport> factoryInputTransport_;
@@ -185,6 +252,105 @@ private:
   /// Thrift call context, if any
   void* connectionContext_;
 
+  /// Asynchronous processor of the server, if any
+  std::shared_ptr<TAsyncProcessor> asyncProcessor_;
+
+  /**
+   * A request dispatched while pipelining.  It owns the frame it was read
+   * into and its own transports and protocols, so that several of them can
+   * be processed concurrently.
+   */
+  struct PipelinedRequest : public TNotification {
+    PipelinedRequest(TConnection* owner)
+      : frame(nullptr), frameSize(0), writeBuffer(nullptr), writeBufferSize(0),
+        done(false), aborted(false) {
+      connection = owner;
+      pipelined = true;
+    }
+    ~PipelinedRequest() { std::free(frame); }
+
+    uint8_t* frame;
+    uint32_t frameSize;
+    std::shared_ptr<TMemoryBuffer> inputTransport;
+    std::shared_ptr<TPooledMemoryBuffer> outputTransport;
+    std::shared_ptr<TTransport> factoryInputTransport;
+    std::shared_ptr<TTransport> factoryOutputTransport;
+    std::shared_ptr<TProtocol> inputProtocol;
+    std::shared_ptr<TProtocol> outputProtocol;
+    uint8_t* writeBuffer;
+    uint32_t writeBufferSize;
+    bool done;
+    bool aborted;
+  };
+
+  /// Whether this connection keeps reading while requests are processing
+  bool pipelined_;
+
+  /// Dispatched requests in arrival order (T_PIPELINE_IN_ORDER only)
+  std::deque<PipelinedRequest*> pendingRequests_;
+
+  /// Requests whose responses are ready to be written, front first
+  std::deque<PipelinedRequest*> sendQueue_;
+
+  /// Request objects available for reuse on this connection
+  std::vector<PipelinedRequest*> freeRequests_;
+
+  /// Number of dispatched tasks that still reference this connection
+  uint32_t tasksInFlight_;
+
+  /// Number of requests read whose responses have not been written yet
+  size_t outstandingRequests_;
+
+  /// Set when close() was requested while tasks were still in flight
+  bool closePending_;
+
+  /// Whether queued responses can be sent with a single gathering write
+  bool gatherWrites_;
+
+  /// Bytes in sendQueue_ that remain to be written
+  size_t queuedBytes_;
+
+  /// Set while the socket is full and queued responses wait for EV_WRITE
+  bool writeBlocked_;
+
+  /// Runs writePipelinedResponses() later in this (or a timer's) loop iteration
+  struct event flushEvent_;
+
+  /// Whether flushEvent_ is active or pending
+  bool flushScheduled_;
+
+  /// Whether flushEvent_ is pending as a timer, holding responses back
+  bool flushTimerArmed_;
+
+  /// Notification used for hand-off to the IO thread and task completion
+  TNotification notification_;
+
+  /// Used to read the method name of a request without consuming it
+  std::shared_ptr<TMemoryBuffer> peekTransport_;
+  std::shared_ptr<TProtocol> peekProtocol_;
+  std::string peekName_;
+
+  /// Identity of this connection as a client for fair queuing
+  std::string connectionIdentity_;
+
+  /// Identity of the client named in the latest request's headers
+  std::string headerIdentity_;
+
+  /// Whether the socket's handshake has neither completed nor failed yet
+  bool handshakePending_;
+
+  /// Whether a handshake thread runs (or ran) the handshake
+  bool handshakeOffloaded_;
+
+  /// Set by the handshake thread if the handshake failed
+  bool handshakeFailed_;
+
+  /// Time the handshake thread waited for, in us
+  uint64_t handshakeQueueMicros_;
+
+  /// When the connection was accepted
+  std::chrono::steady_clock::time_point handshakeStart_;
+
   /// Go into read mode
   void setRead() { setFlags(EV_READ | EV_PERSIST); }
 
@@ -205,45 +371,188 @@ private:
    * Libevent handler called (via our static wrapper) when the connection
    * socket had something happen.  Rather than use the flags libevent passed,
    * we use the connection state to determine whether we need to read or
-   * write the socket.
+   * write the socket.  Only pipelined connections, which read and write at
+   * the same time, look at the flags.
+   *
+   * @param which the flags associated with the event.
+   */
+  void workSocket(short which);
+
+  /**
+   * Whether the request in the given buffer is to be processed on the IO
+   * thread rather than handed to the thread pool.
+   *
+   * @param input the transport holding the request.
+   */
+  bool isInlineRequest(const std::shared_ptr<TMemoryBuffer>& input);
+
+  /**
+   * Process a request on the IO thread, logging any error.
+   *
+   * @return false if processing failed and the connection must be closed.
+   */
+  bool processInline(const std::shared_ptr<TProtocol>& input,
+                     const std::shared_ptr<TProtocol>& output);
+
+  /**
+   * Hand the request to the asynchronous processor.
+   *
+   * @return true if it has completed already, false if the connection now
+   *         waits for it (or has been closed).
+   */
+  bool processAsync();
+
+  /**
+   * Called back by the asynchronous processor when a request is done.
+   *
+   * @param state where the request is, see processAsync().
+   */
+  void asyncComplete(std::shared_ptr<std::atomic<int> > state, bool success);
+
+  /**
+   * Hand a task to the thread pool, behind the tasks of other clients if
+   * the server queues fairly.
+   *
+   * @param task the task processing the request.
+   * @param frame the request frame, starting with its size.
+   * @param size # of bytes in the frame.
+   * @return false if the client has too many requests queued.
+   */
+  bool queueTask(std::shared_ptr<Runnable> task, uint8_t* frame, uint32_t size);
+
+  /// Return the client that sent the request in the given frame.
+  const std::string& getClientIdentity(uint8_t* frame, uint32_t size);
+
+  /**
+   * Answer a request with a TApplicationException rather than processing
+   * it, on the IO thread.
+   *
+   * @return false if the request could not be read and the connection must
+   *         be closed.
+   */
+  bool rejectRequest(const std::shared_ptr<TProtocol>& input,
+                     const std::shared_ptr<TProtocol>& output);
+
+  /// Hand a fully read frame to the thread pool and go back to reading.
+  void dispatchPipelinedRequest();
+
+  /// Queue the response of a processed pipelined request for writing.
+  void finishPipelinedRequest(PipelinedRequest* request);
+
+  /// Write as much of the queued pipelined responses as the socket takes.
+  void writePipelinedResponses();
+
+  /**
+   * Write the queued pipelined responses (starting writeBufferPos_ into
+   * the first one) with a single gathering write.
+   *
+   * @param want set to the number of bytes that were offered.
+   * @return the number of bytes written.
+   */
+  uint32_t writeGathered(uint32_t& want);
+
+  /**
+   * Arrange for the queued responses to be written once the current event
+   * loop iteration has handled all ready events, or when the write
+   * coalescing delay expires if they are held back.
+   */
+  void scheduleFlush();
+
+  /// Drop a scheduled write of the queued responses.
+  void cancelFlush();
+
+  /**
+   * C-callable event handler for flushEvent_.
+   *
+   * @param v void* callback arg where we placed TConnection's "this".
+   */
+  static void flushHandler(evutil_socket_t fd, short which, void* v) {
+    (void)fd;
+    (void)which;
+    auto* connection = (TConnection*)v;
+    connection->flushScheduled_ = false;
+    connection->flushTimerArmed_ = false;
+    connection->writePipelinedResponses();
+  }
+
+  /// Retire a pipelined request whose response was written (or not needed).
+  void releasePipelinedRequest(PipelinedRequest* request);
+
+  /// Register for reading and/or writing as the pipeline state requires.
+  void updatePipelinedFlags();
+
+  /// Free all pipelined request objects held by this connection.
+  void clearPipelinedRequests();
+
+  /// Make the read buffer hold at least the given # of bytes.
+  void reserveReadBuffer(uint32_t size);
+
+  /// Give the read buffer back to the IO thread's pool.
+  void releaseReadBuffer();
+
+  /// Give all buffers held by this connection back to the IO thread's pool.
+  void releaseBuffers();
+
+  /// Give the frame of a pipelined request back to the IO thread's pool.
+  void releaseFrame(PipelinedRequest* request);
+
+  /// Hand the handshake of the socket to the server's handshake threads.
+  void offloadHandshake();
+
+  /**
+   * Account for the end of the handshake and stop timing it.
+   *
+   * @param completed false if the connection is closing before completing it.
    */
-  void workSocket();
+  void finishHandshake(bool completed);
 
 public:
   class Task;
+  class HandshakeTask;
 
   /// Constructor
   TConnection(std::shared_ptr<TSocket> socket,
               TNonblockingIOThread* ioThread) {
     readBuffer_ = nullptr;
     readBufferSize_ = 0;
+    tasksInFlight_ = 0;
+    outstandingRequests_ = 0;
+    closePending_ = false;
+    flushScheduled_ = false;
+    flushTimerArmed_ = false;
+    notification_.connection = this;
 
     ioThread_ = ioThread;
     server_ = ioThread->getServer();
 
     // Allocate input and output transports these only need to be allocated
-    // once per TConnection (they don't need to be reallocated on init() call)
+    // once per TConnection (they don't need to be reallocated on init() call).
+    // Their buffers are only attached while a request is handled.
     inputTransport_.reset(new TMemoryBuffer(readBuffer_, readBufferSize_));
-    outputTransport_.reset(
-        new TMemoryBuffer(static_cast<uint32_t>(server_->getWriteBufferDefaultSize())));
+    outputTransport_.reset(new TPooledMemoryBuffer());
 
     tSocket_ =  socket;
 
     init(ioThread);
   }
 
-  ~TConnection() { std::free(readBuffer_); }
+  ~TConnection() {
+    clearPipelinedRequests();
+    std::free(readBuffer_);
+  }
 
-  /// Close this connection and free or reset its resources.
+  /**
+   * Close this connection and free or reset its resources.  If tasks
+   * dispatched by a pipelined connection still reference it, the close is
+   * completed when the last of them has returned.
+   */
   void close();
 
-  /**
-    * Check buffers against any size limits and shrink it if exceeded.
-    *
-    * @param readLimit we reduce read buffer size to this (if nonzero).
-    * @param writeLimit if nonzero and write buffer is larger, replace it.
-    */
-  void checkIdleBufferMemLimit(size_t readLimit, size_t writeLimit);
+  /// Forget about dispatched tasks; only used when the server is destroyed.
+  void abandonTasks() { tasksInFlight_ = 0; }
+
+  /// Make an offloaded handshake that is still under way fail soon.
+  void interruptHandshake();
 
   /// Initialize
   void init(TNonblockingIOThread* ioThread);
@@ -258,6 +567,21 @@ public:
    */
   void transition();
 
+  /**
+   * Called on the IO thread for every notification received for this
+   * connection.
+   *
+   * @param notification the connection's own one, or a completed request.
+   */
+  void notified(TNotification* notification);
+
+  /**
+   * Called by a worker thread when a pipelined request has been processed,
+   * or by the server when its task was dropped (aborted == true), which
+   * closes the connection once all of its tasks have returned.
+   */
+  void completePipelinedRequest(PipelinedRequest* request, bool aborted);
+
   /**
    * C-callable event handler for connection events.  Provides a callback
    * that libevent can understand which invokes connection_->workSocket().
@@ -266,9 +590,9 @@ public:
    * @param which the flags associated with the event.
    * @param v void* callback arg where we placed TConnection's "this".
    */
-  static void eventHandler(evutil_socket_t fd, short /* which */, void* v) {
+  static void eventHandler(evutil_socket_t fd, short which, void* v) {
     assert(fd == static_cast<evutil_socket_t>(((TConnection*)v)->getTSocket()->getSocketFD()));
-    ((TConnection*)v)->workSocket();
+    ((TConnection*)v)->workSocket(which);
   }
 
   /**
@@ -280,7 +604,7 @@ public:
    *
    * @return true if successful, false if unable to notify (check THRIFT_GET_SOCKET_ERROR).
    */
-  bool notifyIOThread() { return ioThread_->notify(this); }
+  bool notifyIOThread() { return ioThread_->notify(&notification_); }
 
   /*
    * Returns the number of this connection's currently assigned IO
@@ -288,8 +612,16 @@ public:
    */
   int getIOThreadNumber() const { return ioThread_->getThreadNumber(); }
 
-  /// Force connection shutdown for this connection.
-  void forceClose() {
+  /**
+   * Force connection shutdown for this connection.
+   *
+   * @param request the pipelined request whose task was dropped, if any.
+   */
+  void forceClose(PipelinedRequest* request = nullptr) {
+    if (request) {
+      completePipelinedRequest(request, true);
+      return;
+    }
     appState_ = APP_CLOSE_CONNECTION;
     if (!notifyIOThread()) {
       server_->decrementActiveProcessors();
@@ -319,11 +651,13 @@ public:
   Task(std::shared_ptr<TProcessor> processor,
        std::shared_ptr<TProtocol> input,
        std::shared_ptr<TProtocol> output,
-       TConnection* connection)
+       TConnection* connection,
+       PipelinedRequest* request = nullptr)
     : processor_(processor),
       input_(input),
       output_(output),
       connection_(connection),
+      request_(request),
       serverEventHandler_(connection_->getServerEventHandler()),
       connectionContext_(connection_->getConnectionContext()) {}
 
@@ -351,6 +685,11 @@ public:
       TOutput::instance().printf("TNonblockingServer: unknown exception while processing.");
     }
 
+    if (request_) {
+      connection_->completePipelinedRequest(request_, false);
+      return;
+    }
+
     // Signal completion back to the libevent thread via a pipe
     if (!connection_->notifyIOThread()) {
       TOutput::instance().printf("TNonblockingServer: failed to notifyIOThread, closing.");
@@ -362,15 +701,88 @@ public:
 
   TConnection* getTConnection() { return connection_; }
 
+  PipelinedRequest* getPipelinedRequest() { return request_; }
+
 private:
   std::shared_ptr<TProcessor> processor_;
   std::shared_ptr<TProtocol> input_;
   std::shared_ptr<TProtocol> output_;
   TConnection* connection_;
+  PipelinedRequest* request_;
   std::shared_ptr<TServerEventHandler> serverEventHandler_;
   void* connectionContext_;
 };
 
+/**
+ * Runs the handshake of a new connection on a handshake thread, then hands
+ * the connection back to its IO thread.
+ */
+class TNonblockingServer::TConnection::HandshakeTask : public Runnable {
+public:
+  HandshakeTask(TConnection* connection, int timeoutMs)
+    : connection_(connection), timeoutMs_(timeoutMs), queued_(std::chrono::steady_clock::now()) {}
+
+  void run() override {
+    connection_->handshakeQueueMicros_ = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()
+                                                              - queued_).count());
+    try {
+      connection_->getTSocket()->handshake(timeoutMs_);
+    } catch (const std::exception& x) {
+      TOutput::instance().printf("TNonblockingServer: handshake failed: %s", x.what());
+      connection_->handshakeFailed_ = true;
+    }
+
+    // Signal completion back to the libevent thread via a pipe
+    if (!connection_->notifyIOThread()) {
+      TOutput::instance().printf("TNonblockingServer: failed to notifyIOThread after handshake.");
+      throw TException("TNonblockingServer::HandshakeTask::run: failed write on notify pipe");
+    }
+  }
+
+private:
+  TConnection* connection_;
+  int timeoutMs_;
+  std::chrono::steady_clock::time_point queued_;
+};
+
+void TNonblockingServer::TConnection::offloadHandshake() {
+  appState_ = APP_HANDSHAKE;
+  handshakeOffloaded_ = true;
+
+  // The IO thread must leave the socket alone until the handshake is done
+  setIdle();
+  ++tasksInFlight_;
+  try {
+    server_->addHandshakeTask(
+        std::make_shared<HandshakeTask>(this, server_->getHandshakeTimeout()));
+  } catch (IllegalStateException& ise) {
+    // The ThreadManager is not ready to handle any more tasks (it's probably shutting down).
+    TOutput::instance().printf("IllegalStateException: Server::offloadHandshake() %s", ise.what());
+    --tasksInFlight_;
+    close();
+  }
+}
+
+void TNonblockingServer::TConnection::interruptHandshake() {
+  if (handshakePending_ && handshakeOffloaded_) {
+    // The handshake thread sees the peer go away, in its poll() or when it
+    // gets to the handshake.  The descriptor stays open until close(), so
+    // no new connection can take its number meanwhile.
+    shutdown(tSocket_->getSocketFD(), THRIFT_SHUT_RDWR);
+  }
+}
+
+void TNonblockingServer::TConnection::finishHandshake(bool completed) {
+  handshakePending_ = false;
+  auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - handshakeStart_).count();
+  server_->countHandshake(completed,
+                          static_cast<uint64_t>(micros),
+                          handshakeQueueMicros_,
+                          handshakeOffloaded_);
+}
+
 void TNonblockingServer::TConnection::init(TNonblockingIOThread* ioThread) {
   ioThread_ = ioThread;
   server_ = ioThread->getServer();
@@ -383,10 +795,35 @@ void TNonblockingServer::TConnection::init(TNonblockingIOThread* ioThread) {
   writeBuffer_ = nullptr;
   writeBufferSize_ = 0;
   writeBufferPos_ = 0;
-  largestWriteBufferSize_ = 0;
 
   socketState_ = SOCKET_RECV_FRAMING;
-  callsForResize_ = 0;
+
+  asyncProcessor_ = server_->getAsyncProcessor();
+  pipelined_ = !asyncProcessor_ && server_->isThreadPoolProcessing()
+               && server_->getMaxPipelinedRequests() > 1;
+  tasksInFlight_ = 0;
+  outstandingRequests_ = 0;
+  closePending_ = false;
+  queuedBytes_ = 0;
+  writeBlocked_ = false;
+  flushScheduled_ = false;
+  flushTimerArmed_ = false;
+  connectionIdentity_.clear();
+
+  handshakePending_ = tSocket_->hasPendingHandshake();
+  handshakeOffloaded_ = false;
+  handshakeFailed_ = false;
+  handshakeQueueMicros_ = 0;
+  if (handshakePending_) {
+    handshakeStart_ = std::chrono::steady_clock::now();
+  }
+
+  // Subclasses such as TSSLSocket must see every byte written through them
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_SYS_SOCKET_H)
+  gatherWrites_ = tSocket_->canSendDirectly();
+#else
+  gatherWrites_ = false;
+#endif
 
   // get input/transports
   factoryInputTransport_ = server_->getInputTransportFactory()->getTransport(inputTransport_);
@@ -418,7 +855,22 @@ void TNonblockingServer::TConnection::setSocket(std::shared_ptr<TSocket> socket)
   tSocket_ = socket;
 }
 
-void TNonblockingServer::TConnection::workSocket() {
+void TNonblockingServer::TConnection::workSocket(short which) {
+  if (pipelined_) {
+    bool wasReading = (eventFlags_ & EV_READ) != 0;
+    if (which & EV_WRITE) {
+      writePipelinedResponses();
+    }
+    // Reading may have been paused (or the connection closed) meanwhile. If it
+    // was just resumed, data buffered by the transport won't raise an event.
+    if (!(eventFlags_ & EV_READ)) {
+      return;
+    }
+    if (!(which & EV_READ) && (wasReading || !tSocket_->hasPendingDataToRead())) {
+      return;
+    }
+  }
+
   while (true) {
     int got = 0, left = 0, sent = 0;
     uint32_t fetch = 0;
@@ -454,6 +906,10 @@ void TNonblockingServer::TConnection::workSocket() {
         }
       }
 
+      if (handshakePending_ && !tSocket_->hasPendingHandshake()) {
+        finishHandshake(true);
+      }
+
       if (readBufferPos_ < sizeof(framing.size)) {
         // more needed before frame size is known -- save what we have so far
         readWant_ = framing.size;
@@ -524,7 +980,8 @@ void TNonblockingServer::TConnection::workSocket() {
         // We are done reading, move onto the next state
         if (readBufferPos_ == readWant_) {
           transition();
-          if (socketState_ == SOCKET_RECV_FRAMING && tSocket_->hasPendingDataToRead())
+          if (socketState_ == SOCKET_RECV_FRAMING && (!pipelined_ || (eventFlags_ & EV_READ))
+              && tSocket_->hasPendingDataToRead())
           {
               continue;
           }
@@ -564,7 +1021,10 @@ void TNonblockingServer::TConnection::workSocket() {
 
       // We are done!
       if (writeBufferPos_ == writeBufferSize_) {
+        server_->countResponseWrites(1, 1);
         transition();
+      } else {
+        server_->countResponseWrites(0, 1);
       }
 
       return;
@@ -598,16 +1058,23 @@ void TNonblockingServer::TConnection::transition() {
   switch (appState_) {
 
   case APP_READ_REQUEST:
+    if (pipelined_) {
+      // The request takes over the read buffer and we keep on reading
+      server_->incrementActiveProcessors();
+      dispatchPipelinedRequest();
+      return;
+    }
+
     // We are done reading the request, package the read buffer into transport
     // and get back some data from the dispatch function
+    outputTransport_->attach(ioThread_->getBufferPool(),
+                             static_cast<uint32_t>(server_->getWriteBufferDefaultSize()));
     if (server_->getHeaderTransport()) {
       inputTransport_->resetBuffer(readBuffer_, readBufferPos_);
-      outputTransport_->resetBuffer();
     } else {
       // We saved room for the framing size in case header transport needed it,
       // but just skip it for the non-header case
       inputTransport_->resetBuffer(readBuffer_ + 4, readBufferPos_ - 4);
-      outputTransport_->resetBuffer();
 
       // Prepend four bytes of blank space to the buffer so we can
       // write the frame size there later.
@@ -617,7 +1084,11 @@ void TNonblockingServer::TConnection::transition() {
 
     server_->incrementActiveProcessors();
 
-    if (server_->isThreadPoolProcessing()) {
+    if (asyncProcessor_) {
+      if (!processAsync()) {
+        return;
+      }
+    } else if (server_->isThreadPoolProcessing() && !isInlineRequest(inputTransport_)) {
       // We are setting up a Task to do this work and we will wait on it
 
       // Create task and dispatch to the thread manager
@@ -632,47 +1103,32 @@ void TNonblockingServer::TConnection::transition() {
       setIdle();
 
       try {
-        server_->addTask(task);
+        if (queueTask(task, readBuffer_, readBufferPos_)) {
+          return;
+        }
       } catch (IllegalStateException& ise) {
         // The ThreadManager is not ready to handle any more tasks (it's probably shutting down).
         TOutput::instance().printf("IllegalStateException: Server::process() %s", ise.what());
         server_->decrementActiveProcessors();
         close();
+        return;
       } catch (TimedOutException& to) {
         TOutput::instance().printf("[ERROR] TimedOutException: Server::process() %s", to.what());
         server_->decrementActiveProcessors();
         close();
+        return;
       }
 
-      return;
-    } else {
-      try {
-        if (serverEventHandler_) {
-          serverEventHandler_->processContext(connectionContext_, getTSocket());
-        }
-        // Invoke the processor
-        processor_->process(inputProtocol_, outputProtocol_, connectionContext_);
-      } catch (const TTransportException& ttx) {
-        TOutput::instance().printf(
-            "TNonblockingServer transport error in "
-            "process(): %s",
-            ttx.what());
-        server_->decrementActiveProcessors();
-        close();
-        return;
-      } catch (const std::exception& x) {
-        TOutput::instance().printf("Server::process() uncaught exception: %s: %s",
-                            typeid(x).name(),
-                            x.what());
-        server_->decrementActiveProcessors();
-        close();
-        return;
-      } catch (...) {
-        TOutput::instance().printf("Server::process() unknown exception");
+      // The client has too many requests queued, turn this one down
+      if (!rejectRequest(inputProtocol_, outputProtocol_)) {
         server_->decrementActiveProcessors();
         close();
         return;
       }
+    } else if (!processInline(inputProtocol_, outputProtocol_)) {
+      server_->decrementActiveProcessors();
+      close();
+      return;
     }
     // fallthrough
 
@@ -685,7 +1141,13 @@ void TNonblockingServer::TConnection::transition() {
     // the writeBuffer_ for actual writing by the libevent thread
 
     server_->decrementActiveProcessors();
+
+    // The request has been consumed
+    inputTransport_->resetBuffer();
+    releaseReadBuffer();
+
     // Get the result of the operation
+    outputTransport_->account(ioThread_->getBufferPool());
     outputTransport_->getBuffer(&writeBuffer_, &writeBufferSize_);
 
     // If the function call generated return data, then move into the send
@@ -713,27 +1175,16 @@ void TNonblockingServer::TConnection::transition() {
     goto LABEL_APP_INIT;
 
   case APP_SEND_RESULT:
-    // it's now safe to perform buffer size housekeeping.
-    if (writeBufferSize_ > largestWriteBufferSize_) {
-      largestWriteBufferSize_ = writeBufferSize_;
-    }
-    if (server_->getResizeBufferEveryN() > 0
-        && ++callsForResize_ >= server_->getResizeBufferEveryN()) {
-      checkIdleBufferMemLimit(server_->getIdleReadBufferLimit(),
-                              server_->getIdleWriteBufferLimit());
-      callsForResize_ = 0;
-    }
-    // fallthrough
-
   // N.B.: We also intentionally fall through here into the INIT state!
 
   LABEL_APP_INIT:
   case APP_INIT:
 
-    // Clear write buffer variables
+    // Clear write buffer variables, the connection holds no buffers while idle
     writeBuffer_ = nullptr;
     writeBufferPos_ = 0;
     writeBufferSize_ = 0;
+    outputTransport_->detach(ioThread_->getBufferPool());
 
     // Into read4 state we go
     socketState_ = SOCKET_RECV_FRAMING;
@@ -741,33 +1192,40 @@ void TNonblockingServer::TConnection::transition() {
 
     readBufferPos_ = 0;
 
+    // A new connection may have its handshake run elsewhere first
+    if (handshakePending_ && server_->isHandshakeOffloading()) {
+      offloadHandshake();
+      return;
+    }
+
     // Register read event
     setRead();
 
     return;
 
+  case APP_HANDSHAKE:
+    --tasksInFlight_;
+    if (closePending_ || handshakeFailed_) {
+      close();
+      return;
+    }
+    finishHandshake(true);
+
+    appState_ = APP_READ_FRAME_SIZE;
+    setRead();
+
+    // The client may have sent its first request along with the end of the
+    // handshake, which the socket holds already
+    if (tSocket_->hasPendingDataToRead()) {
+      workSocket(EV_READ);
+    }
+    return;
+
   case APP_READ_FRAME_SIZE:
     readWant_ += 4;
 
     // We just read the request length
-    // Double the buffer size until it is big enough
-    if (readWant_ > readBufferSize_) {
-      if (readBufferSize_ == 0) {
-        readBufferSize_ = 1;
-      }
-      uint32_t newSize = readBufferSize_;
-      while (readWant_ > newSize) {
-        newSize *= 2;
-      }
-
-      auto* newBuffer = (uint8_t*)std::realloc(readBuffer_, newSize);
-      if (newBuffer == nullptr) {
-        // nothing else to be done...
-        throw std::bad_alloc();
-      }
-      readBuffer_ = newBuffer;
-      readBufferSize_ = newSize;
-    }
+    reserveReadBuffer(readWant_);
 
     readBufferPos_ = 4;
     *((uint32_t*)readBuffer_) = htonl(readWant_ - 4);
@@ -789,40 +1247,221 @@ void TNonblockingServer::TConnection::transition() {
   }
 }
 
-void TNonblockingServer::TConnection::setFlags(short eventFlags) {
-  // Catch the do nothing case
-  if (eventFlags_ == eventFlags) {
-    return;
+bool TNonblockingServer::TConnection::isInlineRequest(const std::shared_ptr<TMemoryBuffer>& input) {
+  if (!server_->isThreadPoolProcessing()) {
+    return true;
+  }
+  if (!server_->hasInlineMethodPolicy()) {
+    return false;
   }
 
-  // Delete a previously existing event
-  if (eventFlags_ && event_del(&event_) == -1) {
-    TOutput::instance().perror("TConnection::setFlags() event_del", THRIFT_GET_SOCKET_ERROR);
-    return;
+  if (!peekProtocol_) {
+    peekTransport_.reset(new TMemoryBuffer());
+    peekProtocol_ = server_->getInputProtocolFactory()->getProtocol(
+        server_->getInputTransportFactory()->getTransport(peekTransport_));
   }
 
-  // Update in memory structure
-  eventFlags_ = eventFlags;
+  uint8_t* buf = nullptr;
+  uint32_t size = 0;
+  input->getBuffer(&buf, &size);
+  peekTransport_->resetBuffer(buf, size);
+
+  TMessageType type;
+  int32_t seqid;
+  try {
+    peekProtocol_->readMessageBegin(peekName_, type, seqid);
+  } catch (const std::exception&) {
+    // leave reporting the error to the processor
+    return false;
+  }
+  return server_->isInlineMethod(peekName_);
+}
 
-  // Do not call event_set if there are no flags
-  if (!eventFlags_) {
-    return;
+bool TNonblockingServer::TConnection::queueTask(std::shared_ptr<Runnable> task,
+                                                uint8_t* frame,
+                                                uint32_t size) {
+  if (!server_->getFairQueuing()) {
+    server_->addTask(task);
+    return true;
   }
+  return server_->addClientTask(getClientIdentity(frame, size), task, size);
+}
 
-  /*
-   * event_set:
-   *
-   * Prepares the event structure &event to be used in future calls to
-   * event_add() and event_del().  The event will be prepared to call the
-   * eventHandler using the 'sock' file descriptor to monitor events.
-   *
-   * The events can be either EV_READ, EV_WRITE, or both, indicating
-   * that an application can read or write from the file respectively without
-   * blocking.
-   *
-   * The eventHandler will be called with the file descriptor that triggered
-   * the event and the type of event which will be one of: EV_TIMEOUT,
-   * EV_SIGNAL, EV_READ, EV_WRITE.
+const std::string& TNonblockingServer::TConnection::getClientIdentity(uint8_t* frame,
+                                                                      uint32_t size) {
+  const std::string& header = server_->getClientIdentityHeader();
+  if (!header.empty() && server_->getHeaderTransport() && size > 4) {
+    try {
+      if (THeaderTransport::findHeader(frame + 4, size - 4, header, headerIdentity_)) {
+        return headerIdentity_;
+      }
+    } catch (const std::exception&) {
+      // leave reporting the error to the processor
+    }
+  }
+
+  if (connectionIdentity_.empty()) {
+    connectionIdentity_ = tSocket_->getSocketInfo();
+    if (tSocket_->isUnixDomainSocket()) {
+      // all connections share the path, tell them apart by descriptor
+      connectionIdentity_ += " #" + std::to_string(tSocket_->getSocketFD());
+    }
+  }
+  return connectionIdentity_;
+}
+
+bool TNonblockingServer::TConnection::rejectRequest(const std::shared_ptr<TProtocol>& input,
+                                                    const std::shared_ptr<TProtocol>& output) {
+  try {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    input->readMessageBegin(name, type, seqid);
+    input->skip(T_STRUCT);
+    input->readMessageEnd();
+    input->getTransport()->readEnd();
+    if (type == T_ONEWAY) {
+      return true;
+    }
+
+    TApplicationException x(TApplicationException::INTERNAL_ERROR,
+                             "TNonblockingServer: too many requests queued for client");
+    output->writeMessageBegin(name, T_EXCEPTION, seqid);
+    x.write(output.get());
+    output->writeMessageEnd();
+    output->getTransport()->writeEnd();
+    output->getTransport()->flush();
+  } catch (const std::exception& x) {
+    TOutput::instance().printf("TNonblockingServer: failed to reject request: %s", x.what());
+    return false;
+  }
+  return true;
+}
+
+bool TNonblockingServer::TConnection::processInline(const std::shared_ptr<TProtocol>& input,
+                                                    const std::shared_ptr<TProtocol>& output) {
+  try {
+    if (serverEventHandler_) {
+      serverEventHandler_->processContext(connectionContext_, getTSocket());
+    }
+    // Invoke the processor
+    processor_->process(input, output, connectionContext_);
+  } catch (const TTransportException& ttx) {
+    TOutput::instance().printf(
+        "TNonblockingServer transport error in "
+        "process(): %s",
+        ttx.what());
+    return false;
+  } catch (const std::exception& x) {
+    TOutput::instance().printf("Server::process() uncaught exception: %s: %s",
+                        typeid(x).name(),
+                        x.what());
+    return false;
+  } catch (...) {
+    TOutput::instance().printf("Server::process() unknown exception");
+    return false;
+  }
+  return true;
+}
+
+bool TNonblockingServer::TConnection::processAsync() {
+  // The processor may call back before process() returns, in which case we
+  // carry on from here, or later from any thread, which then notifies the
+  // IO thread as a finished Task does.  Whichever of the two gets to move
+  // the state of the request on from ASYNC_DISPATCHING decides which it is.
+  // A processor that throws may still have handed the callback on, so the
+  // request only fails if the callback has not run by then.  The callback
+  // keeps the state alive and leaves the connection alone once the request
+  // has failed, as the connection may be closed or serving someone else.
+  appState_ = APP_WAIT_TASK;
+  setIdle();
+  std::shared_ptr<std::atomic<int> > state(new std::atomic<int>(ASYNC_DISPATCHING));
+  bool failed = false;
+  try {
+    if (serverEventHandler_) {
+      serverEventHandler_->processContext(connectionContext_, getTSocket());
+    }
+    asyncProcessor_->process(std::bind(&TConnection::asyncComplete, this, state, std::placeholders::_1),
+                             inputProtocol_,
+                             outputProtocol_);
+  } catch (const std::exception& x) {
+    TOutput::instance().printf("Server::process() uncaught exception: %s: %s",
+                        typeid(x).name(),
+                        x.what());
+    failed = true;
+  } catch (...) {
+    TOutput::instance().printf("Server::process() unknown exception");
+    failed = true;
+  }
+
+  int expected = ASYNC_DISPATCHING;
+  if (state->compare_exchange_strong(expected, failed ? ASYNC_FAILED : ASYNC_DEFERRED)) {
+    if (failed) {
+      server_->decrementActiveProcessors();
+      close();
+    }
+    return false;
+  }
+  // the callback ran already
+  return true;
+}
+
+void TNonblockingServer::TConnection::asyncComplete(std::shared_ptr<std::atomic<int> > state,
+                                                    bool success) {
+  // Like a Task, a request that failed still sends what it wrote, if
+  // anything
+  (void)success;
+  int expected = ASYNC_DISPATCHING;
+  if (state->compare_exchange_strong(expected, ASYNC_COMPLETED)) {
+    return;
+  }
+  // Nothing is left to do once the request has failed, or if called twice
+  if (expected != ASYNC_DEFERRED || !state->compare_exchange_strong(expected, ASYNC_COMPLETED)) {
+    return;
+  }
+
+  // Signal completion back to the libevent thread via a pipe
+  if (!notifyIOThread()) {
+    TOutput::instance().printf("TNonblockingServer: failed to notifyIOThread, closing.");
+    server_->decrementActiveProcessors();
+    close();
+  }
+}
+
+void TNonblockingServer::TConnection::setFlags(short eventFlags) {
+  // Catch the do nothing case
+  if (eventFlags_ == eventFlags) {
+    return;
+  }
+
+  // Delete a previously existing event
+  if (eventFlags_ && event_del(&event_) == -1) {
+    TOutput::instance().perror("TConnection::setFlags() event_del", THRIFT_GET_SOCKET_ERROR);
+    return;
+  }
+
+  // Update in memory structure
+  eventFlags_ = eventFlags;
+
+  // Do not call event_set if there are no flags
+  if (!eventFlags_) {
+    return;
+  }
+
+  /*
+   * event_set:
+   *
+   * Prepares the event structure &event to be used in future calls to
+   * event_add() and event_del().  The event will be prepared to call the
+   * eventHandler using the 'sock' file descriptor to monitor events.
+   *
+   * The events can be either EV_READ, EV_WRITE, or both, indicating
+   * that an application can read or write from the file respectively without
+   * blocking.
+   *
+   * The eventHandler will be called with the file descriptor that triggered
+   * the event and the type of event which will be one of: EV_TIMEOUT,
+   * EV_SIGNAL, EV_READ, EV_WRITE.
    *
    * The additional flag EV_PERSIST makes an event_add() persistent until
    * event_del() has been called.
@@ -850,10 +1489,21 @@ void TNonblockingServer::TConnection::setFlags(short eventFlags) {
  */
 void TNonblockingServer::TConnection::close() {
   setIdle();
+  cancelFlush();
+
+  if (tasksInFlight_ > 0) {
+    closePending_ = true;
+    return;
+  }
+
+  if (handshakePending_) {
+    finishHandshake(false);
+  }
 
   if (serverEventHandler_) {
     serverEventHandler_->deleteContext(connectionContext_, inputProtocol_, outputProtocol_);
   }
+  releaseBuffers();
   ioThread_ = nullptr;
 
   // Close the socket
@@ -866,28 +1516,466 @@ void TNonblockingServer::TConnection::close() {
   // release processor and handler
   processor_.reset();
 
+  clearPipelinedRequests();
+
   // Give this object back to the server that owns it
   server_->returnConnection(this);
 }
 
-void TNonblockingServer::TConnection::checkIdleBufferMemLimit(size_t readLimit, size_t writeLimit) {
-  if (readLimit > 0 && readBufferSize_ > readLimit) {
-    free(readBuffer_);
-    readBuffer_ = nullptr;
-    readBufferSize_ = 0;
+void TNonblockingServer::TConnection::dispatchPipelinedRequest() {
+  PipelinedRequest* request = nullptr;
+  if (freeRequests_.empty()) {
+    request = new PipelinedRequest(this);
+    request->inputTransport.reset(new TMemoryBuffer(request->frame, request->frameSize));
+    request->outputTransport.reset(new TPooledMemoryBuffer());
+    request->factoryInputTransport
+        = server_->getInputTransportFactory()->getTransport(request->inputTransport);
+    request->factoryOutputTransport
+        = server_->getOutputTransportFactory()->getTransport(request->outputTransport);
+    if (server_->getHeaderTransport()) {
+      request->inputProtocol = server_->getInputProtocolFactory()->getProtocol(
+          request->factoryInputTransport, request->factoryOutputTransport);
+      request->outputProtocol = request->inputProtocol;
+    } else {
+      request->inputProtocol
+          = server_->getInputProtocolFactory()->getProtocol(request->factoryInputTransport);
+      request->outputProtocol
+          = server_->getOutputProtocolFactory()->getProtocol(request->factoryOutputTransport);
+    }
+  } else {
+    request = freeRequests_.back();
+    freeRequests_.pop_back();
   }
 
-  if (writeLimit > 0 && largestWriteBufferSize_ > writeLimit) {
-    // just start over
-    outputTransport_->resetBuffer(static_cast<uint32_t>(server_->getWriteBufferDefaultSize()));
-    largestWriteBufferSize_ = 0;
+  // The request takes the frame we just read, the next one gets a new buffer
+  assert(request->frame == nullptr);
+  request->frame = readBuffer_;
+  request->frameSize = readBufferSize_;
+  readBuffer_ = nullptr;
+  readBufferSize_ = 0;
+
+  request->outputTransport->attach(ioThread_->getBufferPool(),
+                                   static_cast<uint32_t>(server_->getWriteBufferDefaultSize()));
+  if (server_->getHeaderTransport()) {
+    request->inputTransport->resetBuffer(request->frame, readBufferPos_);
+  } else {
+    request->inputTransport->resetBuffer(request->frame + 4, readBufferPos_ - 4);
+
+    // Reserve room for the frame size, as in the non-pipelined case
+    request->outputTransport->getWritePtr(4);
+    request->outputTransport->wroteBytes(4);
+  }
+  request->done = false;
+  request->aborted = false;
+
+  ++outstandingRequests_;
+  if (server_->getPipelineOrder() == T_PIPELINE_IN_ORDER) {
+    pendingRequests_.push_back(request);
+  }
+
+  bool dispatched = false;
+  if (isInlineRequest(request->inputTransport)) {
+    dispatched = processInline(request->inputProtocol, request->outputProtocol);
+    if (dispatched) {
+      server_->decrementActiveProcessors();
+      finishPipelinedRequest(request);
+    }
+  } else {
+    std::shared_ptr<Runnable> task = std::shared_ptr<Runnable>(
+        new Task(processor_, request->inputProtocol, request->outputProtocol, this, request));
+
+    bool queued = false;
+    ++tasksInFlight_;
+    try {
+      queued = queueTask(task, request->frame, readBufferPos_);
+      dispatched = true;
+    } catch (IllegalStateException& ise) {
+      // The ThreadManager is not ready to handle any more tasks (it's probably shutting down).
+      TOutput::instance().printf("IllegalStateException: Server::process() %s", ise.what());
+    } catch (TimedOutException& to) {
+      TOutput::instance().printf("[ERROR] TimedOutException: Server::process() %s", to.what());
+    }
+    if (!queued) {
+      --tasksInFlight_;
+    }
+    if (dispatched && !queued) {
+      // The client has too many requests queued, turn this one down
+      dispatched = rejectRequest(request->inputProtocol, request->outputProtocol);
+      if (dispatched) {
+        server_->decrementActiveProcessors();
+        finishPipelinedRequest(request);
+      }
+    }
+  }
+
+  if (!dispatched) {
+    server_->decrementActiveProcessors();
+    if (!pendingRequests_.empty() && pendingRequests_.back() == request) {
+      pendingRequests_.pop_back();
+    }
+    releasePipelinedRequest(request);
+    close();
+    return;
   }
+
+  // Go on with the next frame while this one is processing
+  socketState_ = SOCKET_RECV_FRAMING;
+  appState_ = APP_READ_FRAME_SIZE;
+  readBufferPos_ = 0;
+
+  updatePipelinedFlags();
+}
+
+void TNonblockingServer::TConnection::completePipelinedRequest(PipelinedRequest* request,
+                                                               bool aborted) {
+  request->aborted = aborted;
+
+  // Signal completion back to the libevent thread
+  if (!ioThread_->notify(request)) {
+    TOutput::instance().printf("TNonblockingServer: failed to notifyIOThread for pipelined request.");
+    throw TException("TNonblockingServer::TConnection::completePipelinedRequest: failed write on notify pipe");
+  }
+}
+
+void TNonblockingServer::TConnection::notified(TNotification* notification) {
+  if (!notification->pipelined) {
+    transition();
+    return;
+  }
+
+  // Every completed request is notified exactly once, so the connection
+  // cannot be recycled while notifications for it are still queued
+  auto* request = static_cast<PipelinedRequest*>(notification);
+  --tasksInFlight_;
+  server_->decrementActiveProcessors();
+
+  if (request->aborted) {
+    closePending_ = true;
+  }
+
+  finishPipelinedRequest(request);
+
+  if (closePending_) {
+    if (tasksInFlight_ == 0) {
+      close();
+    }
+    return;
+  }
+
+  bool wasReading = (eventFlags_ & EV_READ) != 0;
+  updatePipelinedFlags();
+
+  // Data already buffered by the transport (e.g. TSSLSocket) won't raise a
+  // read event once reading resumes
+  if (!wasReading && (eventFlags_ & EV_READ) && tSocket_->hasPendingDataToRead()) {
+    workSocket(EV_READ);
+  }
+}
+
+void TNonblockingServer::TConnection::finishPipelinedRequest(PipelinedRequest* request) {
+  // The request has been consumed
+  releaseFrame(request);
+
+  request->outputTransport->account(ioThread_->getBufferPool());
+  request->outputTransport->getBuffer(&request->writeBuffer, &request->writeBufferSize);
+
+  // 4 bytes were reserved for frame size
+  if (request->writeBufferSize > 4) {
+    auto frameSize = (int32_t)htonl(request->writeBufferSize - 4);
+    memcpy(request->writeBuffer, &frameSize, 4);
+  }
+  request->done = true;
+
+  if (server_->getPipelineOrder() == T_PIPELINE_IN_ORDER) {
+    while (!pendingRequests_.empty() && pendingRequests_.front()->done) {
+      PipelinedRequest* ready = pendingRequests_.front();
+      pendingRequests_.pop_front();
+      if (ready->writeBufferSize > 4) {
+        sendQueue_.push_back(ready);
+        queuedBytes_ += ready->writeBufferSize;
+      } else {
+        releasePipelinedRequest(ready);
+      }
+    }
+  } else if (request->writeBufferSize > 4) {
+    sendQueue_.push_back(request);
+    queuedBytes_ += request->writeBufferSize;
+  } else {
+    // oneway calls have no response
+    releasePipelinedRequest(request);
+  }
+}
+
+void TNonblockingServer::TConnection::writePipelinedResponses() {
+  uint64_t responses = 0;
+  uint64_t writes = 0;
+  writeBlocked_ = false;
+
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_SYS_SOCKET_H)
+  // A TSSLSocket can once its handshake has handed encryption to the kernel
+  if (!gatherWrites_) {
+    gatherWrites_ = tSocket_->canSendDirectly();
+  }
+#endif
+
+#ifdef TCP_CORK
+  // Without a gathering write, let the kernel merge the responses instead
+  int cork = !gatherWrites_ && sendQueue_.size() > 1 ? 1 : 0;
+  if (cork) {
+    setsockopt(tSocket_->getSocketFD(), IPPROTO_TCP, TCP_CORK, const_cast_sockopt(&cork), sizeof(cork));
+  }
+#endif
+
+  while (!sendQueue_.empty()) {
+    // Should never have position past size
+    assert(writeBufferPos_ < sendQueue_.front()->writeBufferSize);
+
+    uint32_t want = 0;
+    uint32_t sent = 0;
+    try {
+      ++writes;
+      if (gatherWrites_ && sendQueue_.size() > 1) {
+        sent = writeGathered(want);
+      } else {
+        PipelinedRequest* request = sendQueue_.front();
+        want = request->writeBufferSize - writeBufferPos_;
+        sent = tSocket_->write_partial(request->writeBuffer + writeBufferPos_, want);
+      }
+    } catch (TTransportException& te) {
+      TOutput::instance().printf("TConnection::workSocket(): %s ", te.what());
+      server_->countResponseWrites(responses, writes);
+      close();
+      return;
+    }
+
+    // Retire the responses that were written completely
+    queuedBytes_ -= sent;
+    while (sent > 0) {
+      PipelinedRequest* request = sendQueue_.front();
+      uint32_t left = request->writeBufferSize - writeBufferPos_;
+      if (sent < left) {
+        writeBufferPos_ += sent;
+        break;
+      }
+      sent -= left;
+      writeBufferPos_ = 0;
+      sendQueue_.pop_front();
+      releasePipelinedRequest(request);
+      ++responses;
+    }
+
+    if (sent < want) {
+      // The socket is full, wait for the next write event
+      writeBlocked_ = true;
+      break;
+    }
+  }
+
+#ifdef TCP_CORK
+  if (cork) {
+    cork = 0;
+    setsockopt(tSocket_->getSocketFD(), IPPROTO_TCP, TCP_CORK, const_cast_sockopt(&cork), sizeof(cork));
+  }
+#endif
+
+  server_->countResponseWrites(responses, writes);
+  updatePipelinedFlags();
+}
+
+uint32_t TNonblockingServer::TConnection::writeGathered(uint32_t& want) {
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_SYS_SOCKET_H)
+  // Enough to fill the socket buffer with small responses
+  const size_t maxBuffers = 64;
+  struct iovec iov[maxBuffers];
+  size_t count = 0;
+  uint32_t offset = writeBufferPos_;
+  want = 0;
+  for (auto request : sendQueue_) {
+    if (count == maxBuffers) {
+      break;
+    }
+    iov[count].iov_base = request->writeBuffer + offset;
+    iov[count].iov_len = request->writeBufferSize - offset;
+    want += request->writeBufferSize - offset;
+    offset = 0;
+    ++count;
+  }
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+#endif
+  ssize_t b = sendmsg(tSocket_->getSocketFD(), &msg, flags);
+  if (b < 0) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    if (errno_copy == THRIFT_EWOULDBLOCK || errno_copy == THRIFT_EAGAIN) {
+      return 0;
+    }
+    if (errno_copy == THRIFT_EPIPE || errno_copy == THRIFT_ECONNRESET
+        || errno_copy == THRIFT_ENOTCONN) {
+      throw TTransportException(TTransportException::NOT_OPEN, "sendmsg()", errno_copy);
+    }
+    throw TTransportException(TTransportException::UNKNOWN, "sendmsg()", errno_copy);
+  }
+  if (b == 0) {
+    throw TTransportException(TTransportException::NOT_OPEN, "Socket send returned 0.");
+  }
+  return static_cast<uint32_t>(b);
+#else
+  (void)want;
+  throw TTransportException(TTransportException::NOT_OPEN, "Gathering writes are not supported");
+#endif
+}
+
+void TNonblockingServer::TConnection::scheduleFlush() {
+  int64_t delay = server_->getWriteCoalescingDelay();
+  bool hold = delay > 0 && tasksInFlight_ > 0 && queuedBytes_ < server_->getWriteCoalescingLimit();
+
+  if (flushScheduled_) {
+    if (hold || !flushTimerArmed_) {
+      return;
+    }
+    // No reason left to hold the responses back
+    event_del(&flushEvent_);
+  } else {
+    event_set(&flushEvent_, -1, 0, TConnection::flushHandler, this);
+    event_base_set(ioThread_->getEventBase(), &flushEvent_);
+    flushScheduled_ = true;
+  }
+
+  flushTimerArmed_ = hold;
+  if (hold) {
+    struct timeval timeout;
+    timeout.tv_sec = static_cast<long>(delay / 1000000);
+    timeout.tv_usec = static_cast<long>(delay % 1000000);
+    if (event_add(&flushEvent_, &timeout) == -1) {
+      TOutput::instance().perror("TConnection::scheduleFlush(): could not event_add", THRIFT_GET_SOCKET_ERROR);
+    }
+  } else {
+    // Runs after the events that are ready in this loop iteration
+    event_active(&flushEvent_, EV_TIMEOUT, 1);
+  }
+}
+
+void TNonblockingServer::TConnection::cancelFlush() {
+  if (flushScheduled_) {
+    event_del(&flushEvent_);
+    flushScheduled_ = false;
+    flushTimerArmed_ = false;
+  }
+}
+
+void TNonblockingServer::TConnection::releasePipelinedRequest(PipelinedRequest* request) {
+  --outstandingRequests_;
+
+  releaseFrame(request);
+  request->outputTransport->detach(ioThread_->getBufferPool());
+  request->writeBuffer = nullptr;
+  request->writeBufferSize = 0;
+
+  freeRequests_.push_back(request);
+}
+
+void TNonblockingServer::TConnection::updatePipelinedFlags() {
+  if (closePending_) {
+    setIdle();
+    cancelFlush();
+    return;
+  }
+
+  short flags = 0;
+  if (outstandingRequests_ < server_->getMaxPipelinedRequests()) {
+    flags |= EV_READ;
+  }
+  if (writeBlocked_) {
+    flags |= EV_WRITE;
+  } else if (!sendQueue_.empty()) {
+    scheduleFlush();
+  }
+  setFlags(flags ? static_cast<short>(flags | EV_PERSIST) : 0);
+}
+
+void TNonblockingServer::TConnection::clearPipelinedRequests() {
+  for (auto request : pendingRequests_) {
+    delete request;
+  }
+  for (auto request : sendQueue_) {
+    delete request;
+  }
+  for (auto request : freeRequests_) {
+    delete request;
+  }
+  pendingRequests_.clear();
+  sendQueue_.clear();
+  freeRequests_.clear();
+  queuedBytes_ = 0;
+  writeBlocked_ = false;
+  tasksInFlight_ = 0;
+  outstandingRequests_ = 0;
+  closePending_ = false;
+}
+
+void TNonblockingServer::TConnection::reserveReadBuffer(uint32_t size) {
+  if (size <= readBufferSize_) {
+    return;
+  }
+  releaseReadBuffer();
+  readBuffer_ = ioThread_->getBufferPool().allocate(size, &readBufferSize_);
+}
+
+void TNonblockingServer::TConnection::releaseReadBuffer() {
+  ioThread_->getBufferPool().release(readBuffer_, readBufferSize_);
+  readBuffer_ = nullptr;
+  readBufferSize_ = 0;
+}
+
+void TNonblockingServer::TConnection::releaseBuffers() {
+  TNonblockingBufferPool& pool = ioThread_->getBufferPool();
+
+  inputTransport_->resetBuffer();
+  releaseReadBuffer();
+  outputTransport_->detach(pool);
+  writeBuffer_ = nullptr;
+  writeBufferSize_ = 0;
+
+  for (auto requests : {&pendingRequests_, &sendQueue_}) {
+    for (auto request : *requests) {
+      releaseFrame(request);
+      request->outputTransport->detach(pool);
+      request->writeBuffer = nullptr;
+      request->writeBufferSize = 0;
+    }
+  }
+}
+
+void TNonblockingServer::TConnection::releaseFrame(PipelinedRequest* request) {
+  request->inputTransport->resetBuffer();
+  ioThread_->getBufferPool().release(request->frame, request->frameSize);
+  request->frame = nullptr;
+  request->frameSize = 0;
 }
 
 TNonblockingServer::~TNonblockingServer() {
+  // Let running handshakes end first, they reference their connections.
+  // Those waiting for a client would take until they time out, so cut them
+  // short.
+  if (handshakeThreadManager_) {
+    for (auto connection : activeConnections_) {
+      connection->interruptHandshake();
+    }
+    handshakeThreadManager_->stop();
+  }
+
   // Close any active connections (moves them to the idle connection stack)
   while (!activeConnections_.empty()) {
-    (*activeConnections_.begin())->close();
+    TConnection* connection = *activeConnections_.begin();
+    connection->abandonTasks();
+    connection->close();
   }
   // Clean up unused TConnection objects in connectionStack_
   while (!connectionStack_.empty()) {
@@ -947,7 +2035,6 @@ void TNonblockingServer::returnConnection(TConnection* connection) {
     delete connection;
     --numTConnections_;
   } else {
-    connection->checkIdleBufferMemLimit(idleReadBufferLimit_, idleWriteBufferLimit_);
     connectionStack_.push(connection);
   }
 }
@@ -1036,6 +2123,7 @@ void TNonblockingServer::setThreadManager(std::shared_ptr<ThreadManager> threadM
   } else {
     threadPoolProcessing_ = false;
   }
+  fairTaskQueue_.setThreadManager(threadManager);
 }
 
 bool TNonblockingServer::serverOverloaded() {
@@ -1063,11 +2151,15 @@ bool TNonblockingServer::serverOverloaded() {
 
 bool TNonblockingServer::drainPendingTask() {
   if (threadManager_) {
-    std::shared_ptr<Runnable> task = threadManager_->removeNextPending();
+    // With fair queuing, the thread manager only holds tasks about to run
+    std::shared_ptr<Runnable> task = fairQueuing_ ? fairTaskQueue_.removeNextPending()
+                                                  : threadManager_->removeNextPending();
     if (task) {
-      TConnection* connection = static_cast<TConnection::Task*>(task.get())->getTConnection();
-      assert(connection && connection->getServer() && connection->getState() == APP_WAIT_TASK);
-      connection->forceClose();
+      auto* connectionTask = static_cast<TConnection::Task*>(task.get());
+      TConnection* connection = connectionTask->getTConnection();
+      assert(connection && connection->getServer()
+             && (connectionTask->getPipelinedRequest() || connection->getState() == APP_WAIT_TASK));
+      connection->forceClose(connectionTask->getPipelinedRequest());
       return true;
     }
   }
@@ -1075,9 +2167,11 @@ bool TNonblockingServer::drainPendingTask() {
 }
 
 void TNonblockingServer::expireClose(std::shared_ptr<Runnable> task) {
-  TConnection* connection = static_cast<TConnection::Task*>(task.get())->getTConnection();
-  assert(connection && connection->getServer() && connection->getState() == APP_WAIT_TASK);
-  connection->forceClose();
+  auto* connectionTask = static_cast<TConnection::Task*>(task.get());
+  TConnection* connection = connectionTask->getTConnection();
+  assert(connection && connection->getServer()
+         && (connectionTask->getPipelinedRequest() || connection->getState() == APP_WAIT_TASK));
+  connection->forceClose(connectionTask->getPipelinedRequest());
 }
 
 void TNonblockingServer::stop() {
@@ -1111,6 +2205,13 @@ void TNonblockingServer::registerEvents(event_base* user_event_base) {
     ioThreads_.push_back(thread);
   }
 
+  // Start the threads running handshakes, if any
+  if (numHandshakeThreads_ > 0) {
+    handshakeThreadManager_ = ThreadManager::newSimpleThreadManager(numHandshakeThreads_);
+    handshakeThreadManager_->threadFactory(std::make_shared<ThreadFactory>());
+    handshakeThreadManager_->start();
+  }
+
   // Notify handler of the preServe event
   if (eventHandler_) {
     eventHandler_->preServe();
@@ -1164,6 +2265,448 @@ void TNonblockingServer::serve() {
   }
 }
 
+size_t TNonblockingServer::getBufferMemoryInUse() const {
+  size_t bytes = 0;
+  for (const auto& ioThread : ioThreads_) {
+    bytes += ioThread->getBufferPool().getBytesInUse();
+  }
+  return bytes;
+}
+
+size_t TNonblockingServer::getBufferMemoryCached() const {
+  size_t bytes = 0;
+  for (const auto& ioThread : ioThreads_) {
+    bytes += ioThread->getBufferPool().getBytesCached();
+  }
+  return bytes;
+}
+
+TNonblockingBufferPool::TNonblockingBufferPool()
+  : cacheLimit_(0), bytesInUse_(0), bytesCached_(0) {
+  for (auto& freeList : freeLists_) {
+    freeList = nullptr;
+  }
+}
+
+TNonblockingBufferPool::~TNonblockingBufferPool() {
+  trim();
+}
+
+int TNonblockingBufferPool::sizeClass(uint32_t size) {
+  int index = 0;
+  for (uint32_t classSize = MIN_BUFFER_SIZE; classSize <= MAX_BUFFER_SIZE; classSize *= 2) {
+    if (size == classSize) {
+      return index;
+    }
+    ++index;
+  }
+  return -1;
+}
+
+uint8_t* TNonblockingBufferPool::allocate(uint32_t want, uint32_t* size) {
+  uint32_t allocated = want;
+  int index = -1;
+  if (want <= MAX_BUFFER_SIZE) {
+    allocated = MIN_BUFFER_SIZE;
+    index = 0;
+    while (allocated < want) {
+      allocated *= 2;
+      ++index;
+    }
+  }
+
+  uint8_t* buffer = nullptr;
+  if (index >= 0 && freeLists_[index] != nullptr) {
+    buffer = freeLists_[index];
+    memcpy(&freeLists_[index], buffer, sizeof(uint8_t*));
+    bytesCached_.fetch_sub(allocated, std::memory_order_relaxed);
+  } else {
+    buffer = static_cast<uint8_t*>(std::malloc(allocated));
+    if (buffer == nullptr) {
+      throw std::bad_alloc();
+    }
+  }
+
+  bytesInUse_.fetch_add(allocated, std::memory_order_relaxed);
+  *size = allocated;
+  return buffer;
+}
+
+void TNonblockingBufferPool::release(uint8_t* buffer, uint32_t size) {
+  if (buffer == nullptr) {
+    return;
+  }
+  bytesInUse_.fetch_sub(size, std::memory_order_relaxed);
+
+  int index = sizeClass(size);
+  if (index < 0 || getBytesCached() + size > cacheLimit_) {
+    std::free(buffer);
+    return;
+  }
+  memcpy(buffer, &freeLists_[index], sizeof(uint8_t*));
+  freeLists_[index] = buffer;
+  bytesCached_.fetch_add(size, std::memory_order_relaxed);
+}
+
+void TNonblockingBufferPool::resized(uint32_t oldSize, uint32_t newSize) {
+  bytesInUse_.fetch_add(newSize, std::memory_order_relaxed);
+  bytesInUse_.fetch_sub(oldSize, std::memory_order_relaxed);
+}
+
+void TNonblockingBufferPool::trim() {
+  for (auto& freeList : freeLists_) {
+    while (freeList != nullptr) {
+      uint8_t* buffer = freeList;
+      memcpy(&freeList, buffer, sizeof(uint8_t*));
+      std::free(buffer);
+    }
+  }
+  bytesCached_.store(0, std::memory_order_relaxed);
+}
+
+void TNonblockingBufferPool::setCacheLimit(size_t limit) {
+  cacheLimit_ = limit;
+  if (getBytesCached() > cacheLimit_) {
+    trim();
+  }
+}
+
+/// Queue and statistics of one client of a TFairTaskQueue
+struct TFairTaskQueue::Client {
+  std::string name;
+  std::deque<Entry> tasks;
+  size_t inFlight;
+  /// Cost the client may still dispatch in this round
+  int64_t deficit;
+  /// Whether the client is in the round
+  bool active;
+  uint64_t dispatched;
+  uint64_t rejected;
+};
+
+/// Runs a dispatched task and accounts for it once done
+class TFairTaskQueue::Task : public Runnable {
+public:
+  Task(TFairTaskQueue* queue, Client* client, std::shared_ptr<Runnable> task)
+    : queue_(queue), client_(client), task_(std::move(task)) {}
+
+  void run() override {
+    try {
+      task_->run();
+    } catch (...) {
+      queue_->finished(client_);
+      throw;
+    }
+    queue_->finished(client_);
+  }
+
+  std::shared_ptr<Runnable> getRunnable() const { return task_; }
+
+  Client* getClient() const { return client_; }
+
+private:
+  TFairTaskQueue* queue_;
+  Client* client_;
+  std::shared_ptr<Runnable> task_;
+};
+
+TFairTaskQueue::TFairTaskQueue()
+  : quantum_(QUANTUM),
+    maxClientTasksInFlight_(0),
+    maxClientQueueDepth_(0),
+    pending_(0),
+    inFlight_(0),
+    rejected_(0) {
+}
+
+TFairTaskQueue::~TFairTaskQueue() {
+  for (auto& client : clients_) {
+    delete client.second;
+  }
+}
+
+void TFairTaskQueue::setThreadManager(std::shared_ptr<ThreadManager> threadManager) {
+  Guard g(mutex_);
+  threadManager_ = threadManager;
+}
+
+void TFairTaskQueue::setExpireCallback(ExpireCallback expireCallback) {
+  Guard g(mutex_);
+  expireCallback_ = expireCallback;
+}
+
+uint32_t TFairTaskQueue::getQuantum() const {
+  Guard g(mutex_);
+  return quantum_;
+}
+
+void TFairTaskQueue::setQuantum(uint32_t quantum) {
+  Guard g(mutex_);
+  quantum_ = (std::max)(quantum, 1u);
+}
+
+size_t TFairTaskQueue::getMaxClientTasksInFlight() const {
+  Guard g(mutex_);
+  return maxClientTasksInFlight_;
+}
+
+void TFairTaskQueue::setMaxClientTasksInFlight(size_t limit) {
+  {
+    Guard g(mutex_);
+    maxClientTasksInFlight_ = limit;
+  }
+  dispatch();
+}
+
+size_t TFairTaskQueue::getMaxClientQueueDepth() const {
+  Guard g(mutex_);
+  return maxClientQueueDepth_;
+}
+
+void TFairTaskQueue::setMaxClientQueueDepth(size_t limit) {
+  Guard g(mutex_);
+  maxClientQueueDepth_ = limit;
+}
+
+size_t TFairTaskQueue::pendingTaskCount() const {
+  Guard g(mutex_);
+  return pending_;
+}
+
+uint64_t TFairTaskQueue::getRejectedCount() const {
+  Guard g(mutex_);
+  return rejected_;
+}
+
+std::vector<TClientQueueStats> TFairTaskQueue::getClientStats() const {
+  Guard g(mutex_);
+  std::vector<TClientQueueStats> stats;
+  stats.reserve(clients_.size());
+  for (const auto& entry : clients_) {
+    const Client* client = entry.second;
+    TClientQueueStats clientStats;
+    clientStats.client = client->name;
+    clientStats.queued = client->tasks.size();
+    clientStats.inFlight = client->inFlight;
+    clientStats.dispatched = client->dispatched;
+    clientStats.rejected = client->rejected;
+    stats.push_back(clientStats);
+  }
+  return stats;
+}
+
+bool TFairTaskQueue::add(const std::string& client,
+                         std::shared_ptr<Runnable> task,
+                         uint32_t cost,
+                         int64_t expiration) {
+  {
+    Guard g(mutex_);
+    Client*& entry = clients_[client];
+    if (entry == nullptr) {
+      entry = new Client();
+      entry->name = client;
+      entry->inFlight = 0;
+      entry->deficit = 0;
+      entry->active = false;
+      entry->dispatched = 0;
+      entry->rejected = 0;
+    }
+    if (maxClientQueueDepth_ > 0 && entry->tasks.size() >= maxClientQueueDepth_) {
+      ++entry->rejected;
+      ++rejected_;
+      return false;
+    }
+
+    Entry queued;
+    queued.task = std::move(task);
+    queued.cost = cost;
+    if (expiration > 0) {
+      queued.expireTime
+          = std::chrono::steady_clock::now() + std::chrono::milliseconds(expiration);
+    }
+    entry->tasks.push_back(std::move(queued));
+    ++pending_;
+    if (!entry->active) {
+      entry->active = true;
+      round_.push_back(entry);
+    }
+  }
+  dispatch();
+  return true;
+}
+
+std::shared_ptr<Runnable> TFairTaskQueue::removeNextPending() {
+  Guard g(mutex_);
+  Client* longest = nullptr;
+  for (Client* client : round_) {
+    if (longest == nullptr || client->tasks.size() > longest->tasks.size()) {
+      longest = client;
+    }
+  }
+  if (longest == nullptr || longest->tasks.empty()) {
+    return std::shared_ptr<Runnable>();
+  }
+  std::shared_ptr<Runnable> task = std::move(longest->tasks.front().task);
+  longest->tasks.pop_front();
+  --pending_;
+  if (longest->tasks.empty()) {
+    deactivate(longest);
+  }
+  return task;
+}
+
+void TFairTaskQueue::dispatch() {
+  std::shared_ptr<ThreadManager> threadManager;
+  {
+    Guard g(mutex_);
+    threadManager = threadManager_;
+  }
+  if (!threadManager) {
+    return;
+  }
+  // Keep the thread manager's own queue (nearly) empty
+  size_t limit = (std::max)(threadManager->workerCount(), static_cast<size_t>(1));
+
+  std::vector<std::shared_ptr<Task> > ready;
+  std::vector<std::shared_ptr<Runnable> > expired;
+  ExpireCallback expireCallback;
+  {
+    Guard g(mutex_);
+    expireCallback = expireCallback_;
+    std::chrono::steady_clock::time_point now;
+    bool haveNow = false;
+    // # of clients in a row skipped because of their in-flight limit
+    size_t blocked = 0;
+    while (inFlight_ < limit && blocked < round_.size()) {
+      Client* client = round_.front();
+      if (throttled(client)) {
+        round_.pop_front();
+        round_.push_back(client);
+        ++blocked;
+        continue;
+      }
+
+      Entry& entry = client->tasks.front();
+      if (entry.expireTime != std::chrono::steady_clock::time_point()) {
+        if (!haveNow) {
+          now = std::chrono::steady_clock::now();
+          haveNow = true;
+        }
+        if (entry.expireTime <= now) {
+          expired.push_back(std::move(entry.task));
+          client->tasks.pop_front();
+          --pending_;
+          if (client->tasks.empty()) {
+            deactivate(client);
+          }
+          continue;
+        }
+      }
+
+      blocked = 0;
+      if (client->deficit < static_cast<int64_t>(entry.cost)) {
+        // Not enough credit yet.  Rather than going round the clients a
+        // quantum at a time, credit them all at once with as many rounds as
+        // the first of them needs to afford its next task.
+        int64_t rounds = roundsShort(client);
+        for (Client* other : round_) {
+          if (rounds == 0) {
+            break;
+          }
+          if (!throttled(other)) {
+            rounds = (std::min)(rounds, roundsShort(other));
+          }
+        }
+        if (rounds == 0) {
+          // Another client can still afford its task in this round
+          round_.pop_front();
+          round_.push_back(client);
+          continue;
+        }
+        for (Client* other : round_) {
+          if (!throttled(other)) {
+            other->deficit += rounds * quantum_;
+          }
+        }
+        continue;
+      }
+
+      // Take one task per turn so that clients interleave finely, while the
+      // deficit keeps clients with costly tasks from taking more than their
+      // share
+      client->deficit -= entry.cost;
+      ready.push_back(std::make_shared<Task>(this, client, std::move(entry.task)));
+      client->tasks.pop_front();
+      --pending_;
+      ++client->inFlight;
+      ++client->dispatched;
+      ++inFlight_;
+      if (client->tasks.empty()) {
+        deactivate(client);
+      } else {
+        round_.pop_front();
+        round_.push_back(client);
+      }
+    }
+  }
+
+  for (auto& task : ready) {
+    try {
+      threadManager->add(task);
+    } catch (const TException& x) {
+      TOutput::instance().printf("TFairTaskQueue: failed to dispatch task: %s", x.what());
+      {
+        Guard g(mutex_);
+        --task->getClient()->inFlight;
+        --inFlight_;
+        deactivate(task->getClient());
+      }
+      expired.push_back(task->getRunnable());
+    }
+  }
+  if (expireCallback) {
+    for (auto& task : expired) {
+      expireCallback(task);
+    }
+  }
+}
+
+bool TFairTaskQueue::throttled(const Client* client) const {
+  return maxClientTasksInFlight_ > 0 && client->inFlight >= maxClientTasksInFlight_;
+}
+
+int64_t TFairTaskQueue::roundsShort(const Client* client) const {
+  int64_t shortfall = static_cast<int64_t>(client->tasks.front().cost) - client->deficit;
+  return shortfall <= 0 ? 0 : (shortfall + quantum_ - 1) / quantum_;
+}
+
+void TFairTaskQueue::finished(Client* client) {
+  {
+    Guard g(mutex_);
+    --client->inFlight;
+    --inFlight_;
+    deactivate(client);
+  }
+  dispatch();
+}
+
+void TFairTaskQueue::deactivate(Client* client) {
+  if (!client->tasks.empty()) {
+    return;
+  }
+  if (client->active) {
+    // Unused credit does not carry over to the client's next busy period
+    client->active = false;
+    client->deficit = 0;
+    round_.erase(std::find(round_.begin(), round_.end(), client));
+  }
+  if (client->inFlight == 0) {
+    auto it = clients_.find(client->name);
+    clients_.erase(it);
+    delete client;
+  }
+}
+
 TNonblockingIOThread::TNonblockingIOThread(TNonblockingServer* server,
                                            int number,
                                            THRIFT_SOCKET listenSocket,
@@ -1176,9 +2719,12 @@ TNonblockingIOThread::TNonblockingIOThread(TNonblockingServer* server,
     eventBase_(nullptr),
     ownEventBase_(false),
     serverEvent_{},
-    notificationEvent_{} {
+    notificationEvent_{},
+    notificationQueue_(nullptr),
+    stopRequested_(false) {
   notificationPipeFDs_[0] = -1;
   notificationPipeFDs_[1] = -1;
+  bufferPool_.setCacheLimit(server->getBufferPoolCacheLimit());
 }
 
 TNonblockingIOThread::~TNonblockingIOThread() {
@@ -1197,9 +2743,17 @@ TNonblockingIOThread::~TNonblockingIOThread() {
     listenSocket_ = THRIFT_INVALID_SOCKET;
   }
 
+  // an eventfd uses the same descriptor for both ends
+  if (notificationPipeFDs_[1] == notificationPipeFDs_[0]) {
+    notificationPipeFDs_[1] = THRIFT_INVALID_SOCKET;
+  }
   for (auto notificationPipeFD : notificationPipeFDs_) {
     if (notificationPipeFD >= 0) {
+#ifdef HAVE_SYS_EVENTFD_H
+      if (0 != ::close(notificationPipeFD)) {
+#else
       if (0 != ::THRIFT_CLOSESOCKET(notificationPipeFD)) {
+#endif
         TOutput::instance().perror("TNonblockingIOThread notificationPipe close(): ",
                             THRIFT_GET_SOCKET_ERROR);
       }
@@ -1209,6 +2763,15 @@ TNonblockingIOThread::~TNonblockingIOThread() {
 }
 
 void TNonblockingIOThread::createNotificationPipe() {
+#ifdef HAVE_SYS_EVENTFD_H
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    TOutput::instance().perror("TNonblockingServer::createNotificationPipe ", errno);
+    throw TException("can't create notification eventfd");
+  }
+  notificationPipeFDs_[0] = fd;
+  notificationPipeFDs_[1] = fd;
+#else
   if (evutil_socketpair(AF_LOCAL, SOCK_STREAM, 0, notificationPipeFDs_) == -1) {
     TOutput::instance().perror("TNonblockingServer::createNotificationPipe ", EVUTIL_SOCKET_ERROR());
     throw TException("can't create notification pipe");
@@ -1234,6 +2797,7 @@ void TNonblockingIOThread::createNotificationPipe() {
           "FD_CLOEXEC");
     }
   }
+#endif
 }
 
 /**
@@ -1295,85 +2859,84 @@ void TNonblockingIOThread::registerEvents() {
   TOutput::instance().printf("TNonblocking: IO thread #%d registered for notify.", number_);
 }
 
-bool TNonblockingIOThread::notify(TNonblockingServer::TConnection* conn) {
-  auto fd = getNotificationSendFD();
-  if (fd < 0) {
+bool TNonblockingIOThread::notify(TNonblockingServer::TNotification* notification) {
+  if (getNotificationSendFD() < 0) {
     return false;
   }
 
-  int ret = -1;
-  long kSize = sizeof(conn);
-  const char * pos = (const char *)const_cast_sockopt(&conn);
+  if (notification == nullptr) {
+    // this is the command to stop our thread
+    stopRequested_ = true;
+    return ringDoorbell();
+  }
 
-#if defined(HAVE_POLL_H) || defined(HAVE_SYS_POLL_H)
-  struct pollfd pfd = {fd, POLLOUT, 0};
+  TNonblockingServer::TNotification* head = notificationQueue_.load(std::memory_order_relaxed);
+  do {
+    notification->next = head;
+  } while (!notificationQueue_.compare_exchange_weak(head,
+                                                     notification,
+                                                     std::memory_order_release,
+                                                     std::memory_order_relaxed));
+
+  // The IO thread takes the whole queue per wakeup, so only the notification
+  // that found it empty needs to ring
+  return head != nullptr || ringDoorbell();
+}
 
-  while (kSize > 0) {
-    pfd.revents = 0;
-    ret = poll(&pfd, 1, -1);
-    if (ret < 0) {
-      return false;
-    } else if (ret == 0) {
+bool TNonblockingIOThread::ringDoorbell() {
+  auto fd = getNotificationSendFD();
+  for (;;) {
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t one = 1;
+    if (::write(fd, &one, sizeof(one)) == sizeof(one)) {
+      return true;
+    }
+#else
+    const char one = 1;
+    if (send(fd, &one, 1, 0) == 1) {
+      return true;
+    }
+#endif
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    if (errno_copy == THRIFT_EINTR) {
       continue;
     }
-
-    if (pfd.revents & POLLHUP || pfd.revents & POLLERR) {
-      ::THRIFT_CLOSESOCKET(fd);
-      return false;
+    if (errno_copy == THRIFT_EAGAIN || errno_copy == THRIFT_EWOULDBLOCK) {
+      // the doorbell is full, so a wakeup is pending anyway
+      return true;
     }
+    TOutput::instance().perror("TNonblockingIOThread::ringDoorbell() ", errno_copy);
+    return false;
+  }
+}
 
-    if (pfd.revents & POLLOUT) {
-      ret = send(fd, pos, kSize, 0);
-      if (ret < 0) {
-        if (errno == EAGAIN) {
-          continue;
-        }
-
-        ::THRIFT_CLOSESOCKET(fd);
-        return false;
-      }
-
-      kSize -= ret;
-      pos += ret;
-    }
+bool TNonblockingIOThread::clearDoorbell(evutil_socket_t fd) {
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t count;
+  if (::read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN && errno != EINTR) {
+    TOutput::instance().perror("TNonblocking: notifyHandler read() failed: ", errno);
+    breakLoop(true);
+    return false;
   }
 #else
-  fd_set wfds, efds;
-
-  while (kSize > 0) {
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
-    FD_SET(fd, &wfds);
-    FD_SET(fd, &efds);
-    ret = select(static_cast<int>(fd + 1), nullptr, &wfds, &efds, nullptr);
-    if (ret < 0) {
-      return false;
-    } else if (ret == 0) {
-      continue;
-    }
-
-    if (FD_ISSET(fd, &efds)) {
-      ::THRIFT_CLOSESOCKET(fd);
+  char buf[64];
+  for (;;) {
+    long nBytes = recv(fd, buf, sizeof(buf), 0);
+    if (nBytes == 0) {
+      TOutput::instance().printf("notifyHandler: Notify socket closed!");
+      breakLoop(false);
       return false;
-    }
-
-    if (FD_ISSET(fd, &wfds)) {
-      ret = send(fd, pos, kSize, 0);
-      if (ret < 0) {
-        if (errno == EAGAIN) {
-          continue;
-        }
-
-        ::THRIFT_CLOSESOCKET(fd);
+    } else if (nBytes < 0) {
+      if (THRIFT_GET_SOCKET_ERROR != THRIFT_EWOULDBLOCK
+          && THRIFT_GET_SOCKET_ERROR != THRIFT_EAGAIN) {
+        TOutput::instance().perror("TNonblocking: notifyHandler read() failed: ", THRIFT_GET_SOCKET_ERROR);
+        breakLoop(true);
         return false;
       }
-
-      kSize -= ret;
-      pos += ret;
+      break;
     }
   }
 #endif
-
   return true;
 }
 
@@ -1383,37 +2946,34 @@ void TNonblockingIOThread::notifyHandler(evutil_socket_t fd, short which, void*
   assert(ioThread);
   (void)which;
 
-  while (true) {
-    TNonblockingServer::TConnection* connection = nullptr;
-    const int kSize = sizeof(connection);
-    long nBytes = recv(fd, cast_sockopt(&connection), kSize, 0);
-    if (nBytes == kSize) {
-      if (connection == nullptr) {
-        // this is the command to stop our thread, exit the handler!
-        ioThread->breakLoop(false);
-        return;
-      }
-      connection->transition();
-    } else if (nBytes > 0) {
-      // throw away these bytes and hope that next time we get a solid read
-      TOutput::instance().printf("notifyHandler: Bad read of %d bytes, wanted %d", nBytes, kSize);
-      ioThread->breakLoop(true);
-      return;
-    } else if (nBytes == 0) {
-      TOutput::instance().printf("notifyHandler: Notify socket closed!");
-      ioThread->breakLoop(false);
-      // exit the loop
-      break;
-    } else { // nBytes < 0
-      if (THRIFT_GET_SOCKET_ERROR != THRIFT_EWOULDBLOCK
-          && THRIFT_GET_SOCKET_ERROR != THRIFT_EAGAIN) {
-        TOutput::instance().perror("TNonblocking: notifyHandler read() failed: ", THRIFT_GET_SOCKET_ERROR);
-        ioThread->breakLoop(true);
-        return;
-      }
-      // exit the loop
-      break;
-    }
+  // Reset the doorbell before taking the queue: anything queued afterwards
+  // finds the queue empty and rings again
+  if (!ioThread->clearDoorbell(fd)) {
+    return;
+  }
+
+  TNonblockingServer::TNotification* batch
+      = ioThread->notificationQueue_.exchange(nullptr, std::memory_order_acquire);
+
+  // The queue is a stack, restore the order in which notifications were sent
+  TNonblockingServer::TNotification* pending = nullptr;
+  while (batch != nullptr) {
+    TNonblockingServer::TNotification* next = batch->next;
+    batch->next = pending;
+    pending = batch;
+    batch = next;
+  }
+
+  while (pending != nullptr) {
+    // the notification may be reused as soon as it has been handled
+    TNonblockingServer::TNotification* notification = pending;
+    pending = pending->next;
+    notification->next = nullptr;
+    notification->connection->notified(notification);
+  }
+
+  if (ioThread->stopRequested_.exchange(false)) {
+    ioThread->breakLoop(false);
   }
 }
 
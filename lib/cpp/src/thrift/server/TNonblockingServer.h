@@ -22,6 +22,7 @@
 
 #include <thrift/Thrift.h>
 #include <memory>
+#include <thrift/async/TAsyncProcessor.h>
 #include <thrift/server/TServer.h>
 #include <thrift/transport/PlatformSocket.h>
 #include <thrift/transport/TBufferTransports.h>
@@ -32,10 +33,15 @@
 #include <thrift/concurrency/Thread.h>
 #include <thrift/concurrency/ThreadFactory.h>
 #include <thrift/concurrency/Mutex.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <stack>
 #include <vector>
 #include <string>
 #include <cstdlib>
+#include <functional>
+#include <unordered_map>
 #include <unordered_set>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -108,11 +114,173 @@ enum TOverloadAction {
   T_OVERLOAD_DRAIN_TASK_QUEUE ///< Drop some tasks from head of task queue */
 };
 
+/// Order in which responses to pipelined requests are written back.
+enum TPipelineOrder {
+  T_PIPELINE_IN_ORDER,  ///< Responses are written in request arrival order */
+  T_PIPELINE_ANY_ORDER  ///< Responses are written as they complete (matched by seqid) */
+};
+
+/// Queueing statistics of one client of a TFairTaskQueue.
+struct TClientQueueStats {
+  std::string client;  ///< Identity of the client
+  size_t queued;       ///< Tasks waiting to be dispatched
+  size_t inFlight;     ///< Tasks dispatched and not finished yet
+  uint64_t dispatched; ///< Tasks dispatched since the client became active
+  uint64_t rejected;   ///< Tasks turned down since the client became active
+};
+
+/// Statistics of the handshakes (e.g. TLS ones) of a TNonblockingServer.
+struct THandshakeStats {
+  uint64_t completed;        ///< Handshakes completed
+  uint64_t failed;           ///< Connections closed before completing theirs
+  uint64_t offloaded;        ///< Handshakes run by the handshake threads
+  uint64_t totalMicros;      ///< Time from accept to completion, summed up
+  uint64_t maxMicros;        ///< Longest time from accept to completion
+  uint64_t totalQueueMicros; ///< Time offloaded ones waited for a thread, summed up
+};
+
+/**
+ * Feeds the tasks of many clients to a ThreadManager so that no client can
+ * crowd out the others.  Tasks wait in a queue per client and are taken
+ * from the queues by deficit round robin, weighted by their cost, while
+ * fewer tasks than the ThreadManager has workers are dispatched.  Hence
+ * the ThreadManager's own queue stays short and a client that queues a lot
+ * of work only delays itself.
+ *
+ * Clients are known by name.  A client is forgotten, together with its
+ * statistics, once it has no tasks queued or in flight.
+ *
+ * All methods may be called from any thread.
+ */
+class TFairTaskQueue {
+public:
+  /// Called for tasks that expired or could not be dispatched.
+  typedef std::function<void(std::shared_ptr<Runnable>)> ExpireCallback;
+
+  /// Default cost a client may dispatch per round
+  static const uint32_t QUANTUM = 4096;
+
+  TFairTaskQueue();
+
+  ~TFairTaskQueue();
+
+  /// Set the ThreadManager tasks are dispatched to.
+  void setThreadManager(std::shared_ptr<ThreadManager> threadManager);
+
+  /// Set the function called for tasks that expired or could not be dispatched.
+  void setExpireCallback(ExpireCallback expireCallback);
+
+  /**
+   * Queue a task of a client and dispatch whatever may be dispatched.
+   *
+   * @param client identity of the client.
+   * @param task the task.
+   * @param cost cost of the task, e.g. the size of the request.
+   * @param expiration time in milliseconds the task may wait (0 == infinite).
+   * @return false if the client has too many tasks queued and the task was
+   *         not taken.
+   */
+  bool add(const std::string& client,
+           std::shared_ptr<Runnable> task,
+           uint32_t cost,
+           int64_t expiration = 0);
+
+  /**
+   * Remove the oldest task of the client with the most tasks queued.
+   *
+   * @return the task, or an empty pointer if nothing is queued.
+   */
+  std::shared_ptr<Runnable> removeNextPending();
+
+  /// Get the cost each client may dispatch per round.
+  uint32_t getQuantum() const;
+
+  /// Set the cost each client may dispatch per round.
+  void setQuantum(uint32_t quantum);
+
+  /// Get the limit on dispatched tasks per client (0 == unlimited).
+  size_t getMaxClientTasksInFlight() const;
+
+  /**
+   * Set the limit on dispatched tasks per client.  Further tasks of the
+   * client wait in its queue even if workers are idle.
+   *
+   * @param limit # of tasks, 0 for no limit.
+   */
+  void setMaxClientTasksInFlight(size_t limit);
+
+  /// Get the limit on queued tasks per client (0 == unlimited).
+  size_t getMaxClientQueueDepth() const;
+
+  /**
+   * Set the limit on queued tasks per client.  Tasks beyond it are
+   * rejected by add().
+   *
+   * @param limit # of tasks, 0 for no limit.
+   */
+  void setMaxClientQueueDepth(size_t limit);
+
+  /// Return the # of tasks waiting to be dispatched.
+  size_t pendingTaskCount() const;
+
+  /// Return the # of tasks rejected since the queue was created.
+  uint64_t getRejectedCount() const;
+
+  /// Return the statistics of all clients with tasks queued or in flight.
+  std::vector<TClientQueueStats> getClientStats() const;
+
+private:
+  TFairTaskQueue(const TFairTaskQueue&);
+  TFairTaskQueue& operator=(const TFairTaskQueue&);
+
+  struct Client;
+  class Task;
+
+  /// A queued task
+  struct Entry {
+    std::shared_ptr<Runnable> task;
+    uint32_t cost;
+    std::chrono::steady_clock::time_point expireTime;
+  };
+
+  /// Hand tasks to the ThreadManager while there are workers for them.
+  void dispatch();
+
+  /// Whether the client has as many tasks in flight as it may.
+  bool throttled(const Client* client) const;
+
+  /// # of rounds of credit the client lacks to afford its next task.
+  int64_t roundsShort(const Client* client) const;
+
+  /// Account for a dispatched task of the client that has finished.
+  void finished(Client* client);
+
+  /// Take an idle client out of the round, and forget it if it has no tasks.
+  void deactivate(Client* client);
+
+  mutable Mutex mutex_;
+  std::shared_ptr<ThreadManager> threadManager_;
+  ExpireCallback expireCallback_;
+  uint32_t quantum_;
+  size_t maxClientTasksInFlight_;
+  size_t maxClientQueueDepth_;
+
+  std::unordered_map<std::string, Client*> clients_;
+
+  /// Clients with tasks queued, in round robin order
+  std::deque<Client*> round_;
+
+  size_t pending_;
+  size_t inFlight_;
+  uint64_t rejected_;
+};
+
 class TNonblockingIOThread;
 
 class TNonblockingServer : public TServer {
 private:
   class TConnection;
+  struct TNotification;
 
   friend class TNonblockingIOThread;
 
@@ -147,6 +315,21 @@ private:
   /// # of IO threads to use by default
   static const int DEFAULT_IO_THREADS = 1;
 
+  /// Default limit on requests in flight per connection (1 = no pipelining)
+  static const size_t MAX_PIPELINED_REQUESTS = 1;
+
+  /// Default time a pipelined response may be held back, in us (0 = none)
+  static const int64_t WRITE_COALESCING_DELAY = 0;
+
+  /// Default # of held back response bytes that causes a write right away
+  static const size_t WRITE_COALESCING_LIMIT = 64 * 1024;
+
+  /// Default # of bytes of unused buffers each IO thread keeps for reuse
+  static const size_t BUFFER_POOL_CACHE_LIMIT = 4 * 1024 * 1024;
+
+  /// Default time an offloaded handshake may take, in ms
+  static const int HANDSHAKE_TIMEOUT = 10000;
+
   /// # of IO threads this server will use
   size_t numIOThreads_;
 
@@ -237,6 +420,65 @@ private:
    */
   int32_t resizeBufferEveryN_;
 
+  /**
+   * Max number of requests a single connection may have dispatched to the
+   * thread pool but not yet answered.  Values greater than 1 enable
+   * pipelining: the connection keeps reading frames while earlier ones are
+   * being processed.
+   */
+  size_t maxPipelinedRequests_;
+
+  /// Order in which pipelined responses are written back.
+  TPipelineOrder pipelineOrder_;
+
+  /// Decides by method name whether a request is processed on the IO thread
+  std::function<bool(const std::string&)> inlineMethodPolicy_;
+
+  /// Processor that completes requests through a callback, if any
+  std::shared_ptr<apache::thrift::async::TAsyncProcessor> asyncProcessor_;
+
+  /**
+   * Time in microseconds a ready pipelined response may be held back while
+   * more requests of its connection are processing, so that their responses
+   * are written together.  0 only coalesces responses that are ready within
+   * the same event loop iteration.
+   */
+  int64_t writeCoalescingDelay_;
+
+  /// Held back responses are written once they add up to this many bytes.
+  size_t writeCoalescingLimit_;
+
+  /// Count of responses written since server started
+  std::atomic<uint64_t> nResponsesWritten_;
+
+  /// Count of socket write calls made for responses since server started
+  std::atomic<uint64_t> nResponseWrites_;
+
+  /// # of bytes of unused buffers each IO thread's buffer pool keeps.
+  size_t bufferPoolCacheLimit_;
+
+  /// Whether tasks are scheduled fairly across clients
+  bool fairQueuing_;
+
+  /// THeader header naming the client of a request (empty = per connection)
+  std::string clientIdentityHeader_;
+
+  /// Per-client queues in front of the thread manager, if fairQueuing_
+  TFairTaskQueue fairTaskQueue_;
+
+  /// # of threads running handshakes (0 = run them on the IO threads)
+  size_t numHandshakeThreads_;
+
+  /// Time in milliseconds an offloaded handshake may take (0 = no limit)
+  int handshakeTimeout_;
+
+  /// Runs the handshakes if numHandshakeThreads_ > 0, created by registerEvents()
+  std::shared_ptr<ThreadManager> handshakeThreadManager_;
+
+  /// Handshake statistics, updated by all IO threads
+  THandshakeStats handshakeStats_;
+  mutable Mutex handshakeStatsMutex_;
+
   /// Set if we are currently in an overloaded state.
   bool overloaded_;
 
@@ -295,6 +537,19 @@ private:
     idleReadBufferLimit_ = IDLE_READ_BUFFER_LIMIT;
     idleWriteBufferLimit_ = IDLE_WRITE_BUFFER_LIMIT;
     resizeBufferEveryN_ = RESIZE_BUFFER_EVERY_N;
+    maxPipelinedRequests_ = MAX_PIPELINED_REQUESTS;
+    pipelineOrder_ = T_PIPELINE_IN_ORDER;
+    writeCoalescingDelay_ = WRITE_COALESCING_DELAY;
+    writeCoalescingLimit_ = WRITE_COALESCING_LIMIT;
+    nResponsesWritten_ = 0;
+    nResponseWrites_ = 0;
+    bufferPoolCacheLimit_ = BUFFER_POOL_CACHE_LIMIT;
+    fairQueuing_ = false;
+    numHandshakeThreads_ = 0;
+    handshakeTimeout_ = HANDSHAKE_TIMEOUT;
+    handshakeStats_ = THandshakeStats();
+    fairTaskQueue_.setExpireCallback(
+        std::bind(&TNonblockingServer::expireClose, this, std::placeholders::_1));
     overloaded_ = false;
     nConnectionsDropped_ = 0;
     nTotalConnectionsDropped_ = 0;
@@ -423,6 +678,19 @@ public:
     threadManager_->add(task, 0LL, taskExpireTime_);
   }
 
+  /**
+   * Queue a task of a client behind the tasks of other clients, see
+   * setFairQueuing().
+   *
+   * @param client identity of the client.
+   * @param task the task.
+   * @param cost cost of the task, the size of its request.
+   * @return false if the client has too many tasks queued.
+   */
+  bool addClientTask(const std::string& client, std::shared_ptr<Runnable> task, uint32_t cost) {
+    return fairTaskQueue_.add(client, task, cost, taskExpireTime_);
+  }
+
   /**
    * Return the count of sockets currently connected to.
    *
@@ -595,6 +863,9 @@ public:
 
   /**
    * Get the maximum size of read buffer allocated to idle TConnection objects.
+   * [NOTE: Connections return their buffers to the buffer pool of their IO
+   * thread as soon as a request has been answered, so idle connections hold
+   * no buffers and this setting has no effect.]
    *
    * @return # bytes beyond which we will dealloc idle buffer.
    */
@@ -610,10 +881,9 @@ public:
 
   /**
    * Set the maximum size read buffer allocated to idle TConnection objects.
-   * If a TConnection object is found (either on connection close or between
-   * calls when resizeBufferEveryN_ is set) with more than this much memory
-   * allocated to its read buffer, we free it and allow it to be reinitialized
-   * on the next received frame.
+   * [NOTE: Connections return their buffers to the buffer pool of their IO
+   * thread as soon as a request has been answered, so idle connections hold
+   * no buffers and this setting has no effect.]
    *
    * @param limit of bytes beyond which we will shrink buffers when checked.
    */
@@ -633,6 +903,9 @@ public:
 
   /**
    * Get the maximum size of write buffer allocated to idle TConnection objects.
+   * [NOTE: Connections return their buffers to the buffer pool of their IO
+   * thread as soon as a request has been answered, so idle connections hold
+   * no buffers and this setting has no effect.]
    *
    * @return # bytes beyond which we will reallocate buffers when checked.
    */
@@ -640,10 +913,9 @@ public:
 
   /**
    * Set the maximum size write buffer allocated to idle TConnection objects.
-   * If a TConnection object is found (either on connection close or between
-   * calls when resizeBufferEveryN_ is set) with more than this much memory
-   * allocated to its write buffer, we destroy and construct that buffer with
-   * writeBufferDefaultSize_ bytes.
+   * [NOTE: Connections return their buffers to the buffer pool of their IO
+   * thread as soon as a request has been answered, so idle connections hold
+   * no buffers and this setting has no effect.]
    *
    * @param limit of bytes beyond which we will shrink buffers when idle.
    */
@@ -657,14 +929,389 @@ public:
   int32_t getResizeBufferEveryN() const { return resizeBufferEveryN_; }
 
   /**
-   * Check buffer sizes every "count" calls.  This allows buffer limits
-   * to be enforced for persistent connections with a controllable degree
-   * of overhead. 0 disables checks except at connection close.
+   * Check buffer sizes every "count" calls.
+   * [NOTE: Connections return their buffers to the buffer pool of their IO
+   * thread as soon as a request has been answered, so idle connections hold
+   * no buffers and this setting has no effect.]
    *
    * @param count the number of calls between checks, or 0 to disable
    */
   void setResizeBufferEveryN(int32_t count) { resizeBufferEveryN_ = count; }
 
+  /**
+   * Get the maximum # of requests a connection may have in flight.
+   *
+   * @return current setting (1 means pipelining is disabled).
+   */
+  size_t getMaxPipelinedRequests() const { return maxPipelinedRequests_; }
+
+  /**
+   * Set the maximum # of requests a connection may have in flight.  With a
+   * value greater than 1 and a ThreadManager, a connection keeps reading
+   * frames while earlier requests are processing and dispatches each of them
+   * to the thread pool as soon as it has been received.  Reading pauses while
+   * the limit is reached.  Since requests of one connection then run
+   * concurrently, the handler must be thread-safe.  Has no effect without a
+   * ThreadManager, and only applies to connections accepted afterwards.
+   *
+   * @param count max # of unanswered requests per connection.
+   */
+  void setMaxPipelinedRequests(size_t count) { maxPipelinedRequests_ = count ? count : 1; }
+
+  /**
+   * Get the order in which pipelined responses are written back.
+   *
+   * @return a TPipelineOrder enum value for the current setting.
+   */
+  TPipelineOrder getPipelineOrder() const { return pipelineOrder_; }
+
+  /**
+   * Set the order in which pipelined responses are written back.
+   * T_PIPELINE_ANY_ORDER writes each response as soon as it is ready, which
+   * requires clients that match responses by seqid (such as the generated
+   * concurrent clients).
+   *
+   * @param order a TPipelineOrder enum value.
+   */
+  void setPipelineOrder(TPipelineOrder order) { pipelineOrder_ = order; }
+
+  /**
+   * Set a policy that decides, given the method name of a request, whether
+   * the request is processed directly on the IO thread even though a
+   * ThreadManager is used.  This saves the hand-off to a worker and the
+   * notification back for cheap calls that never block, but any time spent
+   * in such a handler stalls all connections of that IO thread.  The name
+   * is the one the client sent, i.e. "service:method" with a multiplexed
+   * protocol.  With THeaderTransport the message header is decoded twice.
+   *
+   * @param policy returns true for methods to run inline; empty to disable.
+   */
+  void setInlineMethodPolicy(const std::function<bool(const std::string&)>& policy) {
+    inlineMethodPolicy_ = policy;
+  }
+
+  /**
+   * Process the named methods on the IO thread, see setInlineMethodPolicy().
+   *
+   * @param methods names of the methods to run inline.
+   */
+  void setInlineMethods(const std::vector<std::string>& methods) {
+    std::shared_ptr<std::unordered_set<std::string> > names
+        = std::make_shared<std::unordered_set<std::string> >(methods.begin(), methods.end());
+    inlineMethodPolicy_ = [names](const std::string& method) { return names->count(method) > 0; };
+  }
+
+  /**
+   * Hand requests to an asynchronous (cob style) processor, such as a
+   * generated TAsyncProcessor, instead of the processor the server was
+   * constructed with.  The processor is called on the IO thread and may
+   * complete a request later, from any thread, e.g. once calls the handler
+   * made to other services over a TFramedClientChannel have come back.  No
+   * thread is held meanwhile, so there is no need for a ThreadManager, and
+   * the ThreadManager and pipelining settings are ignored.  A connection
+   * waits for the response to its request before reading the next one.
+   * process() must not throw once it has arranged for its callback to run.
+   * Only applies to connections accepted afterwards.
+   *
+   * @param processor the processor; empty to use the synchronous one.
+   */
+  void setAsyncProcessor(const std::shared_ptr<apache::thrift::async::TAsyncProcessor>& processor) {
+    asyncProcessor_ = processor;
+  }
+
+  std::shared_ptr<apache::thrift::async::TAsyncProcessor> getAsyncProcessor() const {
+    return asyncProcessor_;
+  }
+
+  /// Whether a policy for processing requests inline has been set.
+  bool hasInlineMethodPolicy() const { return static_cast<bool>(inlineMethodPolicy_); }
+
+  /**
+   * Whether requests for the given method are processed on the IO thread.
+   *
+   * @param method the method name of the request.
+   */
+  bool isInlineMethod(const std::string& method) const {
+    return inlineMethodPolicy_ && inlineMethodPolicy_(method);
+  }
+
+  /**
+   * Get the time a ready pipelined response may be held back.
+   *
+   * @return the latency budget in microseconds.
+   */
+  int64_t getWriteCoalescingDelay() const { return writeCoalescingDelay_; }
+
+  /**
+   * Set the time a ready pipelined response may be held back, so that it
+   * is written together with the responses of requests of the same
+   * connection that are still processing.  Responses are written at the
+   * latest when the delay expires, when no request of the connection is left
+   * processing, or when getWriteCoalescingLimit() bytes are waiting.
+   * Responses that become ready within the same event loop iteration are
+   * always written together, with one gathering write where the transport
+   * allows it.
+   *
+   * @param micros latency budget in microseconds, 0 to not hold responses.
+   */
+  void setWriteCoalescingDelay(int64_t micros) { writeCoalescingDelay_ = micros > 0 ? micros : 0; }
+
+  /**
+   * Get the # of held back response bytes that causes a write right away.
+   *
+   * @return current setting.
+   */
+  size_t getWriteCoalescingLimit() const { return writeCoalescingLimit_; }
+
+  /**
+   * Set the # of held back response bytes that causes a write right away,
+   * see setWriteCoalescingDelay().
+   *
+   * @param limit # of bytes.
+   */
+  void setWriteCoalescingLimit(size_t limit) { writeCoalescingLimit_ = limit; }
+
+  /**
+   * Return the count of responses written since the server started.
+   *
+   * @return # of responses.
+   */
+  uint64_t getNumResponsesWritten() const { return nResponsesWritten_; }
+
+  /**
+   * Return the count of socket write calls made to send responses since the
+   * server started.  Compared to getNumResponsesWritten() this shows how
+   * well responses are coalesced.
+   *
+   * @return # of write calls.
+   */
+  uint64_t getNumResponseWrites() const { return nResponseWrites_; }
+
+  /**
+   * Get the # of bytes of unused buffers each IO thread keeps for reuse.
+   *
+   * @return current setting.
+   */
+  size_t getBufferPoolCacheLimit() const { return bufferPoolCacheLimit_; }
+
+  /**
+   * Set the # of bytes of unused buffers each IO thread keeps for reuse.
+   * Connections take their read and write buffers from a pool of their IO
+   * thread while a request is being handled and give them back as soon as
+   * it has been answered.  Buffers released beyond this limit are freed.
+   * Must be called before serve().
+   *
+   * @param limit # of bytes, 0 to free buffers right away.
+   */
+  void setBufferPoolCacheLimit(size_t limit) { bufferPoolCacheLimit_ = limit; }
+
+  /**
+   * Return the # of bytes of buffers currently held by connections, i.e.
+   * by requests being read, processed or answered.
+   *
+   * @return # of bytes over all IO threads.
+   */
+  size_t getBufferMemoryInUse() const;
+
+  /**
+   * Return the # of bytes of unused buffers kept by the IO threads' pools.
+   *
+   * @return # of bytes over all IO threads.
+   */
+  size_t getBufferMemoryCached() const;
+
+  /**
+   * Get whether tasks are scheduled fairly across clients.
+   *
+   * @return true if fair queuing is enabled.
+   */
+  bool getFairQueuing() const { return fairQueuing_; }
+
+  /**
+   * Set whether tasks are scheduled fairly across clients.  When enabled,
+   * requests wait in a queue per client and are handed to the thread
+   * manager by deficit round robin, no more at a time than it has workers,
+   * so a client sending a flood of requests cannot hold up the others.
+   * Clients are told apart by connection, or by a THeader header (see
+   * setClientIdentityHeader()).  Only has effect with a thread manager.
+   * Must be called before serve().
+   *
+   * @param enable true to enable fair queuing.
+   */
+  void setFairQueuing(bool enable) { fairQueuing_ = enable; }
+
+  /**
+   * Get the THeader header that names the client of a request.
+   *
+   * @return the header name, empty if clients are told apart by connection.
+   */
+  const std::string& getClientIdentityHeader() const { return clientIdentityHeader_; }
+
+  /**
+   * Set the THeader header that names the client of a request for fair
+   * queuing, so that the connections of one client share a queue.  Requests
+   * without the header, or not using THeaderTransport, are queued by
+   * connection.  Must be called before serve().
+   *
+   * @param header the header name, empty to queue by connection.
+   */
+  void setClientIdentityHeader(const std::string& header) { clientIdentityHeader_ = header; }
+
+  /**
+   * Get the limit on requests of one client handed to the thread manager.
+   *
+   * @return # of requests, 0 if unlimited.
+   */
+  size_t getMaxClientTasksInFlight() const { return fairTaskQueue_.getMaxClientTasksInFlight(); }
+
+  /**
+   * Set the limit on requests of one client handed to the thread manager
+   * at a time when fair queuing.  Further requests of the client stay in
+   * its queue even while workers are idle.
+   *
+   * @param limit # of requests, 0 for no limit.
+   */
+  void setMaxClientTasksInFlight(size_t limit) { fairTaskQueue_.setMaxClientTasksInFlight(limit); }
+
+  /**
+   * Get the limit on requests queued for one client.
+   *
+   * @return # of requests, 0 if unlimited.
+   */
+  size_t getMaxClientQueueDepth() const { return fairTaskQueue_.getMaxClientQueueDepth(); }
+
+  /**
+   * Set the limit on requests queued for one client when fair queuing.
+   * Requests beyond it are answered right away with a
+   * TApplicationException instead of being processed.
+   *
+   * @param limit # of requests, 0 for no limit.
+   */
+  void setMaxClientQueueDepth(size_t limit) { fairTaskQueue_.setMaxClientQueueDepth(limit); }
+
+  /**
+   * Get the # of request bytes each client may have dispatched per round.
+   *
+   * @return current setting.
+   */
+  uint32_t getFairQueueQuantum() const { return fairTaskQueue_.getQuantum(); }
+
+  /**
+   * Set the # of request bytes each client may have dispatched per round
+   * of the deficit round robin.  Smaller values interleave clients more
+   * finely.
+   *
+   * @param quantum # of bytes.
+   */
+  void setFairQueueQuantum(uint32_t quantum) { fairTaskQueue_.setQuantum(quantum); }
+
+  /**
+   * Return the queueing statistics of the clients with requests queued or
+   * being processed.
+   *
+   * @return one entry per client.
+   */
+  std::vector<TClientQueueStats> getClientQueueStats() const {
+    return fairTaskQueue_.getClientStats();
+  }
+
+  /**
+   * Return the # of requests turned down because their client had too
+   * many queued, since the server started.
+   *
+   * @return # of requests.
+   */
+  uint64_t getNumRejectedRequests() const { return fairTaskQueue_.getRejectedCount(); }
+
+  /**
+   * Get the # of threads running handshakes.
+   *
+   * @return current setting, 0 if the IO threads run them.
+   */
+  size_t getHandshakeThreads() const { return numHandshakeThreads_; }
+
+  /**
+   * Set the # of threads that run the handshakes of new connections, such
+   * as those of the TSSLSockets of a TNonblockingSSLServerSocket.  An IO
+   * thread otherwise runs them itself, one step whenever the client has
+   * sent something, so the key exchanges of a burst of new clients delay
+   * the requests of all other connections of that thread.  A connection
+   * is not watched by its IO thread until its handshake is done.  Must be
+   * called before serve().
+   *
+   * @param count # of threads, 0 to run handshakes on the IO threads.
+   */
+  void setHandshakeThreads(size_t count) { numHandshakeThreads_ = count; }
+
+  /**
+   * Get the time an offloaded handshake may take.
+   *
+   * @return time in milliseconds, 0 if unlimited.
+   */
+  int getHandshakeTimeout() const { return handshakeTimeout_; }
+
+  /**
+   * Set the time an offloaded handshake may take before its connection is
+   * closed.  A handshake thread waits for the client meanwhile, so this
+   * bounds how long a slow or silent client holds one up.
+   *
+   * @param timeoutMs time in milliseconds, 0 for no limit.
+   */
+  void setHandshakeTimeout(int timeoutMs) { handshakeTimeout_ = timeoutMs > 0 ? timeoutMs : 0; }
+
+  /// Whether handshakes are run by handshake threads.
+  bool isHandshakeOffloading() const { return handshakeThreadManager_ != nullptr; }
+
+  /// Hand the handshake of a connection to the handshake threads.
+  void addHandshakeTask(std::shared_ptr<Runnable> task) { handshakeThreadManager_->add(task); }
+
+  /**
+   * Return the statistics of the handshakes of the connections accepted
+   * since the server started.
+   *
+   * @return a snapshot of the statistics.
+   */
+  THandshakeStats getHandshakeStats() const {
+    Guard g(handshakeStatsMutex_);
+    return handshakeStats_;
+  }
+
+  /**
+   * Account for the handshake of a connection that completed or failed.
+   *
+   * @param completed false if the connection closed before completing it.
+   * @param micros time from accept to completion.
+   * @param queueMicros time it waited for a handshake thread, if offloaded.
+   * @param offloaded whether a handshake thread ran it.
+   */
+  void countHandshake(bool completed, uint64_t micros, uint64_t queueMicros, bool offloaded) {
+    Guard g(handshakeStatsMutex_);
+    if (offloaded) {
+      ++handshakeStats_.offloaded;
+      handshakeStats_.totalQueueMicros += queueMicros;
+    }
+    if (!completed) {
+      ++handshakeStats_.failed;
+      return;
+    }
+    ++handshakeStats_.completed;
+    handshakeStats_.totalMicros += micros;
+    if (micros > handshakeStats_.maxMicros) {
+      handshakeStats_.maxMicros = micros;
+    }
+  }
+
+  /**
+   * Account for responses written by an IO thread.
+   *
+   * @param responses # of responses completed.
+   * @param writes # of write calls made.
+   */
+  void countResponseWrites(uint64_t responses, uint64_t writes) {
+    nResponsesWritten_.fetch_add(responses, std::memory_order_relaxed);
+    nResponseWrites_.fetch_add(writes, std::memory_order_relaxed);
+  }
+
   /**
    * Main workhorse function, starts up the server listening on a port and
    * loops over the libevent handler.
@@ -731,6 +1378,82 @@ private:
   void returnConnection(TConnection* connection);
 };
 
+/**
+ * Buffers for the connections of one IO thread.  Requests are sized up to
+ * the next power of two of at least MIN_BUFFER_SIZE bytes and unused
+ * buffers are kept on a free list per size, up to a limit on their total
+ * size.  Buffers larger than MAX_BUFFER_SIZE are not kept.  Since a
+ * TMemoryBuffer may realloc() or free() the buffer it was given, every
+ * buffer is a malloc()ed block of its own.
+ *
+ * Only the IO thread allocates and releases; the statistics may be read by
+ * any thread.
+ */
+class TNonblockingBufferPool {
+public:
+  /// Smallest buffer size handed out
+  static const uint32_t MIN_BUFFER_SIZE = 256;
+
+  /// Largest buffer size kept for reuse
+  static const uint32_t MAX_BUFFER_SIZE = 64 * 1024;
+
+  TNonblockingBufferPool();
+
+  ~TNonblockingBufferPool();
+
+  /**
+   * Get a buffer of at least the given size.
+   *
+   * @param want # of bytes needed.
+   * @param size set to the actual size of the buffer.
+   * @return the buffer, to be given back with release().
+   */
+  uint8_t* allocate(uint32_t want, uint32_t* size);
+
+  /**
+   * Give back a buffer obtained from allocate().
+   *
+   * @param buffer the buffer, may be nullptr.
+   * @param size its current size.
+   */
+  void release(uint8_t* buffer, uint32_t size);
+
+  /// Account for a buffer in use that was reallocated to another size.
+  void resized(uint32_t oldSize, uint32_t newSize);
+
+  /// Free all unused buffers.
+  void trim();
+
+  /// Get the limit on the total size of unused buffers kept.
+  size_t getCacheLimit() const { return cacheLimit_; }
+
+  /// Set the limit on the total size of unused buffers kept.
+  void setCacheLimit(size_t limit);
+
+  /// Return the # of bytes of buffers handed out and not released.
+  size_t getBytesInUse() const { return bytesInUse_.load(std::memory_order_relaxed); }
+
+  /// Return the # of bytes of unused buffers kept.
+  size_t getBytesCached() const { return bytesCached_.load(std::memory_order_relaxed); }
+
+private:
+  TNonblockingBufferPool(const TNonblockingBufferPool&);
+  TNonblockingBufferPool& operator=(const TNonblockingBufferPool&);
+
+  /// # of sizes from MIN_BUFFER_SIZE to MAX_BUFFER_SIZE
+  static const int NUM_SIZE_CLASSES = 9;
+
+  /// Index of the free list for buffers of the given size, or -1.
+  static int sizeClass(uint32_t size);
+
+  /// Unused buffers per size, linked through their first bytes
+  uint8_t* freeLists_[NUM_SIZE_CLASSES];
+
+  size_t cacheLimit_;
+  std::atomic<size_t> bytesInUse_;
+  std::atomic<size_t> bytesCached_;
+};
+
 class TNonblockingIOThread : public Runnable {
 public:
   // Creates an IO thread and sets up the event base.  The listenSocket should
@@ -752,14 +1475,20 @@ public:
   // Returns the number of this IO thread.
   int getThreadNumber() const { return number_; }
 
+  // Returns the pool of buffers for the connections of this thread.  May
+  // only be used on this thread, except for its statistics.
+  TNonblockingBufferPool& getBufferPool() { return bufferPool_; }
+  const TNonblockingBufferPool& getBufferPool() const { return bufferPool_; }
+
   // Returns the thread id associated with this object.  This should
   // only be called after the thread has been started.
   Thread::id_t getThreadId() const { return threadId_; }
 
-  // Returns the send-fd for task complete notifications.
+  // Returns the send-fd of the doorbell for task complete notifications.
+  // This is the same descriptor as the read-fd when an eventfd is used.
   evutil_socket_t getNotificationSendFD() const { return notificationPipeFDs_[1]; }
 
-  // Returns the read-fd for task complete notifications.
+  // Returns the read-fd of the doorbell for task complete notifications.
   evutil_socket_t getNotificationRecvFD() const { return notificationPipeFDs_[0]; }
 
   // Returns the actual thread object associated with this IO thread.
@@ -768,8 +1497,9 @@ public:
   // Sets the actual thread object associated with this IO thread.
   void setThread(const std::shared_ptr<Thread>& t) { thread_ = t; }
 
-  // Used by TConnection objects to indicate processing has finished.
-  bool notify(TNonblockingServer::TConnection* conn);
+  // Used by TConnection objects to indicate processing has finished, or
+  // with nullptr to stop the thread.  May be called from any thread.
+  bool notify(TNonblockingServer::TNotification* notification);
 
   // Enters the event loop and does not return until a call to stop().
   void run() override;
@@ -786,14 +1516,20 @@ public:
 private:
   /**
    * C-callable event handler for signaling task completion.  Provides a
-   * callback that libevent can understand that will read a connection
-   * object's address from a pipe and call connection->transition() for
-   * that object.
+   * callback that libevent can understand that will reset the doorbell,
+   * take all queued notifications at once and pass each of them to its
+   * connection in the order they were sent.
    *
    * @param fd the descriptor the event occurred on.
    */
   static void notifyHandler(evutil_socket_t fd, short which, void* v);
 
+  /// Wake up the IO thread; returns false if the doorbell is broken.
+  bool ringDoorbell();
+
+  /// Reset the doorbell; returns false (after breaking the loop) on error.
+  bool clearDoorbell(evutil_socket_t fd);
+
   /**
    * C-callable event handler for listener events.  Provides a callback
    * that libevent can understand which invokes server->handleEvent().
@@ -809,7 +1545,8 @@ private:
   /// Exits the loop ASAP in case of shutdown or error.
   void breakLoop(bool error);
 
-  /// Create the pipe used to notify I/O process of task completion.
+  /// Create the doorbell (an eventfd, or else a socket pair) used to notify
+  /// the I/O thread of queued notifications.
   void createNotificationPipe();
 
   /// Unregisters our events for notification and listen sockets.
@@ -847,9 +1584,22 @@ private:
   /// Used with eventBase_ for task completion notification
   struct event notificationEvent_;
 
-  /// File descriptors for pipe used for task completion notification.
+  /// File descriptors of the doorbell for task completion notification.
   evutil_socket_t notificationPipeFDs_[2];
 
+  /**
+   * Lock-free queue of pending notifications (pushed by any thread, taken
+   * as a whole by this one).  Only a push onto an empty queue rings the
+   * doorbell.
+   */
+  std::atomic<TNonblockingServer::TNotification*> notificationQueue_;
+
+  /// Set by a notify(nullptr) to stop the event loop.
+  std::atomic<bool> stopRequested_;
+
+  /// Buffers for the connections of this thread
+  TNonblockingBufferPool bufferPool_;
+
   /// Actual IO Thread
   std::shared_ptr<Thread> thread_;
 };
@@ -0,0 +1,202 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TBATCHTRANSPORT_H_
+#define _THRIFT_TRANSPORT_TBATCHTRANSPORT_H_ 1
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <thrift/protocol/TProtocolException.h>
+#include <thrift/transport/TBufferTransports.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * Buffered transport that holds back flushes while a batch is open, so
+ * that the messages of several calls go out in one write.  It goes below
+ * the framing transport, e.g.
+ *
+ *   socket -> TBatchTransport -> TFramedTransport (or THeaderTransport)
+ *
+ * where the framing transport still writes a frame per call, but they all
+ * stay in this buffer until the batch ends (or the buffer fills up).  Reads
+ * are buffered too, so that a batch of responses is read in few calls.
+ */
+class TBatchTransport : public TBufferedTransport {
+public:
+  /// Default size of the buffers, and so the most a batch writes at once
+  static const uint32_t DEFAULT_BATCH_SIZE = 64 * 1024;
+
+  TBatchTransport(std::shared_ptr<TTransport> transport,
+                  uint32_t sz = DEFAULT_BATCH_SIZE,
+                  std::shared_ptr<TConfiguration> config = nullptr)
+    : TBufferedTransport(transport, sz, config), batching_(false) {}
+
+  /// Hold back flushes until endBatch().
+  void beginBatch() { batching_ = true; }
+
+  /// Write out everything written since beginBatch(), and flush again.
+  void endBatch() {
+    batching_ = false;
+    flush();
+  }
+
+  bool isBatching() const { return batching_; }
+
+  /// # of bytes written and not sent yet
+  uint32_t getBatchedBytes() const { return static_cast<uint32_t>(wBase_ - wBuf_.get()); }
+
+  uint32_t getBatchSize() const { return wBufSize_; }
+
+  void flush() override {
+    if (!batching_) {
+      TBufferedTransport::flush();
+    }
+  }
+
+private:
+  bool batching_;
+};
+
+/**
+ * Wraps a transport in a TBatchTransport.
+ */
+class TBatchTransportFactory : public TTransportFactory {
+public:
+  TBatchTransportFactory() = default;
+
+  ~TBatchTransportFactory() override = default;
+
+  std::shared_ptr<TTransport> getTransport(std::shared_ptr<TTransport> trans) override {
+    return std::shared_ptr<TTransport>(
+        new TBatchTransport(trans, TBatchTransport::DEFAULT_BATCH_SIZE, trans->getConfiguration()));
+  }
+};
+
+/**
+ * Makes several calls with a generated client in one round trip.  The
+ * calls are sent with the client's send_ methods into a TBatchTransport
+ * below the client's framing transport, flushed together, and then their
+ * responses are read back in order with the recv_ methods:
+ *
+ *   TClientBatch<MyServiceClient> batch(client, batchTransport);
+ *   std::vector<std::string> values(keys.size());
+ *   for (size_t i = 0; i < keys.size(); ++i) {
+ *     batch.add([&, i](MyServiceClient& c) { c.send_get(keys[i]); },
+ *               [&, i](MyServiceClient& c) { c.recv_get(values[i]); });
+ *   }
+ *   batch.execute();
+ *
+ * Calls are sent in chunks of at most the batch transport's size, each
+ * chunk's responses being read before the next one is sent, so that client
+ * and server do not both wait for the other to read.  The server must
+ * answer calls in the order it got them, as all servers but a
+ * TNonblockingServer set to T_PIPELINE_ANY_ORDER do.
+ */
+template <class Client>
+class TClientBatch {
+public:
+  typedef std::function<void(Client&)> Step;
+
+  TClientBatch(Client& client, std::shared_ptr<TBatchTransport> transport)
+    : client_(client), transport_(transport) {}
+
+  /// Queue a call; send sends it with the client, recv reads its response.
+  void add(const Step& send, const Step& recv) {
+    Call call = {send, recv};
+    calls_.push_back(call);
+  }
+
+  /// Queue a oneway call.
+  void add(const Step& send) { add(send, Step()); }
+
+  /// # of calls queued
+  size_t size() const { return calls_.size(); }
+
+  /**
+   * Make the calls queued, and clear the batch.  An exception thrown by a
+   * recv (such as an exception declared by the method) does not keep the
+   * responses to the other calls from being read; the first one is thrown
+   * once they all have been.  Transport and protocol errors are thrown
+   * right away, as the responses after them cannot be found, and leave the
+   * connection in an unknown state.
+   */
+  void execute() {
+    std::vector<Call> calls;
+    calls.swap(calls_);
+    std::exception_ptr error;
+
+    size_t sent = 0;
+    size_t received = 0;
+    while (received < calls.size()) {
+      transport_->beginBatch();
+      try {
+        do {
+          calls[sent++].send(client_);
+        } while (sent < calls.size()
+                 && transport_->getBatchedBytes() < transport_->getBatchSize() / 2);
+      } catch (...) {
+        transport_->endBatch();
+        throw;
+      }
+      transport_->endBatch();
+
+      for (; received < sent; ++received) {
+        if (!calls[received].recv) {
+          continue;
+        }
+        try {
+          calls[received].recv(client_);
+        } catch (const TTransportException&) {
+          throw;
+        } catch (const protocol::TProtocolException&) {
+          throw;
+        } catch (...) {
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+      }
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  struct Call {
+    Step send;
+    Step recv;
+  };
+
+  Client& client_;
+  std::shared_ptr<TBatchTransport> transport_;
+  std::vector<Call> calls_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TBATCHTRANSPORT_H_
@@ -0,0 +1,543 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <algorithm>
+#include <limits>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_POLL_H
+#include <sys/poll.h>
+#endif
+
+#include <thrift/transport/PlatformSocket.h>
+#include <thrift/transport/TConnectionPool.h>
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+using apache::thrift::concurrency::Guard;
+
+/**
+ * State of one server of a TConnectionPool.  Whether the server is ejected
+ * is kept in its TSocketPoolServer, as for TSocketPool: lastFailTime_ is
+ * set while it is.
+ */
+struct TConnectionPool::Server {
+  shared_ptr<TSocketPoolServer> info;
+
+  /// Idle connections, the most recently used last
+  vector<shared_ptr<TPooledConnection> > idle;
+
+  size_t inFlight;
+  double latency;
+  bool measured;
+
+  /// Whether the one connection an ejected server may get is out
+  bool probing;
+
+  uint64_t checkouts;
+  uint64_t failures;
+
+  explicit Server(const shared_ptr<TSocketPoolServer>& server)
+    : info(server),
+      inFlight(0),
+      latency(0),
+      measured(false),
+      probing(false),
+      checkouts(0),
+      failures(0) {}
+
+  void closeIdle() {
+    for (auto& connection : idle) {
+      connection->getSocket()->close();
+    }
+    idle.clear();
+  }
+};
+
+TConnectionPool::TConnectionPool(const vector<shared_ptr<TSocketPoolServer> >& servers,
+                                 shared_ptr<TTransportFactory> transportFactory)
+  : transportFactory_(transportFactory),
+    maxIdlePerServer_(MAX_IDLE_PER_SERVER),
+    maxConsecutiveFailures_(MAX_CONSECUTIVE_FAILURES),
+    retryInterval_(RETRY_INTERVAL),
+    latencyDecay_(0.3),
+    connTimeout_(0),
+    sendTimeout_(0),
+    recvTimeout_(0),
+    random_(std::random_device()()) {
+  for (const auto& server : servers) {
+    if (server) {
+      servers_.emplace_back(new Server(server));
+    }
+  }
+}
+
+TConnectionPool::~TConnectionPool() {
+  for (auto& server : servers_) {
+    server->closeIdle();
+  }
+}
+
+void TConnectionPool::addServer(const string& host, int port) {
+  Guard g(mutex_);
+  servers_.emplace_back(new Server(std::make_shared<TSocketPoolServer>(host, port)));
+}
+
+void TConnectionPool::getServers(vector<shared_ptr<TSocketPoolServer> >& servers) {
+  Guard g(mutex_);
+  servers.clear();
+  for (auto& server : servers_) {
+    servers.push_back(server->info);
+  }
+}
+
+void TConnectionPool::setMaxIdlePerServer(size_t maxIdle) {
+  Guard g(mutex_);
+  maxIdlePerServer_ = maxIdle;
+  for (auto& server : servers_) {
+    while (server->idle.size() > maxIdlePerServer_) {
+      server->idle.front()->getSocket()->close();
+      server->idle.erase(server->idle.begin());
+    }
+  }
+}
+
+void TConnectionPool::setMaxConsecutiveFailures(int maxConsecutiveFailures) {
+  Guard g(mutex_);
+  maxConsecutiveFailures_ = maxConsecutiveFailures;
+}
+
+void TConnectionPool::setRetryInterval(int retryInterval) {
+  Guard g(mutex_);
+  retryInterval_ = retryInterval;
+}
+
+void TConnectionPool::setLatencyDecay(double decay) {
+  if (!(decay > 0 && decay <= 1)) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "TConnectionPool: latency decay must be in (0, 1]");
+  }
+  Guard g(mutex_);
+  latencyDecay_ = decay;
+}
+
+void TConnectionPool::setConnTimeout(int ms) {
+  Guard g(mutex_);
+  connTimeout_ = ms;
+}
+
+void TConnectionPool::setSendTimeout(int ms) {
+  Guard g(mutex_);
+  sendTimeout_ = ms;
+}
+
+void TConnectionPool::setRecvTimeout(int ms) {
+  Guard g(mutex_);
+  recvTimeout_ = ms;
+}
+
+int TConnectionPool::getRecvTimeout() const {
+  Guard g(mutex_);
+  return recvTimeout_;
+}
+
+bool TConnectionPool::isAvailable(Server& server, time_t now) const {
+  if (server.info->lastFailTime_ == 0) {
+    return true;
+  }
+  // An ejected server gets one probe once the retry interval has passed
+  return !server.probing && now - server.info->lastFailTime_ > retryInterval_;
+}
+
+size_t TConnectionPool::selectServer(const vector<size_t>& exclude) {
+  time_t now = time(nullptr);
+  vector<size_t> candidates;
+  for (size_t i = 0; i < servers_.size(); ++i) {
+    if (std::find(exclude.begin(), exclude.end(), i) == exclude.end()
+        && isAvailable(*servers_[i], now)) {
+      candidates.push_back(i);
+    }
+  }
+  if (candidates.empty()) {
+    // Everything is down, try whatever has not failed yet in this checkout
+    for (size_t i = 0; i < servers_.size(); ++i) {
+      if (std::find(exclude.begin(), exclude.end(), i) == exclude.end()) {
+        candidates.push_back(i);
+      }
+    }
+  }
+  if (candidates.empty()) {
+    return std::numeric_limits<size_t>::max();
+  }
+  if (candidates.size() == 1) {
+    return candidates[0];
+  }
+
+  // Power of two choices: the cheaper of two random servers, where servers
+  // that have not been measured yet come first so that they get measured
+  std::uniform_int_distribution<size_t> pick(0, candidates.size() - 1);
+  size_t a = pick(random_);
+  size_t b = pick(random_);
+  while (b == a) {
+    b = pick(random_);
+  }
+  const Server& first = *servers_[candidates[a]];
+  const Server& second = *servers_[candidates[b]];
+  double firstCost = first.latency * static_cast<double>(first.inFlight + 1);
+  double secondCost = second.latency * static_cast<double>(second.inFlight + 1);
+  if (secondCost < firstCost || (secondCost == firstCost && second.inFlight < first.inFlight)) {
+    return candidates[b];
+  }
+  return candidates[a];
+}
+
+void TConnectionPool::recordFailure(Server& server) {
+  ++server.failures;
+  if (server.info->lastFailTime_ != 0) {
+    // A failed probe, or a failure of a call that started before the
+    // ejection, keeps the server out for another retry interval
+    server.info->lastFailTime_ = time(nullptr);
+    return;
+  }
+  if (++server.info->consecutiveFailures_ >= maxConsecutiveFailures_) {
+    // Mark server as down
+    server.info->consecutiveFailures_ = 0;
+    server.info->lastFailTime_ = time(nullptr);
+    server.closeIdle();
+  }
+}
+
+bool TConnectionPool::isStale(TSocket& socket) {
+  THRIFT_SOCKET fd = socket.getSocketFD();
+  if (fd == THRIFT_INVALID_SOCKET) {
+    return true;
+  }
+  // An idle connection has nothing to read unless the server closed it
+  struct THRIFT_POLLFD fds[1];
+  fds[0].fd = fd;
+  fds[0].events = THRIFT_POLLIN;
+  fds[0].revents = 0;
+  return THRIFT_POLL(fds, 1, 0) != 0;
+}
+
+shared_ptr<TPooledConnection> TConnectionPool::checkout() {
+  return checkout(shared_ptr<TSocketPoolServer>());
+}
+
+shared_ptr<TPooledConnection> TConnectionPool::checkout(const shared_ptr<TSocketPoolServer>& avoid) {
+  vector<size_t> failed;
+  bool connectFailed = false;
+  if (avoid) {
+    Guard g(mutex_);
+    for (size_t i = 0; i < servers_.size(); ++i) {
+      if (servers_[i]->info == avoid) {
+        failed.push_back(i);
+      }
+    }
+  }
+  for (;;) {
+    size_t index;
+    shared_ptr<TPooledConnection> connection;
+    shared_ptr<TSocketPoolServer> info;
+    bool probe = false;
+    int connTimeout, sendTimeout, recvTimeout;
+    {
+      Guard g(mutex_);
+      index = selectServer(failed);
+      if (index == std::numeric_limits<size_t>::max()) {
+        break;
+      }
+      Server& server = *servers_[index];
+      if (server.info->lastFailTime_ != 0 && !server.probing) {
+        server.probing = true;
+        probe = true;
+      }
+      ++server.inFlight;
+      ++server.checkouts;
+      while (!server.idle.empty()) {
+        connection = server.idle.back();
+        server.idle.pop_back();
+        if (!isStale(*connection->socket_)) {
+          break;
+        }
+        connection->socket_->close();
+        connection.reset();
+      }
+      info = server.info;
+      connTimeout = connTimeout_;
+      sendTimeout = sendTimeout_;
+      recvTimeout = recvTimeout_;
+    }
+
+    if (!connection) {
+      shared_ptr<TSocket> socket = std::make_shared<TSocket>(info->host_, info->port_);
+      socket->setConnTimeout(connTimeout);
+      socket->setSendTimeout(sendTimeout);
+      socket->setRecvTimeout(recvTimeout);
+      try {
+        socket->open();
+      } catch (const TException& e) {
+        string errStr = "TConnectionPool::checkout failed " + socket->getSocketInfo() + ": "
+                        + e.what();
+        TOutput::instance()(errStr.c_str());
+        Guard g(mutex_);
+        Server& server = *servers_[index];
+        --server.inFlight;
+        if (probe) {
+          server.probing = false;
+        }
+        recordFailure(server);
+        failed.push_back(index);
+        connectFailed = true;
+        continue;
+      }
+      connection = std::make_shared<TPooledConnection>();
+      connection->socket_ = socket;
+      connection->transport_ = transportFactory_ ? transportFactory_->getTransport(socket)
+                                                 : shared_ptr<TTransport>(socket);
+      connection->server_ = info;
+      connection->index_ = index;
+    }
+    connection->probe_ = probe;
+    connection->checkoutTime_ = std::chrono::steady_clock::now();
+    return connection;
+  }
+
+  if (!connectFailed) {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TConnectionPool: no server to connect to");
+  }
+  TOutput::instance()("TConnectionPool::checkout: all connections failed");
+  throw TTransportException(TTransportException::NOT_OPEN);
+}
+
+void TConnectionPool::checkin(const shared_ptr<TPooledConnection>& connection,
+                              bool success,
+                              bool measured) {
+  if (!connection) {
+    return;
+  }
+  double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now()
+                                                             - connection->checkoutTime_)
+                       .count();
+  bool keep = false;
+  {
+    Guard g(mutex_);
+    Server& server = *servers_[connection->index_];
+    --server.inFlight;
+    if (connection->probe_) {
+      server.probing = false;
+    }
+    if (success) {
+      if (connection->probe_) {
+        // reinstates the ejected server
+        server.info->lastFailTime_ = 0;
+        server.info->consecutiveFailures_ = 0;
+      } else if (server.info->lastFailTime_ == 0) {
+        server.info->consecutiveFailures_ = 0;
+      }
+      if (measured) {
+        if (server.measured) {
+          server.latency += latencyDecay_ * (elapsed - server.latency);
+        } else {
+          server.latency = elapsed;
+          server.measured = true;
+        }
+      }
+      if (connection->socket_->isOpen() && server.idle.size() < maxIdlePerServer_) {
+        server.idle.push_back(connection);
+        keep = true;
+      }
+    } else {
+      recordFailure(server);
+    }
+  }
+  if (!keep) {
+    connection->socket_->close();
+  }
+}
+
+void TConnectionPool::release(const shared_ptr<TPooledConnection>& connection) {
+  if (!connection) {
+    return;
+  }
+  bool keep = false;
+  {
+    Guard g(mutex_);
+    Server& server = *servers_[connection->index_];
+    --server.inFlight;
+    if (connection->probe_) {
+      // the server is probed again by the next checkout
+      server.probing = false;
+    }
+    if (connection->socket_->isOpen() && server.idle.size() < maxIdlePerServer_) {
+      server.idle.push_back(connection);
+      keep = true;
+    }
+  }
+  if (!keep) {
+    connection->socket_->close();
+  }
+}
+
+vector<TConnectionPoolServerStats> TConnectionPool::getServerStats() const {
+  Guard g(mutex_);
+  vector<TConnectionPoolServerStats> stats;
+  stats.reserve(servers_.size());
+  for (const auto& server : servers_) {
+    TConnectionPoolServerStats serverStats;
+    serverStats.host = server->info->host_;
+    serverStats.port = server->info->port_;
+    serverStats.inFlight = server->inFlight;
+    serverStats.idle = server->idle.size();
+    serverStats.latency = server->latency;
+    serverStats.ejected = server->info->lastFailTime_ != 0;
+    serverStats.checkouts = server->checkouts;
+    serverStats.failures = server->failures;
+    stats.push_back(serverStats);
+  }
+  return stats;
+}
+
+TPooledTransport::TPooledTransport(shared_ptr<TConnectionPool> pool,
+                                   shared_ptr<TConfiguration> config)
+  : TVirtualTransport(config), pool_(pool), flushed_(false), reading_(false) {
+  if (!pool_) {
+    throw TTransportException(TTransportException::BAD_ARGS, "TPooledTransport: no pool");
+  }
+}
+
+TPooledTransport::~TPooledTransport() {
+  try {
+    close();
+  } catch (...) {
+    // ignore
+  }
+}
+
+void TPooledTransport::close() {
+  if (!connection_) {
+    return;
+  }
+  if (!flushed_ || reading_) {
+    // a call was left half done, the connection is out of step
+    connection_->getSocket()->close();
+  }
+  release(true, false);
+}
+
+uint32_t TPooledTransport::read(uint8_t* buf, uint32_t len) {
+  if (!connection_) {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TPooledTransport: no call in progress");
+  }
+  reading_ = true;
+  try {
+    return connection_->getTransport()->read(buf, len);
+  } catch (const TTransportException&) {
+    release(false, false);
+    throw;
+  }
+}
+
+uint32_t TPooledTransport::readAll(uint8_t* buf, uint32_t len) {
+  if (!connection_) {
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TPooledTransport: no call in progress");
+  }
+  reading_ = true;
+  try {
+    return connection_->getTransport()->readAll(buf, len);
+  } catch (const TTransportException&) {
+    release(false, false);
+    throw;
+  }
+}
+
+void TPooledTransport::write(const uint8_t* buf, uint32_t len) {
+  if (connection_ && (flushed_ || reading_)) {
+    // The previous call is over although no response was read to the end:
+    // it was oneway, or its response was abandoned
+    if (reading_) {
+      connection_->getSocket()->close();
+    }
+    release(true, false);
+  }
+  if (!connection_) {
+    connection_ = pool_->checkout();
+  }
+  try {
+    connection_->getTransport()->write(buf, len);
+  } catch (const TTransportException&) {
+    release(false, false);
+    throw;
+  }
+}
+
+void TPooledTransport::flush() {
+  if (!connection_) {
+    return;
+  }
+  try {
+    connection_->getTransport()->flush();
+  } catch (const TTransportException&) {
+    release(false, false);
+    throw;
+  }
+  flushed_ = true;
+}
+
+uint32_t TPooledTransport::readEnd() {
+  if (!connection_) {
+    return 0;
+  }
+  uint32_t bytes = connection_->getTransport()->readEnd();
+  if (reading_) {
+    // the response has been read, the call is complete
+    release(true, true);
+  }
+  return bytes;
+}
+
+uint32_t TPooledTransport::writeEnd() {
+  if (!connection_) {
+    return 0;
+  }
+  return connection_->getTransport()->writeEnd();
+}
+
+void TPooledTransport::release(bool success, bool measured) {
+  shared_ptr<TPooledConnection> connection;
+  connection.swap(connection_);
+  flushed_ = false;
+  reading_ = false;
+  pool_->checkin(connection, success, measured);
+}
+}
+}
+} // apache::thrift::transport
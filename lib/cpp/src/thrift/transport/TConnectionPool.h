@@ -0,0 +1,319 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TCONNECTIONPOOL_H_
+#define _THRIFT_TRANSPORT_TCONNECTIONPOOL_H_ 1
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <thrift/concurrency/Mutex.h>
+#include <thrift/transport/TSocketPool.h>
+#include <thrift/transport/TVirtualTransport.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+class TConnectionPool;
+
+/**
+ * A connection checked out of a TConnectionPool: a socket to one of its
+ * servers, and the transport stack made for it by the pool's transport
+ * factory.
+ */
+class TPooledConnection {
+public:
+  /// The socket
+  std::shared_ptr<TSocket> getSocket() const { return socket_; }
+
+  /// The transport to use for the socket, e.g. a TFramedTransport over it
+  std::shared_ptr<TTransport> getTransport() const { return transport_; }
+
+  /// The server the socket is connected to
+  std::shared_ptr<TSocketPoolServer> getServer() const { return server_; }
+
+private:
+  friend class TConnectionPool;
+
+  std::shared_ptr<TSocket> socket_;
+  std::shared_ptr<TTransport> transport_;
+  std::shared_ptr<TSocketPoolServer> server_;
+  size_t index_;
+  bool probe_;
+  std::chrono::steady_clock::time_point checkoutTime_;
+};
+
+/// Statistics of one server of a TConnectionPool.
+struct TConnectionPoolServerStats {
+  std::string host;        ///< Host name
+  int port;                ///< Port
+  size_t inFlight;         ///< Connections checked out
+  size_t idle;             ///< Connections kept open for reuse
+  double latency;          ///< Moving average of RPC latency, in microseconds
+  bool ejected;            ///< Whether the server is considered down
+  uint64_t checkouts;      ///< Connections checked out so far
+  uint64_t failures;       ///< Failed connects and RPCs so far
+};
+
+/**
+ * Thread-safe pool of client connections to a set of servers.  Unlike
+ * TSocketPool, which is one socket, a TConnectionPool is shared by any
+ * number of callers, each taking a connection for the duration of a call
+ * and giving it back afterwards.  Connections that were given back in
+ * good shape stay open and are reused, most recently used first.
+ *
+ * Each checkout goes to the better of two servers picked at random
+ * ("power of two choices"), comparing the moving average of their RPC
+ * latency times the number of connections they have checked out.  A server
+ * whose connects or RPCs fail maxConsecutiveFailures times in a row is
+ * ejected: it gets no traffic until retryInterval seconds have passed, and
+ * then a single probe connection, which reinstates it if its call
+ * succeeds.  If all servers are ejected they are tried nonetheless.
+ *
+ * Generated clients check connections out and in per call when given a
+ * TPooledTransport:
+ *
+ *   std::shared_ptr<TConnectionPool> pool(new TConnectionPool(servers,
+ *       std::make_shared<TFramedTransportFactory>()));
+ *   // in each thread
+ *   MyServiceClient client(std::make_shared<TBinaryProtocol>(
+ *       std::make_shared<TPooledTransport>(pool)));
+ */
+class TConnectionPool {
+public:
+  /// Default # of idle connections kept per server
+  static const size_t MAX_IDLE_PER_SERVER = 8;
+
+  /// Default # of failures in a row that eject a server
+  static const int MAX_CONSECUTIVE_FAILURES = 3;
+
+  /// Default # of seconds an ejected server is left alone
+  static const int RETRY_INTERVAL = 10;
+
+  /**
+   * Connection pool constructor
+   *
+   * @param servers the servers to connect to
+   * @param transportFactory makes the transport used over each socket,
+   *        e.g. a TFramedTransportFactory; by default the socket is used
+   *        as is
+   */
+  TConnectionPool(const std::vector<std::shared_ptr<TSocketPoolServer> >& servers,
+                  std::shared_ptr<TTransportFactory> transportFactory
+                  = std::shared_ptr<TTransportFactory>());
+
+  /**
+   * Closes all idle connections.  The pool must outlive the connections
+   * checked out of it.
+   */
+  ~TConnectionPool();
+
+  /**
+   * Add a server to the pool
+   */
+  void addServer(const std::string& host, int port);
+
+  /**
+   * Get list of servers in this pool
+   */
+  void getServers(std::vector<std::shared_ptr<TSocketPoolServer> >& servers);
+
+  /**
+   * Sets how many idle connections are kept open per server.
+   */
+  void setMaxIdlePerServer(size_t maxIdle);
+
+  /**
+   * Sets how many failures in a row eject a server.
+   */
+  void setMaxConsecutiveFailures(int maxConsecutiveFailures);
+
+  /**
+   * Sets how many seconds an ejected server gets no traffic.
+   */
+  void setRetryInterval(int retryInterval);
+
+  /**
+   * Sets the weight of the latest RPC in the moving latency average, in
+   * (0, 1].
+   */
+  void setLatencyDecay(double decay);
+
+  /**
+   * Sets the connect timeout of new sockets, in milliseconds.
+   */
+  void setConnTimeout(int ms);
+
+  /**
+   * Sets the send timeout of new sockets, in milliseconds.
+   */
+  void setSendTimeout(int ms);
+
+  /**
+   * Sets the receive timeout of new sockets, in milliseconds.
+   */
+  void setRecvTimeout(int ms);
+
+  /**
+   * Gets the receive timeout of new sockets, in milliseconds.
+   */
+  int getRecvTimeout() const;
+
+  /**
+   * Take a connection to the best server, reusing an idle one if there is
+   * one or connecting otherwise.
+   *
+   * @return the connection, to be given back with checkin().
+   * @throws TTransportException if no server could be connected to.
+   */
+  std::shared_ptr<TPooledConnection> checkout();
+
+  /**
+   * Take a connection to the best server other than the given one, e.g.
+   * to retry a call that failed on it.
+   *
+   * @param avoid the server not to connect to.
+   * @throws TTransportException if no other server could be connected to.
+   */
+  std::shared_ptr<TPooledConnection> checkout(const std::shared_ptr<TSocketPoolServer>& avoid);
+
+  /**
+   * Give back a connection obtained from checkout().  It is kept for reuse
+   * if the call succeeded and the socket is still open.
+   *
+   * @param connection the connection.
+   * @param success false if the call failed on the transport; the
+   *        connection is closed and the failure counted against its server.
+   * @param measured whether the time since checkout() is the latency of a
+   *        completed call, to be included in the server's average.
+   */
+  void checkin(const std::shared_ptr<TPooledConnection>& connection,
+               bool success,
+               bool measured = true);
+
+  /**
+   * Give back a connection obtained from checkout() that neither succeeded
+   * nor failed in a way that says anything about its server, e.g. one whose
+   * call was cancelled or never made.  It is kept for reuse if the socket is
+   * still open.
+   *
+   * @param connection the connection.
+   */
+  void release(const std::shared_ptr<TPooledConnection>& connection);
+
+  /**
+   * Return the statistics of all servers.
+   */
+  std::vector<TConnectionPoolServerStats> getServerStats() const;
+
+private:
+  TConnectionPool(const TConnectionPool&);
+  TConnectionPool& operator=(const TConnectionPool&);
+
+  struct Server;
+
+  /// Pick a server for the next checkout, under the lock.
+  size_t selectServer(const std::vector<size_t>& exclude);
+
+  /// Whether the server may get a new checkout, under the lock.
+  bool isAvailable(Server& server, time_t now) const;
+
+  /// Account for a failure of the server, under the lock.
+  void recordFailure(Server& server);
+
+  /// Whether an idle socket was closed by the peer or got unexpected data.
+  static bool isStale(TSocket& socket);
+
+  mutable concurrency::Mutex mutex_;
+  std::vector<std::unique_ptr<Server> > servers_;
+  std::shared_ptr<TTransportFactory> transportFactory_;
+  size_t maxIdlePerServer_;
+  int maxConsecutiveFailures_;
+  time_t retryInterval_;
+  double latencyDecay_;
+  int connTimeout_;
+  int sendTimeout_;
+  int recvTimeout_;
+  std::mt19937 random_;
+};
+
+/**
+ * Transport that runs each call over a connection of a TConnectionPool.
+ * A connection is checked out when a call starts writing and checked back
+ * in once the response has been read, i.e. on readEnd().  A oneway call,
+ * which reads no response, gives its connection back when the next call
+ * starts.  A connection whose call failed on the transport, or whose
+ * response was not read to the end, is not reused.
+ *
+ * Like other transports, a TPooledTransport is for one caller at a time;
+ * the pool behind it may be shared.
+ */
+class TPooledTransport : public TVirtualTransport<TPooledTransport> {
+public:
+  TPooledTransport(std::shared_ptr<TConnectionPool> pool,
+                   std::shared_ptr<TConfiguration> config = nullptr);
+
+  ~TPooledTransport() override;
+
+  /// Always open, connections are made as needed.
+  bool isOpen() const override { return true; }
+
+  /// Nothing to do, connections are made as needed.
+  void open() override {}
+
+  /// Give back the connection, if a call left one checked out.
+  void close() override;
+
+  uint32_t read(uint8_t* buf, uint32_t len);
+
+  uint32_t readAll(uint8_t* buf, uint32_t len);
+
+  void write(const uint8_t* buf, uint32_t len);
+
+  void flush() override;
+
+  uint32_t readEnd() override;
+
+  uint32_t writeEnd() override;
+
+  /// The pool connections come from
+  std::shared_ptr<TConnectionPool> getPool() const { return pool_; }
+
+private:
+  /// Give back the current connection.
+  void release(bool success, bool measured);
+
+  std::shared_ptr<TConnectionPool> pool_;
+  std::shared_ptr<TPooledConnection> connection_;
+
+  /// Whether the current call has been flushed
+  bool flushed_;
+
+  /// Whether the current call has read from the connection
+  bool reading_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TCONNECTIONPOOL_H_
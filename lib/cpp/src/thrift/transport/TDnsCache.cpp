@@ -0,0 +1,247 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <thrift/transport/TDnsCache.h>
+#include <thrift/transport/TTransportException.h>
+
+#if _WIN32
+#include <thrift/windows/TWinsockSingleton.h>
+#endif
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+using apache::thrift::concurrency::Guard;
+
+const int TDnsCache::DEFAULT_TTL_MS;
+const size_t TDnsCache::DEFAULT_MAX_ENTRIES;
+
+TDnsCache::TDnsCache(int ttlMs, size_t maxEntries)
+  : ttlMs_(ttlMs), maxEntries_(maxEntries > 0 ? maxEntries : 1), hits_(0), misses_(0) {
+}
+
+std::shared_ptr<TDnsCache> TDnsCache::getDefault() {
+  static std::shared_ptr<TDnsCache> cache(new TDnsCache());
+  return cache;
+}
+
+std::shared_ptr<const TDnsCache::Addresses> TDnsCache::resolve(const std::string& host,
+                                                               int port,
+                                                               bool* cached) {
+  Key key(host, port);
+  std::shared_future<std::shared_ptr<const Addresses> > addresses;
+  std::promise<std::shared_ptr<const Addresses> > promise;
+  bool lookingUp = false;
+
+  {
+    Guard g(mutex_);
+    Deadline now = std::chrono::steady_clock::now();
+    auto it = entries_.find(key);
+    if (it != entries_.end() && (!it->second.ready || now < it->second.expires)) {
+      ++hits_;
+      addresses = it->second.addresses;
+    } else {
+      if (it != entries_.end()) {
+        entries_.erase(it);
+      } else if (entries_.size() >= maxEntries_) {
+        evict(now);
+      }
+      ++misses_;
+      lookingUp = true;
+      Entry& entry = entries_[key];
+      entry.addresses = promise.get_future().share();
+      entry.ready = false;
+      addresses = entry.addresses;
+    }
+  }
+
+  if (cached) {
+    *cached = !lookingUp;
+  }
+  if (!lookingUp) {
+    // Throws what the lookup we waited for threw
+    return addresses.get();
+  }
+
+  try {
+    std::shared_ptr<const Addresses> result = lookup(host, port);
+    promise.set_value(result);
+    Guard g(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end() && !it->second.ready) {
+      it->second.ready = true;
+      it->second.expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttlMs_);
+    }
+    return result;
+  } catch (...) {
+    promise.set_exception(std::current_exception());
+    Guard g(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end() && !it->second.ready) {
+      entries_.erase(it);
+    }
+    throw;
+  }
+}
+
+void TDnsCache::evict(Deadline now) {
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->second.ready && now >= it->second.expires) {
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (entries_.size() < maxEntries_) {
+    return;
+  }
+  // Drop the entry closest to expiring
+  auto oldest = entries_.end();
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->second.ready && (oldest == entries_.end() || it->second.expires < oldest->second.expires)) {
+      oldest = it;
+    }
+  }
+  if (oldest != entries_.end()) {
+    entries_.erase(oldest);
+  }
+}
+
+void TDnsCache::insert(const std::string& host,
+                       int port,
+                       std::shared_ptr<const Addresses> addresses) {
+  std::promise<std::shared_ptr<const Addresses> > promise;
+  promise.set_value(addresses);
+
+  Guard g(mutex_);
+  Deadline now = std::chrono::steady_clock::now();
+  Key key(host, port);
+  if (entries_.find(key) == entries_.end() && entries_.size() >= maxEntries_) {
+    evict(now);
+  }
+  Entry& entry = entries_[key];
+  entry.addresses = promise.get_future().share();
+  entry.expires = now + std::chrono::milliseconds(ttlMs_);
+  entry.ready = true;
+}
+
+void TDnsCache::invalidate(const std::string& host, int port) {
+  Guard g(mutex_);
+  auto it = entries_.find(Key(host, port));
+  if (it != entries_.end() && it->second.ready) {
+    entries_.erase(it);
+  }
+}
+
+void TDnsCache::clear() {
+  Guard g(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->second.ready) {
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void TDnsCache::setTtl(int ttlMs) {
+  Guard g(mutex_);
+  ttlMs_ = ttlMs;
+}
+
+int TDnsCache::getTtl() const {
+  Guard g(mutex_);
+  return ttlMs_;
+}
+
+uint64_t TDnsCache::getNumHits() const {
+  Guard g(mutex_);
+  return hits_;
+}
+
+uint64_t TDnsCache::getNumMisses() const {
+  Guard g(mutex_);
+  return misses_;
+}
+
+std::shared_ptr<const TDnsCache::Addresses> TDnsCache::lookup(const std::string& host, int port) {
+#ifdef _WIN32
+  TWinsockSingleton::create();
+#endif // _WIN32
+
+  struct addrinfo hints, *res, *res0;
+  res = nullptr;
+  res0 = nullptr;
+  int error;
+  char portStr[sizeof("65535")];
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+  sprintf(portStr, "%d", port);
+
+  error = getaddrinfo(host.c_str(), portStr, &hints, &res0);
+
+  if (
+#ifdef _WIN32
+      error == WSANO_DATA
+#else
+      // to support systems with no ipv4 addresses but using "127.0.0.1" as a hostname
+      // getaddrinfo() fails when AI_ADDRCONFIG is present in this situation...
+      error == EAI_NODATA || error == EAI_ADDRFAMILY
+#endif
+    ) {
+    hints.ai_flags &= ~AI_ADDRCONFIG;
+    error = getaddrinfo(host.c_str(), portStr, &hints, &res0);
+  }
+
+  if (error) {
+    std::string errStr = "TDnsCache::lookup() getaddrinfo() <Host: " + host + " Port: "
+                         + std::to_string(port) + ">" + std::string(THRIFT_GAI_STRERROR(error));
+    TOutput::instance()(errStr.c_str());
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "Could not resolve host for client socket.");
+  }
+
+  std::shared_ptr<Addresses> addresses(new Addresses());
+  for (res = res0; res; res = res->ai_next) {
+    if (res->ai_addrlen > sizeof(sockaddr_storage)) {
+      continue;
+    }
+    TResolvedAddress address;
+    std::memset(&address, 0, sizeof(address));
+    address.family = res->ai_family;
+    address.socktype = res->ai_socktype;
+    address.protocol = res->ai_protocol;
+    std::memcpy(&address.addr, res->ai_addr, res->ai_addrlen);
+    address.addrlen = static_cast<socklen_t>(res->ai_addrlen);
+    addresses->push_back(address);
+  }
+  freeaddrinfo(res0);
+  return addresses;
+}
+}
+}
+} // apache::thrift::transport
@@ -0,0 +1,151 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TDNSCACHE_H_
+#define _THRIFT_TRANSPORT_TDNSCACHE_H_ 1
+
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <thrift/Thrift.h>
+#include <thrift/concurrency/Mutex.h>
+#include <thrift/transport/PlatformSocket.h>
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * An address getaddrinfo() returned, in a form that can be copied around.
+ */
+struct TResolvedAddress {
+  int family;
+  int socktype;
+  int protocol;
+  sockaddr_storage addr;
+  socklen_t addrlen;
+};
+
+/**
+ * Cache of host name lookups, that TSockets given one share instead of
+ * calling getaddrinfo() on every open().  Results are kept for a fixed
+ * time to live, and concurrent lookups of a name that is not cached wait
+ * for one call to getaddrinfo() instead of all making their own, so that
+ * clients reconnecting all at once after a server restart do not flood the
+ * resolver.  Failed lookups are not cached.
+ */
+class TDnsCache {
+public:
+  typedef std::vector<TResolvedAddress> Addresses;
+
+  /// Default time to live of a lookup, in ms
+  static const int DEFAULT_TTL_MS = 30000;
+
+  /// Default # of names cached
+  static const size_t DEFAULT_MAX_ENTRIES = 1024;
+
+  TDnsCache(int ttlMs = DEFAULT_TTL_MS, size_t maxEntries = DEFAULT_MAX_ENTRIES);
+
+  /**
+   * Returns the cache shared by default, with the default settings.
+   */
+  static std::shared_ptr<TDnsCache> getDefault();
+
+  /**
+   * Look host and port up, or return the addresses cached for them.
+   *
+   * @param cached set to whether the addresses came from the cache
+   * @throws TTransportException NOT_OPEN if the lookup failed
+   */
+  std::shared_ptr<const Addresses> resolve(const std::string& host,
+                                           int port,
+                                           bool* cached = nullptr);
+
+  /**
+   * Cache addresses for host and port as if they had been looked up, e.g.
+   * to override what the resolver returns.
+   */
+  void insert(const std::string& host, int port, std::shared_ptr<const Addresses> addresses);
+
+  /**
+   * Drop the addresses cached for host and port, e.g. because none of them
+   * could be connected to.
+   */
+  void invalidate(const std::string& host, int port);
+
+  /**
+   * Drop everything cached.
+   */
+  void clear();
+
+  void setTtl(int ttlMs);
+  int getTtl() const;
+
+  /// # of lookups answered from the cache, or by waiting for another one
+  uint64_t getNumHits() const;
+
+  /// # of lookups that called getaddrinfo()
+  uint64_t getNumMisses() const;
+
+  /**
+   * Look host and port up with getaddrinfo(), without any caching.
+   *
+   * @throws TTransportException NOT_OPEN if the lookup failed
+   */
+  static std::shared_ptr<const Addresses> lookup(const std::string& host, int port);
+
+private:
+  typedef std::pair<std::string, int> Key;
+  typedef std::chrono::steady_clock::time_point Deadline;
+
+  struct Entry {
+    std::shared_future<std::shared_ptr<const Addresses> > addresses;
+    Deadline expires;
+    bool ready;
+  };
+
+  /// Make room for one more entry, under the lock.
+  void evict(Deadline now);
+
+  mutable concurrency::Mutex mutex_;
+  std::map<Key, Entry> entries_;
+  int ttlMs_;
+  size_t maxEntries_;
+  uint64_t hits_;
+  uint64_t misses_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TDNSCACHE_H_
@@ -25,13 +25,23 @@
 
 #include <boost/numeric/conversion/cast.hpp>
 
+#include <algorithm>
 #include <limits>
 #include <utility>
 #include <string>
 #include <string.h>
 #include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
-using std::map;
 using std::string;
 using std::vector;
 
@@ -59,6 +69,63 @@ template <typename To, typename From> To safe_numeric_cast(From i) {
 using namespace apache::thrift::protocol;
 using apache::thrift::protocol::TBinaryProtocol;
 
+TZstdDictionary::TZstdDictionary(const string& content, int level)
+  : cdict_(nullptr), ddict_(nullptr), id_(0) {
+#ifdef HAVE_ZSTD
+  cdict_ = ZSTD_createCDict(content.data(), content.size(), level);
+  ddict_ = ZSTD_createDDict(content.data(), content.size());
+  if (cdict_ == nullptr || ddict_ == nullptr) {
+    ZSTD_freeCDict(cdict_);
+    ZSTD_freeDDict(ddict_);
+    throw TTransportException(TTransportException::BAD_ARGS, "Unusable zstd dictionary");
+  }
+  id_ = ZSTD_getDictID_fromDDict(ddict_);
+#else
+  (void)content;
+  (void)level;
+  throw TTransportException(TTransportException::BAD_ARGS, "zstd support is not built in");
+#endif
+}
+
+TZstdDictionary::~TZstdDictionary() {
+#ifdef HAVE_ZSTD
+  ZSTD_freeCDict(cdict_);
+  ZSTD_freeDDict(ddict_);
+#endif
+}
+
+THeaderTransport::~THeaderTransport() {
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(zstdCCtx_);
+  ZSTD_freeDCtx(zstdDCtx_);
+#endif
+#ifdef HAVE_LIBDEFLATE
+  if (zlibCompressor_ != nullptr) {
+    libdeflate_free_compressor(zlibCompressor_);
+  }
+  if (zlibDecompressor_ != nullptr) {
+    libdeflate_free_decompressor(zlibDecompressor_);
+  }
+#endif
+}
+
+bool THeaderTransport::isTransformSupported(uint16_t transId) {
+  switch (transId) {
+  case ZLIB_TRANSFORM:
+    return true;
+#ifdef HAVE_ZSTD
+  case ZSTD_TRANSFORM:
+    return true;
+#endif
+#ifdef HAVE_LZ4
+  case LZ4_TRANSFORM:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
 uint32_t THeaderTransport::readSlow(uint8_t* buf, uint32_t len) {
   if (clientType == THRIFT_UNFRAMED_BINARY || clientType == THRIFT_UNFRAMED_COMPACT) {
     return transport_->read(buf, len);
@@ -186,35 +253,10 @@ bool THeaderTransport::readFrame() {
   return true;
 }
 
-/**
- * Reads a string from ptr, taking care not to reach headerBoundary
- * Advances ptr on success
- *
- * @param   str             output string
- * @throws  CORRUPTED_DATA  if size of string exceeds boundary
- */
-void THeaderTransport::readString(uint8_t*& ptr,
-                                  /* out */ string& str,
-                                  uint8_t const* headerBoundary) {
-  int32_t strLen;
-
-  uint32_t bytes = readVarint32(ptr, &strLen, headerBoundary);
-  // Bound the string against the header bytes that remain once the length varint
-  // itself is accounted for, and reject a negative length so the size_t
-  // conversion in assign() below stays within the buffer. ptr is only advanced
-  // once these checks pass, keeping the "advances on success" contract above.
-  uint8_t* strStart = ptr + bytes;
-  if (strLen < 0 || strLen > headerBoundary - strStart) {
-    throw TTransportException(TTransportException::CORRUPTED_DATA,
-                              "Info header length exceeds header size");
-  }
-  str.assign(reinterpret_cast<const char*>(strStart), strLen);
-  ptr = strStart + strLen;
-}
-
 void THeaderTransport::readHeaderFormat(uint16_t headerSize, uint32_t sz) {
   readTrans_.clear();   // Clear out any previous transforms.
   readHeaders_.clear(); // Clear out any previous headers.
+  readHeadersCopied_ = false;
 
   // skip over already processed magic(4), seqId(4), headerSize(2)
   auto* ptr = reinterpret_cast<uint8_t*>(rBuf_.get() + 10);
@@ -245,6 +287,9 @@ void THeaderTransport::readHeaderFormat(uint16_t headerSize, uint32_t sz) {
 
     readTrans_.push_back(transId);
   }
+  if (!readTrans_.empty()) {
+    peerTrans_ = readTrans_;
+  }
 
   // Info headers
   while (ptr < headerBoundary) {
@@ -268,12 +313,14 @@ void THeaderTransport::readHeaderFormat(uint16_t headerSize, uint32_t sz) {
       while (numKVHeaders-- && ptr < headerBoundary) {
         // format: key; value
         // both: length (varint32); value (string)
-        string key, value;
-        readString(ptr, key, headerBoundary);
+        const char* key;
+        const char* value;
+        uint32_t keyLen, valueLen;
+        readString(ptr, key, keyLen, headerBoundary);
         // value
-        readString(ptr, value, headerBoundary);
-        // save to headers
-        readHeaders_[key] = value;
+        readString(ptr, value, valueLen, headerBoundary);
+        // save to headers, into the storage of earlier frames' headers
+        readHeaders_.assign(key, keyLen, value, valueLen);
       }
       break;
     }
@@ -284,53 +331,25 @@ void THeaderTransport::readHeaderFormat(uint16_t headerSize, uint32_t sz) {
 }
 
 void THeaderTransport::untransform(uint8_t* ptr, uint32_t sz) {
-  // Update the transform buffer size if needed
-  resizeTransformBuffer();
-
   for (vector<uint16_t>::const_iterator it = readTrans_.begin(); it != readTrans_.end(); ++it) {
     const uint16_t transId = *it;
 
     if (transId == ZLIB_TRANSFORM) {
-      z_stream stream;
-      int err;
-
-      stream.next_in = ptr;
-      stream.avail_in = sz;
-
-      // Setting these to 0 means use the default free/alloc functions
-      stream.zalloc = (alloc_func)nullptr;
-      stream.zfree = (free_func)nullptr;
-      stream.opaque = (voidpf)nullptr;
-      err = inflateInit(&stream);
-      if (err != Z_OK) {
-        throw TApplicationException(TApplicationException::MISSING_RESULT,
-                                    "Error while zlib deflateInit");
-      }
-      stream.next_out = tBuf_.get();
-      stream.avail_out = tBufSize_;
-      err = inflate(&stream, Z_FINISH);
-      if (err != Z_STREAM_END || stream.avail_out == 0) {
-        throw TApplicationException(TApplicationException::MISSING_RESULT,
-                                    "Error while zlib deflate");
-      }
-      sz = stream.total_out;
-
-      err = inflateEnd(&stream);
-      if (err != Z_OK) {
-        throw TApplicationException(TApplicationException::MISSING_RESULT,
-                                    "Error while zlib deflateEnd");
-      }
-
-      // The result now lives in tBuf_ and is typically larger than the source
-      // section it was read from, so it does not fit back into the receive
-      // buffer at ptr.  Swap the transform buffer in as the receive buffer and
-      // continue from its start instead of copying the result back in place.
-      rBuf_.swap(tBuf_);
-      std::swap(rBufSize_, tBufSize_);
-      ptr = rBuf_.get();
+      sz = decompressZlib(ptr, sz);
+    } else if (transId == ZSTD_TRANSFORM) {
+      sz = decompressZstd(ptr, sz);
+    } else if (transId == LZ4_TRANSFORM) {
+      sz = decompressLz4(ptr, sz);
     } else {
       throw TApplicationException(TApplicationException::MISSING_RESULT, "Unknown transform");
     }
+
+    // The result now lives in tBuf_ and is typically larger than the source
+    // section it was read from, so it does not fit back into the receive
+    // buffer at ptr.  Swap the transform buffer in as the receive buffer and
+    // continue from its start instead of copying the result back in place.
+    swapReadBuffers();
+    ptr = rBuf_.get();
   }
 
   setReadBuffer(ptr, sz);
@@ -338,10 +357,11 @@ void THeaderTransport::untransform(uint8_t* ptr, uint32_t sz) {
 
 /**
  * We may have updated the wBuf size, update the tBuf size to match.
- * Should be called in transform.
  *
  * The buffer should be slightly larger than write buffer size due to
- * compression transforms (that may slightly grow on small frame sizes)
+ * compression transforms (that may slightly grow on small frame sizes).
+ * Transforms size the buffer for each frame themselves, so this only
+ * reserves it up front.
  */
 void THeaderTransport::resizeTransformBuffer(uint32_t additionalSize) {
   if (tBufSize_ < wBufSize_ + DEFAULT_BUFFER_SIZE) {
@@ -352,52 +372,335 @@ void THeaderTransport::resizeTransformBuffer(uint32_t additionalSize) {
   }
 }
 
-void THeaderTransport::transform(uint8_t* ptr, uint32_t sz) {
-  // Update the transform buffer size if needed
-  resizeTransformBuffer();
+void THeaderTransport::ensureTransformBuffer(uint32_t sz) {
+  if (sz > tBufSize_) {
+    tBuf_.reset(new uint8_t[sz]);
+    tBufSize_ = sz;
+  }
+}
 
-  for (vector<uint16_t>::const_iterator it = writeTrans_.begin(); it != writeTrans_.end(); ++it) {
-    const uint16_t transId = *it;
+void THeaderTransport::swapWriteBuffers() {
+  wBuf_.swap(tBuf_);
+  std::swap(wBufSize_, tBufSize_);
+  setWriteBuffer(wBuf_.get(), wBufSize_);
+}
 
-    if (transId == ZLIB_TRANSFORM) {
-      z_stream stream;
-      int err;
+void THeaderTransport::swapReadBuffers() {
+  rBuf_.swap(tBuf_);
+  std::swap(rBufSize_, tBufSize_);
+}
 
-      stream.next_in = ptr;
-      stream.avail_in = sz;
+uint32_t THeaderTransport::compressZlib(const uint8_t* ptr, uint32_t sz) {
+#ifdef HAVE_LIBDEFLATE
+  if (zlibCompressor_ == nullptr) {
+    // the level of Z_DEFAULT_COMPRESSION
+    zlibCompressor_ = libdeflate_alloc_compressor(6);
+    if (zlibCompressor_ == nullptr) {
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "Error while libdeflate_alloc_compressor");
+    }
+  }
+  size_t bound = libdeflate_zlib_compress_bound(zlibCompressor_, sz);
+  if (bound > MAX_FRAME_SIZE) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Attempting to send frame that is too large");
+  }
+  ensureTransformBuffer(FRAME_HEADROOM + static_cast<uint32_t>(bound));
+  size_t out = libdeflate_zlib_compress(zlibCompressor_, ptr, sz, tBuf_.get() + FRAME_HEADROOM,
+                                        tBufSize_ - FRAME_HEADROOM);
+  if (out == 0) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Error while libdeflate compress");
+  }
+  return static_cast<uint32_t>(out);
+#else
+  z_stream stream;
+  int err;
+
+  // Setting these to 0 means use the default free/alloc functions
+  stream.zalloc = (alloc_func)nullptr;
+  stream.zfree = (free_func)nullptr;
+  stream.opaque = (voidpf)nullptr;
+  err = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+  if (err != Z_OK) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Error while zlib deflateInit");
+  }
 
-      stream.zalloc = (alloc_func)nullptr;
-      stream.zfree = (free_func)nullptr;
-      stream.opaque = (voidpf)nullptr;
-      err = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
-      if (err != Z_OK) {
-        throw TTransportException(TTransportException::CORRUPTED_DATA,
-                                  "Error while zlib deflateInit");
-      }
-      uint32_t tbuf_size = 0;
-      while (err == Z_OK) {
-        resizeTransformBuffer(tbuf_size);
-
-        stream.next_out = tBuf_.get();
-        stream.avail_out = tBufSize_;
-        err = deflate(&stream, Z_FINISH);
-        tbuf_size += DEFAULT_BUFFER_SIZE;
-      }
-      sz = stream.total_out;
+  // Sized for the worst case, so that one call deflates it all
+  uLong bound = deflateBound(&stream, sz);
+  if (bound > MAX_FRAME_SIZE) {
+    deflateEnd(&stream);
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Attempting to send frame that is too large");
+  }
+  ensureTransformBuffer(FRAME_HEADROOM + static_cast<uint32_t>(bound));
+
+  stream.next_in = const_cast<Bytef*>(ptr);
+  stream.avail_in = sz;
+  stream.next_out = tBuf_.get() + FRAME_HEADROOM;
+  stream.avail_out = tBufSize_ - FRAME_HEADROOM;
+  err = deflate(&stream, Z_FINISH);
+  uint32_t out = static_cast<uint32_t>(stream.total_out);
+  int endErr = deflateEnd(&stream);
+  if (err != Z_STREAM_END) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA, "Error while zlib deflate");
+  }
+  if (endErr != Z_OK) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Error while zlib deflateEnd");
+  }
+  return out;
+#endif
+}
 
-      err = deflateEnd(&stream);
-      if (err != Z_OK) {
-        throw TTransportException(TTransportException::CORRUPTED_DATA,
-                                  "Error while zlib deflateEnd");
-      }
+uint32_t THeaderTransport::decompressZlib(const uint8_t* ptr, uint32_t sz) {
+  const auto maxSize = static_cast<uint32_t>(getMaxMessageSize());
+#ifdef HAVE_LIBDEFLATE
+  if (zlibDecompressor_ == nullptr) {
+    zlibDecompressor_ = libdeflate_alloc_decompressor();
+    if (zlibDecompressor_ == nullptr) {
+      throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                  "Error while libdeflate_alloc_decompressor");
+    }
+  }
+
+  // The size of the result is not known up front, so start over with a
+  // larger buffer until it fits
+  ensureTransformBuffer(sz > maxSize / 4
+                            ? maxSize
+                            : (std::max)(sz * 4, static_cast<uint32_t>(DEFAULT_BUFFER_SIZE)));
+  for (;;) {
+    size_t out = 0;
+    libdeflate_result rc
+        = libdeflate_zlib_decompress(zlibDecompressor_, ptr, sz, tBuf_.get(), tBufSize_, &out);
+    if (rc == LIBDEFLATE_SUCCESS) {
+      return static_cast<uint32_t>(out);
+    }
+    if (rc != LIBDEFLATE_INSUFFICIENT_SPACE) {
+      throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                  "Error while libdeflate decompress");
+    }
+    if (tBufSize_ >= maxSize) {
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "Header transport frame is too large");
+    }
+    ensureTransformBuffer(tBufSize_ > maxSize / 2 ? maxSize : tBufSize_ * 2);
+  }
+#else
+  z_stream stream;
+  int err;
+
+  stream.next_in = const_cast<Bytef*>(ptr);
+  stream.avail_in = sz;
+  stream.zalloc = (alloc_func)nullptr;
+  stream.zfree = (free_func)nullptr;
+  stream.opaque = (voidpf)nullptr;
+  err = inflateInit(&stream);
+  if (err != Z_OK) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "Error while zlib inflateInit");
+  }
+
+  // The size of the result is not known up front, so grow the buffer until
+  // it fits, keeping what has been inflated so far
+  ensureTransformBuffer(sz > maxSize / 4
+                            ? maxSize
+                            : (std::max)(sz * 4, static_cast<uint32_t>(DEFAULT_BUFFER_SIZE)));
+  for (;;) {
+    stream.next_out = tBuf_.get() + stream.total_out;
+    stream.avail_out = tBufSize_ - static_cast<uint32_t>(stream.total_out);
+    err = inflate(&stream, Z_NO_FLUSH);
+    if (err == Z_STREAM_END) {
+      break;
+    }
+    if (err != Z_OK || stream.avail_out != 0) {
+      // corrupt, or the data ended early
+      inflateEnd(&stream);
+      throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                  "Error while zlib inflate");
+    }
+    if (tBufSize_ >= maxSize) {
+      inflateEnd(&stream);
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "Header transport frame is too large");
+    }
+    uint32_t newSize = tBufSize_ > maxSize / 2 ? maxSize : tBufSize_ * 2;
+    std::unique_ptr<uint8_t[]> newBuf(new uint8_t[newSize]);
+    memcpy(newBuf.get(), tBuf_.get(), stream.total_out);
+    tBuf_.swap(newBuf);
+    tBufSize_ = newSize;
+  }
+  uint32_t out = static_cast<uint32_t>(stream.total_out);
+
+  err = inflateEnd(&stream);
+  if (err != Z_OK) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "Error while zlib inflateEnd");
+  }
+  return out;
+#endif
+}
+
+uint32_t THeaderTransport::compressZstd(const uint8_t* ptr, uint32_t sz) {
+#ifdef HAVE_ZSTD
+  if (sz < 2) {
+    return 0;
+  }
+  ensureTransformBuffer(FRAME_HEADROOM + sz);
+  if (zstdCCtx_ == nullptr) {
+    zstdCCtx_ = ZSTD_createCCtx();
+    if (zstdCCtx_ == nullptr) {
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "Error while zstd ZSTD_createCCtx");
+    }
+  }
+  // Anything that does not fit into sz - 1 bytes is not worth sending
+  size_t rc = zstdDictionary_
+                  ? ZSTD_compress_usingCDict(zstdCCtx_, tBuf_.get() + FRAME_HEADROOM, sz - 1,
+                                             ptr, sz, zstdDictionary_->cdict_)
+                  : ZSTD_compressCCtx(zstdCCtx_, tBuf_.get() + FRAME_HEADROOM, sz - 1, ptr, sz,
+                                      zstdLevel_);
+  if (ZSTD_isError(rc)) {
+    if (ZSTD_getErrorCode(rc) == ZSTD_error_dstSize_tooSmall) {
+      return 0;
+    }
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              string("Error while zstd compress: ") + ZSTD_getErrorName(rc));
+  }
+  return static_cast<uint32_t>(rc);
+#else
+  (void)ptr;
+  (void)sz;
+  throw TTransportException(TTransportException::CORRUPTED_DATA, "Unknown transform");
+#endif
+}
+
+uint32_t THeaderTransport::decompressZstd(const uint8_t* ptr, uint32_t sz) {
+#ifdef HAVE_ZSTD
+  unsigned long long size = ZSTD_getFrameContentSize(ptr, sz);
+  if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "Error while zstd ZSTD_getFrameContentSize");
+  }
+  if (size > static_cast<uint32_t>(getMaxMessageSize())) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Header transport frame is too large");
+  }
+  if (zstdDCtx_ == nullptr) {
+    zstdDCtx_ = ZSTD_createDCtx();
+    if (zstdDCtx_ == nullptr) {
+      throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                  "Error while zstd ZSTD_createDCtx");
+    }
+  }
+  ensureTransformBuffer(static_cast<uint32_t>(size));
+  size_t rc = zstdDictionary_
+                  ? ZSTD_decompress_usingDDict(zstdDCtx_, tBuf_.get(), tBufSize_, ptr, sz,
+                                               zstdDictionary_->ddict_)
+                  : ZSTD_decompressDCtx(zstdDCtx_, tBuf_.get(), tBufSize_, ptr, sz);
+  if (ZSTD_isError(rc) || rc != size) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "Error while zstd decompress");
+  }
+  return static_cast<uint32_t>(rc);
+#else
+  (void)ptr;
+  (void)sz;
+  throw TApplicationException(TApplicationException::MISSING_RESULT, "Unknown transform");
+#endif
+}
+
+uint32_t THeaderTransport::compressLz4(const uint8_t* ptr, uint32_t sz) {
+#ifdef HAVE_LZ4
+  if (sz <= 5 || sz > static_cast<uint32_t>(LZ4_MAX_INPUT_SIZE)) {
+    return 0;
+  }
+  ensureTransformBuffer(FRAME_HEADROOM + sz);
+  uint8_t* out = tBuf_.get() + FRAME_HEADROOM;
+  // The block follows the size of the data, see LZ4_TRANSFORM
+  int rc = LZ4_compress_default(reinterpret_cast<const char*>(ptr),
+                                reinterpret_cast<char*>(out) + 4,
+                                static_cast<int>(sz),
+                                static_cast<int>(sz - 5));
+  if (rc <= 0) {
+    return 0;
+  }
+  uint32_t szN = htonl(sz);
+  memcpy(out, &szN, sizeof(szN));
+  return static_cast<uint32_t>(rc) + 4;
+#else
+  (void)ptr;
+  (void)sz;
+  throw TTransportException(TTransportException::CORRUPTED_DATA, "Unknown transform");
+#endif
+}
+
+uint32_t THeaderTransport::decompressLz4(const uint8_t* ptr, uint32_t sz) {
+#ifdef HAVE_LZ4
+  uint32_t szN;
+  if (sz < sizeof(szN)) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "Error while LZ4 decompress");
+  }
+  memcpy(&szN, ptr, sizeof(szN));
+  uint32_t size = ntohl(szN);
+  if (size > static_cast<uint32_t>(getMaxMessageSize())) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Header transport frame is too large");
+  }
+  ensureTransformBuffer(size);
+  int rc = LZ4_decompress_safe(reinterpret_cast<const char*>(ptr) + 4,
+                               reinterpret_cast<char*>(tBuf_.get()),
+                               static_cast<int>(sz - 4),
+                               static_cast<int>(size));
+  if (rc < 0 || static_cast<uint32_t>(rc) != size) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "Error while LZ4 decompress");
+  }
+  return size;
+#else
+  (void)ptr;
+  (void)sz;
+  throw TApplicationException(TApplicationException::MISSING_RESULT, "Unknown transform");
+#endif
+}
 
-      memcpy(ptr, tBuf_.get(), sz);
+void THeaderTransport::transform(uint8_t* ptr, uint32_t sz) {
+  // Small frames are not worth compressing
+  frameTrans_.clear();
+  if (sz < minCompressSize_) {
+    wBase_ = ptr + sz;
+    return;
+  }
+
+  const vector<uint16_t>& trans = writeTrans_.empty() ? peerTrans_ : writeTrans_;
+  for (vector<uint16_t>::const_iterator it = trans.begin(); it != trans.end(); ++it) {
+    const uint16_t transId = *it;
+
+    uint32_t out;
+    if (transId == ZLIB_TRANSFORM) {
+      out = compressZlib(ptr, sz);
+    } else if (transId == ZSTD_TRANSFORM) {
+      out = compressZstd(ptr, sz);
+    } else if (transId == LZ4_TRANSFORM) {
+      out = compressLz4(ptr, sz);
     } else {
       throw TTransportException(TTransportException::CORRUPTED_DATA, "Unknown transform");
     }
+
+    // zstd and LZ4 give up on data they cannot shrink
+    if (out > 0) {
+      // The result is in tBuf_, past the same headroom; trade the buffers
+      // rather than copy it back
+      swapWriteBuffers();
+      ptr = wBuf_.get() + FRAME_HEADROOM;
+      sz = out;
+      frameTrans_.push_back(transId);
+    }
   }
 
-  wBase_ = wBuf_.get() + sz;
+  wBase_ = ptr + sz;
 }
 
 void THeaderTransport::resetProtocol() {
@@ -409,7 +712,7 @@ void THeaderTransport::resetProtocol() {
 }
 
 uint32_t THeaderTransport::getWriteBytes() {
-  return safe_numeric_cast<uint32_t>(wBase_ - wBuf_.get());
+  return safe_numeric_cast<uint32_t>(wBase_ - (wBuf_.get() + FRAME_HEADROOM));
 }
 
 /**
@@ -430,7 +733,7 @@ void THeaderTransport::setHeader(const string& key, const string& value) {
 
 uint32_t THeaderTransport::getMaxWriteHeadersSize() const {
   size_t maxWriteHeadersSize = 0;
-  THeaderTransport::StringToStringMap::const_iterator it;
+  StringToStringMap::const_iterator it;
   for (it = writeHeaders_.begin(); it != writeHeaders_.end(); ++it) {
     // add sizes of key and value to maxWriteHeadersSize
     // 2 varints32 + the strings themselves
@@ -439,6 +742,15 @@ uint32_t THeaderTransport::getMaxWriteHeadersSize() const {
   return safe_numeric_cast<uint32_t>(maxWriteHeadersSize);
 }
 
+const THeaderTransport::StringToStringMap& THeaderTransport::getHeaders() const {
+  if (!readHeadersCopied_) {
+    readHeadersCopy_.clear();
+    readHeadersCopy_.insert(readHeaders_.begin(), readHeaders_.end());
+    readHeadersCopied_ = true;
+  }
+  return readHeadersCopy_;
+}
+
 void THeaderTransport::clearHeaders() {
   writeHeaders_.clear();
 }
@@ -449,14 +761,15 @@ void THeaderTransport::flush() {
   uint32_t haveBytes = getWriteBytes();
 
   if (clientType == THRIFT_HEADER_CLIENT_TYPE) {
-    transform(wBuf_.get(), haveBytes);
+    transform(wBuf_.get() + FRAME_HEADROOM, haveBytes);
     haveBytes = getWriteBytes(); // transform may have changed the size
   }
 
   // Note that we reset wBase_ prior to the underlying write
   // to ensure we're in a sane state (i.e. internal buffer cleaned)
   // if the underlying write throws up an exception
-  wBase_ = wBuf_.get();
+  uint8_t* payload = wBuf_.get() + FRAME_HEADROOM;
+  wBase_ = payload;
 
   if (haveBytes > MAX_FRAME_SIZE) {
     throw TTransportException(TTransportException::CORRUPTED_DATA,
@@ -466,23 +779,19 @@ void THeaderTransport::flush() {
   if (clientType == THRIFT_HEADER_CLIENT_TYPE) {
     // header size will need to be updated at the end because of varints.
     // Make it big enough here for max varint size, plus 4 for padding.
-    uint32_t headerSize = (2 + getNumTransforms()) * THRIFT_MAX_VARINT32_BYTES + 4;
+    uint32_t headerSize
+        = (2 + static_cast<uint32_t>(frameTrans_.size())) * THRIFT_MAX_VARINT32_BYTES + 4;
     // add approximate size of info headers
     headerSize += getMaxWriteHeadersSize();
 
-    // Pkt size
-    uint32_t maxSzHbo = headerSize + haveBytes // thrift header + payload
-                        + 10;                  // common header section
+    // The header is put together in the transform buffer, which holds
+    // nothing by now, and then moved in front of the payload if it fits
+    ensureTransformBuffer(headerSize + 4 + 10); // size, common header section
     uint8_t* pkt = tBuf_.get();
     uint8_t* headerStart;
     uint8_t* headerSizePtr;
     uint8_t* pktStart = pkt;
 
-    if (maxSzHbo > tBufSize_) {
-      throw TTransportException(TTransportException::CORRUPTED_DATA,
-                                "Attempting to header frame that is too large");
-    }
-
     uint32_t szHbo;
     uint32_t szNbo;
     uint16_t headerSizeN;
@@ -504,10 +813,10 @@ void THeaderTransport::flush() {
     headerStart = pkt;
 
     pkt += writeVarint32(protoId, pkt);
-    pkt += writeVarint32(getNumTransforms(), pkt);
+    pkt += writeVarint32(static_cast<int32_t>(frameTrans_.size()), pkt);
 
     // For now, each transform is only the ID, no following data.
-    for (vector<uint16_t>::const_iterator it = writeTrans_.begin(); it != writeTrans_.end(); ++it) {
+    for (vector<uint16_t>::const_iterator it = frameTrans_.begin(); it != frameTrans_.end(); ++it) {
       pkt += writeVarint32(*it, pkt);
     }
 
@@ -520,7 +829,7 @@ void THeaderTransport::flush() {
       // Write key-value headers count
       pkt += writeVarint32(static_cast<int32_t>(headerCount), pkt);
       // Write info headers
-      map<string, string>::const_iterator it;
+      StringToStringMap::const_iterator it;
       for (it = writeHeaders_.begin(); it != writeHeaders_.end(); ++it) {
         writeString(pkt, it->first);  // key
         writeString(pkt, it->second); // value
@@ -553,16 +862,22 @@ void THeaderTransport::flush() {
     szNbo = htonl(szHbo);
     memcpy(pktStart, &szNbo, sizeof(szNbo));
 
-    outTransport_->write(pktStart, szHbo - haveBytes + 4);
-    outTransport_->write(wBuf_.get(), haveBytes);
+    uint32_t headerBytes = szHbo - haveBytes + 4;
+    if (headerBytes <= FRAME_HEADROOM) {
+      memcpy(payload - headerBytes, pktStart, headerBytes);
+      outTransport_->write(payload - headerBytes, headerBytes + haveBytes);
+    } else {
+      outTransport_->write(pktStart, headerBytes);
+      outTransport_->write(payload, haveBytes);
+    }
   } else if (clientType == THRIFT_FRAMED_BINARY || clientType == THRIFT_FRAMED_COMPACT) {
     auto szHbo = (uint32_t)haveBytes;
     uint32_t szNbo = htonl(szHbo);
 
-    outTransport_->write(reinterpret_cast<uint8_t*>(&szNbo), 4);
-    outTransport_->write(wBuf_.get(), haveBytes);
+    memcpy(payload - 4, &szNbo, sizeof(szNbo));
+    outTransport_->write(payload - 4, haveBytes + 4);
   } else if (clientType == THRIFT_UNFRAMED_BINARY || clientType == THRIFT_UNFRAMED_COMPACT) {
-    outTransport_->write(wBuf_.get(), haveBytes);
+    outTransport_->write(payload, haveBytes);
   } else {
     throw TTransportException(TTransportException::BAD_ARGS, "Unknown client type");
   }
@@ -571,43 +886,6 @@ void THeaderTransport::flush() {
   outTransport_->flush();
 }
 
-/**
- * Read an i16 from the wire as a varint. The MSB of each byte is set
- * if there is another byte to follow. This can read up to 3 bytes.
- */
-uint32_t THeaderTransport::readVarint16(uint8_t const* ptr, int16_t* i16, uint8_t const* boundary) {
-  int32_t val;
-  uint32_t rsize = readVarint32(ptr, &val, boundary);
-  *i16 = (int16_t)val;
-  return rsize;
-}
-
-/**
- * Read an i32 from the wire as a varint. The MSB of each byte is set
- * if there is another byte to follow. This can read up to 5 bytes.
- */
-uint32_t THeaderTransport::readVarint32(uint8_t const* ptr, int32_t* i32, uint8_t const* boundary) {
-
-  uint32_t rsize = 0;
-  uint32_t val = 0;
-  int shift = 0;
-
-  while (true) {
-    if (ptr == boundary) {
-      throw TApplicationException(TApplicationException::INVALID_MESSAGE_TYPE,
-                                  "Trying to read past header boundary");
-    }
-    uint8_t byte = *(ptr++);
-    rsize++;
-    val |= (uint64_t)(byte & 0x7f) << shift;
-    shift += 7;
-    if (!(byte & 0x80)) {
-      *i32 = val;
-      return rsize;
-    }
-  }
-}
-
 /**
  * Write an i32 as a varint. Results in 1-5 bytes on the wire.
  */
@@ -21,11 +21,13 @@
 #define THRIFT_TRANSPORT_THEADERTRANSPORT_H_ 1
 
 #include <bitset>
+#include <cstddef>
 #include <limits>
+#include <map>
 #include <vector>
 #include <stdexcept>
 #include <string>
-#include <map>
+#include <utility>
 
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
@@ -33,6 +35,7 @@
 #include <inttypes.h>
 #endif
 
+#include <thrift/TNonCopyable.h>
 #include <thrift/protocol/TProtocolTypes.h>
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/transport/TTransport.h>
@@ -47,12 +50,99 @@ enum CLIENT_TYPE {
   THRIFT_UNKNOWN_CLIENT_TYPE = 5,
 };
 
+// zstd types, so that zstd.h is only needed to build the library
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+// libdeflate types, likewise
+struct libdeflate_compressor;
+struct libdeflate_decompressor;
+
 namespace apache {
 namespace thrift {
 namespace transport {
 
 using apache::thrift::protocol::T_COMPACT_PROTOCOL;
 
+/**
+ * A dictionary for THeaderTransport::ZSTD_TRANSFORM, digested once and then
+ * shared by any number of transports.  Small messages that look alike, like
+ * the requests of one service, compress much better with a dictionary
+ * trained on samples of them (`zstd --train`).  Both ends must use the same
+ * dictionary.
+ */
+class TZstdDictionary : apache::thrift::TNonCopyable {
+public:
+  /**
+   * @param content the dictionary.
+   * @param level the compression level to digest it for.
+   * @throws TTransportException if zstd support is not built in or the
+   *         dictionary is unusable.
+   */
+  explicit TZstdDictionary(const std::string& content, int level = 1);
+  ~TZstdDictionary();
+
+  /// The id zstd frames compressed with the dictionary carry.
+  uint32_t getId() const { return id_; }
+
+private:
+  friend class THeaderTransport;
+
+  ZSTD_CDict_s* cdict_;
+  ZSTD_DDict_s* ddict_;
+  uint32_t id_;
+};
+
+/**
+ * The key-value headers of a frame, in the order they were set.  A flat
+ * list rather than a tree: frames carry a handful of headers, which a linear
+ * lookup finds faster, and clear() keeps the entries and the storage of their
+ * strings, so a transport that sees frames alike stops allocating for their
+ * headers after the first one.
+ */
+class THeaderMap {
+public:
+  typedef std::pair<std::string, std::string> value_type;
+  typedef std::vector<value_type>::iterator iterator;
+  typedef std::vector<value_type>::const_iterator const_iterator;
+
+  THeaderMap() : size_(0) {}
+
+  iterator begin() { return entries_.begin(); }
+  iterator end() { return entries_.begin() + static_cast<std::ptrdiff_t>(size_); }
+  const_iterator begin() const { return entries_.begin(); }
+  const_iterator end() const { return entries_.begin() + static_cast<std::ptrdiff_t>(size_); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  void clear() { size_ = 0; }
+
+  iterator find(const std::string& key);
+  const_iterator find(const std::string& key) const;
+  size_t count(const std::string& key) const { return find(key) == end() ? 0 : 1; }
+
+  /// The value of key, added empty if missing.
+  std::string& operator[](const std::string& key);
+
+  /// Removes key, keeping the order of the other entries.
+  size_t erase(const std::string& key);
+
+  /// Sets key to value, both given as bytes, as read off the wire.
+  void assign(const char* key, size_t keySize, const char* value, size_t valueSize);
+
+private:
+  /// Finds key, given as bytes, among the entries in use.
+  size_t indexOf(const char* key, size_t keySize) const;
+
+  /// Takes an entry into use, reusing one that clear() left behind.
+  value_type& append();
+
+  std::vector<value_type> entries_;
+  size_t size_;
+};
+
 /**
  * Header transport. All writes go into an in-memory buffer until flush is
  * called, at which point the transport writes the length of the entire
@@ -71,6 +161,13 @@ public:
   static const int DEFAULT_BUFFER_SIZE = 512u;
   static const int THRIFT_MAX_VARINT32_BYTES = 5;
 
+  /**
+   * Bytes kept free in front of the payload in the write buffer, where
+   * flush() puts the frame size and the header so that a frame goes out with
+   * one write.  Frames with larger headers go out with two.
+   */
+  static const uint32_t FRAME_HEADROOM = 64u;
+
   /// Use default buffer sizes.
   explicit THeaderTransport(const std::shared_ptr<TTransport>& transport,
                             std::shared_ptr<TConfiguration> config = nullptr)
@@ -80,6 +177,13 @@ public:
       clientType(THRIFT_HEADER_CLIENT_TYPE),
       seqId(0),
       flags(0),
+      minCompressSize_(0),
+      zstdLevel_(1),
+      zstdCCtx_(nullptr),
+      zstdDCtx_(nullptr),
+      zlibCompressor_(nullptr),
+      zlibDecompressor_(nullptr),
+      readHeadersCopied_(false),
       tBufSize_(0),
       tBuf_(nullptr) {
     if (!transport_) throw std::invalid_argument("transport is empty");
@@ -95,6 +199,13 @@ public:
       clientType(THRIFT_HEADER_CLIENT_TYPE),
       seqId(0),
       flags(0),
+      minCompressSize_(0),
+      zstdLevel_(1),
+      zstdCCtx_(nullptr),
+      zstdDCtx_(nullptr),
+      zlibCompressor_(nullptr),
+      zlibDecompressor_(nullptr),
+      readHeadersCopied_(false),
       tBufSize_(0),
       tBuf_(nullptr) {
     if (!transport_) throw std::invalid_argument("inTransport is empty");
@@ -102,6 +213,8 @@ public:
     initBuffers();
   }
 
+  ~THeaderTransport() override;
+
   uint32_t readSlow(uint8_t* buf, uint32_t len) override;
   void flush() override;
 
@@ -125,7 +238,8 @@ public:
   /**
    * Untransform the data based on the received header flags
    * On conclusion of function, setReadBuffer is called with the
-   * untransformed data.
+   * untransformed data.  Each transform decompresses into the transform
+   * buffer, which then trades places with the read buffer.
    *
    * @param ptr ptr to data
    * @param size of data
@@ -135,17 +249,52 @@ public:
   /**
    * Transform the data based on our write transform flags
    * At conclusion of function the write buffer is set to the
-   * transformed data.
+   * transformed data.  Each transform compresses into the transform buffer,
+   * which then trades places with the write buffer, so the payload is never
+   * copied back.
    *
-   * @param ptr Ptr to data to transform
+   * @param ptr Ptr to data to transform, FRAME_HEADROOM bytes into wBuf_
    * @param sz Size of data buffer
    */
   void transform(uint8_t* ptr, uint32_t sz);
 
   uint16_t getNumTransforms() const;
 
+  /**
+   * Apply a transform to the frames written.  A transport with no transforms
+   * set applies those of the last frame it read that had any, so a server
+   * answers in kind and a client that compresses its requests gets
+   * compressed responses.
+   */
   void setTransform(uint16_t transId) { writeTrans_.push_back(transId); }
 
+  /// Whether this build can apply and remove the given transform.
+  static bool isTransformSupported(uint16_t transId);
+
+  /**
+   * Set the payload size below which frames are written without
+   * compression, where it costs more time than it saves.  The zstd and LZ4
+   * transforms are skipped anyway if they would not make a frame smaller.
+   *
+   * @param size # of bytes, 0 to compress every frame.
+   */
+  void setMinCompressSize(uint32_t size) { minCompressSize_ = size; }
+  uint32_t getMinCompressSize() const { return minCompressSize_; }
+
+  /// Set the level of ZSTD_TRANSFORM without dictionary; 1 favours speed.
+  void setZstdLevel(int level) { zstdLevel_ = level; }
+  int getZstdLevel() const { return zstdLevel_; }
+
+  /**
+   * Compress and decompress ZSTD_TRANSFORM with a dictionary.  Its level is
+   * used rather than getZstdLevel().
+   *
+   * @param dictionary the dictionary, empty to do without.
+   */
+  void setZstdDictionary(const std::shared_ptr<const TZstdDictionary>& dictionary) {
+    zstdDictionary_ = dictionary;
+  }
+
   // Info headers
 
   typedef std::map<std::string, std::string> StringToStringMap;
@@ -158,14 +307,44 @@ public:
   StringToStringMap& getWriteHeaders() { return writeHeaders_; }
 
   // these work with read headers
-  const StringToStringMap& getHeaders() const { return readHeaders_; }
+  const StringToStringMap& getHeaders() const;
+
+  /**
+   * The read headers as they came off the wire, without copying them into a
+   * StringToStringMap as getHeaders() does.  Valid until the next frame is read.
+   */
+  const THeaderMap& getHeaderMap() const { return readHeaders_; }
+
+  /**
+   * Look up a key-value header of a frame that has not been read through a
+   * THeaderTransport, without untransforming its data.  Servers use this to
+   * learn about a request before handing it on.
+   *
+   * @param frame the frame, following its 4 byte size
+   * @param sz size of the frame
+   * @param key the header to look for
+   * @param value set to the value of the header, if found
+   * @return true if the frame is in header format and carries the header
+   */
+  static bool findHeader(uint8_t* frame,
+                         uint32_t sz,
+                         const std::string& key,
+                         /* out */ std::string& value);
 
   // accessors for seqId
   int32_t getSequenceNumber() const { return seqId; }
   void setSequenceNumber(int32_t seqId) { this->seqId = seqId; }
 
+  /**
+   * Transform ids.  0x02 - 0x04 are used by other implementations (HMAC,
+   * snappy, QuickLZ).  Support for zstd and LZ4 is optional, see
+   * isTransformSupported().  An LZ4 frame is the 4 byte size of its data
+   * followed by one LZ4 block.
+   */
   enum TRANSFORMS {
     ZLIB_TRANSFORM = 0x01,
+    ZSTD_TRANSFORM = 0x05,
+    LZ4_TRANSFORM = 0x06,
   };
 
 protected:
@@ -183,6 +362,7 @@ protected:
   void initBuffers() {
     setReadBuffer(nullptr, 0);
     setWriteBuffer(wBuf_.get(), wBufSize_);
+    wBase_ = wBuf_.get() + FRAME_HEADROOM;
   }
 
   std::shared_ptr<TTransport> outTransport_;
@@ -202,10 +382,30 @@ protected:
   std::vector<uint16_t> readTrans_;
   std::vector<uint16_t> writeTrans_;
 
+  /// Transforms of the last frame read that had any
+  std::vector<uint16_t> peerTrans_;
+
+  /// Transforms applied to the frame being written
+  std::vector<uint16_t> frameTrans_;
+
+  uint32_t minCompressSize_;
+  int zstdLevel_;
+  std::shared_ptr<const TZstdDictionary> zstdDictionary_;
+  ZSTD_CCtx_s* zstdCCtx_;
+  ZSTD_DCtx_s* zstdDCtx_;
+
+  /// Where built with libdeflate, which does ZLIB_TRANSFORM in one call
+  libdeflate_compressor* zlibCompressor_;
+  libdeflate_decompressor* zlibDecompressor_;
+
   // Map to use for headers
-  StringToStringMap readHeaders_;
+  THeaderMap readHeaders_;
   StringToStringMap writeHeaders_;
 
+  /// readHeaders_ as getHeaders() returns them, built on its first call per frame
+  mutable StringToStringMap readHeadersCopy_;
+  mutable bool readHeadersCopied_;
+
   /**
    * Returns the maximum number of bytes that write k/v headers can take
    */
@@ -223,7 +423,50 @@ protected:
   uint32_t tBufSize_;
   std::unique_ptr<uint8_t[]> tBuf_;
 
-  void readString(uint8_t*& ptr, /* out */ std::string& str, uint8_t const* headerBoundary);
+  /// Make the transform buffer hold at least sz bytes; drops its content.
+  void ensureTransformBuffer(uint32_t sz);
+
+  /// Make the transform buffer the write buffer and the other way round.
+  void swapWriteBuffers();
+
+  /// Make the transform buffer the read buffer and the other way round.
+  void swapReadBuffers();
+
+  /**
+   * Deflate sz bytes at ptr into the transform buffer.
+   *
+   * @return the compressed size.
+   */
+  uint32_t compressZlib(const uint8_t* ptr, uint32_t sz);
+
+  /**
+   * Inflate sz bytes at ptr into the transform buffer, growing it as needed.
+   *
+   * @return the decompressed size.
+   */
+  uint32_t decompressZlib(const uint8_t* ptr, uint32_t sz);
+
+  /**
+   * Compress sz bytes at ptr into the transform buffer with zstd or LZ4,
+   * FRAME_HEADROOM bytes in.
+   *
+   * @return the compressed size, or 0 if it would not be smaller than sz.
+   */
+  uint32_t compressZstd(const uint8_t* ptr, uint32_t sz);
+  uint32_t compressLz4(const uint8_t* ptr, uint32_t sz);
+
+  /**
+   * Decompress sz bytes at ptr into the transform buffer.
+   *
+   * @return the decompressed size.
+   */
+  uint32_t decompressZstd(const uint8_t* ptr, uint32_t sz);
+  uint32_t decompressLz4(const uint8_t* ptr, uint32_t sz);
+
+  static void readString(uint8_t*& ptr,
+                         /* out */ const char*& str,
+                         /* out */ uint32_t& strLen,
+                         uint8_t const* headerBoundary);
 
   void writeString(uint8_t*& ptr, const std::string& str);
 
@@ -232,13 +475,13 @@ protected:
    * Read an i16 from the wire as a varint. The MSB of each byte is set
    * if there is another byte to follow. This can read up to 3 bytes.
    */
-  uint32_t readVarint16(uint8_t const* ptr, int16_t* i16, uint8_t const* boundary);
+  static uint32_t readVarint16(uint8_t const* ptr, int16_t* i16, uint8_t const* boundary);
 
   /**
    * Read an i32 from the wire as a varint. The MSB of each byte is set
    * if there is another byte to follow. This can read up to 5 bytes.
    */
-  uint32_t readVarint32(uint8_t const* ptr, int32_t* i32, uint8_t const* boundary);
+  static uint32_t readVarint32(uint8_t const* ptr, int32_t* i32, uint8_t const* boundary);
 
   /**
    * Write an i32 as a varint. Results in 1-5 bytes on the wire.
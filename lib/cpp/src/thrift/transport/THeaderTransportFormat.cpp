@@ -0,0 +1,226 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * The parts of THeaderTransport that parse the header format in place.  They
+ * need no compression library, so they are built into libthrift, where
+ * servers such as TNonblockingServer look into frames with them.
+ */
+
+#include <thrift/transport/THeaderTransport.h>
+#include <thrift/TApplicationException.h>
+#include <thrift/transport/PlatformSocket.h>
+
+#include <algorithm>
+#include <string>
+#include <string.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+using std::string;
+
+THeaderMap::iterator THeaderMap::find(const string& key) {
+  return begin() + static_cast<std::ptrdiff_t>(indexOf(key.data(), key.size()));
+}
+
+THeaderMap::const_iterator THeaderMap::find(const string& key) const {
+  return begin() + static_cast<std::ptrdiff_t>(indexOf(key.data(), key.size()));
+}
+
+string& THeaderMap::operator[](const string& key) {
+  size_t i = indexOf(key.data(), key.size());
+  if (i < size_) {
+    return entries_[i].second;
+  }
+  value_type& entry = append();
+  entry.first = key;
+  return entry.second;
+}
+
+size_t THeaderMap::erase(const string& key) {
+  size_t i = indexOf(key.data(), key.size());
+  if (i == size_) {
+    return 0;
+  }
+  // move the erased entry past the ones in use, keeping its storage for later
+  std::rotate(entries_.begin() + static_cast<std::ptrdiff_t>(i),
+              entries_.begin() + static_cast<std::ptrdiff_t>(i + 1),
+              end());
+  --size_;
+  return 1;
+}
+
+void THeaderMap::assign(const char* key, size_t keySize, const char* value, size_t valueSize) {
+  size_t i = indexOf(key, keySize);
+  value_type& entry = i < size_ ? entries_[i] : append();
+  entry.first.assign(key, keySize);
+  entry.second.assign(value, valueSize);
+}
+
+size_t THeaderMap::indexOf(const char* key, size_t keySize) const {
+  for (size_t i = 0; i < size_; ++i) {
+    const string& k = entries_[i].first;
+    if (k.size() == keySize && memcmp(k.data(), key, keySize) == 0) {
+      return i;
+    }
+  }
+  return size_;
+}
+
+THeaderMap::value_type& THeaderMap::append() {
+  if (size_ == entries_.size()) {
+    entries_.push_back(value_type());
+  }
+  value_type& entry = entries_[size_++];
+  entry.second.clear();
+  return entry;
+}
+
+/**
+ * Finds a string at ptr, taking care not to reach headerBoundary
+ * Advances ptr on success
+ *
+ * @param   str             set to the start of the string, in the header
+ * @param   strLen          set to the size of the string
+ * @throws  CORRUPTED_DATA  if size of string exceeds boundary
+ */
+void THeaderTransport::readString(uint8_t*& ptr,
+                                  /* out */ const char*& str,
+                                  /* out */ uint32_t& strLen,
+                                  uint8_t const* headerBoundary) {
+  int32_t len;
+
+  uint32_t bytes = readVarint32(ptr, &len, headerBoundary);
+  // Bound the string against the header bytes that remain once the length varint
+  // itself is accounted for, and reject a negative length so the size_t
+  // conversion by callers stays within the buffer. ptr is only advanced
+  // once these checks pass, keeping the "advances on success" contract above.
+  uint8_t* strStart = ptr + bytes;
+  if (len < 0 || len > headerBoundary - strStart) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Info header length exceeds header size");
+  }
+  str = reinterpret_cast<const char*>(strStart);
+  strLen = static_cast<uint32_t>(len);
+  ptr = strStart + len;
+}
+
+bool THeaderTransport::findHeader(uint8_t* frame,
+                                  uint32_t sz,
+                                  const string& key,
+                                  /* out */ string& value) {
+  if (sz < 10) {
+    return false;
+  }
+  uint32_t magic_n;
+  memcpy(&magic_n, frame, sizeof(magic_n));
+  if ((ntohl(magic_n) & HEADER_MASK) != HEADER_MAGIC) {
+    return false;
+  }
+
+  uint16_t headerSize_n;
+  memcpy(&headerSize_n, frame + 8, sizeof(headerSize_n));
+  uint32_t headerSize = ntohs(headerSize_n);
+  if (headerSize >= 16384) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Header size is unreasonable");
+  }
+  headerSize *= 4;
+  if (headerSize > sz - 10) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Header size is larger than frame");
+  }
+
+  // Same layout as parsed by readHeaderFormat()
+  uint8_t* ptr = frame + 10;
+  const uint8_t* const headerBoundary = ptr + headerSize;
+  int16_t protocolId;
+  ptr += readVarint16(ptr, &protocolId, headerBoundary);
+  int16_t numTransforms;
+  ptr += readVarint16(ptr, &numTransforms, headerBoundary);
+  for (int i = 0; i < numTransforms; i++) {
+    int32_t transId;
+    ptr += readVarint32(ptr, &transId, headerBoundary);
+  }
+
+  while (ptr < headerBoundary) {
+    int32_t infoId;
+    ptr += readVarint32(ptr, &infoId, headerBoundary);
+    if (infoId != infoIdType::KEYVALUE) {
+      // header padding, or an infoId we cannot handle
+      break;
+    }
+    uint32_t numKVHeaders;
+    ptr += readVarint32(ptr, (int32_t*)&numKVHeaders, headerBoundary);
+    while (numKVHeaders-- && ptr < headerBoundary) {
+      const char* k;
+      const char* v;
+      uint32_t kLen, vLen;
+      readString(ptr, k, kLen, headerBoundary);
+      readString(ptr, v, vLen, headerBoundary);
+      if (kLen == key.size() && memcmp(k, key.data(), kLen) == 0) {
+        value.assign(v, vLen);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ * Read an i16 from the wire as a varint. The MSB of each byte is set
+ * if there is another byte to follow. This can read up to 3 bytes.
+ */
+uint32_t THeaderTransport::readVarint16(uint8_t const* ptr, int16_t* i16, uint8_t const* boundary) {
+  int32_t val;
+  uint32_t rsize = readVarint32(ptr, &val, boundary);
+  *i16 = (int16_t)val;
+  return rsize;
+}
+
+/**
+ * Read an i32 from the wire as a varint. The MSB of each byte is set
+ * if there is another byte to follow. This can read up to 5 bytes.
+ */
+uint32_t THeaderTransport::readVarint32(uint8_t const* ptr, int32_t* i32, uint8_t const* boundary) {
+
+  uint32_t rsize = 0;
+  uint32_t val = 0;
+  int shift = 0;
+
+  while (true) {
+    if (ptr == boundary) {
+      throw TApplicationException(TApplicationException::INVALID_MESSAGE_TYPE,
+                                  "Trying to read past header boundary");
+    }
+    uint8_t byte = *(ptr++);
+    rsize++;
+    val |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+    if (!(byte & 0x80)) {
+      *i32 = val;
+      return rsize;
+    }
+  }
+}
+}
+}
+} // apache::thrift::transport
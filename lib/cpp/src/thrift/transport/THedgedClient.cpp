@@ -0,0 +1,275 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <algorithm>
+#include <cerrno>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_POLL_H
+#include <sys/poll.h>
+#endif
+
+#include <thrift/transport/PlatformSocket.h>
+#include <thrift/transport/THedgedClient.h>
+
+using std::shared_ptr;
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+using apache::thrift::concurrency::Guard;
+
+THedgedClientBase::THedgedClientBase(shared_ptr<TConnectionPool> pool,
+                                     shared_ptr<TRetryBudget> budget)
+  : pool_(pool),
+    budget_(budget),
+    calls_(0),
+    hedges_(0),
+    hedgesWon_(0),
+    retries_(0),
+    hedgePercentile_(0.95),
+    minHedgeDelay_(1000),
+    maxRetries_(MAX_RETRIES),
+    nextLatency_(0),
+    newLatencies_(0),
+    hedgeDelay_(-1) {
+  if (!pool_ || !budget_) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "THedgedClient: pool and retry budget are required");
+  }
+  latencies_.reserve(LATENCY_SAMPLES);
+}
+
+void THedgedClientBase::setHedgePercentile(double percentile) {
+  if (percentile < 0 || percentile >= 1) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "THedgedClient: hedge percentile must be in [0, 1)");
+  }
+  Guard g(mutex_);
+  hedgePercentile_ = percentile;
+  newLatencies_ = LATENCY_SAMPLES;
+}
+
+void THedgedClientBase::setMinHedgeDelay(int64_t us) {
+  Guard g(mutex_);
+  minHedgeDelay_ = us;
+  newLatencies_ = LATENCY_SAMPLES;
+}
+
+void THedgedClientBase::setMaxRetries(int maxRetries) {
+  Guard g(mutex_);
+  maxRetries_ = maxRetries;
+}
+
+int64_t THedgedClientBase::getHedgeDelay() {
+  Guard g(mutex_);
+  if (hedgePercentile_ == 0 || latencies_.size() < MIN_LATENCY_SAMPLES) {
+    return -1;
+  }
+  // recomputed every so often rather than for every call
+  if (newLatencies_ >= LATENCY_SAMPLES / 16) {
+    std::vector<int64_t> sorted(latencies_);
+    std::vector<int64_t>::iterator nth
+        = sorted.begin() + static_cast<size_t>(hedgePercentile_ * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), nth, sorted.end());
+    hedgeDelay_ = std::max(*nth, minHedgeDelay_);
+    newLatencies_ = 0;
+  }
+  return hedgeDelay_;
+}
+
+void THedgedClientBase::recordLatency(int64_t us, bool hedge) {
+  if (hedge) {
+    ++hedgesWon_;
+  }
+  Guard g(mutex_);
+  if (latencies_.size() < LATENCY_SAMPLES) {
+    latencies_.push_back(us);
+  } else {
+    latencies_[nextLatency_] = us;
+    nextLatency_ = (nextLatency_ + 1) % LATENCY_SAMPLES;
+  }
+  ++newLatencies_;
+}
+
+bool THedgedClientBase::mayRetry(int& retries) {
+  {
+    Guard g(mutex_);
+    if (retries >= maxRetries_) {
+      return false;
+    }
+  }
+  if (!budget_->tryWithdraw()) {
+    return false;
+  }
+  ++retries;
+  ++retries_;
+  return true;
+}
+
+bool THedgedClientBase::mayHedge() {
+  if (!budget_->tryWithdraw()) {
+    return false;
+  }
+  ++hedges_;
+  return true;
+}
+
+shared_ptr<TPooledConnection> THedgedClientBase::connect(const shared_ptr<TSocketPoolServer>& avoid,
+                                                         bool otherServerOnly) {
+  if (!avoid) {
+    return pool_->checkout();
+  }
+  if (otherServerOnly) {
+    return pool_->checkout(avoid);
+  }
+  try {
+    return pool_->checkout(avoid);
+  } catch (const TTransportException&) {
+    return pool_->checkout();
+  }
+}
+
+THedgedClientBase::Call::~Call() {
+  for (auto& attempt : attempts_) {
+    if (attempt.pending) {
+      // the response is not wanted any more, which says nothing about the
+      // server either way
+      attempt.connection->getSocket()->close();
+      owner_.pool_->release(attempt.connection);
+    }
+  }
+}
+
+size_t THedgedClientBase::Call::add(const shared_ptr<TPooledConnection>& connection,
+                                    const shared_ptr<void>& client,
+                                    bool hedge) {
+  Attempt attempt;
+  attempt.connection = connection;
+  attempt.client = client;
+  attempt.start = std::chrono::steady_clock::now();
+  attempt.hedge = hedge;
+  attempt.pending = true;
+  attempts_.push_back(attempt);
+  return attempts_.size() - 1;
+}
+
+void THedgedClientBase::Call::fail(size_t index, bool serverFault) {
+  Attempt& attempt = attempts_[index];
+  error_ = std::current_exception();
+  failedServer_ = attempt.connection->getServer();
+  attempt.pending = false;
+  attempt.connection->getSocket()->close();
+  if (serverFault) {
+    owner_.pool_->checkin(attempt.connection, false, false);
+  } else {
+    owner_.pool_->release(attempt.connection);
+  }
+}
+
+void THedgedClientBase::Call::complete(size_t index) {
+  Attempt& attempt = attempts_[index];
+  attempt.pending = false;
+  owner_.pool_->checkin(attempt.connection, true, true);
+  owner_.recordLatency(std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - attempt.start)
+                           .count(),
+                       attempt.hedge);
+}
+
+size_t THedgedClientBase::Call::pending() const {
+  size_t count = 0;
+  for (const auto& attempt : attempts_) {
+    if (attempt.pending) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+shared_ptr<TSocketPoolServer> THedgedClientBase::Call::pendingServer() const {
+  for (const auto& attempt : attempts_) {
+    if (attempt.pending) {
+      return attempt.connection->getServer();
+    }
+  }
+  return shared_ptr<TSocketPoolServer>();
+}
+
+size_t THedgedClientBase::Call::wait(int64_t hedgeDelay) {
+  std::vector<size_t> indexes;
+  std::vector<THRIFT_POLLFD> fds;
+  for (size_t i = 0; i < attempts_.size(); ++i) {
+    if (attempts_[i].pending) {
+      THRIFT_POLLFD fd;
+      fd.fd = attempts_[i].connection->getSocket()->getSocketFD();
+      fd.events = THRIFT_POLLIN;
+      fd.revents = 0;
+      fds.push_back(fd);
+      indexes.push_back(i);
+    }
+  }
+  if (indexes.size() == 1 && hedgeDelay < 0) {
+    // nothing to wait for, the response is received from the only attempt
+    return indexes[0];
+  }
+
+  std::chrono::steady_clock::time_point deadline = attempts_[indexes[0]].start
+                                                   + std::chrono::microseconds(hedgeDelay);
+  int recvTimeout = owner_.pool_->getRecvTimeout();
+  for (;;) {
+    int timeout = recvTimeout > 0 ? recvTimeout : -1;
+    bool hedgeTimeout = false;
+    if (hedgeDelay >= 0) {
+      int64_t remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+                              deadline - std::chrono::steady_clock::now())
+                              .count();
+      if (remaining <= 0) {
+        return HEDGE;
+      }
+      int remainingMs = static_cast<int>((remaining + 999) / 1000);
+      if (timeout < 0 || remainingMs <= timeout) {
+        timeout = remainingMs;
+        hedgeTimeout = true;
+      }
+    }
+
+    int ret = THRIFT_POLL(&fds[0], fds.size(), timeout);
+    if (ret > 0) {
+      for (size_t i = 0; i < fds.size(); ++i) {
+        if (fds[i].revents) {
+          return indexes[i];
+        }
+      }
+    } else if (ret < 0 && THRIFT_GET_SOCKET_ERROR == THRIFT_EINTR) {
+      continue;
+    } else if (ret == 0 && hedgeTimeout) {
+      continue;
+    }
+    // timed out or failed, the oldest attempt's recv reports it
+    return indexes[0];
+  }
+}
+}
+}
+} // apache::thrift::transport
@@ -0,0 +1,351 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_THEDGEDCLIENT_H_
+#define _THRIFT_TRANSPORT_THEDGEDCLIENT_H_ 1
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <thrift/concurrency/Mutex.h>
+#include <thrift/protocol/TProtocol.h>
+#include <thrift/transport/TConnectionPool.h>
+#include <thrift/transport/TRetryBudget.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * The part of THedgedClient that does not depend on the client class.
+ */
+class THedgedClientBase {
+public:
+  /// # of recent latencies the hedge delay is computed from
+  static const size_t LATENCY_SAMPLES = 256;
+
+  /// # of latencies needed before calls are hedged
+  static const size_t MIN_LATENCY_SAMPLES = 32;
+
+  /// Default # of retries of a failed idempotent call
+  static const int MAX_RETRIES = 2;
+
+  virtual ~THedgedClientBase() {}
+
+  /**
+   * Sets the latency percentile after which an idempotent call is sent to
+   * a second server, e.g. 0.95; 0 disables hedging.
+   */
+  void setHedgePercentile(double percentile);
+
+  /**
+   * Sets the minimum delay before an idempotent call is hedged, in
+   * microseconds.
+   */
+  void setMinHedgeDelay(int64_t us);
+
+  /**
+   * Sets how many times a failed idempotent call may be sent again.
+   */
+  void setMaxRetries(int maxRetries);
+
+  /**
+   * Returns the current hedge delay in microseconds, or -1 while calls are
+   * not hedged.
+   */
+  int64_t getHedgeDelay();
+
+  /// Calls made so far
+  uint64_t getNumCalls() const { return calls_; }
+
+  /// Hedged duplicates sent so far
+  uint64_t getNumHedges() const { return hedges_; }
+
+  /// Calls answered by their hedged duplicate so far
+  uint64_t getNumHedgesWon() const { return hedgesWon_; }
+
+  /// Calls retried after failing so far
+  uint64_t getNumRetries() const { return retries_; }
+
+  std::shared_ptr<TConnectionPool> getPool() const { return pool_; }
+
+  std::shared_ptr<TRetryBudget> getRetryBudget() const { return budget_; }
+
+protected:
+  THedgedClientBase(std::shared_ptr<TConnectionPool> pool, std::shared_ptr<TRetryBudget> budget);
+
+  /**
+   * The attempts of one call, each a send of the call over its own
+   * connection.  Connections of attempts still pending when the call is
+   * over are closed, which is how the losing duplicate is cancelled.
+   */
+  class Call {
+  public:
+    /// Returned by wait() when the call should be hedged
+    static const size_t HEDGE = static_cast<size_t>(-1);
+
+    explicit Call(THedgedClientBase& owner) : owner_(owner) {}
+    ~Call();
+
+    /// Start an attempt over the connection, returns its index.
+    size_t add(const std::shared_ptr<TPooledConnection>& connection,
+               const std::shared_ptr<void>& client,
+               bool hedge);
+
+    /// The attempt failed; serverFault counts it against its server, else
+    /// the attempt counts neither for nor against it.
+    void fail(size_t attempt, bool serverFault);
+
+    /// The attempt got its response.
+    void complete(size_t attempt);
+
+    /**
+     * Wait until an attempt has its response arriving, or until the oldest
+     * pending attempt has taken hedgeDelay microseconds (if not negative).
+     *
+     * @return the attempt to receive from, or HEDGE.
+     */
+    size_t wait(int64_t hedgeDelay);
+
+    /// # of attempts still waiting for their response
+    size_t pending() const;
+
+    bool failed() const { return static_cast<bool>(error_); }
+
+    /// Rethrow the error of the last failed attempt.
+    void rethrow() const { std::rethrow_exception(error_); }
+
+    /// The server of the oldest pending attempt
+    std::shared_ptr<TSocketPoolServer> pendingServer() const;
+
+    /// The server of the last failed attempt
+    std::shared_ptr<TSocketPoolServer> failedServer() const { return failedServer_; }
+
+    template <class Client>
+    Client& client(size_t attempt) {
+      return *static_cast<Client*>(attempts_[attempt].client.get());
+    }
+
+  private:
+    Call(const Call&);
+    Call& operator=(const Call&);
+
+    struct Attempt {
+      std::shared_ptr<TPooledConnection> connection;
+      std::shared_ptr<void> client;
+      std::chrono::steady_clock::time_point start;
+      bool hedge;
+      bool pending;
+    };
+
+    THedgedClientBase& owner_;
+    std::vector<Attempt> attempts_;
+    std::exception_ptr error_;
+    std::shared_ptr<TSocketPoolServer> failedServer_;
+  };
+
+  /// Check out a connection, preferably not to the given server.
+  std::shared_ptr<TPooledConnection> connect(const std::shared_ptr<TSocketPoolServer>& avoid,
+                                             bool otherServerOnly);
+
+  /// Take a retry out of the budget, if the call has retries left.
+  bool mayRetry(int& retries);
+
+  /// Take a hedge out of the budget.
+  bool mayHedge();
+
+  /// Record the latency of a completed attempt.
+  void recordLatency(int64_t us, bool hedge);
+
+  std::shared_ptr<TConnectionPool> pool_;
+  std::shared_ptr<TRetryBudget> budget_;
+
+  std::atomic<uint64_t> calls_;
+  std::atomic<uint64_t> hedges_;
+  std::atomic<uint64_t> hedgesWon_;
+  std::atomic<uint64_t> retries_;
+
+private:
+  concurrency::Mutex mutex_;
+  double hedgePercentile_;
+  int64_t minHedgeDelay_;
+  int maxRetries_;
+  std::vector<int64_t> latencies_;
+  size_t nextLatency_;
+  size_t newLatencies_;
+  int64_t hedgeDelay_;
+};
+
+namespace detail {
+
+/// Keeps the result of a call; void calls have none.
+template <class Result>
+class THedgedResult {
+public:
+  template <class Recv, class Client>
+  void receive(Recv& recv, Client& client) {
+    value_.reset(new Result(recv(client)));
+  }
+  Result take() { return std::move(*value_); }
+
+private:
+  std::unique_ptr<Result> value_;
+};
+
+template <>
+class THedgedResult<void> {
+public:
+  template <class Recv, class Client>
+  void receive(Recv& recv, Client& client) {
+    recv(client);
+  }
+  void take() {}
+};
+}
+
+/**
+ * Wrapper making calls with a generated client over a TConnectionPool,
+ * each on a connection of its own.  Calls marked idempotent are
+ *
+ * - hedged: if no response has arrived after the hedge percentile of
+ *   recent latencies, the call is sent to a second server as well, and
+ *   whichever response comes first is used; the connection of the other
+ *   one is closed.
+ * - retried on another server if they fail on the transport.
+ *
+ * Hedges and retries are paid for from a TRetryBudget, so that they cannot
+ * amplify an overload.  Other calls are sent once.
+ *
+ * Calls are made with the send_ and recv_ methods of the generated client,
+ * which lets one thread wait for two responses at once:
+ *
+ *   THedgedClient<MyServiceClient> client(pool,
+ *       std::make_shared<TBinaryProtocolFactory>());
+ *   std::string value = client.call(true,
+ *       [&](MyServiceClient& c) { c.send_get(key); },
+ *       [](MyServiceClient& c) { std::string r; c.recv_get(r); return r; });
+ *
+ * send may run more than once and recv gets the result of one of them, so
+ * both must only use the client they are given.  A THedgedClient may be
+ * shared by threads.
+ */
+template <class Client>
+class THedgedClient : public THedgedClientBase {
+public:
+  THedgedClient(std::shared_ptr<TConnectionPool> pool,
+                std::shared_ptr<protocol::TProtocolFactory> protocolFactory,
+                std::shared_ptr<TRetryBudget> budget = std::make_shared<TRetryBudget>())
+    : THedgedClientBase(pool, budget), protocolFactory_(protocolFactory) {}
+
+  /**
+   * Make a call.
+   *
+   * @param idempotent whether the call may be hedged and retried.
+   * @param send sends the call with the client given.
+   * @param recv receives the response with the client given.
+   * @return what recv returns.
+   */
+  template <class Send, class Recv>
+  auto call(bool idempotent, Send send, Recv recv) -> decltype(recv(std::declval<Client&>())) {
+    detail::THedgedResult<decltype(recv(std::declval<Client&>()))> result;
+    Call call(*this);
+    int retries = 0;
+    bool hedged = !idempotent;
+
+    ++calls_;
+    budget_->deposit();
+    for (;;) {
+      if (call.pending() == 0) {
+        if (call.failed() && (!idempotent || !mayRetry(retries))) {
+          call.rethrow();
+        }
+        start(call, send, connect(call.failedServer(), false), false);
+        continue;
+      }
+
+      size_t ready = call.wait(hedged ? -1 : getHedgeDelay());
+      if (ready == Call::HEDGE) {
+        hedged = true;
+        std::shared_ptr<TPooledConnection> connection;
+        try {
+          connection = connect(call.pendingServer(), true);
+        } catch (const TTransportException&) {
+          // no other server to send the call to
+          continue;
+        }
+        if (!mayHedge()) {
+          pool_->release(connection);
+          continue;
+        }
+        start(call, send, connection, true);
+        continue;
+      }
+
+      try {
+        result.receive(recv, call.template client<Client>(ready));
+      } catch (const TTransportException&) {
+        call.fail(ready, true);
+        continue;
+      } catch (const protocol::TProtocolException&) {
+        call.fail(ready, false);
+        throw;
+      } catch (...) {
+        // an exception in the response, the connection is fine
+        call.complete(ready);
+        throw;
+      }
+      call.complete(ready);
+      return result.take();
+    }
+  }
+
+  std::shared_ptr<protocol::TProtocolFactory> getProtocolFactory() const {
+    return protocolFactory_;
+  }
+
+private:
+  template <class Send>
+  void start(Call& call,
+             Send& send,
+             const std::shared_ptr<TPooledConnection>& connection,
+             bool hedge) {
+    std::shared_ptr<Client> client
+        = std::make_shared<Client>(protocolFactory_->getProtocol(connection->getTransport()));
+    size_t attempt = call.add(connection, client, hedge);
+    try {
+      send(*client);
+    } catch (const TTransportException&) {
+      call.fail(attempt, true);
+    } catch (...) {
+      call.fail(attempt, false);
+      throw;
+    }
+  }
+
+  std::shared_ptr<protocol::TProtocolFactory> protocolFactory_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_THEDGEDCLIENT_H_
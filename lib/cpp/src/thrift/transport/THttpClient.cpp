@@ -17,7 +17,6 @@
  * under the License.
  */
 
-#include <algorithm>
 #include <limits>
 #include <cstdlib>
 #include <sstream>
@@ -149,49 +148,18 @@ void THttpClient::onewayComplete() {
 }
 
 void THttpClient::drainPendingOnewayResponse() {
-  readBuffer_.resetBuffer();
-
   if (readHeaders_) {
     readHeaders();
   }
-
-  if (chunked_) {
-    while (!chunkedDone_) {
-      char* line = readLine();
-      uint32_t chunkSize = parseChunkSize(line);
-      if (chunkSize == 0) {
-        readChunkedFooters();
-        break;
-      }
-
-      discardResponseBody(chunkSize);
-      readLine();
-    }
-  } else {
-    discardResponseBody(contentLength_);
+  if (!chunked_) {
+    contentLeft_ = contentLength_;
   }
+  readEnd();
 
   readHeaders_ = true;
   onewayResponsePending_ = false;
 }
 
-void THttpClient::discardResponseBody(uint32_t size) {
-  uint32_t remaining = size;
-  while (remaining > 0) {
-    uint32_t avail = httpBufLen_ - httpPos_;
-    if (avail == 0) {
-      httpPos_ = 0;
-      httpBufLen_ = 0;
-      refill();
-      avail = httpBufLen_;
-    }
-
-    uint32_t give = (std::min)(remaining, avail);
-    httpPos_ += give;
-    remaining -= give;
-  }
-}
-
 void THttpClient::setPath(std::string path) {
   path_ = path;
 }
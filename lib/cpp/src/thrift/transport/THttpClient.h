@@ -70,7 +70,6 @@ protected:
   bool parseStatusLine(char* status) override;
 
   void drainPendingOnewayResponse();
-  void discardResponseBody(uint32_t size);
 };
 }
 }
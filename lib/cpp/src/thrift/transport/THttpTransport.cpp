@@ -17,6 +17,9 @@
  * under the License.
  */
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 
 #include <thrift/transport/THttpTransport.h>
@@ -40,6 +43,7 @@ THttpTransport::THttpTransport(std::shared_ptr<TTransport> transport, std::share
     chunkedDone_(false),
     chunkSize_(0),
     contentLength_(0),
+    contentLeft_(0),
     httpBuf_(nullptr),
     httpPos_(0),
     httpBufLen_(0),
@@ -63,69 +67,104 @@ THttpTransport::~THttpTransport() {
 
 uint32_t THttpTransport::read(uint8_t* buf, uint32_t len) {
   checkReadBytesAvailable(len);
-  if (readBuffer_.available_read() == 0) {
-    readBuffer_.resetBuffer();
-    uint32_t got = readMoreData();
-    if (got == 0) {
-      return 0;
+  if (contentLeft_ == 0 && readMoreData() == 0) {
+    return 0;
+  }
+  uint32_t give = (std::min)(len, contentLeft_);
+  uint32_t avail = httpBufLen_ - httpPos_;
+  if (avail == 0) {
+    // We have given all the data, reset position to head of the buffer
+    httpPos_ = 0;
+    httpBufLen_ = 0;
+    if (give >= httpBufSize_) {
+      // Large reads of content go straight from the transport to the caller
+      uint32_t got = transport_->read(buf, give);
+      if (got == 0) {
+        throw TTransportException(TTransportException::END_OF_FILE, "Could not read content");
+      }
+      contentLeft_ -= got;
+      return got;
     }
+    refill();
+    avail = httpBufLen_;
   }
-  return readBuffer_.read(buf, len);
+  give = (std::min)(give, avail);
+  memcpy(buf, httpBuf_ + httpPos_, give);
+  httpPos_ += give;
+  contentLeft_ -= give;
+  return give;
 }
 
 uint32_t THttpTransport::readEnd() {
-  // Read any pending chunked data (footers etc.)
+  // Skip whatever is left of the content, and of the chunked data (footers etc.)
+  skipContent();
   if (chunked_) {
     while (!chunkedDone_) {
       readChunked();
+      skipContent();
     }
   }
   return 0;
 }
 
-uint32_t THttpTransport::readMoreData() {
-  uint32_t size;
+const uint8_t* THttpTransport::borrow(uint8_t* buf, uint32_t* len) {
+  (void)buf;
+  uint32_t avail = (std::min)(httpBufLen_ - httpPos_, contentLeft_);
+  if (avail == 0 || *len > avail) {
+    return nullptr;
+  }
+  *len = avail;
+  return reinterpret_cast<const uint8_t*>(httpBuf_ + httpPos_);
+}
 
-  if (httpPos_ == httpBufLen_) {
-    // Get more data!
-    refill();
+void THttpTransport::consume(uint32_t len) {
+  if (len > (std::min)(httpBufLen_ - httpPos_, contentLeft_)) {
+    throw TTransportException(TTransportException::BAD_ARGS, "consume did not follow a borrow.");
   }
+  httpPos_ += len;
+  contentLeft_ -= len;
+}
 
+uint32_t THttpTransport::readMoreData() {
   if (readHeaders_) {
     readHeaders();
+    if (!chunked_) {
+      // The read after this content starts the next message
+      readHeaders_ = true;
+      contentLeft_ = contentLength_;
+      return contentLeft_;
+    }
   }
 
   if (chunked_) {
-    size = readChunked();
-  } else {
-    size = readContent(contentLength_);
-    readHeaders_ = true;
+    return readChunked();
   }
-
-  return size;
+  return 0;
 }
 
 uint32_t THttpTransport::readChunked() {
-  uint32_t length = 0;
+  if (chunkedDone_) {
+    return 0;
+  }
+  if (chunkSize_ != 0) {
+    // Read trailing CRLF after the content of the previous chunk
+    readLine();
+  }
 
   char* line = readLine();
-  uint32_t chunkSize = parseChunkSize(line);
-  if (chunkSize == 0) {
+  chunkSize_ = parseChunkSize(line);
+  if (chunkSize_ == 0) {
     readChunkedFooters();
-  } else {
-    // Read data content
-    length += readContent(chunkSize);
-    // Read trailing CRLF after content
-    readLine();
   }
-  return length;
+  contentLeft_ = chunkSize_;
+  return chunkSize_;
 }
 
 void THttpTransport::readChunkedFooters() {
   // End of data, read footer lines until a blank one appears
   while (true) {
     char* line = readLine();
-    if (strlen(line) == 0) {
+    if (*line == '\0') {
       chunkedDone_ = true;
       break;
     }
@@ -137,53 +176,45 @@ uint32_t THttpTransport::parseChunkSize(char* line) {
   if (semi != nullptr) {
     *semi = '\0';
   }
-  uint32_t size = 0;
-  sscanf(line, "%x", &size);
-  return size;
+  return static_cast<uint32_t>(strtoul(line, nullptr, 16));
 }
 
-uint32_t THttpTransport::readContent(uint32_t size) {
-  uint32_t need = size;
-  while (need > 0) {
+void THttpTransport::skipContent() {
+  while (contentLeft_ > 0) {
     uint32_t avail = httpBufLen_ - httpPos_;
     if (avail == 0) {
-      // We have given all the data, reset position to head of the buffer
       httpPos_ = 0;
       httpBufLen_ = 0;
       refill();
-
-      // Now have available however much we read
       avail = httpBufLen_;
     }
-    uint32_t give = avail;
-    if (need < give) {
-      give = need;
-    }
-    readBuffer_.write((uint8_t*)(httpBuf_ + httpPos_), give);
+    uint32_t give = (std::min)(avail, contentLeft_);
     httpPos_ += give;
-    need -= give;
+    contentLeft_ -= give;
   }
-  return size;
 }
 
 char* THttpTransport::readLine() {
+  // Bytes after httpPos_ already searched, which survive shift()
+  uint32_t scanned = 0;
   while (true) {
-    char* eol = nullptr;
-
-    eol = strstr(httpBuf_ + httpPos_, CRLF);
-
-    // No CRLF yet?
-    if (eol == nullptr) {
-      // Shift whatever we have now to front and refill
-      shift();
-      refill();
-    } else {
-      // Return pointer to next line
-      *eol = '\0';
-      char* line = httpBuf_ + httpPos_;
-      httpPos_ = static_cast<uint32_t>((eol - httpBuf_) + CRLF_LEN);
-      return line;
+    char* line = httpBuf_ + httpPos_;
+    char* end = httpBuf_ + httpBufLen_;
+    char* cr = line + scanned;
+    while ((cr = static_cast<char*>(memchr(cr, '\r', end - cr))) != nullptr && cr + 1 < end) {
+      if (cr[1] == '\n') {
+        // Return pointer to next line
+        *cr = '\0';
+        httpPos_ = static_cast<uint32_t>((cr - httpBuf_) + CRLF_LEN);
+        return line;
+      }
+      ++cr;
     }
+
+    // No CRLF yet, search again from a trailing CR after the refill
+    scanned = static_cast<uint32_t>((cr != nullptr ? cr : end) - line);
+    shift();
+    refill();
   }
 }
 
@@ -227,6 +258,7 @@ void THttpTransport::readHeaders() {
   chunked_ = false;
   chunkedDone_ = false;
   chunkSize_ = 0;
+  contentLeft_ = 0;
 
   // Control state flow
   bool statusLine = true;
@@ -236,7 +268,7 @@ void THttpTransport::readHeaders() {
   while (true) {
     char* line = readLine();
 
-    if (strlen(line) == 0) {
+    if (*line == '\0') {
       if (finished) {
         readHeaders_ = false;
         return;
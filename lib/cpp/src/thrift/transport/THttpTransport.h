@@ -44,7 +44,11 @@ public:
 
   bool isOpen() const override { return transport_->isOpen(); }
 
-  bool peek() override { return transport_->peek(); }
+  /**
+   * Pipelined requests may already sit in the HTTP buffer, where the
+   * underlying transport cannot see them.
+   */
+  bool peek() override { return httpPos_ < httpBufLen_ || transport_->peek(); }
 
   void close() override { transport_->close(); }
 
@@ -52,6 +56,14 @@ public:
 
   uint32_t readEnd() override;
 
+  /**
+   * Lends the part of the current body or chunk that is already buffered.
+   * Never reads from the underlying transport.
+   */
+  const uint8_t* borrow(uint8_t* buf, uint32_t* len);
+
+  void consume(uint32_t len);
+
   void write(const uint8_t* buf, uint32_t len);
 
   void flush() override {
@@ -72,6 +84,8 @@ protected:
   bool chunkedDone_;
   uint32_t chunkSize_;
   uint32_t contentLength_;
+  // Bytes of the current body or chunk not yet handed out
+  uint32_t contentLeft_;
 
   char* httpBuf_;
   uint32_t httpPos_;
@@ -91,7 +105,7 @@ protected:
   void readChunkedFooters();
   uint32_t parseChunkSize(char* line);
 
-  uint32_t readContent(uint32_t size);
+  void skipContent();
 
   void refill();
   void shift();
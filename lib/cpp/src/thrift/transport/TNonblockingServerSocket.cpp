@@ -353,6 +353,7 @@ void TNonblockingServerSocket::_setup_tcp_sockopts() {
   }
 #endif
 
+  tuning_.applyToListener(serverSocket_);
 } // _setup_tcp_sockopts()
 
 void TNonblockingServerSocket::listen() {
@@ -599,6 +600,9 @@ shared_ptr<TSocket> TNonblockingServerSocket::acceptImpl() {
   if (keepAlive_) {
     client->setKeepAlive(keepAlive_);
   }
+  if (tuning_.isSet()) {
+    client->setSocketTuning(tuning_);
+  }
   client->setCachedAddress((sockaddr*)&clientAddress, size);
 
   if (acceptCallback_)
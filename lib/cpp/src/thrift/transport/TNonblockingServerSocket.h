@@ -22,6 +22,7 @@
 
 #include <thrift/transport/TNonblockingServerTransport.h>
 #include <thrift/transport/PlatformSocket.h>
+#include <thrift/transport/TSocketTuning.h>
 
 namespace apache {
 namespace thrift {
@@ -88,6 +89,11 @@ public:
   void setTcpSendBuffer(int tcpSendBuffer);
   void setTcpRecvBuffer(int tcpRecvBuffer);
 
+  // Low latency options for the listening socket and the accepted ones;
+  // must be called before listen() for the listening socket to get them.
+  void setSocketTuning(const TSocketTuning& tuning) { tuning_ = tuning; }
+  const TSocketTuning& getSocketTuning() const { return tuning_; }
+
   // listenCallback gets called just before listen, and after all Thrift
   // setsockopt calls have been made.  If you have custom setsockopt
   // things that need to happen on the listening socket, this is the place to do it.
@@ -135,6 +141,7 @@ private:
   int tcpRecvBuffer_;
   bool keepAlive_;
   bool listening_;
+  TSocketTuning tuning_;
 
   socket_func_t listenCallback_;
   socket_func_t acceptCallback_;
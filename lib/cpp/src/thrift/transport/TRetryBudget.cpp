@@ -0,0 +1,83 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <algorithm>
+
+#include <thrift/transport/TRetryBudget.h>
+#include <thrift/transport/TTransportException.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+using apache::thrift::concurrency::Guard;
+
+constexpr double TRetryBudget::RETRY_RATIO;
+constexpr double TRetryBudget::MIN_RETRIES_PER_SECOND;
+constexpr double TRetryBudget::MAX_BALANCE;
+
+TRetryBudget::TRetryBudget(double retryRatio, double minRetriesPerSecond, double maxBalance)
+  : retryRatio_(retryRatio),
+    minRetriesPerSecond_(minRetriesPerSecond),
+    maxBalance_(maxBalance),
+    balance_(maxBalance),
+    lastRefill_(std::chrono::steady_clock::now()),
+    rejected_(0) {
+  if (retryRatio < 0 || minRetriesPerSecond < 0 || maxBalance < 1) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "TRetryBudget: invalid budget parameters");
+  }
+}
+
+void TRetryBudget::refill() {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  double elapsed = std::chrono::duration<double>(now - lastRefill_).count();
+  lastRefill_ = now;
+  balance_ = std::min(maxBalance_, balance_ + elapsed * minRetriesPerSecond_);
+}
+
+void TRetryBudget::deposit() {
+  Guard g(mutex_);
+  balance_ = std::min(maxBalance_, balance_ + retryRatio_);
+}
+
+bool TRetryBudget::tryWithdraw() {
+  Guard g(mutex_);
+  refill();
+  if (balance_ < 1) {
+    ++rejected_;
+    return false;
+  }
+  balance_ -= 1;
+  return true;
+}
+
+double TRetryBudget::getBalance() {
+  Guard g(mutex_);
+  refill();
+  return balance_;
+}
+
+uint64_t TRetryBudget::getNumRejected() const {
+  Guard g(mutex_);
+  return rejected_;
+}
+}
+}
+} // apache::thrift::transport
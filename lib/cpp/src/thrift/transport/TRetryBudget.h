@@ -0,0 +1,96 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TRETRYBUDGET_H_
+#define _THRIFT_TRANSPORT_TRETRYBUDGET_H_ 1
+
+#include <chrono>
+#include <cstdint>
+
+#include <thrift/concurrency/Mutex.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * Token bucket limiting how many calls are sent again, as retries or hedges,
+ * relative to the calls sent in the first place.  Every call deposits
+ * retryRatio tokens, and minRetriesPerSecond tokens are added as time
+ * passes, so that clients with little traffic can still retry; each retry
+ * withdraws one token.  The balance is capped at maxBalance.
+ *
+ * When servers are overloaded and calls fail, retries thus add at most
+ * retryRatio to the load instead of multiplying it.  One budget is meant to
+ * be shared by all clients of a service.
+ */
+class TRetryBudget {
+public:
+  /// Default tokens deposited per call
+  static constexpr double RETRY_RATIO = 0.2;
+
+  /// Default tokens added per second
+  static constexpr double MIN_RETRIES_PER_SECOND = 10;
+
+  /// Default cap on the balance
+  static constexpr double MAX_BALANCE = 20;
+
+  TRetryBudget(double retryRatio = RETRY_RATIO,
+               double minRetriesPerSecond = MIN_RETRIES_PER_SECOND,
+               double maxBalance = MAX_BALANCE);
+
+  /**
+   * Account for a call sent for the first time.
+   */
+  void deposit();
+
+  /**
+   * Take a token for sending a call again.
+   *
+   * @return false if the budget is spent, and the call must not be sent.
+   */
+  bool tryWithdraw();
+
+  /**
+   * Returns the tokens currently available.
+   */
+  double getBalance();
+
+  /**
+   * Returns how many retries were refused so far.
+   */
+  uint64_t getNumRejected() const;
+
+private:
+  /// Add the tokens earned since the last refill, under the lock.
+  void refill();
+
+  mutable concurrency::Mutex mutex_;
+  double retryRatio_;
+  double minRetriesPerSecond_;
+  double maxBalance_;
+  double balance_;
+  std::chrono::steady_clock::time_point lastRefill_;
+  uint64_t rejected_;
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TRETRYBUDGET_H_
@@ -20,6 +20,8 @@
 #include <thrift/thrift-config.h>
 
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <errno.h>
 #include <memory>
 #include <string>
@@ -49,9 +51,16 @@
 #include <openssl/engine.h>
 #endif
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #include <thrift/concurrency/Mutex.h>
 #include <thrift/transport/TSSLSocket.h>
 #include <thrift/transport/PlatformSocket.h>
@@ -178,6 +187,161 @@ static void buildErrors(string& message, int errno_copy = 0, int sslerrno = 0);
 static bool matchName(const char* host, const char* pattern, int size);
 static char uppercase(char c);
 
+static void upRefSession(SSL_SESSION* session) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+  SSL_SESSION_up_ref(session);
+#else
+  CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#endif
+}
+
+static bool isResumable(SSL_SESSION* session) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000
+  if (!SSL_SESSION_is_resumable(session)) {
+    return false;
+  }
+#endif
+  return time(nullptr) < SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+}
+
+static bool isSingleUse(SSL_SESSION* session) {
+#ifdef TLS1_3_VERSION
+  return SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION;
+#else
+  (void)session;
+  return false;
+#endif
+}
+
+/**
+ * Keys a TSSLSocketFactory encrypts session tickets with, newest first.
+ * The SSL_CTX owns them, for ticketKeyCallback() to find for as long as
+ * any socket uses the context, and frees them with itself.
+ */
+class TSSLTicketKeys {
+public:
+  struct Key {
+    unsigned char name[16];
+    unsigned char hmacKey[32];
+    unsigned char aesKey[32];
+  };
+
+  void add(const uint8_t* material) {
+    Key key;
+    std::memcpy(key.name, material, sizeof(key.name));
+    std::memcpy(key.hmacKey, material + sizeof(key.name), sizeof(key.hmacKey));
+    std::memcpy(key.aesKey, material + sizeof(key.name) + sizeof(key.hmacKey), sizeof(key.aesKey));
+    Guard guard(mutex_);
+    keys_.push_front(key);
+    if (keys_.size() > TSSLSocketFactory::MAX_TICKET_KEYS) {
+      keys_.pop_back();
+    }
+  }
+
+  bool current(Key& key) const {
+    Guard guard(mutex_);
+    if (keys_.empty()) {
+      return false;
+    }
+    key = keys_.front();
+    return true;
+  }
+
+  bool find(const unsigned char* name, Key& key, bool& isCurrent) const {
+    Guard guard(mutex_);
+    for (size_t i = 0; i < keys_.size(); ++i) {
+      if (std::memcmp(keys_[i].name, name, sizeof(key.name)) == 0) {
+        key = keys_[i];
+        isCurrent = i == 0;
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  mutable Mutex mutex_;
+  std::deque<Key> keys_;
+};
+
+static void freeTicketKeys(void* /* parent */,
+                           void* ptr,
+                           CRYPTO_EX_DATA* /* ad */,
+                           int /* idx */,
+                           long /* argl */,
+                           void* /* argp */) {
+  delete static_cast<TSSLTicketKeys*>(ptr);
+}
+
+static int ticketKeysIndex() {
+  static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, freeTicketKeys);
+  return index;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticketKeyCallback(SSL* ssl,
+                             unsigned char* name,
+                             unsigned char* iv,
+                             EVP_CIPHER_CTX* cctx,
+                             EVP_MAC_CTX* hctx,
+                             int enc) {
+#else
+static int ticketKeyCallback(SSL* ssl,
+                             unsigned char* name,
+                             unsigned char* iv,
+                             EVP_CIPHER_CTX* cctx,
+                             HMAC_CTX* hctx,
+                             int enc) {
+#endif
+  auto* keys = static_cast<TSSLTicketKeys*>(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ticketKeysIndex()));
+  if (keys == nullptr) {
+    // no keys to use: issue no tickets and make full handshakes
+    return 0;
+  }
+  TSSLTicketKeys::Key key;
+  // 1 to use the ticket, 2 to use it and send a new one
+  int rc = 1;
+  if (enc) {
+    if (!keys->current(key) || RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+      return -1;
+    }
+    std::memcpy(name, key.name, sizeof(key.name));
+    if (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aesKey, iv) != 1) {
+      return -1;
+    }
+  } else {
+    bool isCurrent = false;
+    if (!keys->find(name, key, isCurrent)) {
+      return 0;
+    }
+    if (EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aesKey, iv) != 1) {
+      return -1;
+    }
+    rc = isCurrent ? 1 : 2;
+#ifdef TLS1_3_VERSION
+    // TLS 1.3 tickets are used once, so the client needs a new one
+    if (SSL_version(ssl) == TLS1_3_VERSION) {
+      rc = 2;
+    }
+#endif
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[3];
+  params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmacKey, sizeof(key.hmacKey));
+  params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0);
+  params[2] = OSSL_PARAM_construct_end();
+  if (EVP_MAC_CTX_set_params(hctx, params) != 1) {
+    return -1;
+  }
+#else
+  if (HMAC_Init_ex(hctx, key.hmacKey, sizeof(key.hmacKey), EVP_sha256(), nullptr) != 1) {
+    return -1;
+  }
+#endif
+  return rc;
+}
+
 // SSLContext implementation
 SSLContext::SSLContext(const SSLProtocol& protocol) {
   if (protocol == SSLTLS) {
@@ -236,6 +400,110 @@ SSL* SSLContext::createSSL() {
   return ssl;
 }
 
+// TSSLSessionCache implementation
+TSSLSessionCache::TSSLSessionCache(size_t maxEntries)
+  : maxEntries_(maxEntries > 0 ? maxEntries : 1), hits_(0), misses_(0) {
+}
+
+TSSLSessionCache::~TSSLSessionCache() {
+  clear();
+}
+
+SSL_SESSION* TSSLSessionCache::get(const string& host, int port) {
+  Guard guard(mutex_);
+  auto it = entries_.find(Key(host, port));
+  if (it != entries_.end() && !isResumable(it->second.session)) {
+    SSL_SESSION_free(it->second.session);
+    entries_.erase(it);
+    it = entries_.end();
+  }
+  if (it == entries_.end()) {
+    ++misses_;
+    return nullptr;
+  }
+  ++hits_;
+  SSL_SESSION* session = it->second.session;
+  if (isSingleUse(session)) {
+    // hand the cache's reference over
+    entries_.erase(it);
+  } else {
+    upRefSession(session);
+  }
+  return session;
+}
+
+void TSSLSessionCache::put(const string& host, int port, SSL_SESSION* session) {
+  if (session == nullptr || !isResumable(session)) {
+    return;
+  }
+  upRefSession(session);
+  Guard guard(mutex_);
+  Key key(host, port);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    SSL_SESSION_free(it->second.session);
+  } else if (entries_.size() >= maxEntries_) {
+    evict();
+  }
+  Entry& entry = entries_[key];
+  entry.session = session;
+  entry.stored = std::chrono::steady_clock::now();
+}
+
+void TSSLSessionCache::invalidate(const string& host, int port) {
+  Guard guard(mutex_);
+  auto it = entries_.find(Key(host, port));
+  if (it != entries_.end()) {
+    SSL_SESSION_free(it->second.session);
+    entries_.erase(it);
+  }
+}
+
+void TSSLSessionCache::clear() {
+  Guard guard(mutex_);
+  for (auto& entry : entries_) {
+    SSL_SESSION_free(entry.second.session);
+  }
+  entries_.clear();
+}
+
+size_t TSSLSessionCache::size() const {
+  Guard guard(mutex_);
+  return entries_.size();
+}
+
+uint64_t TSSLSessionCache::getNumHits() const {
+  Guard guard(mutex_);
+  return hits_;
+}
+
+uint64_t TSSLSessionCache::getNumMisses() const {
+  Guard guard(mutex_);
+  return misses_;
+}
+
+void TSSLSessionCache::evict() {
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (!isResumable(it->second.session)) {
+      SSL_SESSION_free(it->second.session);
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (entries_.size() < maxEntries_) {
+    return;
+  }
+  auto oldest = entries_.begin();
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->second.stored < oldest->second.stored) {
+      oldest = it;
+    }
+  }
+  SSL_SESSION_free(oldest->second.session);
+  entries_.erase(oldest);
+}
+
 // TSSLSocket implementation
 TSSLSocket::TSSLSocket(std::shared_ptr<SSLContext> ctx, std::shared_ptr<TConfiguration> config)
   : TSocket(config), server_(false), ssl_(nullptr), ctx_(ctx) {
@@ -291,6 +559,9 @@ void TSSLSocket::init() {
   handshakeCompleted_ = false;
   readRetryCount_ = 0;
   eventSafe_ = false;
+  kernelTls_ = false;
+  kernelTlsSend_ = false;
+  kernelTlsRecv_ = false;
 }
 
 bool TSSLSocket::isOpen() const {
@@ -405,6 +676,8 @@ void TSSLSocket::close() {
     SSL_free(ssl_);
     ssl_ = nullptr;
     handshakeCompleted_ = false;
+    kernelTlsSend_ = false;
+    kernelTlsRecv_ = false;
 #if OPENSSL_VERSION_NUMBER >= 0x10100000
     // Do nothing unless an openssl derivative is detected
 #  if !defined(OPENSSL_IS_BORINGSSL) && !defined(OPENSSL_IS_AWSLC)
@@ -509,6 +782,10 @@ void TSSLSocket::write(const uint8_t* buf, uint32_t len) {
   initializeHandshake();
   if (!checkHandshake())
     return;
+  if (kernelTlsSend_) {
+    writeKernelTls(buf, len);
+    return;
+  }
   // loop in case SSL_MODE_ENABLE_PARTIAL_WRITE is set in SSL_CTX.
   uint32_t written = 0;
   while (written < len) {
@@ -554,6 +831,9 @@ uint32_t TSSLSocket::write_partial(const uint8_t* buf, uint32_t len) {
   initializeHandshake();
   if (!checkHandshake())
     return 0;
+  if (kernelTlsSend_) {
+    return writeKernelTls(buf, len);
+  }
   // loop in case SSL_MODE_ENABLE_PARTIAL_WRITE is set in SSL_CTX.
   uint32_t written = 0;
   while (written < len) {
@@ -590,6 +870,23 @@ uint32_t TSSLSocket::write_partial(const uint8_t* buf, uint32_t len) {
   return written;
 }
 
+uint32_t TSSLSocket::writeKernelTls(const uint8_t* buf, uint32_t len) {
+  uint32_t written = 0;
+  while (written < len) {
+    // the socket is non-blocking since the handshake
+    uint32_t bytes = TSocket::write_partial(&buf[written], len - written);
+    if (bytes == 0) {
+      if (isLibeventSafe()) {
+        break;
+      }
+      waitForEvent(false);
+      continue;
+    }
+    written += bytes;
+  }
+  return written;
+}
+
 void TSSLSocket::flush() {
   resetConsumedMessageSize();
   // Don't throw exception if not open. Thrift servers close socket twice.
@@ -619,11 +916,18 @@ void TSSLSocket::initializeHandshakeParams() {
     TOutput::instance().perror("thriftServerEventHandler: set THRIFT_O_NONBLOCK (THRIFT_FCNTL) ",
                         THRIFT_GET_SOCKET_ERROR);
     ::THRIFT_CLOSESOCKET(socket_);
+    socket_ = THRIFT_INVALID_SOCKET;
     return;
   }
   ssl_ = ctx_->createSSL();
 
   SSL_set_fd(ssl_, static_cast<int>(socket_));
+  SSL_set_app_data(ssl_, this);
+#ifdef SSL_OP_ENABLE_KTLS
+  if (kernelTls_) {
+    SSL_set_options(ssl_, SSL_OP_ENABLE_KTLS);
+  }
+#endif
 }
 
 bool TSSLSocket::checkHandshake() {
@@ -640,6 +944,10 @@ void TSSLSocket::initializeHandshake() {
 
   if (ssl_ == nullptr) {
     initializeHandshakeParams();
+    // it closes the socket if it cannot set it up
+    if (ssl_ == nullptr || !TSocket::isOpen()) {
+      throw TTransportException(TTransportException::NOT_OPEN, "SSL handshake setup failed");
+    }
   }
 
   int rc;
@@ -679,6 +987,14 @@ void TSSLSocket::initializeHandshake() {
       // set the SNI hostname
       SSL_set_tlsext_host_name(ssl_, getHost().c_str());
     #endif
+    // offer a cached session, unless the handshake is already under way
+    if (sessionCache_ != nullptr && SSL_get_session(ssl_) == nullptr) {
+      SSL_SESSION* session = sessionCache_->get(getHost(), getPort());
+      if (session != nullptr) {
+        SSL_set_session(ssl_, session);
+        SSL_SESSION_free(session);
+      }
+    }
     do {
       rc = SSL_connect(ssl_);
       if (rc <= 0) {
@@ -708,15 +1024,86 @@ void TSSLSocket::initializeHandshake() {
     } while (rc == 2);
   }
   if (rc <= 0) {
+    if (!server() && sessionCache_ != nullptr) {
+      sessionCache_->invalidate(getHost(), getPort());
+    }
     string fname(server() ? "SSL_accept" : "SSL_connect");
     string errors;
     buildErrors(errors, errno_copy, error);
     throw TSSLException(fname + ": " + errors);
   }
   authorize();
+#ifdef BIO_get_ktls_send
+  // OpenSSL falls back to user space on its own if the kernel refuses
+  if (kernelTls_) {
+    kernelTlsSend_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+    kernelTlsRecv_ = BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+  }
+#endif
+  if (handshakeCounters_ != nullptr) {
+    if (SSL_session_reused(ssl_)) {
+      ++handshakeCounters_->resumed;
+    } else {
+      ++handshakeCounters_->full;
+    }
+  }
   handshakeCompleted_ = true;
 }
 
+void TSSLSocket::handshake(int timeoutMs) {
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+                                                   + std::chrono::milliseconds(timeoutMs);
+  for (;;) {
+    initializeHandshake();
+    if (checkHandshake()) {
+      return;
+    }
+
+    // a libevent safe socket returns whenever it has to wait for the peer
+    int timeout = -1;
+    if (timeoutMs > 0) {
+      timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     deadline - std::chrono::steady_clock::now()).count());
+      if (timeout <= 0) {
+        throw TTransportException(TTransportException::TIMED_OUT, "SSL handshake timed out");
+      }
+    }
+    struct THRIFT_POLLFD fds[2];
+    memset(fds, 0, sizeof(fds));
+    fds[0].fd = socket_;
+    fds[0].events = SSL_want_write(ssl_) ? THRIFT_POLLOUT : THRIFT_POLLIN;
+    if (interruptListener_) {
+      fds[1].fd = *(interruptListener_.get());
+      fds[1].events = THRIFT_POLLIN;
+    }
+    int ret = THRIFT_POLL(fds, interruptListener_ ? 2 : 1, timeout);
+    if (ret < 0) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      if (errno_copy == THRIFT_EINTR) {
+        continue;
+      }
+      TOutput::instance().perror("TSSLSocket::handshake THRIFT_POLL() ", errno_copy);
+      throw TTransportException(TTransportException::UNKNOWN, "Unknown", errno_copy);
+    }
+    if (ret > 0 && (fds[1].revents & THRIFT_POLLIN)) {
+      throw TTransportException(TTransportException::INTERRUPTED, "Interrupted");
+    }
+  }
+}
+
+bool TSSLSocket::sessionReused() const {
+  return handshakeCompleted_ && ssl_ != nullptr && SSL_session_reused(ssl_);
+}
+
+int TSSLSocket::newSessionCallback(SSL* ssl, SSL_SESSION* session) {
+  auto* socket = static_cast<TSSLSocket*>(SSL_get_app_data(ssl));
+  if (socket != nullptr && !socket->server() && socket->sessionCache_ != nullptr) {
+    socket->sessionCache_->put(socket->getHost(), socket->getPort(), session);
+  }
+  // the cache took its own reference, if any
+  return 0;
+}
+
 void TSSLSocket::authorize() {
   long rc = SSL_get_verify_result(ssl_);
   if (rc != X509_V_OK) { // verify authentication result
@@ -890,7 +1277,11 @@ Mutex TSSLSocketFactory::mutex_;
 bool TSSLSocketFactory::manualOpenSSLInitialization_ = false;
 bool TSSLSocketFactory::didWeInitializeOpenSSL_ = false;
 
-TSSLSocketFactory::TSSLSocketFactory(SSLProtocol protocol) : server_(false) {
+TSSLSocketFactory::TSSLSocketFactory(SSLProtocol protocol)
+  : server_(false),
+    kernelTls_(false),
+    ticketKeys_(nullptr),
+    handshakeCounters_(std::make_shared<TSSLHandshakeCounters>()) {
   initializeOpenSSLState();
   try {
     ctx_ = std::make_shared<SSLContext>(protocol);
@@ -900,7 +1291,11 @@ TSSLSocketFactory::TSSLSocketFactory(SSLProtocol protocol) : server_(false) {
   }
 }
 
-TSSLSocketFactory::TSSLSocketFactory(const SSLContextFactory& contextFactory) : server_(false) {
+TSSLSocketFactory::TSSLSocketFactory(const SSLContextFactory& contextFactory)
+  : server_(false),
+    kernelTls_(false),
+    ticketKeys_(nullptr),
+    handshakeCounters_(std::make_shared<TSSLHandshakeCounters>()) {
   if (!contextFactory) {
     throw TSSLException("SSLContextFactory must not be empty");
   }
@@ -990,6 +1385,79 @@ void TSSLSocketFactory::setup(std::shared_ptr<TSSLSocket> ssl) {
   if (access_ != nullptr) {
     ssl->access(access_);
   }
+  if (!server()) {
+    ssl->setSessionCache(sessionCache_);
+  }
+  ssl->handshakeCounters_ = handshakeCounters_;
+  ssl->setKernelTls(kernelTls_);
+}
+
+void TSSLSocketFactory::setSessionCache(std::shared_ptr<TSSLSessionCache> cache) {
+  const long clientModes = SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE;
+  long mode = SSL_CTX_get_session_cache_mode(ctx_->get());
+  if (cache != nullptr) {
+    // sessions go to the callback only, and are looked up by TSSLSocket
+    SSL_CTX_set_session_cache_mode(ctx_->get(), mode | clientModes);
+    SSL_CTX_sess_set_new_cb(ctx_->get(), TSSLSocket::newSessionCallback);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx_->get(), mode & ~clientModes);
+    SSL_CTX_sess_set_new_cb(ctx_->get(), nullptr);
+  }
+  sessionCache_ = cache;
+}
+
+void TSSLSocketFactory::enableSessionTickets(long lifetimeSeconds, size_t numTickets) {
+  SSL_CTX* ctx = ctx_->get();
+  SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+  SSL_CTX_set_timeout(ctx, lifetimeSeconds);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000 && !defined(OPENSSL_IS_BORINGSSL)
+  SSL_CTX_set_num_tickets(ctx, numTickets);
+#else
+  (void)numTickets;
+#endif
+  if (ticketKeys_ == nullptr) {
+    rotateSessionTicketKey();
+  }
+}
+
+void TSSLSocketFactory::disableSessionTickets() {
+  SSL_CTX_set_options(ctx_->get(), SSL_OP_NO_TICKET);
+}
+
+void TSSLSocketFactory::rotateSessionTicketKey() {
+  uint8_t key[TICKET_KEY_SIZE];
+  if (RAND_bytes(key, sizeof(key)) != 1) {
+    string errors;
+    buildErrors(errors);
+    throw TSSLException("RAND_bytes: " + errors);
+  }
+  addTicketKey(key);
+  OPENSSL_cleanse(key, sizeof(key));
+}
+
+void TSSLSocketFactory::rotateSessionTicketKey(const uint8_t* key, size_t len) {
+  if (key == nullptr || len != TICKET_KEY_SIZE) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "rotateSessionTicketKey: <key> must be TICKET_KEY_SIZE bytes");
+  }
+  addTicketKey(key);
+}
+
+void TSSLSocketFactory::addTicketKey(const uint8_t* key) {
+  if (ticketKeys_ == nullptr) {
+    // factories sharing a context share its keys
+    ticketKeys_ = static_cast<TSSLTicketKeys*>(SSL_CTX_get_ex_data(ctx_->get(), ticketKeysIndex()));
+  }
+  if (ticketKeys_ == nullptr) {
+    ticketKeys_ = new TSSLTicketKeys();
+    SSL_CTX_set_ex_data(ctx_->get(), ticketKeysIndex(), ticketKeys_);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx_->get(), ticketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx_->get(), ticketKeyCallback);
+#endif
+  }
+  ticketKeys_->add(key);
 }
 
 void TSSLSocketFactory::ciphers(const string& enable) {
@@ -1008,6 +1476,9 @@ void TSSLSocketFactory::authenticate(bool required) {
   int mode;
   if (required) {
     mode = SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT | SSL_VERIFY_CLIENT_ONCE;
+    // servers refuse to resume sessions of verified peers without one
+    static const unsigned char sessionIdContext[] = "thrift";
+    SSL_CTX_set_session_id_context(ctx_->get(), sessionIdContext, sizeof(sessionIdContext) - 1);
   } else {
     mode = SSL_VERIFY_NONE;
   }
@@ -23,9 +23,13 @@
 // Put this first to avoid WIN32 build failure
 #include <thrift/transport/TSocket.h>
 
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <map>
 #include <openssl/ssl.h>
 #include <string>
+#include <thrift/TNonCopyable.h>
 #include <thrift/concurrency/Mutex.h>
 
 namespace apache {
@@ -34,6 +38,8 @@ namespace transport {
 
 class AccessManager;
 class SSLContext;
+class TSSLSessionCache;
+class TSSLTicketKeys;
 typedef std::function<std::shared_ptr<SSLContext>()> SSLContextFactory;
 
 enum SSLProtocol {
@@ -66,6 +72,17 @@ void initializeOpenSSL();
  */
 void cleanupOpenSSL();
 
+/**
+ * # of handshakes the sockets of a TSSLSocketFactory completed, shared with
+ * the sockets so that they can outlive it.
+ */
+struct TSSLHandshakeCounters {
+  TSSLHandshakeCounters() : full(0), resumed(0) {}
+
+  std::atomic<uint64_t> full;
+  std::atomic<uint64_t> resumed;
+};
+
 /**
  * OpenSSL implementation for SSL socket interface.
  */
@@ -108,6 +125,37 @@ public:
    * Determines whether SSL Socket is libevent safe or not.
    */
   bool isLibeventSafe() const { return eventSafe_; }
+  /**
+   * Whether the handshake resumed an earlier session instead of being a full
+   * one.  False until the handshake completes.
+   */
+  bool sessionReused() const;
+  /**
+   * Set the cache to resume sessions of client sockets from, and to store
+   * their new sessions into.
+   */
+  void setSessionCache(std::shared_ptr<TSSLSessionCache> cache) { sessionCache_ = cache; }
+  /**
+   * Have OpenSSL hand the record layer over to the kernel (kTLS) once the
+   * handshake is done, so that writes go straight to the socket and reads
+   * are decrypted by the kernel.  Where the kernel, the OpenSSL build or
+   * the negotiated cipher do not support it, the socket keeps encrypting in
+   * user space.  It must be set before the handshake.
+   */
+  void setKernelTls(bool enable) { kernelTls_ = enable; }
+  bool getKernelTls() const { return kernelTls_; }
+  /// Whether the kernel encrypts what is written, bypassing OpenSSL
+  bool isKernelTlsSend() const { return kernelTlsSend_; }
+  /// Whether the kernel decrypts what SSL_read() reads
+  bool isKernelTlsRecv() const { return kernelTlsRecv_; }
+  bool canSendDirectly() const override { return kernelTlsSend_; }
+  bool hasPendingHandshake() const override { return !handshakeCompleted_; }
+  /**
+   * Run the handshake to its end.  A libevent safe socket waits for the
+   * peer in between steps for at most timeoutMs altogether; any other
+   * socket waits as its receive and send timeouts allow.
+   */
+  void handshake(int timeoutMs) override;
 
 protected:
   /**
@@ -177,14 +225,29 @@ protected:
   SSL* ssl_;
   std::shared_ptr<SSLContext> ctx_;
   std::shared_ptr<AccessManager> access_;
+  std::shared_ptr<TSSLSessionCache> sessionCache_;
+  std::shared_ptr<TSSLHandshakeCounters> handshakeCounters_;
   friend class TSSLSocketFactory;
 
 private:
   bool handshakeCompleted_;
   int readRetryCount_;
   bool eventSafe_;
+  bool kernelTls_;
+  bool kernelTlsSend_;
+  bool kernelTlsRecv_;
 
   void init();
+  /**
+   * Write to the socket the kernel encrypts.  Returns early, like SSL_write
+   * would, only if the socket is libevent safe and the write would block.
+   */
+  uint32_t writeKernelTls(const uint8_t* buf, uint32_t len);
+  /**
+   * Called by OpenSSL with every session a client socket gets: at the end of
+   * TLS 1.2 handshakes, and with each ticket a TLS 1.3 server sends after it.
+   */
+  static int newSessionCallback(SSL* ssl, SSL_SESSION* session);
 };
 
 /**
@@ -314,6 +377,59 @@ public:
    * @param manager  The AccessManager instance
    */
   virtual void access(std::shared_ptr<AccessManager> manager) { access_ = manager; }
+  /**
+   * Resume the sessions of client sockets from a cache, which several
+   * factories may share, so that reconnecting to a server skips the
+   * certificate exchange and key agreement of a full handshake.  A session
+   * is looked up by the host and port the socket connects to.
+   *
+   * @param cache  The cache, or nullptr to stop caching sessions
+   */
+  virtual void setSessionCache(std::shared_ptr<TSSLSessionCache> cache);
+  std::shared_ptr<TSSLSessionCache> getSessionCache() const { return sessionCache_; }
+  /**
+   * Enable kernel TLS on the sockets created, see TSSLSocket::setKernelTls().
+   */
+  virtual void setKernelTls(bool enable) { kernelTls_ = enable; }
+  bool getKernelTls() const { return kernelTls_; }
+  /**
+   * Have server sockets issue session tickets encrypted with keys this
+   * factory manages, which rotateSessionTicketKey() replaces, rather than
+   * with the key OpenSSL generates for the context.  Clients resume TLS 1.2
+   * sessions and make TLS 1.3 PSK resumptions with the tickets.
+   *
+   * @param lifetimeSeconds  How long sessions can be resumed for
+   * @param numTickets       # of tickets sent after each TLS 1.3 handshake
+   */
+  virtual void enableSessionTickets(long lifetimeSeconds = 7200, size_t numTickets = 2);
+  /**
+   * Stop issuing session tickets.
+   */
+  virtual void disableSessionTickets();
+  /**
+   * Encrypt new session tickets with a new random key.  Tickets encrypted
+   * with the MAX_TICKET_KEYS - 1 keys before it are still accepted, and
+   * replaced by ones encrypted with the new key.
+   */
+  virtual void rotateSessionTicketKey();
+  /**
+   * Encrypt new session tickets with the given key, so that servers behind
+   * the same address can resume each other's sessions.
+   *
+   * @param key  TICKET_KEY_SIZE bytes: the key name (16), the HMAC key (32)
+   *             and the AES key (32)
+   */
+  virtual void rotateSessionTicketKey(const uint8_t* key, size_t len);
+  /// # of handshakes of sockets of this factory that did not resume a session
+  uint64_t getNumFullHandshakes() const { return handshakeCounters_->full; }
+  /// # of handshakes of sockets of this factory that resumed a session
+  uint64_t getNumResumedHandshakes() const { return handshakeCounters_->resumed; }
+
+  /// Size of the key material rotateSessionTicketKey() takes
+  static const size_t TICKET_KEY_SIZE = 80;
+
+  /// # of session ticket keys accepted, including the one in use
+  static const size_t MAX_TICKET_KEYS = 3;
 
   static void setManualOpenSSLInitialization(bool manualOpenSSLInitialization);
 
@@ -331,7 +447,12 @@ protected:
 
 private:
   bool server_;
+  bool kernelTls_;
   std::shared_ptr<AccessManager> access_;
+  std::shared_ptr<TSSLSessionCache> sessionCache_;
+  /// Owned by the context, which outlives the factory while sockets use it
+  TSSLTicketKeys* ticketKeys_;
+  std::shared_ptr<TSSLHandshakeCounters> handshakeCounters_;
   static concurrency::Mutex mutex_;
   static uint64_t count_;
   static bool manualOpenSSLInitialization_;
@@ -339,6 +460,7 @@ private:
   void initializeOpenSSLState();
   void cleanupOpenSSLState();
   void setup(std::shared_ptr<TSSLSocket> ssl);
+  void addTicketKey(const uint8_t* key);
   static int passwordCallback(char* password, int size, int, void* data);
 };
 
@@ -388,6 +510,73 @@ private:
   SSL_CTX* ctx_;
 };
 
+/**
+ * Sessions of client TSSLSockets, by the host and port they connected to,
+ * that sockets connecting there again resume instead of making a full
+ * handshake.  It is safe to share between threads and factories.  Expired
+ * sessions are dropped when looked up, and the oldest ones when the cache
+ * is full.  TLS 1.3 sessions are taken out of the cache when handed out,
+ * as a ticket should only be used once; the server sends new ones on every
+ * connection.
+ */
+class TSSLSessionCache : apache::thrift::TNonCopyable {
+public:
+  /// Default # of sessions cached
+  static const size_t DEFAULT_MAX_ENTRIES = 1024;
+
+  TSSLSessionCache(size_t maxEntries = DEFAULT_MAX_ENTRIES);
+  ~TSSLSessionCache();
+
+  /**
+   * Returns the session cached for host and port, or nullptr.  The caller
+   * owns a reference to it, to release with SSL_SESSION_free().
+   */
+  SSL_SESSION* get(const std::string& host, int port);
+
+  /**
+   * Cache session for host and port, replacing any cached before.  The cache
+   * takes its own reference to it.
+   */
+  void put(const std::string& host, int port, SSL_SESSION* session);
+
+  /**
+   * Drop the session cached for host and port, e.g. because resuming it
+   * failed.
+   */
+  void invalidate(const std::string& host, int port);
+
+  /**
+   * Drop every session.
+   */
+  void clear();
+
+  /// # of sessions cached
+  size_t size() const;
+
+  /// # of lookups that returned a session
+  uint64_t getNumHits() const;
+
+  /// # of lookups that found none
+  uint64_t getNumMisses() const;
+
+private:
+  typedef std::pair<std::string, int> Key;
+
+  struct Entry {
+    SSL_SESSION* session;
+    std::chrono::steady_clock::time_point stored;
+  };
+
+  /// Make room for one more entry, under the lock.
+  void evict();
+
+  mutable concurrency::Mutex mutex_;
+  std::map<Key, Entry> entries_;
+  size_t maxEntries_;
+  uint64_t hits_;
+  uint64_t misses_;
+};
+
 /**
  * Callback interface for access control. It's meant to verify the remote host.
  * It's constructed when application starts and set to TSSLSocketFactory
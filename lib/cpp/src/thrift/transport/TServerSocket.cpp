@@ -401,6 +401,8 @@ void TServerSocket::_setup_tcp_sockopts() {
                               "Could not set TCP_NODELAY",
                               errno_copy);
   }
+
+  tuning_.applyToListener(serverSocket_);
 }
 
 void TServerSocket::listen() {
@@ -431,6 +433,7 @@ void TServerSocket::listen() {
     pChildInterruptSockReader_
         = std::shared_ptr<THRIFT_SOCKET>(new THRIFT_SOCKET(sv[0]), destroyer_of_fine_sockets);
   }
+  childInterrupter_ = std::make_shared<TSocketInterrupter>();
 
 
   // Validate port number
@@ -725,6 +728,9 @@ shared_ptr<TTransport> TServerSocket::acceptImpl() {
   if (keepAlive_) {
     client->setKeepAlive(keepAlive_);
   }
+  if (tuning_.isSet()) {
+    client->setSocketTuning(tuning_);
+  }
   client->setCachedAddress((sockaddr*)&clientAddress, size);
 
   if (acceptCallback_)
@@ -735,7 +741,12 @@ shared_ptr<TTransport> TServerSocket::acceptImpl() {
 
 shared_ptr<TSocket> TServerSocket::createSocket(THRIFT_SOCKET clientSocket) {
   if (interruptableChildren_) {
-    return std::make_shared<TSocket>(clientSocket, pChildInterruptSockReader_);
+    shared_ptr<TSocket> client = std::make_shared<TSocket>(clientSocket, pChildInterruptSockReader_);
+#ifndef _WIN32
+    // shutdown() does not wake up a blocked recv() on Windows
+    client->setInterrupter(childInterrupter_);
+#endif
+    return client;
   } else {
     return std::make_shared<TSocket>(clientSocket);
   }
@@ -762,6 +773,9 @@ void TServerSocket::interruptChildren() {
   if (childInterruptSockWriter_ != THRIFT_INVALID_SOCKET) {
     notify(childInterruptSockWriter_);
   }
+  if (childInterrupter_) {
+    childInterrupter_->interrupt();
+  }
 }
 
 void TServerSocket::close() {
@@ -787,6 +801,7 @@ void TServerSocket::close() {
   interruptSockReader_ = THRIFT_INVALID_SOCKET;
   childInterruptSockWriter_ = THRIFT_INVALID_SOCKET;
   pChildInterruptSockReader_.reset();
+  childInterrupter_.reset();
   listening_ = false;
 }
 } // namespace transport
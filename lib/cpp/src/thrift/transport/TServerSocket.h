@@ -25,6 +25,7 @@
 #include <thrift/concurrency/Mutex.h>
 #include <thrift/transport/PlatformSocket.h>
 #include <thrift/transport/TServerTransport.h>
+#include <thrift/transport/TSocketTuning.h>
 
 #include <sys/types.h>
 #ifdef HAVE_SYS_SOCKET_H
@@ -39,6 +40,7 @@ namespace thrift {
 namespace transport {
 
 class TSocket;
+class TSocketInterrupter;
 
 enum class SocketType {
     NONE,
@@ -116,6 +118,11 @@ public:
   void setTcpSendBuffer(int tcpSendBuffer);
   void setTcpRecvBuffer(int tcpRecvBuffer);
 
+  // Low latency options for the listening socket and the accepted ones;
+  // must be called before listen() for the listening socket to get them.
+  void setSocketTuning(const TSocketTuning& tuning) { tuning_ = tuning; }
+  const TSocketTuning& getSocketTuning() const { return tuning_; }
+
   // listenCallback gets called just before listen, and after all Thrift
   // setsockopt calls have been made.  If you have custom setsockopt
   // things that need to happen on the listening socket, this is the place to do it.
@@ -128,13 +135,14 @@ public:
   void setAcceptCallback(const socket_func_t& acceptCallback) { acceptCallback_ = acceptCallback; }
 
   // When enabled (the default), new children TSockets will be constructed so
-  // they can be interrupted by TServerTransport::interruptChildren().
-  // This is more expensive in terms of system calls (poll + recv) however
+  // they can be interrupted by TServerTransport::interruptChildren(), which
   // ensures a connected client cannot interfere with TServer::stop().
+  // Children are interrupted by shutting their receiving side down, so their
+  // reads cost no more than those of other sockets, except on Windows, where
+  // they poll an interrupt socket before every recv.
   //
-  // When disabled, TSocket children do not incur an additional poll() call.
-  // Server-side reads are more efficient, however a client can interfere with
-  // the server's ability to shutdown properly by staying connected.
+  // When disabled, a client can interfere with the server's ability to
+  // shutdown properly by staying connected.
   //
   // Must be called before listen(); mode cannot be switched after that.
   // \throws std::logic_error if listen() has been called
@@ -158,6 +166,7 @@ protected:
   virtual std::shared_ptr<TSocket> createSocket(THRIFT_SOCKET client);
   bool interruptableChildren_;
   std::shared_ptr<THRIFT_SOCKET> pChildInterruptSockReader_; // if interruptableChildren_ this is shared with child TSockets
+  std::shared_ptr<TSocketInterrupter> childInterrupter_;     // if interruptableChildren_ this is shared with child TSockets
 
 private:
   void notify(THRIFT_SOCKET notifySock);
@@ -179,6 +188,7 @@ private:
   int tcpRecvBuffer_;
   bool keepAlive_;
   bool listening_;
+  TSocketTuning tuning_;
 
   concurrency::Mutex rwMutex_;                                 // thread-safe interrupt
   THRIFT_SOCKET interruptSockWriter_;                          // is notified on interrupt()
@@ -19,8 +19,12 @@
 
 #include <thrift/thrift-config.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <sstream>
+#include <typeinfo>
+#include <vector>
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #ifdef __sun
@@ -101,7 +105,9 @@ TSocket::TSocket(const string& host, int port, std::shared_ptr<TConfiguration> c
     lingerOn_(1),
     lingerVal_(0),
     noDelay_(1),
-    maxRecvRetries_(5) {
+    maxRecvRetries_(5),
+    connAttemptDelay_(0),
+    connectStats_() {
 }
 
 TSocket::TSocket(const string& path, std::shared_ptr<TConfiguration> config)
@@ -117,7 +123,9 @@ TSocket::TSocket(const string& path, std::shared_ptr<TConfiguration> config)
     lingerOn_(1),
     lingerVal_(0),
     noDelay_(1),
-    maxRecvRetries_(5) {
+    maxRecvRetries_(5),
+    connAttemptDelay_(0),
+    connectStats_() {
   cachedPeerAddr_.ipv4.sin_family = AF_UNSPEC;
 }
 
@@ -133,7 +141,9 @@ TSocket::TSocket(std::shared_ptr<TConfiguration> config)
     lingerOn_(1),
     lingerVal_(0),
     noDelay_(1),
-    maxRecvRetries_(5) {
+    maxRecvRetries_(5),
+    connAttemptDelay_(0),
+    connectStats_() {
   cachedPeerAddr_.ipv4.sin_family = AF_UNSPEC;
 }
 
@@ -149,7 +159,9 @@ TSocket::TSocket(THRIFT_SOCKET socket, std::shared_ptr<TConfiguration> config)
     lingerOn_(1),
     lingerVal_(0),
     noDelay_(1),
-    maxRecvRetries_(5) {
+    maxRecvRetries_(5),
+    connAttemptDelay_(0),
+    connectStats_() {
   cachedPeerAddr_.ipv4.sin_family = AF_UNSPEC;
 #ifdef SO_NOSIGPIPE
   {
@@ -173,7 +185,9 @@ TSocket::TSocket(THRIFT_SOCKET socket, std::shared_ptr<THRIFT_SOCKET> interruptL
     lingerOn_(1),
     lingerVal_(0),
     noDelay_(1),
-    maxRecvRetries_(5) {
+    maxRecvRetries_(5),
+    connAttemptDelay_(0),
+    connectStats_() {
   cachedPeerAddr_.ipv4.sin_family = AF_UNSPEC;
 #ifdef SO_NOSIGPIPE
   {
@@ -215,7 +229,12 @@ bool TSocket::peek() {
   if (!isOpen()) {
     return false;
   }
-  if (interruptListener_) {
+  if (interrupter_) {
+    // Woken by the interrupter shutting the socket down
+    if (interrupter_->isInterrupted()) {
+      return false;
+    }
+  } else if (interruptListener_) {
     for (int retries = 0;;) {
       struct THRIFT_POLLFD fds[2];
       std::memset(fds, 0, sizeof(fds));
@@ -249,6 +268,9 @@ bool TSocket::peek() {
   // Check to see if data is available or if the remote side closed
   uint8_t buf;
   int r = static_cast<int>(recv(socket_, cast_sockopt(&buf), 1, MSG_PEEK));
+  if (r <= 0 && interrupter_ && interrupter_->isInterrupted()) {
+    return false;
+  }
   if (r == -1) {
     int errno_copy = THRIFT_GET_SOCKET_ERROR;
 #if defined __FreeBSD__ || defined __MACH__
@@ -266,48 +288,37 @@ bool TSocket::peek() {
   return (r > 0);
 }
 
-void TSocket::openConnection(struct addrinfo* res) {
-
-  if (isOpen()) {
-    return;
-  }
-
-  if (isUnixDomainSocket()) {
-    socket_ = socket(PF_UNIX, SOCK_STREAM, IPPROTO_IP);
-  } else {
-    socket_ = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-  }
-
-  if (socket_ == THRIFT_INVALID_SOCKET) {
-    int errno_copy = THRIFT_GET_SOCKET_ERROR;
-    TOutput::instance().perror("TSocket::open() socket() " + getSocketInfo(), errno_copy);
-    throw TTransportException(TTransportException::NOT_OPEN, "socket()", errno_copy);
-  }
+void setGenericTimeout(THRIFT_SOCKET s, int timeout_ms, int optname);
 
+void TSocket::setSocketOptions(THRIFT_SOCKET socket, bool fastOpen) {
   // Send timeout
   if (sendTimeout_ > 0) {
-    setSendTimeout(sendTimeout_);
+    setGenericTimeout(socket, sendTimeout_, SO_SNDTIMEO);
   }
 
   // Recv timeout
   if (recvTimeout_ > 0) {
-    setRecvTimeout(recvTimeout_);
+    setGenericTimeout(socket, recvTimeout_, SO_RCVTIMEO);
   }
 
   if (keepAlive_) {
-    setKeepAlive(keepAlive_);
+    applyKeepAlive(socket);
   }
 
   // Linger
-  setLinger(lingerOn_, lingerVal_);
+  applyLinger(socket);
 
   // No delay
-  setNoDelay(noDelay_);
+  applyNoDelay(socket);
+
+  if (tuning_.isSet() && !isUnixDomainSocket()) {
+    tuning_.applyToSocket(socket, fastOpen);
+  }
 
 #ifdef SO_NOSIGPIPE
   {
     int one = 1;
-    setsockopt(socket_, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
   }
 #endif
 
@@ -315,9 +326,30 @@ void TSocket::openConnection(struct addrinfo* res) {
 #ifdef TCP_LOW_MIN_RTO
   if (getUseLowMinRto()) {
     int one = 1;
-    setsockopt(socket_, IPPROTO_TCP, TCP_LOW_MIN_RTO, &one, sizeof(one));
+    setsockopt(socket, IPPROTO_TCP, TCP_LOW_MIN_RTO, &one, sizeof(one));
   }
 #endif
+}
+
+void TSocket::openConnection(struct addrinfo* res) {
+
+  if (isOpen()) {
+    return;
+  }
+
+  if (isUnixDomainSocket()) {
+    socket_ = socket(PF_UNIX, SOCK_STREAM, IPPROTO_IP);
+  } else {
+    socket_ = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  }
+
+  if (socket_ == THRIFT_INVALID_SOCKET) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    TOutput::instance().perror("TSocket::open() socket() " + getSocketInfo(), errno_copy);
+    throw TTransportException(TTransportException::NOT_OPEN, "socket()", errno_copy);
+  }
+
+  setSocketOptions(socket_, true);
 
   // Set the socket to be non blocking for connect if a timeout exists
   int flags = THRIFT_FCNTL(socket_, THRIFT_F_GETFL, 0);
@@ -448,64 +480,269 @@ void TSocket::local_open() {
     throw TTransportException(TTransportException::BAD_ARGS, "Specified port is invalid");
   }
 
-  struct addrinfo hints, *res, *res0;
-  res = nullptr;
-  res0 = nullptr;
-  int error;
-  char port[sizeof("65535")];
-  std::memset(&hints, 0, sizeof(hints));
-  hints.ai_family = PF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
-  sprintf(port, "%d", port_);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  connectStats_ = ConnectStats();
 
-  error = getaddrinfo(host_.c_str(), port, &hints, &res0);
+  std::shared_ptr<const TDnsCache::Addresses> addresses;
+  try {
+    if (dnsCache_) {
+      addresses = dnsCache_->resolve(host_, port_, &connectStats_.resolvedFromCache);
+    } else {
+      addresses = TDnsCache::lookup(host_, port_);
+    }
+  } catch (TTransportException&) {
+    close();
+    throw;
+  }
 
-  if (
-#ifdef _WIN32
-      error == WSANO_DATA
-#else
-      // to support systems with no ipv4 addresses but using "127.0.0.1" as a hostname
-      // getaddrinfo() fails when AI_ADDRCONFIG is present in this situation...
-      error == EAI_NODATA || error == EAI_ADDRFAMILY
-#endif
-    ) {
-    hints.ai_flags &= ~AI_ADDRCONFIG;
-    error = getaddrinfo(host_.c_str(), port, &hints, &res0);
+  std::chrono::steady_clock::time_point resolved = std::chrono::steady_clock::now();
+  connectStats_.resolveMicros
+      = std::chrono::duration_cast<std::chrono::microseconds>(resolved - start).count();
+
+  try {
+    if (addresses->empty()) {
+      throw TTransportException(TTransportException::NOT_OPEN,
+                                "Could not resolve host for client socket.");
+    }
+    if (connAttemptDelay_ > 0 && addresses->size() > 1) {
+      openParallel(*addresses);
+    } else {
+      // Cycle through all the returned addresses until one
+      // connects or push the exception up.
+      for (size_t i = 0; i < addresses->size(); ++i) {
+        const TResolvedAddress& address = (*addresses)[i];
+        struct addrinfo res;
+        std::memset(&res, 0, sizeof(res));
+        res.ai_family = address.family;
+        res.ai_socktype = address.socktype;
+        res.ai_protocol = address.protocol;
+        res.ai_addr = (struct sockaddr*)&address.addr;
+        res.ai_addrlen = address.addrlen;
+        ++connectStats_.attempts;
+        try {
+          openConnection(&res);
+          break;
+        } catch (TTransportException&) {
+          close();
+          if (i + 1 == addresses->size()) {
+            throw;
+          }
+        }
+      }
+    }
+  } catch (TTransportException&) {
+    // The host may have moved, look it up again next time
+    if (dnsCache_) {
+      dnsCache_->invalidate(host_, port_);
+    }
+    throw;
   }
 
-  if (error) {
-    string errStr = "TSocket::open() getaddrinfo() " + getSocketInfo()
-                    + string(THRIFT_GAI_STRERROR(error));
-    TOutput::instance()(errStr.c_str());
-    close();
-    throw TTransportException(TTransportException::NOT_OPEN,
-                              "Could not resolve host for client socket.");
+  connectStats_.connectMicros = std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - resolved).count();
+}
+
+THRIFT_SOCKET TSocket::startConnect(const TResolvedAddress& address, bool& connected, int& error) {
+  connected = false;
+  THRIFT_SOCKET s = socket(address.family, address.socktype, address.protocol);
+  if (s == THRIFT_INVALID_SOCKET) {
+    error = THRIFT_GET_SOCKET_ERROR;
+    return s;
   }
 
-  // Cycle through all the returned addresses until one
-  // connects or push the exception up.
-  for (res = res0; res; res = res->ai_next) {
-    try {
-      openConnection(res);
+  // With TCP_FASTOPEN_CONNECT, connect() returns at once, before the
+  // connection is made, and this attempt would win the race without running it
+  setSocketOptions(s, false);
+
+  int flags = THRIFT_FCNTL(s, THRIFT_F_GETFL, 0);
+  if (-1 == THRIFT_FCNTL(s, THRIFT_F_SETFL, flags | THRIFT_O_NONBLOCK)) {
+    error = THRIFT_GET_SOCKET_ERROR;
+    ::THRIFT_CLOSESOCKET(s);
+    return THRIFT_INVALID_SOCKET;
+  }
+
+  if (connect(s, (const struct sockaddr*)&address.addr, static_cast<int>(address.addrlen)) == 0) {
+    connected = true;
+    return s;
+  }
+  error = THRIFT_GET_SOCKET_ERROR;
+  if (error != THRIFT_EINPROGRESS && error != THRIFT_EWOULDBLOCK) {
+    ::THRIFT_CLOSESOCKET(s);
+    return THRIFT_INVALID_SOCKET;
+  }
+  return s;
+}
+
+void TSocket::openParallel(const TDnsCache::Addresses& addresses) {
+  typedef std::chrono::steady_clock Clock;
+
+  // Alternate between address families, starting with the first one
+  std::vector<const TResolvedAddress*> order;
+  {
+    std::vector<const TResolvedAddress*> first, others;
+    for (const TResolvedAddress& address : addresses) {
+      (address.family == addresses[0].family ? first : others).push_back(&address);
+    }
+    for (size_t i = 0; i < first.size() || i < others.size(); ++i) {
+      if (i < first.size()) {
+        order.push_back(first[i]);
+      }
+      if (i < others.size()) {
+        order.push_back(others[i]);
+      }
+    }
+  }
+
+  struct Attempt {
+    THRIFT_SOCKET socket;
+    const TResolvedAddress* address;
+    Clock::time_point deadline;
+  };
+  std::vector<Attempt> attempts;
+  size_t next = 0;
+  int error = 0;
+  bool timedOut = false;
+  Clock::time_point nextStart = Clock::now();
+  THRIFT_SOCKET winner = THRIFT_INVALID_SOCKET;
+  const TResolvedAddress* winnerAddress = nullptr;
+
+  while (winner == THRIFT_INVALID_SOCKET) {
+    Clock::time_point now = Clock::now();
+
+    if (next < order.size() && (attempts.empty() || now >= nextStart)) {
+      bool connected;
+      ++connectStats_.attempts;
+      THRIFT_SOCKET s = startConnect(*order[next], connected, error);
+      if (connected) {
+        winner = s;
+        winnerAddress = order[next];
+      } else if (s != THRIFT_INVALID_SOCKET) {
+        Attempt attempt = {s,
+                           order[next],
+                           connTimeout_ > 0 ? now + std::chrono::milliseconds(connTimeout_)
+                                            : Clock::time_point::max()};
+        attempts.push_back(attempt);
+      }
+      ++next;
+      nextStart = now + std::chrono::milliseconds(connAttemptDelay_);
+      continue;
+    }
+
+    if (attempts.empty()) {
+      break;
+    }
+
+    // Give up on the attempts that timed out
+    for (size_t i = 0; i < attempts.size();) {
+      if (now >= attempts[i].deadline) {
+        ::THRIFT_CLOSESOCKET(attempts[i].socket);
+        attempts.erase(attempts.begin() + i);
+        timedOut = true;
+      } else {
+        ++i;
+      }
+    }
+    if (attempts.empty()) {
+      continue;
+    }
+
+    Clock::time_point wakeup = next < order.size() ? nextStart : Clock::time_point::max();
+    std::vector<struct THRIFT_POLLFD> fds(attempts.size());
+    for (size_t i = 0; i < attempts.size(); ++i) {
+      std::memset(&fds[i], 0, sizeof(fds[i]));
+      fds[i].fd = attempts[i].socket;
+      fds[i].events = THRIFT_POLLOUT;
+      wakeup = (std::min)(wakeup, attempts[i].deadline);
+    }
+    int timeout = -1;
+    if (wakeup != Clock::time_point::max()) {
+      timeout = static_cast<int>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(wakeup - now).count()) + 1;
+    }
+
+    int ret = THRIFT_POLL(&fds[0], static_cast<int>(fds.size()), timeout);
+    if (ret < 0) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      if (errno_copy == THRIFT_EINTR) {
+        continue;
+      }
+      error = errno_copy;
       break;
-    } catch (TTransportException&) {
-      if (res->ai_next) {
-        close();
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < fds.size(); ++i) {
+      if (fds[i].revents == 0) {
+        attempts[j++] = attempts[i];
+        continue;
+      }
+      int val = 0;
+      socklen_t lon = sizeof(int);
+      if (getsockopt(attempts[i].socket, SOL_SOCKET, SO_ERROR, cast_sockopt(&val), &lon) == -1) {
+        val = THRIFT_GET_SOCKET_ERROR;
+      }
+      if (val == 0 && winner == THRIFT_INVALID_SOCKET) {
+        winner = attempts[i].socket;
+        winnerAddress = attempts[i].address;
       } else {
-        close();
-        freeaddrinfo(res0); // cleanup on failure
-        throw;
+        ::THRIFT_CLOSESOCKET(attempts[i].socket);
+        if (val != 0) {
+          error = val;
+          // Start on the next address right away
+          nextStart = now;
+        }
       }
     }
+    attempts.resize(j);
+  }
+
+  for (const Attempt& attempt : attempts) {
+    if (attempt.socket != winner) {
+      ::THRIFT_CLOSESOCKET(attempt.socket);
+    }
+  }
+
+  if (winner == THRIFT_INVALID_SOCKET) {
+    if (timedOut && error == 0) {
+      string errStr = "TSocket::open() timed out " + getSocketInfo();
+      TOutput::instance()(errStr.c_str());
+      throw TTransportException(TTransportException::NOT_OPEN, "open() timed out");
+    }
+    TOutput::instance().perror("TSocket::open() connect() " + getSocketInfo(), error);
+    throw TTransportException(TTransportException::NOT_OPEN, "connect() failed", error);
+  }
+
+  socket_ = winner;
+  int flags = THRIFT_FCNTL(socket_, THRIFT_F_GETFL, 0);
+  if (-1 == THRIFT_FCNTL(socket_, THRIFT_F_SETFL, flags & ~THRIFT_O_NONBLOCK)) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    TOutput::instance().perror("TSocket::open() THRIFT_FCNTL " + getSocketInfo(), errno_copy);
+    close();
+    throw TTransportException(TTransportException::NOT_OPEN, "THRIFT_FCNTL() failed", errno_copy);
+  }
+  setCachedAddress((const sockaddr*)&winnerAddress->addr, winnerAddress->addrlen);
+}
+
+void TSocket::setSocketTuning(const TSocketTuning& tuning) {
+  tuning_ = tuning;
+  if (socket_ != THRIFT_INVALID_SOCKET && tuning_.isSet() && !isUnixDomainSocket()) {
+    tuning_.applyToSocket(socket_, false);
   }
+}
+
+void TSocket::setDnsCache(std::shared_ptr<TDnsCache> dnsCache) {
+  dnsCache_ = dnsCache;
+}
 
-  // Free address structure memory
-  freeaddrinfo(res0);
+void TSocket::setConnAttemptDelay(int ms) {
+  connAttemptDelay_ = ms;
 }
 
 void TSocket::close() {
   if (socket_ != THRIFT_INVALID_SOCKET) {
+    if (interrupter_) {
+      interrupter_->remove(socket_);
+    }
     shutdown(socket_, THRIFT_SHUT_RDWR);
     ::THRIFT_CLOSESOCKET(socket_);
   }
@@ -517,6 +754,41 @@ void TSocket::setSocketFD(THRIFT_SOCKET socket) {
     close();
   }
   socket_ = socket;
+  if (interrupter_ && socket_ != THRIFT_INVALID_SOCKET) {
+    interrupter_->add(socket_);
+  }
+}
+
+void TSocket::setInterrupter(std::shared_ptr<TSocketInterrupter> interrupter) {
+  if (interrupter_ && socket_ != THRIFT_INVALID_SOCKET) {
+    interrupter_->remove(socket_);
+  }
+  interrupter_ = interrupter;
+  if (interrupter_ && socket_ != THRIFT_INVALID_SOCKET) {
+    interrupter_->add(socket_);
+  }
+}
+
+TSocketInterrupter::TSocketInterrupter() : interrupted_(false) {
+}
+
+void TSocketInterrupter::add(THRIFT_SOCKET socket) {
+  concurrency::Guard g(mutex_);
+  sockets_.insert(socket);
+}
+
+void TSocketInterrupter::remove(THRIFT_SOCKET socket) {
+  concurrency::Guard g(mutex_);
+  sockets_.erase(socket);
+}
+
+void TSocketInterrupter::interrupt() {
+  concurrency::Guard g(mutex_);
+  interrupted_ = true;
+  for (THRIFT_SOCKET socket : sockets_) {
+    // Only the receiving side, so that responses being written still go out
+    shutdown(socket, THRIFT_SHUT_RD);
+  }
 }
 
 uint32_t TSocket::read(uint8_t* buf, uint32_t len) {
@@ -552,7 +824,12 @@ try_again:
 
   int got = 0;
 
-  if (interruptListener_) {
+  if (interrupter_) {
+    // Blocking reads are woken by the interrupter shutting the socket down
+    if (interrupter_->isInterrupted()) {
+      throw TTransportException(TTransportException::INTERRUPTED, "Interrupted");
+    }
+  } else if (interruptListener_) {
     struct THRIFT_POLLFD fds[2];
     std::memset(fds, 0, sizeof(fds));
     fds[0].fd = socket_;
@@ -586,6 +863,10 @@ try_again:
   // THRIFT_GETTIMEOFDAY can change THRIFT_GET_SOCKET_ERROR
   int errno_copy = THRIFT_GET_SOCKET_ERROR;
 
+  if (got <= 0 && interrupter_ && interrupter_->isInterrupted()) {
+    throw TTransportException(TTransportException::INTERRUPTED, "Interrupted");
+  }
+
   // Check for error on read
   if (got < 0) {
     if (errno_copy == THRIFT_EAGAIN) {
@@ -640,6 +921,10 @@ try_again:
     throw TTransportException(TTransportException::UNKNOWN, "Unknown", errno_copy);
   }
 
+  if (got > 0 && tuning_.quickAck) {
+    TSocketTuning::rearmQuickAck(socket_);
+  }
+
   return got;
 }
 
@@ -696,6 +981,19 @@ uint32_t TSocket::write_partial(const uint8_t* buf, uint32_t len) {
   return b;
 }
 
+bool TSocket::canSendDirectly() const {
+  // a subclass may transform what it writes
+  return typeid(*this) == typeid(TSocket);
+}
+
+bool TSocket::hasPendingHandshake() const {
+  return false;
+}
+
+void TSocket::handshake(int timeoutMs) {
+  (void)timeoutMs;
+}
+
 std::string TSocket::getHost() const {
   return host_;
 }
@@ -727,7 +1025,11 @@ void TSocket::setPath(std::string path) {
 void TSocket::setLinger(bool on, int linger) {
   lingerOn_ = on;
   lingerVal_ = linger;
-  if (socket_ == THRIFT_INVALID_SOCKET) {
+  applyLinger(socket_);
+}
+
+void TSocket::applyLinger(THRIFT_SOCKET socket) {
+  if (socket == THRIFT_INVALID_SOCKET) {
     return;
   }
 
@@ -737,7 +1039,7 @@ void TSocket::setLinger(bool on, int linger) {
   struct linger l = {static_cast<u_short>(lingerOn_ ? 1 : 0), static_cast<u_short>(lingerVal_)};
 #endif
 
-  int ret = setsockopt(socket_, SOL_SOCKET, SO_LINGER, cast_sockopt(&l), sizeof(l));
+  int ret = setsockopt(socket, SOL_SOCKET, SO_LINGER, cast_sockopt(&l), sizeof(l));
   if (ret == -1) {
     int errno_copy
         = THRIFT_GET_SOCKET_ERROR; // Copy THRIFT_GET_SOCKET_ERROR because we're allocating memory.
@@ -747,13 +1049,17 @@ void TSocket::setLinger(bool on, int linger) {
 
 void TSocket::setNoDelay(bool noDelay) {
   noDelay_ = noDelay;
-  if (socket_ == THRIFT_INVALID_SOCKET || isUnixDomainSocket()) {
+  applyNoDelay(socket_);
+}
+
+void TSocket::applyNoDelay(THRIFT_SOCKET socket) {
+  if (socket == THRIFT_INVALID_SOCKET || isUnixDomainSocket()) {
     return;
   }
 
   // Set socket to NODELAY
   int v = noDelay_ ? 1 : 0;
-  int ret = setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, cast_sockopt(&v), sizeof(v));
+  int ret = setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, cast_sockopt(&v), sizeof(v));
   if (ret == -1) {
     int errno_copy
         = THRIFT_GET_SOCKET_ERROR; // Copy THRIFT_GET_SOCKET_ERROR because we're allocating memory.
@@ -803,8 +1109,11 @@ void TSocket::setSendTimeout(int ms) {
 
 void TSocket::setKeepAlive(bool keepAlive) {
   keepAlive_ = keepAlive;
+  applyKeepAlive(socket_);
+}
 
-  if (socket_ == THRIFT_INVALID_SOCKET) {
+void TSocket::applyKeepAlive(THRIFT_SOCKET socket) {
+  if (socket == THRIFT_INVALID_SOCKET) {
     return;
   }
 
@@ -817,7 +1126,7 @@ void TSocket::setKeepAlive(bool keepAlive) {
 
   int value = keepAlive_;
   int ret
-      = setsockopt(socket_, SOL_SOCKET, SO_KEEPALIVE, const_cast_sockopt(&value), sizeof(value));
+      = setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, const_cast_sockopt(&value), sizeof(value));
 
   if (ret == -1) {
     int errno_copy
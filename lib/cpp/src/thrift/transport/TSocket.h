@@ -20,8 +20,16 @@
 #ifndef _THRIFT_TRANSPORT_TSOCKET_H_
 #define _THRIFT_TRANSPORT_TSOCKET_H_ 1
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <set>
 #include <string>
 
+#include <thrift/concurrency/Mutex.h>
+
+#include <thrift/transport/TDnsCache.h>
+#include <thrift/transport/TSocketTuning.h>
 #include <thrift/transport/TTransport.h>
 #include <thrift/transport/TVirtualTransport.h>
 #include <thrift/transport/TServerSocket.h>
@@ -41,6 +49,29 @@ namespace apache {
 namespace thrift {
 namespace transport {
 
+/**
+ * Interrupts the blocking reads of a group of sockets by shutting down
+ * their receiving side, so that, unlike with an interrupt listener, they
+ * need not poll before every read.  Once interrupted, reads of the sockets
+ * in the group, and of those added later, throw INTERRUPTED.
+ */
+class TSocketInterrupter {
+public:
+  TSocketInterrupter();
+
+  void add(THRIFT_SOCKET socket);
+  void remove(THRIFT_SOCKET socket);
+
+  void interrupt();
+
+  bool isInterrupted() const { return interrupted_; }
+
+private:
+  concurrency::Mutex mutex_;
+  std::set<THRIFT_SOCKET> sockets_;
+  std::atomic<bool> interrupted_;
+};
+
 /**
  * TCP Socket implementation of the TTransport interface.
  *
@@ -228,6 +259,54 @@ public:
    */
   void setKeepAlive(bool keepAlive);
 
+  /**
+   * Set the low latency options of TSocketTuning, on the socket if it is
+   * open and on the sockets opened from now on.
+   */
+  void setSocketTuning(const TSocketTuning& tuning);
+
+  const TSocketTuning& getSocketTuning() const { return tuning_; }
+
+  /**
+   * Look the host up in dnsCache, shared with other sockets, instead of
+   * calling getaddrinfo() on every open().  The cached addresses are dropped
+   * when none of them can be connected to.  No cache is used by default.
+   */
+  void setDnsCache(std::shared_ptr<TDnsCache> dnsCache);
+
+  std::shared_ptr<TDnsCache> getDnsCache() const { return dnsCache_; }
+
+  /**
+   * Connect to the addresses of the host in parallel, as in "Happy
+   * Eyeballs" (RFC 8305): whenever the connections started have not been
+   * made within ms milliseconds, or have all failed, one to the next address
+   * is started, alternating between address families, and the first to be
+   * made is kept.  Each connection still times out after the connect
+   * timeout.  0, the default, tries one address after the other.
+   *
+   * Connections made in parallel do not use TSocketTuning::fastOpen, as
+   * connect() would return before knowing whether the connection can be made.
+   */
+  void setConnAttemptDelay(int ms);
+
+  int getConnAttemptDelay() const { return connAttemptDelay_; }
+
+  /**
+   * How the last open() went.
+   */
+  struct ConnectStats {
+    /// Time spent looking the host up, in microseconds
+    int64_t resolveMicros;
+    /// Time spent connecting, in microseconds
+    int64_t connectMicros;
+    /// # of addresses a connection was started to
+    uint32_t attempts;
+    /// Whether the addresses of the host came from the DNS cache
+    bool resolvedFromCache;
+  };
+
+  const ConnectStats& getConnectStats() const { return connectStats_; }
+
   /**
    * Get socket information formatted as a string <Host: x Port: x>
    */
@@ -253,6 +332,29 @@ public:
    */
   THRIFT_SOCKET getSocketFD() { return socket_; }
 
+  /**
+   * Whether sending on getSocketFD() directly, e.g. with a gathering write,
+   * is the same as writing through this transport.  Subclasses that change
+   * what they write, like TSSLSocket unless the kernel does the encryption,
+   * are not.
+   */
+  virtual bool canSendDirectly() const;
+
+  /**
+   * Whether a handshake, like the one of TSSLSocket, has to complete before
+   * data flows.  TNonblockingServer may hand it to threads of its own
+   * rather than drive it on an IO thread.
+   */
+  virtual bool hasPendingHandshake() const;
+
+  /**
+   * Complete the pending handshake, if any, blocking until it is done.
+   *
+   * @param timeoutMs longest time to take, in milliseconds (0 = no limit).
+   * \throws TTransportException TIMED_OUT if the handshake takes longer.
+   */
+  virtual void handshake(int timeoutMs);
+
   /**
    * (Re-)initialize a TSocket for the supplied descriptor.  This is only
    * intended for use by TNonblockingServer -- other use may result in
@@ -262,6 +364,12 @@ public:
    */
   void setSocketFD(THRIFT_SOCKET fd);
 
+  /**
+   * Make the socket one of those interrupter interrupts; reads then no
+   * longer poll the interrupt listener, if any.
+   */
+  void setInterrupter(std::shared_ptr<TSocketInterrupter> interrupter);
+
   /*
    * Returns a cached copy of the peer address.
    */
@@ -333,6 +441,9 @@ protected:
    */
   std::shared_ptr<THRIFT_SOCKET> interruptListener_;
 
+  /** Interrupts reads by shutting the socket down, instead of interruptListener_ */
+  std::shared_ptr<TSocketInterrupter> interrupter_;
+
   /** Connect timeout in ms */
   int connTimeout_;
 
@@ -366,9 +477,28 @@ protected:
   /** Whether to use low minimum TCP retransmission timeout */
   static bool useLowMinRto_;
 
+  /** Low latency socket options */
+  TSocketTuning tuning_;
+
+  /** Cache of host lookups, if any */
+  std::shared_ptr<TDnsCache> dnsCache_;
+
+  /** Delay between parallel connection attempts in ms, 0 if sequential */
+  int connAttemptDelay_;
+
+  /** How the last open() went */
+  ConnectStats connectStats_;
+
 private:
   void unix_open();
   void local_open();
+  /// Set the options of this TSocket on socket, with TCP_FASTOPEN_CONNECT if fastOpen
+  void setSocketOptions(THRIFT_SOCKET socket, bool fastOpen);
+  void applyLinger(THRIFT_SOCKET socket);
+  void applyNoDelay(THRIFT_SOCKET socket);
+  void applyKeepAlive(THRIFT_SOCKET socket);
+  void openParallel(const TDnsCache::Addresses& addresses);
+  THRIFT_SOCKET startConnect(const TResolvedAddress& address, bool& connected, int& error);
 };
 }
 }
@@ -0,0 +1,137 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <cstring>
+#include <string>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include <thrift/transport/TSocketTuning.h>
+
+#ifndef SOCKOPT_CAST_T
+#ifndef _WIN32
+#define SOCKOPT_CAST_T void
+#else
+#define SOCKOPT_CAST_T char
+#endif // _WIN32
+#endif
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+namespace {
+
+void setIntOption(THRIFT_SOCKET socket, int level, int name, int value, const char* what) {
+  if (-1 == setsockopt(socket,
+                       level,
+                       name,
+                       reinterpret_cast<const SOCKOPT_CAST_T*>(&value),
+                       sizeof(value))) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    TOutput::instance().perror(std::string("TSocketTuning setsockopt() ") + what + " ",
+                               errno_copy);
+  }
+}
+
+bool isIPv6(THRIFT_SOCKET socket) {
+  sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  std::memset(&addr, 0, sizeof(addr));
+  if (getsockname(socket, reinterpret_cast<sockaddr*>(&addr), &len) == -1) {
+    return false;
+  }
+  return addr.ss_family == AF_INET6;
+}
+}
+
+void TSocketTuning::applyToSocket(THRIFT_SOCKET socket, bool connecting) const {
+#ifdef SO_BUSY_POLL
+  if (busyPollMicros > 0) {
+    setIntOption(socket, SOL_SOCKET, SO_BUSY_POLL, busyPollMicros, "SO_BUSY_POLL");
+  }
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+  if (connecting && fastOpen > 0) {
+    setIntOption(socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+  }
+#else
+  (void)connecting;
+#endif
+#ifdef TCP_QUICKACK
+  if (quickAck) {
+    setIntOption(socket, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+  }
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+  if (notSentLowat > 0) {
+    setIntOption(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, notSentLowat, "TCP_NOTSENT_LOWAT");
+  }
+#endif
+#ifdef SO_INCOMING_CPU
+  if (incomingCpu >= 0) {
+    setIntOption(socket, SOL_SOCKET, SO_INCOMING_CPU, incomingCpu, "SO_INCOMING_CPU");
+  }
+#endif
+  if (tos >= 0) {
+#ifdef IPV6_TCLASS
+    if (isIPv6(socket)) {
+      setIntOption(socket, IPPROTO_IPV6, IPV6_TCLASS, tos, "IPV6_TCLASS");
+      return;
+    }
+#endif
+#ifdef IP_TOS
+    setIntOption(socket, IPPROTO_IP, IP_TOS, tos, "IP_TOS");
+#endif
+  }
+}
+
+void TSocketTuning::applyToListener(THRIFT_SOCKET socket) const {
+#ifdef TCP_FASTOPEN
+  if (fastOpen > 0) {
+    setIntOption(socket, IPPROTO_TCP, TCP_FASTOPEN, fastOpen, "TCP_FASTOPEN");
+  }
+#endif
+#ifdef SO_INCOMING_CPU
+  if (incomingCpu >= 0) {
+    setIntOption(socket, SOL_SOCKET, SO_INCOMING_CPU, incomingCpu, "SO_INCOMING_CPU");
+  }
+#endif
+}
+
+void TSocketTuning::rearmQuickAck(THRIFT_SOCKET socket) {
+#ifdef TCP_QUICKACK
+  int one = 1;
+  setsockopt(socket, IPPROTO_TCP, TCP_QUICKACK, reinterpret_cast<const SOCKOPT_CAST_T*>(&one),
+             sizeof(one));
+#else
+  (void)socket;
+#endif
+}
+}
+}
+} // apache::thrift::transport
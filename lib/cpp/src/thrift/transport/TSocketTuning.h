@@ -0,0 +1,92 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TSOCKETTUNING_H_
+#define _THRIFT_TRANSPORT_TSOCKETTUNING_H_ 1
+
+#include <thrift/Thrift.h>
+#include <thrift/transport/PlatformSocket.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * Socket options for latency sensitive services, beyond those TSocket and
+ * the server sockets have setters for.  All of them are off by default.
+ * Options the platform does not have are ignored, and failing to set one
+ * is logged but not an error, as they only ever change performance.
+ */
+class TSocketTuning {
+public:
+  TSocketTuning()
+    : busyPollMicros(0), fastOpen(0), quickAck(false), notSentLowat(0), incomingCpu(-1), tos(-1) {}
+
+  /// SO_BUSY_POLL: microseconds to busy poll the device for data on reads
+  int busyPollMicros;
+
+  /**
+   * TCP_FASTOPEN: on server sockets, the length of the queue of connections
+   * whose SYN carried data; on client sockets, any value above 0 sends the
+   * first write with the SYN (TCP_FASTOPEN_CONNECT) once the server is
+   * known to accept it, unless TSocket::setConnAttemptDelay() has the
+   * addresses tried in parallel.
+   */
+  int fastOpen;
+
+  /// TCP_QUICKACK: acknowledge data right away; set again after every read
+  bool quickAck;
+
+  /// TCP_NOTSENT_LOWAT: bytes not sent yet above which writes block
+  int notSentLowat;
+
+  /// SO_INCOMING_CPU: CPU whose receive queue connections are steered to
+  int incomingCpu;
+
+  /// IP_TOS, or IPV6_TCLASS on IPv6 sockets, for the traffic sent
+  int tos;
+
+  /// Whether any option is set
+  bool isSet() const {
+    return busyPollMicros > 0 || fastOpen > 0 || quickAck || notSentLowat > 0
+           || incomingCpu >= 0 || tos >= 0;
+  }
+
+  /**
+   * Set the options on a client socket before connecting it, or on one
+   * already connected or accepted, which fastOpen does not apply to.
+   */
+  void applyToSocket(THRIFT_SOCKET socket, bool connecting) const;
+
+  /**
+   * Set the options on a listening server socket; the ones set on the
+   * connections it accepts are set with applyToSocket().
+   */
+  void applyToListener(THRIFT_SOCKET socket) const;
+
+  /**
+   * Set TCP_QUICKACK again, as the kernel turns it off on its own.
+   */
+  static void rearmQuickAck(THRIFT_SOCKET socket);
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TSOCKETTUNING_H_
@@ -17,6 +17,7 @@
  * under the License.
  */
 
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <string>
@@ -26,6 +27,12 @@
 
 #include <thrift/Thrift.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using std::string;
 
 namespace apache {
@@ -47,6 +54,38 @@ std::string base64Encode(unsigned char* data, int length) {
   length = BIO_get_mem_data(dest, &encoded);
   return std::string(encoded, length);
 }
+
+void webSocketUnmask(uint8_t* data, uint32_t length, const uint8_t* mask) {
+  // Every step covers a multiple of 4 bytes, so the key stays aligned with
+  // the payload until the last few bytes
+  uint32_t key;
+  memcpy(&key, mask, 4);
+  uint32_t i = 0;
+#if defined(__AVX2__)
+  const __m256i key256 = _mm256_set1_epi32(static_cast<int>(key));
+  for (; length - i >= 32; i += 32) {
+    auto* p = reinterpret_cast<__m256i*>(data + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key256));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i key128 = _mm_set1_epi32(static_cast<int>(key));
+  for (; length - i >= 16; i += 16) {
+    auto* p = reinterpret_cast<__m128i*>(data + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key128));
+  }
+#endif
+  const uint64_t key64 = (static_cast<uint64_t>(key) << 32) | key;
+  for (; length - i >= 8; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    word ^= key64;
+    memcpy(data + i, &word, 8);
+  }
+  for (; i < length; ++i) {
+    data[i] ^= mask[i % 4];
+  }
+}
 } // namespace transport
 } // namespace thrift
 } // namespace apache
@@ -20,7 +20,9 @@
 #ifndef _THRIFT_TRANSPORT_TWEBSOCKETSERVER_H_
 #define _THRIFT_TRANSPORT_TWEBSOCKETSERVER_H_ 1
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 
@@ -50,6 +52,12 @@ namespace transport {
 
 std::string base64Encode(unsigned char* data, int length);
 
+/**
+ * Unmasks a WebSocket payload of the given length in place with the 4 byte
+ * masking key, a word or vector at a time.
+ */
+void webSocketUnmask(uint8_t* data, uint32_t length, const uint8_t* mask);
+
 template <bool binary>
 class TWebSocketServer : public THttpServer {
 public:
@@ -75,28 +83,28 @@ public:
       THttpServer::flush();
     }
 
-    uint32_t want = len;
-    auto have = readBuffer_.available_read();
-
-    // If we have some data in the buffer, copy it out and return it.
-    // We have to return it without attempting to read more, since we aren't
+    // Only read frames while the buffer lacks data, since we aren't
     // guaranteed that the underlying transport actually has more data, so
-    // attempting to read from it could block.
-    if (have > 0 && have >= want) {
-      return readBuffer_.read(buf, want);
+    // attempting to read from it could block. Frames are appended to what is
+    // left of the previous ones, so a message may span several of them.
+    while (readBuffer_.available_read() < len) {
+      if (!readFrame()) {
+        // EOF.  No frame available.
+        return 0;
+      }
     }
+    return readBuffer_.read(buf, len);
+  }
 
-    // Read another frame.
-    if (!readFrame()) {
-      // EOF.  No frame available.
-      return 0;
-    }
+  bool peek() override { return readBuffer_.available_read() > 0 || THttpServer::peek(); }
 
-    // Hand over whatever we have.
-    uint32_t give = (std::min)(want, readBuffer_.available_read());
-    return readBuffer_.read(buf, give);
+  // Lend the unmasked payloads to the protocol
+  const uint8_t* borrow_virt(uint8_t* buf, uint32_t* len) override {
+    return readBuffer_.borrow(buf, len);
   }
 
+  void consume_virt(uint32_t len) override { readBuffer_.consume(len); }
+
   void flush() override {
     resetConsumedMessageSize();
     writeFrameHeader();
@@ -199,7 +207,7 @@ private:
   };
 
   void failConnection(CloseCode reason) {
-    writeFrameHeader(Opcode::Close);
+    writeFrameHeader(Opcode::Close, 2);
     auto buffer = htons(static_cast<uint16_t>(reason));
     transport_->write(reinterpret_cast<const uint8_t*>(&buffer), 2);
     transport_->flush();
@@ -210,20 +218,50 @@ private:
     return upgrade_ && connection_ && secWebSocketKey_ && secWebSocketVersion_;
   }
 
-  void pong() {
-    writeFrameHeader(Opcode::Pong);
-    uint8_t* buffer;
-    uint32_t size;
-    readBuffer_.getBuffer(&buffer, &size);
-    transport_->write(buffer, size);
+  void pong(const uint8_t* payload, uint32_t length) {
+    writeFrameHeader(Opcode::Pong, length);
+    transport_->write(payload, length);
     transport_->flush();
   }
 
+  // Read len bytes from the connection, starting with any left in the HTTP
+  // buffer after the handshake. Returns false at EOF.
+  bool readFrameBytes(uint8_t* buf, uint32_t len) {
+    while (len > 0) {
+      uint32_t avail = httpBufLen_ - httpPos_;
+      if (avail == 0) {
+        httpPos_ = 0;
+        httpBufLen_ = 0;
+        if (len >= httpBufSize_) {
+          // Large payloads go straight from the transport to the caller
+          uint32_t got = transport_->read(buf, len);
+          if (got == 0) {
+            return false;
+          }
+          buf += got;
+          len -= got;
+          continue;
+        }
+        // Small frames are read several at a time
+        avail = transport_->read(reinterpret_cast<uint8_t*>(httpBuf_), httpBufSize_);
+        if (avail == 0) {
+          return false;
+        }
+        httpBufLen_ = avail;
+      }
+      uint32_t give = (std::min)(len, avail);
+      memcpy(buf, httpBuf_ + httpPos_, give);
+      httpPos_ += give;
+      buf += give;
+      len -= give;
+    }
+    return true;
+  }
+
   bool readFrame() {
     uint8_t headerBuffer[8];
 
-    auto read = transport_->read(headerBuffer, 2);
-    if (read < 2) {
+    if (!readFrameBytes(headerBuffer, 2)) {
       return false;
     }
     // Since Thrift has its own message end marker and we read frame by frame,
@@ -251,14 +289,12 @@ private:
     // Read the length
     uint64_t payloadLength = headerBuffer[1] & 0x7F;
     if (payloadLength == 126) {
-      read = transport_->read(headerBuffer, 2);
-      if (read < 2) {
+      if (!readFrameBytes(headerBuffer, 2)) {
         return false;
       }
       payloadLength = ntohs(*reinterpret_cast<uint16_t*>(headerBuffer));
     } else if (payloadLength == 127) {
-      read = transport_->read(headerBuffer, 8);
-      if (read < 8) {
+      if (!readFrameBytes(headerBuffer, 8)) {
         return false;
       }
       payloadLength = THRIFT_ntohll(*reinterpret_cast<uint64_t*>(headerBuffer));
@@ -278,48 +314,67 @@ private:
 
     auto length = static_cast<uint32_t>(payloadLength);
 
-    if (length > 0) {
-      // Read the masking key
-      read = transport_->read(headerBuffer, 4);
-      if (read < 4) {
-        return false;
-      }
+    // Read the masking key, which even empty frames carry
+    uint8_t mask[4];
+    if (!readFrameBytes(mask, 4)) {
+      return false;
+    }
 
-      readBuffer_.resetBuffer(length);
-      uint8_t* buffer = readBuffer_.getWritePtr(length);
-      read = transport_->read(buffer, length);
-      readBuffer_.wroteBytes(read);
-      if (read < length) {
+    // Control frames may come between the fragments of a message, so their
+    // payloads are kept apart from it
+    if ((static_cast<uint8_t>(opcode) & 0x08) != 0) {
+      uint8_t control[125];
+      if (length > sizeof(control)) {
+        failConnection(CloseCode::ProtocolError);
+        throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                  "Control frames must not be longer than 125 bytes");
+      }
+      if (!readFrameBytes(control, length)) {
         return false;
       }
-      
-      // Unmask the data
-      for (size_t i = 0; i < length; i++) {
-        buffer[i] ^= headerBuffer[i % 4];
+      webSocketUnmask(control, length, mask);
+
+      switch (opcode) {
+      case Opcode::Close:
+        if (length >= 2) {
+          CloseCode closeCode = static_cast<CloseCode>((control[0] << 8) | control[1]);
+          THRIFT_UNUSED_VARIABLE(closeCode);
+          T_DEBUG("Connection closed: %d %.*s", closeCode, length - 2, control + 2);
+        }
+        transport_->close();
+        return false;
+      case Opcode::Ping:
+        pong(control, length);
+        return true;
+      default:
+        return true;
       }
-
-      T_DEBUG("FIN=%d, Opcode=%X, length=%d, payload=%s", fin, opcode, length,
-              binary ? readBuffer_.toHexString() : cast(string) readBuffer_);
     }
 
-    switch (opcode) {
-    case Opcode::Close:
-      if (length >= 2) {
-        uint8_t buffer[2];
-        readBuffer_.read(buffer, 2);
-        CloseCode closeCode = static_cast<CloseCode>(ntohs(*reinterpret_cast<uint16_t*>(buffer)));
-        THRIFT_UNUSED_VARIABLE(closeCode);
-        string closeReason = readBuffer_.readAsString(length - 2);
-        T_DEBUG("Connection closed: %d %s", closeCode, closeReason);
+    if (length > 0) {
+      // Append the payload to what the protocol has yet to read, unmasking it
+      // where it lands. Start over once everything was read, and move a
+      // leftover to the front rather than grow past it.
+      if (readBuffer_.available_read() == 0) {
+        readBuffer_.resetBuffer();
+      } else if (readBuffer_.available_write() < length) {
+        uint32_t left = readBuffer_.available_read();
+        const uint8_t* leftover = readBuffer_.borrow(nullptr, &left);
+        readBuffer_.resetBuffer();
+        // the buffer keeps its memory, which the leftover may overlap
+        std::memmove(readBuffer_.getWritePtr(left), leftover, left);
+        readBuffer_.wroteBytes(left);
       }
-      transport_->close();
-      return false;
-    case Opcode::Ping:
-      pong();
-      return readFrame();
-    default:
-      return true;
+      uint8_t* buffer = readBuffer_.getWritePtr(length);
+      if (!readFrameBytes(buffer, length)) {
+        return false;
+      }
+      webSocketUnmask(buffer, length, mask);
+      readBuffer_.wroteBytes(length);
+
+      T_DEBUG("FIN=%d, Opcode=%X, length=%d", fin, opcode, length);
     }
+    return true;
   }
 
   void resetHandshake() {
@@ -339,8 +394,11 @@ private:
   }
 
   void writeFrameHeader(Opcode opcode = Opcode::Continuation) {
+    writeFrameHeader(opcode, writeBuffer_.available_read());
+  }
+
+  void writeFrameHeader(Opcode opcode, uint32_t length) {
     uint32_t headerSize = 1;
-    uint32_t length = writeBuffer_.available_read();
     if (length < 126) {
       ++headerSize;
     } else if (length < 65536) {
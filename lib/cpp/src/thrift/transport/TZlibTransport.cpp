@@ -18,6 +18,7 @@
  */
 
 #include <cassert>
+#include <cstddef>
 #include <cstring>
 #include <algorithm>
 #include <thrift/transport/TZlibTransport.h>
@@ -28,8 +29,123 @@ namespace apache {
 namespace thrift {
 namespace transport {
 
+TZlibStreamPool::~TZlibStreamPool() {
+  for (size_t i = 0; i < deflaters_.size(); ++i) {
+    deflateEnd(deflaters_[i].stream);
+    delete deflaters_[i].stream;
+  }
+  for (size_t i = 0; i < inflaters_.size(); ++i) {
+    inflateEnd(inflaters_[i]);
+    delete inflaters_[i];
+  }
+}
+
+z_stream* TZlibStreamPool::acquireDeflate(int level, int strategy) {
+  {
+    concurrency::Guard g(mutex_);
+    for (size_t i = deflaters_.size(); i-- > 0;) {
+      if (deflaters_[i].level == level && deflaters_[i].strategy == strategy) {
+        z_stream* stream = deflaters_[i].stream;
+        deflaters_.erase(deflaters_.begin() + static_cast<std::ptrdiff_t>(i));
+        return stream;
+      }
+    }
+  }
+
+  auto* stream = new z_stream;
+  stream->zalloc = Z_NULL;
+  stream->zfree = Z_NULL;
+  stream->opaque = Z_NULL;
+  stream->next_in = Z_NULL;
+  stream->avail_in = 0;
+  // 8 is the memory level of deflateInit()
+  int rv = deflateInit2(stream, level, Z_DEFLATED, MAX_WBITS, 8, strategy);
+  if (rv != Z_OK) {
+    TZlibTransportException ex(rv, stream->msg);
+    delete stream;
+    throw ex;
+  }
+  return stream;
+}
+
+z_stream* TZlibStreamPool::acquireInflate() {
+  {
+    concurrency::Guard g(mutex_);
+    if (!inflaters_.empty()) {
+      z_stream* stream = inflaters_.back();
+      inflaters_.pop_back();
+      return stream;
+    }
+  }
+
+  auto* stream = new z_stream;
+  stream->zalloc = Z_NULL;
+  stream->zfree = Z_NULL;
+  stream->opaque = Z_NULL;
+  stream->next_in = Z_NULL;
+  stream->avail_in = 0;
+  int rv = inflateInit(stream);
+  if (rv != Z_OK) {
+    TZlibTransportException ex(rv, stream->msg);
+    delete stream;
+    throw ex;
+  }
+  return stream;
+}
+
+void TZlibStreamPool::releaseDeflate(z_stream* stream, int level, int strategy) {
+  // Unflushed data is discarded, as when a transport is destroyed
+  if (deflateReset(stream) == Z_OK) {
+    concurrency::Guard g(mutex_);
+    if (deflaters_.size() < maxIdle_) {
+      Deflater deflater = {stream, level, strategy};
+      deflaters_.push_back(deflater);
+      return;
+    }
+  }
+  deflateEnd(stream);
+  delete stream;
+}
+
+void TZlibStreamPool::releaseInflate(z_stream* stream) {
+  if (inflateReset(stream) == Z_OK) {
+    concurrency::Guard g(mutex_);
+    if (inflaters_.size() < maxIdle_) {
+      inflaters_.push_back(stream);
+      return;
+    }
+  }
+  inflateEnd(stream);
+  delete stream;
+}
+
+size_t TZlibStreamPool::getIdleCount() {
+  concurrency::Guard g(mutex_);
+  return deflaters_.size() + inflaters_.size();
+}
+
 // Don't call this outside of the constructor.
 void TZlibTransport::initZlib() {
+  if (pool_) {
+    rstream_ = pool_->acquireInflate();
+    try {
+      wstream_ = pool_->acquireDeflate(comp_level_, comp_strategy_);
+    } catch (...) {
+      pool_->releaseInflate(rstream_);
+      throw;
+    }
+
+    rstream_->next_in = crbuf_;
+    wstream_->next_in = uwbuf_;
+    rstream_->next_out = urbuf_;
+    wstream_->next_out = cwbuf_;
+    rstream_->avail_in = 0;
+    wstream_->avail_in = 0;
+    rstream_->avail_out = urbuf_size_;
+    wstream_->avail_out = cwbuf_size_;
+    return;
+  }
+
   int rv;
   bool r_init = false;
   try {
@@ -58,7 +174,8 @@ void TZlibTransport::initZlib() {
     // Have to set this flag so we know whether to de-initialize.
     r_init = true;
 
-    rv = deflateInit(wstream_, comp_level_);
+    // 8 is the memory level of deflateInit()
+    rv = deflateInit2(wstream_, comp_level_, Z_DEFLATED, MAX_WBITS, 8, comp_strategy_);
     checkZlibRv(rv, wstream_->msg);
   }
 
@@ -88,6 +205,16 @@ inline void TZlibTransport::checkZlibRvNothrow(int status, const char* message)
 }
 
 TZlibTransport::~TZlibTransport() {
+  if (pool_) {
+    pool_->releaseInflate(rstream_);
+    pool_->releaseDeflate(wstream_, comp_level_, comp_strategy_);
+    delete[] urbuf_;
+    delete[] crbuf_;
+    delete[] uwbuf_;
+    delete[] cwbuf_;
+    return;
+  }
+
   int rv;
   rv = inflateEnd(rstream_);
   checkZlibRvNothrow(rv, rstream_->msg);
@@ -406,25 +533,28 @@ TZlibTransportFactory::TZlibTransportFactory(std::shared_ptr<TTransportFactory>
   :transportFactory_(transportFactory) {
 }
 
+void TZlibTransportFactory::setBufferSizes(int urbufSize,
+                                           int crbufSize,
+                                           int uwbufSize,
+                                           int cwbufSize) {
+  urbufSize_ = urbufSize;
+  crbufSize_ = crbufSize;
+  uwbufSize_ = uwbufSize;
+  cwbufSize_ = cwbufSize;
+}
+
 std::shared_ptr<TTransport> TZlibTransportFactory::getTransport(std::shared_ptr<TTransport> trans) {
-  if (transportFactory_) {
-    std::shared_ptr<TTransport> inner = transportFactory_->getTransport(trans);
-    return std::shared_ptr<TTransport>(new TZlibTransport(inner,
-                                                            TZlibTransport::DEFAULT_URBUF_SIZE,
-                                                            TZlibTransport::DEFAULT_CRBUF_SIZE,
-                                                            TZlibTransport::DEFAULT_UWBUF_SIZE,
-                                                            TZlibTransport::DEFAULT_CWBUF_SIZE,
-                                                            Z_DEFAULT_COMPRESSION,
-                                                            inner->getConfiguration()));
-  } else {
-    return std::shared_ptr<TTransport>(new TZlibTransport(trans,
-                                                            TZlibTransport::DEFAULT_URBUF_SIZE,
-                                                            TZlibTransport::DEFAULT_CRBUF_SIZE,
-                                                            TZlibTransport::DEFAULT_UWBUF_SIZE,
-                                                            TZlibTransport::DEFAULT_CWBUF_SIZE,
-                                                            Z_DEFAULT_COMPRESSION,
-                                                            trans->getConfiguration()));
-  }
+  std::shared_ptr<TTransport> inner = transportFactory_ ? transportFactory_->getTransport(trans)
+                                                        : trans;
+  return std::shared_ptr<TTransport>(new TZlibTransport(inner,
+                                                          urbufSize_,
+                                                          crbufSize_,
+                                                          uwbufSize_,
+                                                          cwbufSize_,
+                                                          static_cast<int16_t>(compLevel_),
+                                                          inner->getConfiguration(),
+                                                          compStrategy_,
+                                                          pool_));
 }
 }
 }
@@ -20,11 +20,15 @@
 #ifndef _THRIFT_TRANSPORT_TZLIBTRANSPORT_H_
 #define _THRIFT_TRANSPORT_TZLIBTRANSPORT_H_ 1
 
+#include <thrift/TNonCopyable.h>
+#include <thrift/concurrency/Mutex.h>
 #include <thrift/transport/TTransport.h>
 #include <thrift/transport/TVirtualTransport.h>
 #include <thrift/TToString.h>
 #include <zlib.h>
 
+#include <vector>
+
 struct z_stream_s;
 
 namespace apache {
@@ -60,6 +64,56 @@ public:
   std::string zlib_msg_;
 };
 
+/**
+ * Keeps the zlib streams of closed TZlibTransports for new ones, so that
+ * short-lived connections do not set up and tear down the state of deflate
+ * (a few hundred KB at the default memory level) and inflate every time.
+ * Shared by any number of transports on any number of threads.
+ */
+class TZlibStreamPool : apache::thrift::TNonCopyable {
+public:
+  /**
+   * @param maxIdle # of deflate and of inflate streams kept; the streams of
+   *                further transports are freed when they close.
+   */
+  explicit TZlibStreamPool(size_t maxIdle = DEFAULT_MAX_IDLE) : maxIdle_(maxIdle) {}
+  ~TZlibStreamPool();
+
+  /**
+   * A deflate stream at the start of a zlib stream, set up for level and
+   * strategy.  Its buffers are the caller's to set.
+   *
+   * @throws TZlibTransportException if zlib fails to set up a new one.
+   */
+  struct z_stream_s* acquireDeflate(int level, int strategy);
+
+  /// An inflate stream at the start of a zlib stream.
+  struct z_stream_s* acquireInflate();
+
+  /// Takes back a stream of acquireDeflate(), in whatever state.
+  void releaseDeflate(struct z_stream_s* stream, int level, int strategy);
+
+  /// Takes back a stream of acquireInflate(), in whatever state.
+  void releaseInflate(struct z_stream_s* stream);
+
+  /// # of streams waiting to be used again.
+  size_t getIdleCount();
+
+  static const size_t DEFAULT_MAX_IDLE = 16;
+
+private:
+  struct Deflater {
+    struct z_stream_s* stream;
+    int level;
+    int strategy;
+  };
+
+  size_t maxIdle_;
+  concurrency::Mutex mutex_;
+  std::vector<Deflater> deflaters_;
+  std::vector<struct z_stream_s*> inflaters_;
+};
+
 /**
  * This transport uses zlib to compress on write and decompress on read
  *
@@ -77,6 +131,12 @@ public:
    * @param uwbuf_size   Uncompressed buffer size for writing.
    * @param cwbuf_size   Compressed buffer size for writing.
    * @param comp_level   Compression level (0=none[fast], 6=default, 9=max[slow]).
+   * @param config       Limits, as of any transport.
+   * @param comp_strategy Compression strategy, see deflateInit2(); Z_FILTERED,
+   *                     Z_HUFFMAN_ONLY and Z_RLE trade ratio for speed on
+   *                     data that suits them.
+   * @param pool         Streams to take from and give back to, or empty for
+   *                     streams of this transport alone.
    */
   TZlibTransport(std::shared_ptr<TTransport> transport,
                  int urbuf_size = DEFAULT_URBUF_SIZE,
@@ -84,7 +144,9 @@ public:
                  int uwbuf_size = DEFAULT_UWBUF_SIZE,
                  int cwbuf_size = DEFAULT_CWBUF_SIZE,
                  int16_t comp_level = Z_DEFAULT_COMPRESSION,
-                 std::shared_ptr<TConfiguration> config = nullptr)
+                 std::shared_ptr<TConfiguration> config = nullptr,
+                 int comp_strategy = Z_DEFAULT_STRATEGY,
+                 std::shared_ptr<TZlibStreamPool> pool = nullptr)
     : TVirtualTransport(config),
       transport_(transport),
       urpos_(0),
@@ -101,7 +163,9 @@ public:
       cwbuf_(nullptr),
       rstream_(nullptr),
       wstream_(nullptr),
-      comp_level_(comp_level) {
+      comp_level_(comp_level),
+      comp_strategy_(comp_strategy),
+      pool_(pool) {
     if (uwbuf_size_ < MIN_DIRECT_DEFLATE_SIZE) {
       // Have to copy this into a local because of a linking issue.
       int minimum = MIN_DIRECT_DEFLATE_SIZE;
@@ -186,6 +250,9 @@ public:
 
   std::shared_ptr<TTransport> getUnderlyingTransport() const { return transport_; }
 
+  int getCompressionLevel() const { return comp_level_; }
+  int getCompressionStrategy() const { return comp_strategy_; }
+
 protected:
   inline void checkZlibRv(int status, const char* msg);
   inline void checkZlibRvNothrow(int status, const char* msg);
@@ -223,6 +290,8 @@ protected:
   struct z_stream_s* wstream_;
 
   const int comp_level_;
+  const int comp_strategy_;
+  std::shared_ptr<TZlibStreamPool> pool_;
 };
 
 /**
@@ -242,8 +311,34 @@ public:
 
   std::shared_ptr<TTransport> getTransport(std::shared_ptr<TTransport> trans) override;
 
+  /// Set the compression level of the transports made from now on.
+  void setCompressionLevel(int level) { compLevel_ = level; }
+
+  /// Set the compression strategy of the transports made from now on.
+  void setCompressionStrategy(int strategy) { compStrategy_ = strategy; }
+
+  /**
+   * Set the buffer sizes of the transports made from now on, see
+   * TZlibTransport::TZlibTransport().
+   */
+  void setBufferSizes(int urbufSize, int crbufSize, int uwbufSize, int cwbufSize);
+
+  /**
+   * Have the transports made from now on share the streams of a pool.
+   *
+   * @param pool the pool, empty for streams of each transport alone.
+   */
+  void setStreamPool(const std::shared_ptr<TZlibStreamPool>& pool) { pool_ = pool; }
+
 protected:
   std::shared_ptr<TTransportFactory> transportFactory_;
+  int compLevel_ = Z_DEFAULT_COMPRESSION;
+  int compStrategy_ = Z_DEFAULT_STRATEGY;
+  int urbufSize_ = TZlibTransport::DEFAULT_URBUF_SIZE;
+  int crbufSize_ = TZlibTransport::DEFAULT_CRBUF_SIZE;
+  int uwbufSize_ = TZlibTransport::DEFAULT_UWBUF_SIZE;
+  int cwbufSize_ = TZlibTransport::DEFAULT_CWBUF_SIZE;
+  std::shared_ptr<TZlibStreamPool> pool_;
 };
 
 }
@@ -22,6 +22,8 @@
 
 using apache::thrift::protocol::base64_encode;
 using apache::thrift::protocol::base64_decode;
+using apache::thrift::protocol::base64_encode_buffer;
+using apache::thrift::protocol::base64_decode_buffer;
 
 BOOST_AUTO_TEST_SUITE(Base64Test)
 
@@ -71,4 +73,70 @@ BOOST_AUTO_TEST_CASE(test_Base64_Encode_Decode) {
   }
 }
 
+// Decode len characters of buf into out as base64_decode does, 4 at a time
+uint32_t decodeInGroups(const uint8_t* buf, uint32_t len, uint8_t* out) {
+  uint8_t group[4];
+  uint32_t outLen = 0;
+  for (uint32_t i = 0; i < len; i += 4) {
+    uint32_t n = len - i < 4 ? len - i : 4;
+    if (n > 1) {
+      memcpy(group, buf + i, n);
+      base64_decode(group, n);
+      memcpy(out + outLen, group, n - 1);
+      outLen += n - 1;
+    }
+  }
+  return outLen;
+}
+
+BOOST_AUTO_TEST_CASE(test_Base64_Encode_Decode_Buffer) {
+  uint8_t input[100];
+  uint8_t expected[136];
+  uint8_t encoded[136];
+
+  for (int i = 0; i < 100; i++) {
+    input[i] = (uint8_t)(i * 167 + 13);
+  }
+
+  // Lengths that span several 12, 16, 24 and 32 byte blocks
+  for (uint32_t len = 0; len <= 100; len++) {
+    uint32_t expectedLen = 0;
+    for (uint32_t i = 0; i < len; i += 3) {
+      uint32_t n = len - i < 3 ? len - i : 3;
+      base64_encode(input + i, n, expected + expectedLen);
+      expectedLen += n + 1;
+    }
+
+    BOOST_CHECK_EQUAL(base64_encode_buffer(input, len, encoded), expectedLen);
+    BOOST_CHECK(0 == memcmp(encoded, expected, expectedLen));
+    checkEncoding(encoded, expectedLen);
+
+    BOOST_CHECK_EQUAL(base64_decode_buffer(encoded, expectedLen), len);
+    BOOST_CHECK(0 == memcmp(encoded, input, len));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_Base64_Decode_Buffer_Invalid) {
+  const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const uint8_t invalid[] = {'=', '-', ' ', '@', '[', '`', '{', 0x00, 0x7f, 0x80, 0xff};
+  uint8_t buf[70];
+  uint8_t expected[70];
+
+  // Characters outside the alphabet decode to the same bytes as with
+  // base64_decode, wherever they are in a block
+  for (uint32_t len = 1; len <= 70; len++) {
+    for (uint32_t pos = 0; pos < len; pos++) {
+      for (uint8_t ch : invalid) {
+        for (uint32_t i = 0; i < len; i++) {
+          buf[i] = (uint8_t)alphabet[(i * 7) % 64];
+        }
+        buf[pos] = ch;
+        uint32_t expectedLen = decodeInGroups(buf, len, expected);
+        BOOST_CHECK_EQUAL(base64_decode_buffer(buf, len), expectedLen);
+        BOOST_CHECK(0 == memcmp(buf, expected, expectedLen));
+      }
+    }
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,39 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+namespace cpp futureclienttest
+
+struct Pair {
+  1: string first,
+  2: string second
+}
+
+exception Failure {
+  1: string message
+}
+
+// a service with each kind of result a future_ method of a cob client
+// completes its future with, for use in TFramedClientChannelTest.cpp
+service FutureService {
+  string echo(1: string text),
+  i32 add(1: i32 a, 2: i32 b),
+  Pair swap(1: Pair pair),
+  void ping(),
+  void fail(1: string message) throws (1: Failure failure)
+}
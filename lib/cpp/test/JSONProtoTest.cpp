@@ -20,6 +20,7 @@
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <iomanip>
+#include <limits>
 #include <sstream>
 #include <thrift/protocol/TJSONProtocol.h>
 #include <memory>
@@ -31,6 +32,7 @@
 
 using namespace thrift::test::debug;
 using namespace apache::thrift;
+using apache::thrift::transport::TBufferedTransport;
 using apache::thrift::transport::TMemoryBuffer;
 using apache::thrift::protocol::TJSONProtocol;
 
@@ -402,3 +404,151 @@ BOOST_AUTO_TEST_CASE(test_json_base64_padding_validation) {
   test_base64_padding("===");
   test_base64_padding("====");
 }
+
+static std::string escapeJSONString(const std::string& str) {
+  std::string out("\"");
+  for (char c : str) {
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\b': out += "\\b"; break;
+    case '\f': out += "\\f"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default:
+      if (static_cast<uint8_t>(c) < 0x20) {
+        char escape[7];
+        snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned>(c));
+        out += escape;
+      } else {
+        out += c;
+      }
+    }
+  }
+  return out + "\"";
+}
+
+BOOST_AUTO_TEST_CASE(test_json_string_escaping) {
+  // Every character that is escaped, and some that are not, at each position
+  // of strings that span several 8, 16 and 32 byte blocks
+  const std::string specials("\"\\\b\f\n\r\t\x01\x1f \x7f\xd7");
+  for (size_t len = 1; len <= 70; ++len) {
+    for (size_t pos = 0; pos < len; ++pos) {
+      for (char special : specials) {
+        std::string str(len, 'a');
+        str[pos] = special;
+
+        std::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+        std::shared_ptr<TJSONProtocol> proto(new TJSONProtocol(buffer));
+        proto->writeString(str);
+        BOOST_CHECK_EQUAL(buffer->getBufferAsString(), escapeJSONString(str));
+
+        // Read once from the memory buffer, which lends all of its bytes,
+        // and once through a transport that lends a few at a time
+        std::string json(buffer->getBufferAsString());
+        std::string read;
+        proto->readString(read);
+        BOOST_CHECK(read == str);
+
+        buffer->resetBuffer((uint8_t*)&json[0], static_cast<uint32_t>(json.size()));
+        std::shared_ptr<TBufferedTransport> buffered(new TBufferedTransport(buffer, 5, 5));
+        TJSONProtocol bufferedProto(buffered);
+        bufferedProto.readString(read);
+        BOOST_CHECK(read == str);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_json_numbers) {
+  const int64_t i64s[] = {(std::numeric_limits<int64_t>::min)(),
+                          (std::numeric_limits<int64_t>::max)(), 0, -1, 10, 99, 100, 12345};
+  const double doubles[] = {0.5, -0.25, 1024, 0.1, 1e-300};
+
+  std::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  std::shared_ptr<TJSONProtocol> proto(new TJSONProtocol(buffer));
+  proto->writeListBegin(apache::thrift::protocol::T_I64, 8);
+  for (int64_t i64 : i64s) {
+    proto->writeI64(i64);
+  }
+  proto->writeListEnd();
+  proto->writeMapBegin(apache::thrift::protocol::T_I32, apache::thrift::protocol::T_DOUBLE, 5);
+  for (int32_t i = 0; i < 5; ++i) {
+    proto->writeI32(i == 0 ? (std::numeric_limits<int32_t>::min)() : -i);
+    proto->writeDouble(doubles[i]);
+  }
+  proto->writeMapEnd();
+  proto->writeListBegin(apache::thrift::protocol::T_BYTE, 1);
+  proto->writeByte(-128);
+  proto->writeListEnd();
+
+  BOOST_CHECK_EQUAL(buffer->getBufferAsString(),
+                    "[\"i64\",8,-9223372036854775808,9223372036854775807,0,-1,10,99,100,12345]"
+                    "[\"i32\",\"dbl\",5,{\"-2147483648\":0.5,\"-1\":-0.25,\"-2\":1024,"
+                    "\"-3\":0.10000000000000001,\"-4\":1e-300}]"
+                    "[\"i8\",1,-128]");
+
+  std::shared_ptr<TBufferedTransport> buffered(new TBufferedTransport(buffer, 7, 7));
+  TJSONProtocol bufferedProto(buffered);
+  apache::thrift::protocol::TType keyType, valType;
+  uint32_t size;
+  bufferedProto.readListBegin(keyType, size);
+  BOOST_CHECK_EQUAL(size, 8u);
+  for (int64_t i64 : i64s) {
+    int64_t value = 0;
+    bufferedProto.readI64(value);
+    BOOST_CHECK_EQUAL(value, i64);
+  }
+  bufferedProto.readListEnd();
+  bufferedProto.readMapBegin(keyType, valType, size);
+  for (int32_t i = 0; i < 5; ++i) {
+    int32_t key = 0;
+    double value = 0;
+    bufferedProto.readI32(key);
+    bufferedProto.readDouble(value);
+    BOOST_CHECK_EQUAL(key, i == 0 ? (std::numeric_limits<int32_t>::min)() : -i);
+    BOOST_CHECK_EQUAL(value, doubles[i]);
+  }
+  bufferedProto.readMapEnd();
+  int8_t byte = 0;
+  bufferedProto.readListBegin(valType, size);
+  bufferedProto.readByte(byte);
+  bufferedProto.readListEnd();
+  BOOST_CHECK_EQUAL(byte, -128);
+}
+
+BOOST_AUTO_TEST_CASE(test_json_integer_parsing) {
+  auto readI32 = [](const std::string& json) {
+    std::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer(
+      (uint8_t*)(json.c_str()), static_cast<uint32_t>(json.size())));
+    TJSONProtocol proto(buffer);
+    int32_t value = 0;
+    proto.readI32(value);
+    return value;
+  };
+
+  BOOST_CHECK_EQUAL(readI32("-2147483648]"), (std::numeric_limits<int32_t>::min)());
+  BOOST_CHECK_EQUAL(readI32("+17]"), 17);
+  BOOST_CHECK_THROW(readI32("1.5]"), apache::thrift::protocol::TProtocolException);
+  BOOST_CHECK_THROW(readI32("1-2]"), apache::thrift::protocol::TProtocolException);
+}
+
+BOOST_AUTO_TEST_CASE(test_json_large_binary) {
+  // Sizes around the chunks that binary fields are encoded in
+  const uint32_t sizes[] = {0, 1, 2, 100, 3071, 3072, 3073, 10000};
+  for (uint32_t size : sizes) {
+    std::string binary(size, '\0');
+    for (uint32_t i = 0; i < size; ++i) {
+      binary[i] = static_cast<char>(i * 167 + 13);
+    }
+
+    std::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+    std::shared_ptr<TJSONProtocol> proto(new TJSONProtocol(buffer));
+    BOOST_CHECK_EQUAL(proto->writeBinary(binary), 2 + size / 3 * 4 + (size % 3 ? size % 3 + 1 : 0));
+
+    std::string read;
+    proto->readBinary(read);
+    BOOST_CHECK(read == binary);
+  }
+}
@@ -0,0 +1,235 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <thrift/TApplicationException.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/THeaderProtocol.h>
+#include <thrift/protocol/TProtocolException.h>
+#include <thrift/transport/TBatchTransport.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TSocket.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "TestServers.h"
+
+using apache::thrift::TApplicationException;
+using apache::thrift::protocol::T_CALL;
+using apache::thrift::protocol::T_EXCEPTION;
+using apache::thrift::protocol::TBinaryProtocol;
+using apache::thrift::protocol::TProtocolException;
+using apache::thrift::protocol::THeaderProtocol;
+using apache::thrift::protocol::THeaderProtocolFactory;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::test::EchoOptions;
+using apache::thrift::test::EchoServer;
+using apache::thrift::transport::TBatchTransport;
+using apache::thrift::transport::TClientBatch;
+using apache::thrift::transport::TFramedTransport;
+using apache::thrift::transport::TSocket;
+using apache::thrift::transport::TTransport;
+using apache::thrift::transport::TTransportFactory;
+using apache::thrift::transport::TVirtualTransport;
+using std::shared_ptr;
+
+namespace {
+
+/// Counts the writes made to the transport below it
+class CountingTransport : public TVirtualTransport<CountingTransport> {
+public:
+  CountingTransport(shared_ptr<TTransport> transport) : transport_(transport), writes(0) {}
+
+  bool isOpen() const override { return transport_->isOpen(); }
+  void open() override { transport_->open(); }
+  void close() override { transport_->close(); }
+
+  uint32_t read(uint8_t* buf, uint32_t len) { return transport_->read(buf, len); }
+
+  void write(const uint8_t* buf, uint32_t len) {
+    ++writes;
+    transport_->write(buf, len);
+  }
+
+  void flush() override { transport_->flush(); }
+
+private:
+  shared_ptr<TTransport> transport_;
+
+public:
+  int writes;
+};
+
+/// What the compiler generates for "string echo(1: string payload)"
+class EchoClient {
+public:
+  EchoClient(shared_ptr<TProtocol> prot) : prot_(prot) {}
+
+  void send_echo(const std::string& payload) {
+    prot_->writeMessageBegin("echo", T_CALL, 0);
+    prot_->writeString(payload);
+    prot_->writeMessageEnd();
+    prot_->getTransport()->writeEnd();
+    prot_->getTransport()->flush();
+  }
+
+  std::string recv_echo() {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    std::string reply;
+    prot_->readMessageBegin(name, type, seqid);
+    if (type == T_EXCEPTION) {
+      TApplicationException x;
+      x.read(prot_.get());
+      prot_->readMessageEnd();
+      prot_->getTransport()->readEnd();
+      throw x;
+    }
+    prot_->readString(reply);
+    prot_->readMessageEnd();
+    prot_->getTransport()->readEnd();
+    return reply;
+  }
+
+private:
+  shared_ptr<TProtocol> prot_;
+};
+
+/// Echoes each payload in one batch, checking the replies
+void echoAll(TClientBatch<EchoClient>& batch, const std::vector<std::string>& payloads) {
+  std::vector<std::string> replies(payloads.size());
+  for (size_t i = 0; i < payloads.size(); ++i) {
+    batch.add([&payloads, i](EchoClient& c) { c.send_echo(payloads[i]); },
+              [&replies, i](EchoClient& c) { replies[i] = c.recv_echo(); });
+  }
+  BOOST_CHECK_EQUAL(payloads.size(), batch.size());
+  batch.execute();
+  BOOST_CHECK_EQUAL(0u, batch.size());
+  BOOST_CHECK(replies == payloads);
+}
+
+std::vector<std::string> makePayloads(size_t count, size_t length) {
+  std::vector<std::string> payloads;
+  for (size_t i = 0; i < count; ++i) {
+    std::string payload = std::to_string(i);
+    payload.resize(length, 'x');
+    payloads.push_back(payload);
+  }
+  return payloads;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(TBatchTransportTest)
+
+BOOST_AUTO_TEST_CASE(test_batch_over_framed) {
+  EchoServer server;
+  shared_ptr<CountingTransport> counting(
+      new CountingTransport(std::make_shared<TSocket>("localhost", server.port)));
+  shared_ptr<TBatchTransport> batchTransport(new TBatchTransport(counting));
+  shared_ptr<TTransport> framed(new TFramedTransport(batchTransport));
+  EchoClient client(std::make_shared<TBinaryProtocol>(framed));
+  framed->open();
+
+  TClientBatch<EchoClient> batch(client, batchTransport);
+  echoAll(batch, makePayloads(100, 16));
+  BOOST_CHECK_EQUAL(1, counting->writes);
+
+  // Calls made outside of a batch are flushed as usual
+  client.send_echo("single");
+  BOOST_CHECK_EQUAL(2, counting->writes);
+  BOOST_CHECK_EQUAL("single", client.recv_echo());
+
+  // A batch too large for the buffer is sent in chunks
+  counting->writes = 0;
+  echoAll(batch, makePayloads(50, 4096));
+  BOOST_CHECK_GT(counting->writes, 1);
+  BOOST_CHECK_LT(counting->writes, 50);
+}
+
+BOOST_AUTO_TEST_CASE(test_batch_over_header) {
+  EchoServer server(EchoOptions(),
+                    std::make_shared<TTransportFactory>(),
+                    std::make_shared<THeaderProtocolFactory>());
+  shared_ptr<CountingTransport> counting(
+      new CountingTransport(std::make_shared<TSocket>("localhost", server.port)));
+  shared_ptr<TBatchTransport> batchTransport(new TBatchTransport(counting));
+  shared_ptr<TProtocol> prot(new THeaderProtocol(batchTransport));
+  EchoClient client(prot);
+  prot->getTransport()->open();
+
+  TClientBatch<EchoClient> batch(client, batchTransport);
+  echoAll(batch, makePayloads(100, 16));
+  BOOST_CHECK_EQUAL(1, counting->writes);
+}
+
+BOOST_AUTO_TEST_CASE(test_batch_exceptions) {
+  EchoOptions options;
+  options.exceptions = true;
+  EchoServer server(options);
+  shared_ptr<TBatchTransport> batchTransport(
+      new TBatchTransport(std::make_shared<TSocket>("localhost", server.port)));
+  shared_ptr<TTransport> framed(new TFramedTransport(batchTransport));
+  EchoClient client(std::make_shared<TBinaryProtocol>(framed));
+  framed->open();
+
+  // A failed call is thrown after the replies to the others have been read
+  TClientBatch<EchoClient> batch(client, batchTransport);
+  std::vector<std::string> replies;
+  for (const char* payload : {"a", "fail", "b", "fail", "c"}) {
+    std::string sent(payload);
+    batch.add([sent](EchoClient& c) { c.send_echo(sent); },
+              [&replies](EchoClient& c) { replies.push_back(c.recv_echo()); });
+  }
+  BOOST_CHECK_THROW(batch.execute(), TApplicationException);
+  BOOST_CHECK(replies == std::vector<std::string>({"a", "b", "c"}));
+
+  // and the connection is still usable
+  echoAll(batch, makePayloads(3, 8));
+}
+
+BOOST_AUTO_TEST_CASE(test_batch_protocol_error) {
+  EchoServer server;
+  shared_ptr<TBatchTransport> batchTransport(
+      new TBatchTransport(std::make_shared<TSocket>("localhost", server.port)));
+  shared_ptr<TTransport> framed(new TFramedTransport(batchTransport));
+  EchoClient client(std::make_shared<TBinaryProtocol>(framed));
+  framed->open();
+
+  // A response that cannot be decoded stops the batch
+  TClientBatch<EchoClient> batch(client, batchTransport);
+  std::vector<std::string> replies;
+  for (const char* payload : {"a", "garbled", "b"}) {
+    std::string sent(payload);
+    batch.add([sent](EchoClient& c) { c.send_echo(sent); },
+              [&replies](EchoClient& c) {
+                replies.push_back(c.recv_echo());
+                if (replies.back() == "garbled") {
+                  throw TProtocolException(TProtocolException::INVALID_DATA);
+                }
+              });
+  }
+  BOOST_CHECK_THROW(batch.execute(), TProtocolException);
+  BOOST_CHECK(replies == std::vector<std::string>({"a", "garbled"}));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,440 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Measures the throughput of many threads sharing one concurrent client
+ * connection, with TConcurrentClientSyncInfo and with the implementation it
+ * replaced (a map of per-seqid monitors and a shared read mutex).  The
+ * server answers pipelined calls out of order.
+ *
+ * Usage: TConcurrentClientBenchmark [threads] [calls per thread]
+ */
+
+#include <thrift/TApplicationException.h>
+#include <thrift/TProcessor.h>
+#include <thrift/async/TConcurrentClientSyncInfo.h>
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/concurrency/ThreadFactory.h>
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TNonblockingServer.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TNonblockingServerSocket.h>
+#include <thrift/transport/TSocket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace apache::thrift;
+using namespace apache::thrift::concurrency;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::server;
+using namespace apache::thrift::transport;
+
+namespace {
+
+void quiet(const char* message) {
+  (void)message;
+}
+
+/// Answers every call with the string argument it was sent.
+class EchoProcessor : public TProcessor {
+public:
+  bool process(std::shared_ptr<TProtocol> in,
+               std::shared_ptr<TProtocol> out,
+               void* connectionContext) override {
+    (void)connectionContext;
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    std::string payload;
+    in->readMessageBegin(name, type, seqid);
+    in->readString(payload);
+    in->readMessageEnd();
+    in->getTransport()->readEnd();
+
+    out->writeMessageBegin(name, T_REPLY, seqid);
+    out->writeString(payload);
+    out->writeMessageEnd();
+    out->getTransport()->writeEnd();
+    out->getTransport()->flush();
+    return true;
+  }
+};
+
+/*
+ * The previous TConcurrentClientSyncInfo, for comparison.
+ */
+namespace legacy {
+
+class SyncInfo {
+public:
+  typedef std::shared_ptr<Monitor> MonitorPtr;
+
+  SyncInfo()
+    : stop_(false),
+      nextseqid_((std::numeric_limits<int32_t>::max)() - 10),
+      recvPending_(false),
+      wakeupSomeone_(false),
+      seqidPending_(0),
+      mtypePending_(T_CALL) {
+    freeMonitors_.reserve(MONITOR_CACHE_SIZE);
+  }
+
+  int32_t generateSeqId() {
+    Guard seqidGuard(seqidMutex_);
+    if (stop_)
+      throwDeadConnection();
+    if (!seqidToMonitorMap_.empty() && nextseqid_ == seqidToMonitorMap_.begin()->first)
+      throw TApplicationException(TApplicationException::BAD_SEQUENCE_ID,
+                                  "about to repeat a seqid");
+    int32_t newSeqId = nextseqid_;
+    if (nextseqid_ == (std::numeric_limits<int32_t>::max)())
+      nextseqid_ = (std::numeric_limits<int32_t>::min)();
+    else
+      ++nextseqid_;
+    seqidToMonitorMap_[newSeqId] = newMonitor();
+    return newSeqId;
+  }
+
+  bool getPending(std::string& fname, TMessageType& mtype, int32_t& rseqid) {
+    if (stop_)
+      throwDeadConnection();
+    wakeupSomeone_ = false;
+    if (recvPending_) {
+      recvPending_ = false;
+      rseqid = seqidPending_;
+      fname = fnamePending_;
+      mtype = mtypePending_;
+      return true;
+    }
+    return false;
+  }
+
+  void updatePending(const std::string& fname, TMessageType mtype, int32_t rseqid) {
+    recvPending_ = true;
+    seqidPending_ = rseqid;
+    fnamePending_ = fname;
+    mtypePending_ = mtype;
+    MonitorPtr monitor;
+    {
+      Guard seqidGuard(seqidMutex_);
+      auto i = seqidToMonitorMap_.find(rseqid);
+      if (i == seqidToMonitorMap_.end())
+        throw TApplicationException(TApplicationException::BAD_SEQUENCE_ID,
+                                    "server sent a bad seqid");
+      monitor = i->second;
+    }
+    monitor->notify();
+  }
+
+  void waitForWork(int32_t seqid) {
+    MonitorPtr m;
+    {
+      Guard seqidGuard(seqidMutex_);
+      m = seqidToMonitorMap_[seqid];
+    }
+    while (true) {
+      if (stop_)
+        throwDeadConnection();
+      if (wakeupSomeone_)
+        return;
+      if (recvPending_ && seqidPending_ == seqid)
+        return;
+      m->waitForever();
+    }
+  }
+
+  void endRecv(int32_t seqid, bool committed) {
+    Guard seqidGuard(seqidMutex_);
+    deleteMonitor(seqidToMonitorMap_[seqid]);
+    seqidToMonitorMap_.erase(seqid);
+    wakeupSomeone_ = true;
+    if (!committed) {
+      stop_ = true;
+      for (auto& i : seqidToMonitorMap_)
+        i.second->notify();
+    } else if (!seqidToMonitorMap_.empty()) {
+      seqidToMonitorMap_.rbegin()->second->notify();
+    }
+  }
+
+  void markBad() {
+    Guard seqidGuard(seqidMutex_);
+    wakeupSomeone_ = true;
+    stop_ = true;
+    for (auto& i : seqidToMonitorMap_)
+      i.second->notify();
+  }
+
+  Mutex& getReadMutex() { return readMutex_; }
+  Mutex& getWriteMutex() { return writeMutex_; }
+
+private:
+  enum { MONITOR_CACHE_SIZE = 10 };
+
+  MonitorPtr newMonitor() {
+    if (freeMonitors_.empty())
+      return std::make_shared<Monitor>(&readMutex_);
+    MonitorPtr retval;
+    retval.swap(freeMonitors_.back());
+    freeMonitors_.pop_back();
+    return retval;
+  }
+
+  void deleteMonitor(MonitorPtr& m) {
+    if (freeMonitors_.size() > MONITOR_CACHE_SIZE) {
+      m.reset();
+      return;
+    }
+    freeMonitors_.push_back(MonitorPtr());
+    m.swap(freeMonitors_.back());
+  }
+
+  static void throwDeadConnection() {
+    throw TTransportException(TTransportException::NOT_OPEN, "client died");
+  }
+
+  volatile bool stop_;
+  Mutex seqidMutex_;
+  int32_t nextseqid_;
+  std::map<int32_t, MonitorPtr> seqidToMonitorMap_;
+  std::vector<MonitorPtr> freeMonitors_;
+  Mutex writeMutex_;
+  Mutex readMutex_;
+  bool recvPending_;
+  bool wakeupSomeone_;
+  int32_t seqidPending_;
+  std::string fnamePending_;
+  TMessageType mtypePending_;
+};
+
+class SendSentry {
+public:
+  explicit SendSentry(SyncInfo* sync) : sync_(*sync), committed_(false) {
+    sync_.getWriteMutex().lock();
+  }
+  ~SendSentry() {
+    if (!committed_)
+      sync_.markBad();
+    sync_.getWriteMutex().unlock();
+  }
+  void commit() { committed_ = true; }
+
+private:
+  SyncInfo& sync_;
+  bool committed_;
+};
+
+class RecvSentry {
+public:
+  RecvSentry(SyncInfo* sync, int32_t seqid) : sync_(*sync), seqid_(seqid), committed_(false) {
+    sync_.getReadMutex().lock();
+  }
+  ~RecvSentry() {
+    sync_.endRecv(seqid_, committed_);
+    sync_.getReadMutex().unlock();
+  }
+  void commit() { committed_ = true; }
+
+private:
+  SyncInfo& sync_;
+  int32_t seqid_;
+  bool committed_;
+};
+
+} // namespace legacy
+
+struct Current {
+  typedef async::TConcurrentClientSyncInfo SyncInfo;
+  typedef async::TConcurrentSendSentry SendSentry;
+  typedef async::TConcurrentRecvSentry RecvSentry;
+};
+
+struct Legacy {
+  typedef legacy::SyncInfo SyncInfo;
+  typedef legacy::SendSentry SendSentry;
+  typedef legacy::RecvSentry RecvSentry;
+};
+
+/// What the compiler generates for "string echo(1: string payload)" in a
+/// concurrent client.
+template <class Impl>
+class EchoConcurrentClient {
+public:
+  explicit EchoConcurrentClient(std::shared_ptr<TProtocol> prot)
+    : prot_(prot), sync_(std::make_shared<typename Impl::SyncInfo>()) {}
+
+  std::string echo(const std::string& payload) {
+    int32_t seqid = send_echo(payload);
+    return recv_echo(seqid);
+  }
+
+  int32_t send_echo(const std::string& payload) {
+    int32_t cseqid = sync_->generateSeqId();
+    typename Impl::SendSentry sentry(sync_.get());
+    prot_->writeMessageBegin("echo", T_CALL, cseqid);
+    prot_->writeString(payload);
+    prot_->writeMessageEnd();
+    prot_->getTransport()->writeEnd();
+    prot_->getTransport()->flush();
+    sentry.commit();
+    return cseqid;
+  }
+
+  std::string recv_echo(const int32_t seqid) {
+    int32_t rseqid = 0;
+    std::string fname;
+    TMessageType mtype;
+    typename Impl::RecvSentry sentry(sync_.get(), seqid);
+    while (true) {
+      if (!sync_->getPending(fname, mtype, rseqid)) {
+        prot_->readMessageBegin(fname, mtype, rseqid);
+      }
+      if (seqid == rseqid) {
+        std::string reply;
+        prot_->readString(reply);
+        prot_->readMessageEnd();
+        prot_->getTransport()->readEnd();
+        sentry.commit();
+        return reply;
+      }
+      sync_->updatePending(fname, mtype, rseqid);
+      sync_->waitForWork(seqid);
+    }
+  }
+
+private:
+  std::shared_ptr<TProtocol> prot_;
+  std::shared_ptr<typename Impl::SyncInfo> sync_;
+};
+
+struct Result {
+  double seconds;
+  double p99;
+  int errors;
+};
+
+template <class Impl>
+Result run(int port, int threads, int calls) {
+  std::shared_ptr<TSocket> socket = std::make_shared<TSocket>("localhost", port);
+  socket->setNoDelay(true);
+  std::shared_ptr<TFramedTransport> transport = std::make_shared<TFramedTransport>(socket);
+  transport->open();
+  EchoConcurrentClient<Impl> client(std::make_shared<TBinaryProtocol>(transport));
+
+  std::atomic<int> errors(0);
+  std::vector<std::vector<double> > latencies(threads);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&client, &errors, &latencies, t, calls] {
+      const std::string payload = "call " + std::to_string(t);
+      latencies[t].reserve(calls);
+      try {
+        for (int i = 0; i < calls; ++i) {
+          auto begin = std::chrono::steady_clock::now();
+          if (client.echo(payload) != payload) {
+            ++errors;
+          }
+          latencies[t].push_back(
+              std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin)
+                  .count());
+        }
+      } catch (const std::exception& e) {
+        std::cerr << "client: " << e.what() << std::endl;
+        ++errors;
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  Result result;
+  result.seconds
+      = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::vector<double> all;
+  for (auto& l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  std::sort(all.begin(), all.end());
+  result.p99 = all.empty() ? 0 : all[static_cast<size_t>(0.99 * (all.size() - 1))];
+  result.errors = errors;
+  transport->close();
+  return result;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  int threads = argc > 1 ? std::atoi(argv[1]) : 256;
+  int calls = argc > 2 ? std::atoi(argv[2]) : 2000;
+  if (threads <= 0 || calls <= 0) {
+    std::cerr << "Usage: " << argv[0] << " [threads] [calls per thread]" << std::endl;
+    return 1;
+  }
+
+  TOutput::instance().setOutputFunction(quiet);
+
+  std::shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(4);
+  threadManager->threadFactory(std::make_shared<ThreadFactory>());
+  threadManager->start();
+  std::shared_ptr<TNonblockingServer> server
+      = std::make_shared<TNonblockingServer>(std::make_shared<EchoProcessor>(),
+                                             std::make_shared<TBinaryProtocolFactory>(),
+                                             std::make_shared<TNonblockingServerSocket>(0),
+                                             threadManager);
+  server->setMaxPipelinedRequests(static_cast<size_t>(threads));
+  std::thread serverThread([server] { server->serve(); });
+  while (server->getListenPort() == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  int port = server->getListenPort();
+
+  std::cout << threads << " threads x " << calls << " calls over one connection" << std::endl;
+  std::cout << std::left << std::setw(28) << "sync info" << std::right << std::setw(12)
+            << "calls/s" << std::setw(12) << "p99 us" << std::endl;
+
+  int errors = 0;
+  const char* names[] = {"map of monitors (previous)", "slot table"};
+  for (int i = 0; i < 2; ++i) {
+    Result result = i == 0 ? run<Legacy>(port, threads, calls) : run<Current>(port, threads, calls);
+    errors += result.errors;
+    std::cout << std::left << std::setw(28) << names[i] << std::right << std::fixed
+              << std::setprecision(0) << std::setw(12)
+              << (threads * static_cast<double>(calls)) / result.seconds << std::setw(12)
+              << result.p99 << std::endl;
+  }
+
+  server->stop();
+  serverThread.join();
+  threadManager->stop();
+  return errors ? 1 : 0;
+}
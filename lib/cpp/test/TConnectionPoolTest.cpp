@@ -0,0 +1,213 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TConnectionPool.h>
+#include <thrift/transport/TServerSocket.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "TestServers.h"
+
+using apache::thrift::protocol::T_CALL;
+using apache::thrift::protocol::TBinaryProtocol;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::test::EchoServer;
+using apache::thrift::transport::TConnectionPool;
+using apache::thrift::transport::TConnectionPoolServerStats;
+using apache::thrift::transport::TFramedTransportFactory;
+using apache::thrift::transport::TPooledConnection;
+using apache::thrift::transport::TPooledTransport;
+using apache::thrift::transport::TServerSocket;
+using apache::thrift::transport::TSocketPoolServer;
+using apache::thrift::transport::TTransport;
+using apache::thrift::transport::TTransportException;
+using std::shared_ptr;
+
+namespace {
+
+std::string call(TBinaryProtocol& protocol, const std::string& payload) {
+  protocol.writeMessageBegin("echo", T_CALL, 0);
+  protocol.writeString(payload);
+  protocol.writeMessageEnd();
+  protocol.getTransport()->writeEnd();
+  protocol.getTransport()->flush();
+
+  std::string name;
+  TMessageType type;
+  int32_t seqid;
+  std::string reply;
+  protocol.readMessageBegin(name, type, seqid);
+  protocol.readString(reply);
+  protocol.readMessageEnd();
+  protocol.getTransport()->readEnd();
+  return reply;
+}
+
+int unusedPort() {
+  TServerSocket socket("localhost", 0);
+  socket.listen();
+  int port = socket.getPort();
+  socket.close();
+  return port;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(TConnectionPoolTest)
+
+BOOST_AUTO_TEST_CASE(test_reuses_connections) {
+  EchoServer echo;
+  std::vector<shared_ptr<TSocketPoolServer> > servers;
+  servers.push_back(std::make_shared<TSocketPoolServer>("localhost", echo.port));
+  shared_ptr<TConnectionPool> pool(
+      new TConnectionPool(servers, std::make_shared<TFramedTransportFactory>()));
+
+  TBinaryProtocol protocol(std::make_shared<TPooledTransport>(pool));
+  for (int i = 0; i < 10; ++i) {
+    BOOST_CHECK_EQUAL("hello", call(protocol, "hello"));
+  }
+
+  std::vector<TConnectionPoolServerStats> stats = pool->getServerStats();
+  BOOST_REQUIRE_EQUAL(1u, stats.size());
+  BOOST_CHECK_EQUAL(10u, stats[0].checkouts);
+  BOOST_CHECK_EQUAL(0u, stats[0].inFlight);
+  BOOST_CHECK_EQUAL(1u, stats[0].idle);
+  BOOST_CHECK(stats[0].latency > 0);
+  BOOST_CHECK_EQUAL(1, echo.counter->connections);
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_by_threads) {
+  EchoServer echo;
+  std::vector<shared_ptr<TSocketPoolServer> > servers;
+  servers.push_back(std::make_shared<TSocketPoolServer>("localhost", echo.port));
+  shared_ptr<TConnectionPool> pool(
+      new TConnectionPool(servers, std::make_shared<TFramedTransportFactory>()));
+  pool->setMaxIdlePerServer(4);
+
+  std::atomic<int> errors(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([pool, &errors] {
+      TBinaryProtocol protocol(std::make_shared<TPooledTransport>(pool));
+      for (int i = 0; i < 100; ++i) {
+        if (call(protocol, "payload") != "payload") {
+          ++errors;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  BOOST_CHECK_EQUAL(0, errors);
+  std::vector<TConnectionPoolServerStats> stats = pool->getServerStats();
+  BOOST_CHECK_EQUAL(400u, stats[0].checkouts);
+  BOOST_CHECK_EQUAL(0u, stats[0].inFlight);
+  BOOST_CHECK(echo.counter->connections <= 4);
+}
+
+BOOST_AUTO_TEST_CASE(test_ejects_dead_server) {
+  EchoServer echo;
+  std::vector<shared_ptr<TSocketPoolServer> > servers;
+  servers.push_back(std::make_shared<TSocketPoolServer>("localhost", unusedPort()));
+  servers.push_back(std::make_shared<TSocketPoolServer>("localhost", echo.port));
+  shared_ptr<TConnectionPool> pool(
+      new TConnectionPool(servers, std::make_shared<TFramedTransportFactory>()));
+  pool->setMaxConsecutiveFailures(2);
+
+  TBinaryProtocol protocol(std::make_shared<TPooledTransport>(pool));
+  for (int i = 0; i < 50; ++i) {
+    BOOST_CHECK_EQUAL("hello", call(protocol, "hello"));
+  }
+
+  std::vector<TConnectionPoolServerStats> stats = pool->getServerStats();
+  BOOST_CHECK(stats[0].ejected);
+  BOOST_CHECK_EQUAL(2u, stats[0].failures);
+  BOOST_CHECK(!stats[1].ejected);
+  BOOST_CHECK_EQUAL(50u, stats[1].checkouts);
+}
+
+BOOST_AUTO_TEST_CASE(test_only_probe_reinstates_server) {
+  EchoServer echo;
+  std::vector<shared_ptr<TSocketPoolServer> > servers;
+  servers.push_back(std::make_shared<TSocketPoolServer>("localhost", echo.port));
+  shared_ptr<TConnectionPool> pool(new TConnectionPool(servers));
+  pool->setMaxConsecutiveFailures(2);
+
+  shared_ptr<TPooledConnection> first = pool->checkout();
+  shared_ptr<TPooledConnection> second = pool->checkout();
+  shared_ptr<TPooledConnection> third = pool->checkout();
+  pool->checkin(first, false);
+  pool->checkin(second, false);
+  BOOST_CHECK(pool->getServerStats()[0].ejected);
+
+  // A call that started before the ejection does not end it
+  pool->checkin(third, true);
+  BOOST_CHECK(pool->getServerStats()[0].ejected);
+
+  // Nor does a call alongside the probe, while the probe does
+  shared_ptr<TPooledConnection> probe = pool->checkout();
+  shared_ptr<TPooledConnection> other = pool->checkout();
+  pool->checkin(other, true);
+  BOOST_CHECK(pool->getServerStats()[0].ejected);
+  pool->checkin(probe, true);
+  BOOST_CHECK(!pool->getServerStats()[0].ejected);
+}
+
+BOOST_AUTO_TEST_CASE(test_release_is_neutral) {
+  EchoServer echo;
+  std::vector<shared_ptr<TSocketPoolServer> > servers;
+  servers.push_back(std::make_shared<TSocketPoolServer>("localhost", echo.port));
+  shared_ptr<TConnectionPool> pool(new TConnectionPool(servers));
+  pool->setMaxConsecutiveFailures(2);
+
+  // A released connection neither resets the failure count
+  pool->checkin(pool->checkout(), false);
+  pool->release(pool->checkout());
+  BOOST_CHECK(!pool->getServerStats()[0].ejected);
+  pool->checkin(pool->checkout(), false);
+  BOOST_CHECK(pool->getServerStats()[0].ejected);
+
+  // nor reinstates the server, but lets it be probed again
+  pool->release(pool->checkout());
+  BOOST_CHECK(pool->getServerStats()[0].ejected);
+  pool->checkin(pool->checkout(), true);
+  BOOST_CHECK(!pool->getServerStats()[0].ejected);
+  BOOST_CHECK_EQUAL(0u, pool->getServerStats()[0].inFlight);
+}
+
+BOOST_AUTO_TEST_CASE(test_no_server) {
+  std::vector<shared_ptr<TSocketPoolServer> > servers;
+  servers.push_back(std::make_shared<TSocketPoolServer>("localhost", unusedPort()));
+  shared_ptr<TConnectionPool> pool(new TConnectionPool(servers));
+
+  BOOST_CHECK_THROW(pool->checkout(), TTransportException);
+  std::vector<TConnectionPoolServerStats> stats = pool->getServerStats();
+  BOOST_CHECK_EQUAL(0u, stats[0].inFlight);
+  BOOST_CHECK_EQUAL(1u, stats[0].failures);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,195 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <thrift/transport/TDnsCache.h>
+#include <thrift/transport/TServerSocket.h>
+#include <thrift/transport/TSocket.h>
+#include <thrift/transport/TTransportException.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using apache::thrift::transport::TDnsCache;
+using apache::thrift::transport::TResolvedAddress;
+using apache::thrift::transport::TServerSocket;
+using apache::thrift::transport::TSocket;
+using apache::thrift::transport::TTransport;
+using apache::thrift::transport::TTransportException;
+using std::shared_ptr;
+
+namespace {
+
+TResolvedAddress ipv4Address(const char* ip, int port) {
+  TResolvedAddress address;
+  std::memset(&address, 0, sizeof(address));
+  sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&address.addr);
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons(static_cast<uint16_t>(port));
+  inet_pton(AF_INET, ip, &sin->sin_addr);
+  address.family = AF_INET;
+  address.socktype = SOCK_STREAM;
+  address.protocol = IPPROTO_TCP;
+  address.addrlen = sizeof(sockaddr_in);
+  return address;
+}
+
+/// A server socket listening on an ephemeral port
+struct Listener {
+  Listener() : socket("localhost", 0) {
+    socket.listen();
+    port = socket.getPort();
+  }
+
+  TServerSocket socket;
+  int port;
+};
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(TDnsCacheTest)
+
+BOOST_AUTO_TEST_CASE(test_caches_lookups) {
+  TDnsCache cache(60000);
+  bool cached = true;
+  shared_ptr<const TDnsCache::Addresses> first = cache.resolve("localhost", 9090, &cached);
+  BOOST_CHECK(!cached);
+  BOOST_CHECK(!first->empty());
+  shared_ptr<const TDnsCache::Addresses> second = cache.resolve("localhost", 9090, &cached);
+  BOOST_CHECK(cached);
+  BOOST_CHECK_EQUAL(first.get(), second.get());
+  BOOST_CHECK_EQUAL(1u, cache.getNumMisses());
+  BOOST_CHECK_EQUAL(1u, cache.getNumHits());
+
+  // Ports are cached apart, as the addresses include them
+  cache.resolve("localhost", 9091, &cached);
+  BOOST_CHECK(!cached);
+
+  cache.invalidate("localhost", 9090);
+  cache.resolve("localhost", 9090, &cached);
+  BOOST_CHECK(!cached);
+  BOOST_CHECK_EQUAL(3u, cache.getNumMisses());
+}
+
+BOOST_AUTO_TEST_CASE(test_expires_lookups) {
+  TDnsCache cache(20);
+  bool cached;
+  cache.resolve("localhost", 9090, &cached);
+  cache.resolve("localhost", 9090, &cached);
+  BOOST_CHECK(cached);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  cache.resolve("localhost", 9090, &cached);
+  BOOST_CHECK(!cached);
+}
+
+BOOST_AUTO_TEST_CASE(test_does_not_cache_failures) {
+  TDnsCache cache;
+  BOOST_CHECK_THROW(cache.resolve("host.invalid", 9090), TTransportException);
+  BOOST_CHECK_THROW(cache.resolve("host.invalid", 9090), TTransportException);
+  BOOST_CHECK_EQUAL(2u, cache.getNumMisses());
+}
+
+BOOST_AUTO_TEST_CASE(test_concurrent_lookups_share_one) {
+  TDnsCache cache;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.push_back(std::thread([&cache] { cache.resolve("localhost", 9090); }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  BOOST_CHECK_EQUAL(1u, cache.getNumMisses());
+  BOOST_CHECK_EQUAL(7u, cache.getNumHits());
+}
+
+BOOST_AUTO_TEST_CASE(test_socket_uses_cache) {
+  Listener listener;
+  shared_ptr<TDnsCache> cache(new TDnsCache());
+  for (int i = 0; i < 3; ++i) {
+    TSocket socket("localhost", listener.port);
+    socket.setDnsCache(cache);
+    socket.open();
+    BOOST_CHECK_EQUAL(i > 0, socket.getConnectStats().resolvedFromCache);
+    BOOST_CHECK_EQUAL(1u, socket.getConnectStats().attempts);
+    BOOST_CHECK_GE(socket.getConnectStats().connectMicros, 0);
+  }
+  BOOST_CHECK_EQUAL(1u, cache->getNumMisses());
+
+  // Addresses nothing listens on are looked up again
+  TSocket socket("localhost", listener.port);
+  socket.setDnsCache(cache);
+  std::shared_ptr<TDnsCache::Addresses> addresses(new TDnsCache::Addresses());
+  addresses->push_back(ipv4Address("127.0.0.1", 1));
+  cache->insert("localhost", listener.port, addresses);
+  BOOST_CHECK_THROW(socket.open(), TTransportException);
+  socket.open();
+  BOOST_CHECK(!socket.getConnectStats().resolvedFromCache);
+}
+
+BOOST_AUTO_TEST_CASE(test_parallel_connect) {
+  Listener listener;
+  shared_ptr<TDnsCache> cache(new TDnsCache());
+  std::shared_ptr<TDnsCache::Addresses> addresses(new TDnsCache::Addresses());
+  // Refused right away, then not answered (or unreachable), then listening
+  addresses->push_back(ipv4Address("127.0.0.1", 1));
+  addresses->push_back(ipv4Address("10.255.255.1", listener.port));
+  addresses->push_back(ipv4Address("127.0.0.1", listener.port));
+  cache->insert("server", listener.port, addresses);
+
+  TSocket socket("server", listener.port);
+  socket.setDnsCache(cache);
+  socket.setConnTimeout(10000);
+  socket.setConnAttemptDelay(50);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  socket.open();
+  BOOST_CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+  BOOST_CHECK(socket.isOpen());
+  BOOST_CHECK_EQUAL(3u, socket.getConnectStats().attempts);
+  BOOST_CHECK_EQUAL(listener.port, socket.getPeerPort());
+
+  // Connected sockets block as usual
+  uint8_t byte = 42;
+  socket.write(&byte, 1);
+  shared_ptr<TTransport> accepted = listener.socket.accept();
+  byte = 0;
+  BOOST_CHECK_EQUAL(1u, accepted->read(&byte, 1));
+  BOOST_CHECK_EQUAL(42, byte);
+  accepted->write(&byte, 1);
+  BOOST_CHECK_EQUAL(1u, socket.read(&byte, 1));
+}
+
+BOOST_AUTO_TEST_CASE(test_parallel_connect_fails) {
+  shared_ptr<TDnsCache> cache(new TDnsCache());
+  std::shared_ptr<TDnsCache::Addresses> addresses(new TDnsCache::Addresses());
+  addresses->push_back(ipv4Address("127.0.0.1", 1));
+  addresses->push_back(ipv4Address("127.0.0.1", 2));
+  cache->insert("server", 1, addresses);
+
+  TSocket socket("server", 1);
+  socket.setDnsCache(cache);
+  socket.setConnAttemptDelay(50);
+  BOOST_CHECK_THROW(socket.open(), TTransportException);
+  BOOST_CHECK(!socket.isOpen());
+  BOOST_CHECK_EQUAL(2u, socket.getConnectStats().attempts);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
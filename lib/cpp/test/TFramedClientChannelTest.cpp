@@ -0,0 +1,492 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define BOOST_TEST_MODULE TFramedClientChannelTest
+#include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <thrift/TProcessor.h>
+#include <thrift/async/TAsyncProcessor.h>
+#include <thrift/async/TFramedClientChannel.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TNonblockingServer.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TNonblockingServerSocket.h>
+#include <thrift/transport/TServerSocket.h>
+#include <thrift/transport/TSocket.h>
+
+#include <event2/event.h>
+
+#include "gen-cpp/FutureService.h"
+#include "TestServers.h"
+
+using apache::thrift::TProcessor;
+using apache::thrift::async::TAsyncChannel;
+using apache::thrift::async::TAsyncProcessor;
+using apache::thrift::async::TFramedClientChannel;
+using apache::thrift::protocol::T_CALL;
+using apache::thrift::protocol::T_REPLY;
+using apache::thrift::protocol::TBinaryProtocolFactory;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::protocol::TProtocolFactory;
+using apache::thrift::server::TNonblockingServer;
+using apache::thrift::test::EchoServer;
+using apache::thrift::transport::TFramedTransport;
+using apache::thrift::transport::TMemoryBuffer;
+using apache::thrift::transport::TNonblockingServerSocket;
+using apache::thrift::transport::TServerSocket;
+using apache::thrift::transport::TSocket;
+using apache::thrift::transport::TTransportException;
+using std::shared_ptr;
+using futureclienttest::Failure;
+using futureclienttest::FutureServiceCobClient;
+using futureclienttest::FutureServiceIf;
+using futureclienttest::FutureServiceProcessor;
+using futureclienttest::Pair;
+
+namespace {
+
+/// Serves FutureService
+class FutureHandler : public FutureServiceIf {
+public:
+  void echo(std::string& _return, const std::string& text) override { _return = text; }
+
+  int32_t add(const int32_t a, const int32_t b) override { return a + b; }
+
+  void swap(Pair& _return, const Pair& pair) override {
+    _return.first = pair.second;
+    _return.second = pair.first;
+  }
+
+  void ping() override {}
+
+  void fail(const std::string& message) override {
+    Failure failure;
+    failure.message = message;
+    throw failure;
+  }
+};
+
+/// What the compiler generates for a cob client of
+/// "string echo(1: string payload)"
+class EchoCobClient {
+public:
+  EchoCobClient(shared_ptr<TAsyncChannel> channel, TProtocolFactory* protocolFactory)
+    : channel_(channel),
+      itrans_(new TMemoryBuffer()),
+      otrans_(new TMemoryBuffer()),
+      protocolFactory_(protocolFactory),
+      piprot_(protocolFactory->getProtocol(itrans_)),
+      poprot_(protocolFactory->getProtocol(otrans_)) {}
+
+  void echo(std::function<void(EchoCobClient* client)> cob, const std::string& payload) {
+    send_echo(payload);
+    channel_->sendAndRecvMessage(std::bind(cob, this), otrans_.get(), itrans_.get());
+  }
+
+  std::future<std::string> future_echo(const std::string& payload) {
+    shared_ptr<std::promise<std::string> > promise(new std::promise<std::string>());
+    shared_ptr<EchoCobClient> client(new EchoCobClient(channel_, protocolFactory_));
+    client->echo([promise, client](EchoCobClient* c) {
+      try {
+        promise->set_value(c->recv_echo());
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    }, payload);
+    return promise->get_future();
+  }
+
+  void send_echo(const std::string& payload) {
+    poprot_->writeMessageBegin("echo", T_CALL, 0);
+    poprot_->writeString(payload);
+    poprot_->writeMessageEnd();
+    poprot_->getTransport()->writeEnd();
+    poprot_->getTransport()->flush();
+  }
+
+  std::string recv_echo() {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    std::string reply;
+    piprot_->readMessageBegin(name, type, seqid);
+    piprot_->readString(reply);
+    piprot_->readMessageEnd();
+    piprot_->getTransport()->readEnd();
+    return reply;
+  }
+
+private:
+  shared_ptr<TAsyncChannel> channel_;
+  shared_ptr<TMemoryBuffer> itrans_;
+  shared_ptr<TMemoryBuffer> otrans_;
+  TProtocolFactory* protocolFactory_;
+  shared_ptr<TProtocol> piprot_;
+  shared_ptr<TProtocol> poprot_;
+};
+
+/**
+ * Answers "echo" with what two calls to the downstream service return,
+ * made at once over a channel on the server's own event loop.
+ */
+class FanOutProcessor : public TAsyncProcessor {
+public:
+  FanOutProcessor(shared_ptr<TAsyncChannel> channel) : channel_(channel) {}
+
+  void process(std::function<void(bool success)> _return,
+               shared_ptr<TProtocol> in,
+               shared_ptr<TProtocol> out) override {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    std::string payload;
+    in->readMessageBegin(name, type, seqid);
+    in->readString(payload);
+    in->readMessageEnd();
+    in->getTransport()->readEnd();
+
+    struct Replies {
+      int left;
+      std::string values[2];
+    };
+    shared_ptr<Replies> replies(new Replies());
+    replies->left = 2;
+    for (int i = 0; i < 2; ++i) {
+      shared_ptr<EchoCobClient> client(new EchoCobClient(channel_, &protocolFactory_));
+      client->echo([=](EchoCobClient* c) {
+        try {
+          replies->values[i] = c->recv_echo();
+        } catch (const TTransportException&) {
+          replies->values[i] = "failed";
+        }
+        if (--replies->left == 0) {
+          out->writeMessageBegin(name, T_REPLY, seqid);
+          out->writeString(replies->values[0] + "|" + replies->values[1]);
+          out->writeMessageEnd();
+          out->getTransport()->writeEnd();
+          out->getTransport()->flush();
+          _return(true);
+        }
+        (void)client;
+      }, payload + "#" + std::to_string(i));
+    }
+  }
+
+private:
+  shared_ptr<TAsyncChannel> channel_;
+  TBinaryProtocolFactory protocolFactory_;
+};
+
+/**
+ * Echoes its argument right away, but for "throw", for which it hands the
+ * callback to another thread that calls it a while later, and then throws.
+ */
+class DeferThenThrowProcessor : public TAsyncProcessor {
+public:
+  ~DeferThenThrowProcessor() override { join(); }
+
+  void process(std::function<void(bool success)> _return,
+               shared_ptr<TProtocol> in,
+               shared_ptr<TProtocol> out) override {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    std::string payload;
+    in->readMessageBegin(name, type, seqid);
+    in->readString(payload);
+    in->readMessageEnd();
+    in->getTransport()->readEnd();
+    if (payload == "throw") {
+      late_ = std::thread([_return] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        _return(false);
+      });
+      throw std::runtime_error("handler failed");
+    }
+
+    out->writeMessageBegin(name, T_REPLY, seqid);
+    out->writeString(payload);
+    out->writeMessageEnd();
+    out->getTransport()->writeEnd();
+    out->getTransport()->flush();
+    _return(true);
+  }
+
+  void join() {
+    if (late_.joinable()) {
+      late_.join();
+    }
+  }
+
+private:
+  std::thread late_;
+};
+
+/// Make a blocking echo call to the given port.
+std::string callEcho(int port, const std::string& payload) {
+  shared_ptr<TSocket> socket(new TSocket("localhost", port));
+  shared_ptr<TFramedTransport> transport(new TFramedTransport(socket));
+  shared_ptr<TProtocol> prot(TBinaryProtocolFactory().getProtocol(transport));
+  transport->open();
+  prot->writeMessageBegin("echo", T_CALL, 0);
+  prot->writeString(payload);
+  prot->writeMessageEnd();
+  transport->writeEnd();
+  transport->flush();
+
+  std::string name;
+  TMessageType type;
+  int32_t seqid;
+  std::string reply;
+  prot->readMessageBegin(name, type, seqid);
+  prot->readString(reply);
+  prot->readMessageEnd();
+  transport->readEnd();
+  return reply;
+}
+
+void wakeUp(evutil_socket_t, short, void*) {}
+
+/// An event loop thread with a channel on it
+struct ChannelFixture {
+  ChannelFixture() : base(event_base_new()), stopping(false) {
+    // the loop checks whether to stop every so often
+    wake = event_new(base, -1, EV_PERSIST, wakeUp, nullptr);
+    struct timeval tv = {0, 10000};
+    event_add(wake, &tv);
+  }
+
+  ~ChannelFixture() {
+    stopping = true;
+    if (loop.joinable()) {
+      loop.join();
+    }
+    channel.reset();
+    event_free(wake);
+    event_base_free(base);
+  }
+
+  void connect(int port) {
+    channel.reset(new TFramedClientChannel("localhost", port, base));
+    loop = std::thread([this] {
+      while (!stopping) {
+        event_base_loop(base, EVLOOP_ONCE);
+      }
+    });
+  }
+
+  struct event_base* base;
+  struct event* wake;
+  std::atomic<bool> stopping;
+  std::thread loop;
+  shared_ptr<TFramedClientChannel> channel;
+  TBinaryProtocolFactory protocolFactory;
+};
+
+} // namespace
+
+BOOST_FIXTURE_TEST_SUITE(TFramedClientChannelTest, ChannelFixture)
+
+BOOST_AUTO_TEST_CASE(test_pipelines_calls) {
+  EchoServer server;
+  connect(server.port);
+  EchoCobClient client(channel, &protocolFactory);
+
+  std::vector<std::future<std::string> > replies;
+  for (int i = 0; i < 1000; ++i) {
+    replies.push_back(client.future_echo("hello" + std::to_string(i)));
+  }
+  for (int i = 0; i < 1000; ++i) {
+    BOOST_CHECK_EQUAL("hello" + std::to_string(i), replies[i].get());
+  }
+  BOOST_CHECK_EQUAL(0u, channel->getNumPendingCalls());
+  BOOST_CHECK(channel->good());
+}
+
+BOOST_AUTO_TEST_CASE(test_generated_future_client) {
+  EchoServer server(std::make_shared<FutureServiceProcessor>(std::make_shared<FutureHandler>()));
+  connect(server.port);
+  FutureServiceCobClient client(channel, &protocolFactory);
+
+  // all in flight at once, with each kind of result
+  std::vector<std::future<int32_t> > sums;
+  for (int i = 0; i < 100; ++i) {
+    sums.push_back(client.future_add(i, 1000));
+  }
+  Pair pair;
+  pair.first = "first";
+  pair.second = "second";
+  std::future<Pair> swapped = client.future_swap(pair);
+  std::future<std::string> echoed = client.future_echo("hello");
+  std::future<void> pinged = client.future_ping();
+  std::future<void> failed = client.future_fail("declined");
+
+  for (int i = 0; i < 100; ++i) {
+    BOOST_CHECK_EQUAL(i + 1000, sums[i].get());
+  }
+  Pair reply = swapped.get();
+  BOOST_CHECK_EQUAL("second", reply.first);
+  BOOST_CHECK_EQUAL("first", reply.second);
+  BOOST_CHECK_EQUAL("hello", echoed.get());
+  BOOST_CHECK_NO_THROW(pinged.get());
+  try {
+    failed.get();
+    BOOST_ERROR("the declared exception was not thrown");
+  } catch (const Failure& failure) {
+    BOOST_CHECK_EQUAL("declined", failure.message);
+  }
+  BOOST_CHECK_EQUAL(0u, channel->getNumPendingCalls());
+}
+
+BOOST_AUTO_TEST_CASE(test_calls_from_many_threads) {
+  EchoServer server;
+  connect(server.port);
+  EchoCobClient client(channel, &protocolFactory);
+
+  std::atomic<int> wrong(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.push_back(std::thread([&, t] {
+      std::vector<std::future<std::string> > replies;
+      for (int i = 0; i < 200; ++i) {
+        replies.push_back(client.future_echo(std::to_string(t) + "/" + std::to_string(i)));
+      }
+      for (int i = 0; i < 200; ++i) {
+        if (replies[i].get() != std::to_string(t) + "/" + std::to_string(i)) {
+          ++wrong;
+        }
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  BOOST_CHECK_EQUAL(0, wrong);
+}
+
+BOOST_AUTO_TEST_CASE(test_call_timeout) {
+  EchoServer server;
+  connect(server.port);
+  EchoCobClient client(channel, &protocolFactory);
+
+  channel->setCallTimeout(50);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::future<std::string> slow = client.future_echo("slow");
+  BOOST_CHECK_THROW(slow.get(), TTransportException);
+  BOOST_CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(180));
+  BOOST_CHECK_EQUAL(1u, channel->getNumTimeouts());
+  BOOST_CHECK(channel->timedOut());
+
+  // the late response to the slow call is dropped
+  channel->setCallTimeout(0);
+  BOOST_CHECK_EQUAL("fast", client.future_echo("fast").get());
+  BOOST_CHECK(!channel->timedOut());
+}
+
+BOOST_AUTO_TEST_CASE(test_connection_failure) {
+  int port;
+  {
+    TServerSocket socket("localhost", 0);
+    socket.listen();
+    port = socket.getPort();
+  }
+  connect(port);
+  EchoCobClient client(channel, &protocolFactory);
+
+  BOOST_CHECK_THROW(client.future_echo("hello").get(), TTransportException);
+  BOOST_CHECK(channel->error());
+  BOOST_CHECK_EQUAL(0u, channel->getNumPendingCalls());
+}
+
+BOOST_AUTO_TEST_CASE(test_fan_out_from_async_server) {
+  EchoServer downstream;
+  channel.reset(new TFramedClientChannel("localhost", downstream.port, base));
+
+  // the server and the channel share one event loop, and no other thread
+  // takes part in handling requests
+  shared_ptr<TNonblockingServer> server(
+      new TNonblockingServer(shared_ptr<TProcessor>(),
+                             std::make_shared<TBinaryProtocolFactory>(),
+                             std::make_shared<TNonblockingServerSocket>(0)));
+  server->setAsyncProcessor(std::make_shared<FanOutProcessor>(channel));
+  server->registerEvents(base);
+  int port = server->getListenPort();
+  std::thread serving([server] { server->serve(); });
+
+  std::atomic<int> wrong(0);
+  std::vector<std::thread> clients;
+  for (int t = 0; t < 4; ++t) {
+    clients.push_back(std::thread([&, t] {
+      for (int i = 0; i < 25; ++i) {
+        std::string payload = std::to_string(t) + "/" + std::to_string(i);
+        if (callEcho(port, payload) != payload + "#0|" + payload + "#1") {
+          ++wrong;
+        }
+      }
+    }));
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  server->stop();
+  serving.join();
+
+  BOOST_CHECK_EQUAL(0, wrong);
+  BOOST_CHECK_EQUAL(0u, channel->getNumPendingCalls());
+}
+
+BOOST_AUTO_TEST_CASE(test_async_processor_defers_then_throws) {
+  shared_ptr<DeferThenThrowProcessor> processor(new DeferThenThrowProcessor());
+  shared_ptr<TNonblockingServer> server(
+      new TNonblockingServer(shared_ptr<TProcessor>(),
+                             std::make_shared<TBinaryProtocolFactory>(),
+                             std::make_shared<TNonblockingServerSocket>(0)));
+  server->setAsyncProcessor(processor);
+  server->registerEvents(base);
+  int port = server->getListenPort();
+  std::thread serving([server] { server->serve(); });
+
+  // the failed request closes its connection, and the callback that comes
+  // later leaves alone whichever connection takes its place
+  BOOST_CHECK_THROW(callEcho(port, "throw"), TTransportException);
+  std::chrono::steady_clock::time_point end
+      = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+  int calls = 0;
+  while (std::chrono::steady_clock::now() < end) {
+    std::string payload = "hello" + std::to_string(calls++);
+    BOOST_CHECK_EQUAL(payload, callEcho(port, payload));
+  }
+  processor->join();
+  BOOST_CHECK_EQUAL("after", callEcho(port, "after"));
+
+  server->stop();
+  serving.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,158 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Measures the time to write and read a message through THeaderProtocol
+ * over a memory buffer, with each transform this build supports and with
+ * and without key-value headers.
+ *
+ * Usage: THeaderProtocolBenchmark [messages] [payload size]
+ */
+
+#include <thrift/protocol/THeaderProtocol.h>
+#include <thrift/transport/THeaderTransport.h>
+#include <thrift/transport/TBufferTransports.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace apache::thrift;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::transport;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const int NUM_HEADERS = 8;
+
+void writeMessage(THeaderProtocol& out, const std::string& text, int32_t seqId, bool headers) {
+  if (headers) {
+    for (int i = 0; i < NUM_HEADERS; ++i) {
+      out.setHeader("header-" + std::to_string(i), "value of header " + std::to_string(i));
+    }
+  }
+  out.writeMessageBegin("call", T_CALL, seqId);
+  out.writeStructBegin("args");
+  out.writeFieldBegin("id", T_I64, 1);
+  out.writeI64(seqId);
+  out.writeFieldEnd();
+  out.writeFieldBegin("text", T_STRING, 2);
+  out.writeString(text);
+  out.writeFieldEnd();
+  out.writeFieldBegin("values", T_LIST, 3);
+  out.writeListBegin(T_I32, 16);
+  for (int32_t i = 0; i < 16; ++i) {
+    out.writeI32(i * seqId);
+  }
+  out.writeListEnd();
+  out.writeFieldEnd();
+  out.writeFieldStop();
+  out.writeStructEnd();
+  out.writeMessageEnd();
+  out.getTransport()->flush();
+}
+
+void readMessage(THeaderProtocol& in) {
+  std::string name;
+  TMessageType type;
+  int32_t seqId;
+  in.readMessageBegin(name, type, seqId);
+  in.skip(T_STRUCT);
+  in.readMessageEnd();
+}
+
+void run(const std::string& name,
+         uint16_t transId,
+         bool headers,
+         int messages,
+         const std::string& text) {
+  std::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  THeaderProtocol out(buffer);
+  THeaderProtocol in(buffer);
+  if (transId != 0) {
+    std::dynamic_pointer_cast<THeaderTransport>(out.getTransport())->setTransform(transId);
+  }
+
+  size_t headerCount = 0;
+  uint32_t frameSize = 0;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < messages; ++i) {
+    writeMessage(out, text, i, headers);
+    frameSize = buffer->available_read();
+    readMessage(in);
+    headerCount += in.getHeaderMap().size();
+    buffer->resetBuffer();
+  }
+  Clock::duration elapsed = Clock::now() - start;
+
+  if (headerCount != (headers ? static_cast<size_t>(messages) * NUM_HEADERS : 0)) {
+    std::cerr << name << ": headers lost" << std::endl;
+  }
+  double nanos = static_cast<double>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  std::cout << std::left << std::setw(12) << name << std::setw(9) << (headers ? "yes" : "no")
+            << std::right << std::setw(10) << frameSize << std::fixed << std::setprecision(0)
+            << std::setw(12) << nanos / messages << std::setprecision(1) << std::setw(12)
+            << messages * static_cast<double>(text.size()) / (1024.0 * 1024.0) / (nanos / 1e9)
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  int messages = argc > 1 ? std::atoi(argv[1]) : 100000;
+  int size = argc > 2 ? std::atoi(argv[2]) : 4096;
+  if (messages <= 0 || size < 0) {
+    std::cerr << "Usage: " << argv[0] << " [messages] [payload size]" << std::endl;
+    return 1;
+  }
+
+  // Text that compresses about as well as typical string fields
+  std::string text;
+  for (int i = 0; static_cast<int>(text.size()) < size; ++i) {
+    text += "entry " + std::to_string(i * 7919 % 1000) + " of the list; ";
+  }
+  text.resize(size);
+
+  std::vector<std::pair<std::string, uint16_t> > transforms;
+  transforms.push_back(std::make_pair("none", 0));
+  transforms.push_back(std::make_pair("zlib", THeaderTransport::ZLIB_TRANSFORM));
+  if (THeaderTransport::isTransformSupported(THeaderTransport::ZSTD_TRANSFORM)) {
+    transforms.push_back(std::make_pair("zstd", THeaderTransport::ZSTD_TRANSFORM));
+  }
+  if (THeaderTransport::isTransformSupported(THeaderTransport::LZ4_TRANSFORM)) {
+    transforms.push_back(std::make_pair("lz4", THeaderTransport::LZ4_TRANSFORM));
+  }
+
+  std::cout << messages << " messages with " << size << " bytes of text" << std::endl;
+  std::cout << std::left << std::setw(12) << "transform" << std::setw(9) << "headers"
+            << std::right << std::setw(10) << "frame" << std::setw(12) << "ns/msg"
+            << std::setw(12) << "MB/s" << std::endl;
+  for (size_t i = 0; i < transforms.size(); ++i) {
+    run(transforms[i].first, transforms[i].second, false, messages, text);
+    run(transforms[i].first, transforms[i].second, true, messages, text);
+  }
+  return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/THedgedClient.h>
+#include <thrift/transport/TRetryBudget.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "TestServers.h"
+
+using apache::thrift::protocol::T_CALL;
+using apache::thrift::protocol::TBinaryProtocolFactory;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::test::EchoOptions;
+using apache::thrift::test::EchoServer;
+using apache::thrift::test::EchoStalls;
+using apache::thrift::transport::TConnectionPool;
+using apache::thrift::transport::TFramedTransportFactory;
+using apache::thrift::transport::THedgedClient;
+using apache::thrift::transport::TRetryBudget;
+using apache::thrift::transport::TSocketPoolServer;
+using apache::thrift::transport::TTransportException;
+using std::shared_ptr;
+
+namespace {
+
+/// What the compiler generates for "string echo(1: string payload)"
+class EchoClient {
+public:
+  EchoClient(shared_ptr<TProtocol> prot) : prot_(prot) {}
+
+  void send_echo(const std::string& payload) {
+    prot_->writeMessageBegin("echo", T_CALL, 0);
+    prot_->writeString(payload);
+    prot_->writeMessageEnd();
+    prot_->getTransport()->writeEnd();
+    prot_->getTransport()->flush();
+  }
+
+  std::string recv_echo() {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    std::string reply;
+    prot_->readMessageBegin(name, type, seqid);
+    prot_->readString(reply);
+    prot_->readMessageEnd();
+    prot_->getTransport()->readEnd();
+    return reply;
+  }
+
+private:
+  shared_ptr<TProtocol> prot_;
+};
+
+shared_ptr<TConnectionPool> makePool(const std::vector<int>& ports) {
+  std::vector<shared_ptr<TSocketPoolServer> > servers;
+  for (int port : ports) {
+    servers.push_back(std::make_shared<TSocketPoolServer>("localhost", port));
+  }
+  return std::make_shared<TConnectionPool>(servers, std::make_shared<TFramedTransportFactory>());
+}
+
+std::string echo(THedgedClient<EchoClient>& client, bool idempotent, const std::string& payload) {
+  return client.call(idempotent,
+                     [&](EchoClient& c) { c.send_echo(payload); },
+                     [](EchoClient& c) { return c.recv_echo(); });
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(THedgedClientTest)
+
+BOOST_AUTO_TEST_CASE(test_retry_budget) {
+  TRetryBudget budget(0.5, 0, 2);
+  BOOST_CHECK(budget.tryWithdraw());
+  BOOST_CHECK(budget.tryWithdraw());
+  BOOST_CHECK(!budget.tryWithdraw());
+  budget.deposit();
+  BOOST_CHECK(!budget.tryWithdraw());
+  budget.deposit();
+  BOOST_CHECK(budget.tryWithdraw());
+  BOOST_CHECK_EQUAL(2u, budget.getNumRejected());
+
+  BOOST_CHECK_THROW(TRetryBudget(-1, 0, 2), TTransportException);
+}
+
+BOOST_AUTO_TEST_CASE(test_hedges_slow_calls) {
+  EchoOptions options;
+  options.stalls = std::make_shared<EchoStalls>();
+  EchoServer first(options);
+  EchoServer second(options);
+  THedgedClient<EchoClient> client(makePool({first.port, second.port}),
+                                   std::make_shared<TBinaryProtocolFactory>());
+  client.setMinHedgeDelay(10000);
+
+  std::chrono::steady_clock::duration slowest(0);
+  for (int i = 0; i < 200; ++i) {
+    std::string payload = (i % 25 == 24 ? "slow" : "fast") + std::to_string(i);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    BOOST_CHECK_EQUAL(payload, echo(client, true, payload));
+    if (i >= static_cast<int>(THedgedClient<EchoClient>::MIN_LATENCY_SAMPLES)) {
+      slowest = std::max(slowest, std::chrono::steady_clock::now() - start);
+    }
+  }
+
+  BOOST_CHECK(client.getHedgeDelay() >= 10000);
+  BOOST_CHECK(client.getNumHedges() >= 7);
+  BOOST_CHECK(client.getNumHedgesWon() >= 7);
+  BOOST_CHECK(slowest < std::chrono::milliseconds(150));
+}
+
+BOOST_AUTO_TEST_CASE(test_no_hedge_unless_idempotent) {
+  EchoOptions options;
+  options.stalls = std::make_shared<EchoStalls>();
+  EchoServer first(options);
+  EchoServer second(options);
+  THedgedClient<EchoClient> client(makePool({first.port, second.port}),
+                                   std::make_shared<TBinaryProtocolFactory>());
+
+  for (int i = 0; i < 100; ++i) {
+    std::string payload = (i % 25 == 24 ? "slow" : "fast") + std::to_string(i);
+    BOOST_CHECK_EQUAL(payload, echo(client, false, payload));
+  }
+  BOOST_CHECK_EQUAL(0u, client.getNumHedges());
+}
+
+BOOST_AUTO_TEST_CASE(test_retries_within_budget) {
+  EchoServer good;
+  EchoOptions failing;
+  failing.failing = true;
+  EchoServer bad(failing);
+  shared_ptr<TConnectionPool> pool = makePool({bad.port, good.port});
+  pool->setMaxConsecutiveFailures(1000);
+  THedgedClient<EchoClient> client(pool,
+                                   std::make_shared<TBinaryProtocolFactory>(),
+                                   std::make_shared<TRetryBudget>(0, 0, 5));
+
+  int failures = 0;
+  for (int i = 0; i < 50; ++i) {
+    try {
+      BOOST_CHECK_EQUAL("hello", echo(client, true, "hello"));
+    } catch (const TTransportException&) {
+      ++failures;
+    }
+  }
+  BOOST_CHECK_EQUAL(5u, client.getNumRetries());
+  BOOST_CHECK(failures > 0);
+  BOOST_CHECK(client.getRetryBudget()->getNumRejected() > 0);
+
+  BOOST_CHECK_THROW(echo(client, false, "hello"), TTransportException);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
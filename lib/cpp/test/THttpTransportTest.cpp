@@ -0,0 +1,160 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <thrift/transport/THttpClient.h>
+#include <thrift/transport/THttpServer.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "TestServers.h"
+
+using apache::thrift::test::TrickleTransport;
+using apache::thrift::transport::THttpClient;
+using apache::thrift::transport::THttpServer;
+using apache::thrift::transport::TTransportException;
+using std::shared_ptr;
+using std::string;
+
+namespace {
+
+string request(const string& body, const string& headers = "") {
+  return "POST /service HTTP/1.1\r\nHost: localhost\r\n" + headers
+         + "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+string chunkedRequest() {
+  return "POST /service HTTP/1.1\r\ntransfer-encoding: chunked\r\n\r\n"
+         "4;name=value\r\nWiki\r\n6\r\npedia \r\nE\r\nin \r\n\r\nchunks.\r\n0\r\n"
+         "Trailer: x\r\n\r\n";
+}
+
+string readAll(THttpServer& server, uint32_t len) {
+  string body(len, '\0');
+  server.readAll((uint8_t*)&body[0], len);
+  server.readEnd();
+  return body;
+}
+
+const uint32_t STEPS[] = {1, 2, 7, 64, 4096};
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(THttpTransportTest)
+
+BOOST_AUTO_TEST_CASE(test_http_pipelined_requests) {
+  for (uint32_t step : STEPS) {
+    shared_ptr<TrickleTransport> trans(new TrickleTransport(
+        request("hello") + request("hello world", "x-forwarded-for: 10.0.0.1\r\n"), step));
+    THttpServer server(trans);
+
+    BOOST_CHECK_EQUAL(readAll(server, 5), "hello");
+    // The second request is still to come, whether or not it is buffered
+    BOOST_CHECK(server.peek());
+    server.write((const uint8_t*)"reply", 5);
+    server.flush();
+    string response = trans->output();
+    BOOST_CHECK_EQUAL(response.compare(0, 17, "HTTP/1.1 200 OK\r\n"), 0);
+    BOOST_CHECK(response.find("\r\nContent-Length: 5\r\n") != string::npos);
+    BOOST_CHECK_EQUAL(response.substr(response.size() - 9), "\r\n\r\nreply");
+
+    BOOST_CHECK_EQUAL(readAll(server, 11), "hello world");
+    BOOST_CHECK(server.getOrigin().find("10.0.0.1") != string::npos);
+    BOOST_CHECK(!server.peek());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_http_chunked_request) {
+  for (uint32_t step : STEPS) {
+    shared_ptr<TrickleTransport> trans(
+        new TrickleTransport(chunkedRequest() + chunkedRequest() + request("next"), step));
+    THttpServer server(trans);
+
+    BOOST_CHECK_EQUAL(readAll(server, 24), "Wikipedia in \r\n\r\nchunks.");
+    server.flush();
+
+    // Reading part of the content, readEnd() skips the rest
+    BOOST_CHECK_EQUAL(readAll(server, 6), "Wikipe");
+    server.flush();
+
+    BOOST_CHECK_EQUAL(readAll(server, 4), "next");
+    BOOST_CHECK(!server.peek());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_http_large_content) {
+  string body(100000, '\0');
+  for (size_t i = 0; i < body.size(); ++i) {
+    body[i] = static_cast<char>(i * 31 + i / 256);
+  }
+  const uint32_t steps[] = {7, 4096, 65536};
+  for (uint32_t step : steps) {
+    shared_ptr<TrickleTransport> trans(new TrickleTransport(request(body) + request("x"), step));
+    THttpServer server(trans);
+
+    string got(body.size(), '\0');
+    uint32_t pos = 0;
+    // Take the content in reads large enough to bypass the HTTP buffer, and
+    // through borrow() where it is buffered
+    while (pos < body.size()) {
+      uint32_t len = 1;
+      const uint8_t* borrowed = server.borrow(nullptr, &len);
+      if (borrowed != nullptr) {
+        BOOST_REQUIRE_GE(len, 1u);
+        BOOST_REQUIRE_LE(pos + len, body.size());
+        got.replace(pos, len, (const char*)borrowed, len);
+        server.consume(len);
+        pos += len;
+      } else {
+        uint32_t want = (std::min)(30000u, static_cast<uint32_t>(body.size()) - pos);
+        pos += server.read((uint8_t*)&got[pos], want);
+      }
+    }
+    BOOST_CHECK(got == body);
+    uint32_t len = 1;
+    BOOST_CHECK(server.borrow(nullptr, &len) == nullptr);
+    BOOST_CHECK_THROW(server.consume(1), TTransportException);
+    server.readEnd();
+    BOOST_CHECK_EQUAL(readAll(server, 1), "x");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_http_client_drains_oneway_response) {
+  for (uint32_t step : STEPS) {
+    string chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n";
+    string reply = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nreply";
+    shared_ptr<TrickleTransport> trans(new TrickleTransport(chunked + reply, step));
+    THttpClient client(trans);
+
+    client.write((const uint8_t*)"oneway", 6);
+    client.flush();
+    client.onewayComplete();
+    client.write((const uint8_t*)"call", 4);
+    client.flush();
+
+    string body(5, '\0');
+    client.readAll((uint8_t*)&body[0], 5);
+    client.readEnd();
+    BOOST_CHECK_EQUAL(body, "reply");
+    BOOST_CHECK(!client.peek());
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -21,6 +21,8 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
+#include <chrono>
+#include <thread>
 
 #include "thrift/server/TNonblockingServer.h"
 #include "thrift/transport/TSSLSocket.h"
@@ -146,6 +148,7 @@ private:
 
   struct Runner : public apache::thrift::concurrency::Runnable {
     int port;
+    size_t handshakeThreads;
     std::shared_ptr<event_base> userEventBase;
     std::shared_ptr<TProcessor> processor;
     std::shared_ptr<server::TNonblockingServer> server;
@@ -154,7 +157,7 @@ private:
     std::shared_ptr<transport::TNonblockingSSLServerSocket> socket;
     Mutex mutex_;
 
-    Runner():port(0) {
+    Runner():port(0), handshakeThreads(0) {
       listenHandler.reset(new ListenEventHandler(&mutex_));
     }
 
@@ -179,6 +182,7 @@ private:
         server.reset(new server::TNonblockingServer(processor, socket));
 	      server->setServerEventHandler(listenHandler);
         server->setNumIOThreads(1);
+        server->setHandshakeThreads(handshakeThreads);
         if (userEventBase) {
           server->registerEvents(userEventBase.get());
         }
@@ -199,7 +203,9 @@ private:
   };
 
 protected:
-  Fixture() : processor(new test::ParentServiceProcessor(std::make_shared<Handler>())) {}
+  Fixture()
+    : handshakeThreads_(0),
+      processor(new test::ParentServiceProcessor(std::make_shared<Handler>())) {}
 
   ~Fixture() {
     if (server) {
@@ -214,11 +220,14 @@ protected:
     userEventBase_.reset(user_event_base, EventDeleter());
   }
 
+  void setHandshakeThreads(size_t count) { handshakeThreads_ = count; }
+
   int startServer(int port) {
     std::shared_ptr<Runner> runner(new Runner);
     runner->port = port;
     runner->processor = processor;
     runner->userEventBase = userEventBase_;
+    runner->handshakeThreads = handshakeThreads_;
 
     std::unique_ptr<apache::thrift::concurrency::ThreadFactory> threadFactory(
         new apache::thrift::concurrency::ThreadFactory(false));
@@ -230,6 +239,14 @@ protected:
     return runner->port;
   }
 
+  /// Stop the server and wait until it is destroyed.
+  void destroyServer() {
+    server->stop();
+    thread->join();
+    server.reset();
+    thread.reset();
+  }
+
   bool canCommunicate(int serverPort) {
     std::shared_ptr<TSSLSocketFactory> pClientSocketFactory = createClientSocketFactory();
     std::shared_ptr<TSSLSocket> socket = pClientSocketFactory->createSocket("localhost", serverPort);
@@ -244,6 +261,7 @@ protected:
 
 private:
   std::shared_ptr<event_base> userEventBase_;
+  size_t handshakeThreads_;
   std::shared_ptr<test::ParentServiceProcessor> processor;
 protected:
   std::shared_ptr<server::TNonblockingServer> server;
@@ -286,4 +304,95 @@ BOOST_FIXTURE_TEST_CASE(provide_event_base, Fixture) {
 #endif
 }
 
+BOOST_FIXTURE_TEST_CASE(handshake_stats, Fixture) {
+  startServer(0);
+  BOOST_CHECK(canCommunicate(server->getListenPort()));
+
+  server::THandshakeStats stats = server->getHandshakeStats();
+  BOOST_CHECK_EQUAL(stats.completed, 1u);
+  BOOST_CHECK_EQUAL(stats.failed, 0u);
+  BOOST_CHECK_EQUAL(stats.offloaded, 0u);
+  BOOST_CHECK_GT(stats.maxMicros, 0u);
+  BOOST_CHECK_GE(stats.totalMicros, stats.maxMicros);
+}
+
+BOOST_FIXTURE_TEST_CASE(offload_handshakes, Fixture) {
+  setHandshakeThreads(2);
+  startServer(0);
+  int port = server->getListenPort();
+
+  // an established connection keeps working while others are accepted
+  std::shared_ptr<TSSLSocketFactory> pClientSocketFactory = createClientSocketFactory();
+  std::shared_ptr<TSSLSocket> socket = pClientSocketFactory->createSocket("localhost", port);
+  socket->open();
+  test::ParentServiceClient client(std::make_shared<protocol::TBinaryProtocol>(
+      std::make_shared<transport::TFramedTransport>(socket)));
+  std::vector<std::shared_ptr<TSSLSocket> > others;
+  for (int i = 0; i < 4; ++i) {
+    client.addString("foo");
+    others.push_back(pClientSocketFactory->createSocket("localhost", port));
+    others.back()->open();
+    test::ParentServiceClient other(std::make_shared<protocol::TBinaryProtocol>(
+        std::make_shared<transport::TFramedTransport>(others.back())));
+    other.addString("bar");
+  }
+  std::vector<std::string> strings;
+  client.getStrings(strings);
+  BOOST_CHECK_EQUAL(strings.size(), 8u);
+  socket->close();
+  for (size_t i = 0; i < others.size(); ++i) {
+    others[i]->close();
+  }
+
+  server::THandshakeStats stats = server->getHandshakeStats();
+  BOOST_CHECK_EQUAL(stats.completed, 5u);
+  BOOST_CHECK_EQUAL(stats.offloaded, 5u);
+  BOOST_CHECK_EQUAL(stats.failed, 0u);
+}
+
+BOOST_FIXTURE_TEST_CASE(offloaded_handshake_fails, Fixture) {
+  setHandshakeThreads(1);
+  startServer(0);
+  int port = server->getListenPort();
+
+  // a plain socket cannot complete the handshake
+  std::shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port));
+  socket->setRecvTimeout(5000);
+  socket->open();
+  const uint8_t garbage[] = "GET / HTTP/1.0\r\n\r\n";
+  socket->write(garbage, sizeof(garbage));
+  // wait for the server to close the connection
+  try {
+    uint8_t buf[64];
+    while (socket->read(buf, sizeof(buf)) > 0) {
+    }
+  } catch (const transport::TTransportException& e) {
+    BOOST_CHECK_NE(e.getType(), transport::TTransportException::TIMED_OUT);
+  }
+  socket->close();
+
+  BOOST_CHECK(canCommunicate(port));
+  server::THandshakeStats stats = server->getHandshakeStats();
+  BOOST_CHECK_EQUAL(stats.completed, 1u);
+  BOOST_CHECK_EQUAL(stats.failed, 1u);
+  BOOST_CHECK_EQUAL(stats.offloaded, 2u);
+}
+
+BOOST_FIXTURE_TEST_CASE(destroy_during_offloaded_handshake, Fixture) {
+  setHandshakeThreads(1);
+  startServer(0);
+  int port = server->getListenPort();
+
+  // a client that never starts its handshake keeps a handshake thread waiting
+  transport::TSocket socket("localhost", port);
+  socket.open();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // the server does not wait for the handshake to time out
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  destroyServer();
+  BOOST_CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+  socket.close();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
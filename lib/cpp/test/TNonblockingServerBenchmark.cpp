@@ -0,0 +1,212 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Measures how many socket writes TNonblockingServer needs per response
+ * when clients pipeline small requests, with and without write coalescing.
+ *
+ * Usage: TNonblockingServerBenchmark [clients] [requests per client] [depth]
+ */
+
+#include <thrift/TProcessor.h>
+#include <thrift/concurrency/ThreadFactory.h>
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TNonblockingServer.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TNonblockingServerSocket.h>
+#include <thrift/transport/TSocket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace apache::thrift;
+using namespace apache::thrift::concurrency;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::server;
+using namespace apache::thrift::transport;
+
+namespace {
+
+void quiet(const char* message) {
+  (void)message;
+}
+
+/// Answers every call with the string argument it was sent.
+class EchoProcessor : public TProcessor {
+public:
+  bool process(std::shared_ptr<TProtocol> in,
+               std::shared_ptr<TProtocol> out,
+               void* connectionContext) override {
+    (void)connectionContext;
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    std::string payload;
+    in->readMessageBegin(name, type, seqid);
+    in->readString(payload);
+    in->readMessageEnd();
+    in->getTransport()->readEnd();
+
+    out->writeMessageBegin(name, T_REPLY, seqid);
+    out->writeString(payload);
+    out->writeMessageEnd();
+    out->getTransport()->writeEnd();
+    out->getTransport()->flush();
+    return true;
+  }
+};
+
+struct Scenario {
+  const char* name;
+  size_t maxPipelinedRequests;
+  int64_t writeCoalescingDelay;
+};
+
+struct Result {
+  double seconds;
+  uint64_t responses;
+  uint64_t writes;
+  int errors;
+};
+
+Result run(const Scenario& scenario, int clients, int requests, int depth) {
+  std::shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(4);
+  threadManager->threadFactory(std::make_shared<ThreadFactory>());
+  threadManager->start();
+
+  std::shared_ptr<TNonblockingServer> server = std::make_shared<TNonblockingServer>(
+      std::make_shared<EchoProcessor>(),
+      std::make_shared<TBinaryProtocolFactory>(),
+      std::make_shared<TNonblockingServerSocket>(0),
+      threadManager);
+  server->setMaxPipelinedRequests(scenario.maxPipelinedRequests);
+  server->setWriteCoalescingDelay(scenario.writeCoalescingDelay);
+
+  std::thread serverThread([server] { server->serve(); });
+  while (server->getListenPort() == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  int port = server->getListenPort();
+
+  std::atomic<int> errors(0);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int c = 0; c < clients; ++c) {
+    threads.emplace_back([&errors, port, requests, depth] {
+      try {
+        std::shared_ptr<TSocket> socket = std::make_shared<TSocket>("localhost", port);
+        socket->setNoDelay(true);
+        std::shared_ptr<TFramedTransport> transport = std::make_shared<TFramedTransport>(socket);
+        TBinaryProtocol protocol(transport);
+        transport->open();
+
+        const std::string payload(64, 'x');
+        for (int i = 0; i < requests; i += depth) {
+          for (int d = 0; d < depth; ++d) {
+            protocol.writeMessageBegin("echo", T_CALL, i + d);
+            protocol.writeString(payload);
+            protocol.writeMessageEnd();
+            transport->writeEnd();
+            transport->flush();
+          }
+          for (int d = 0; d < depth; ++d) {
+            std::string name;
+            TMessageType type;
+            int32_t seqid;
+            std::string reply;
+            protocol.readMessageBegin(name, type, seqid);
+            protocol.readString(reply);
+            protocol.readMessageEnd();
+            transport->readEnd();
+            if (reply != payload) {
+              ++errors;
+            }
+          }
+        }
+        transport->close();
+      } catch (const std::exception& e) {
+        std::cerr << "client: " << e.what() << std::endl;
+        ++errors;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  Result result;
+  result.seconds
+      = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  result.responses = server->getNumResponsesWritten();
+  result.writes = server->getNumResponseWrites();
+  result.errors = errors;
+
+  server->stop();
+  serverThread.join();
+  threadManager->stop();
+  return result;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  int clients = argc > 1 ? std::atoi(argv[1]) : 8;
+  int requests = argc > 2 ? std::atoi(argv[2]) : 20000;
+  int depth = argc > 3 ? std::atoi(argv[3]) : 32;
+  if (clients <= 0 || requests <= 0 || depth <= 0) {
+    std::cerr << "Usage: " << argv[0] << " [clients] [requests per client] [depth]" << std::endl;
+    return 1;
+  }
+
+  TOutput::instance().setOutputFunction(quiet);
+
+  const Scenario scenarios[] = {
+    {"not pipelined", 1, 0},
+    {"pipelined", static_cast<size_t>(depth), 0},
+    {"pipelined, 200us delay", static_cast<size_t>(depth), 200},
+  };
+
+  std::cout << clients << " clients x " << requests << " requests, " << depth
+            << " in flight per client" << std::endl;
+  std::cout << std::left << std::setw(26) << "scenario" << std::right << std::setw(12)
+            << "requests/s" << std::setw(12) << "responses" << std::setw(12) << "writes"
+            << std::setw(16) << "writes/response" << std::endl;
+
+  int errors = 0;
+  for (const Scenario& scenario : scenarios) {
+    Result result = run(scenario, clients, requests, depth);
+    errors += result.errors;
+    std::cout << std::left << std::setw(26) << scenario.name << std::right << std::fixed
+              << std::setprecision(0) << std::setw(12)
+              << (clients * static_cast<double>(requests)) / result.seconds << std::setw(12)
+              << result.responses << std::setw(12) << result.writes << std::setprecision(3)
+              << std::setw(16)
+              << (result.responses ? static_cast<double>(result.writes) / result.responses : 0.0)
+              << std::endl;
+  }
+  return errors ? 1 : 0;
+}
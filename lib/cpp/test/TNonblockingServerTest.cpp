@@ -19,10 +19,13 @@
 
 #define BOOST_TEST_MODULE TNonblockingServerTest
 #include <boost/test/unit_test.hpp>
+#include <chrono>
 #include <memory>
+#include <thread>
 
 #include "thrift/concurrency/Monitor.h"
 #include "thrift/concurrency/Thread.h"
+#include "thrift/concurrency/ThreadManager.h"
 #include "thrift/server/TNonblockingServer.h"
 #include "thrift/transport/TNonblockingServerSocket.h"
 
@@ -37,21 +40,30 @@ using apache::thrift::concurrency::ThreadFactory;
 using apache::thrift::concurrency::Runnable;
 using apache::thrift::concurrency::Thread;
 using apache::thrift::concurrency::ThreadFactory;
+using apache::thrift::concurrency::ThreadManager;
 using apache::thrift::server::TServerEventHandler;
 using std::make_shared;
 using std::shared_ptr;
 
 using namespace apache::thrift;
 
+// getDataWait() of this length takes a while
+const int32_t SLOW_DATA_LENGTH = 1000;
+
 struct Handler : public test::ParentServiceIf {
   void addString(const std::string& s) override { strings_.push_back(s); }
   void getStrings(std::vector<std::string>& _return) override { _return = strings_; }
+  void getDataWait(std::string& _return, const int32_t length) override {
+    if (length == SLOW_DATA_LENGTH) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    _return.assign(length, 'x');
+  }
   std::vector<std::string> strings_;
 
   // dummy overrides not used in this test
   int32_t incrementGeneration() override { return 0; }
   int32_t getGeneration() override { return 0; }
-  void getDataWait(std::string&, const int32_t) override {}
   void onewayWait() override {}
   void exceptionWait(const std::string&) override {}
   void unexpectedExceptionWait(const std::string&) override {}
@@ -80,10 +92,23 @@ private:
     shared_ptr<server::TNonblockingServer> server;
     shared_ptr<ListenEventHandler> listenHandler;
     shared_ptr<transport::TNonblockingServerSocket> socket;
+    size_t maxPipelinedRequests;
+    server::TPipelineOrder pipelineOrder;
+    int64_t writeCoalescingDelay;
+    std::vector<std::string> inlineMethods;
+    bool fairQueuing;
+    size_t maxClientTasksInFlight;
+    size_t maxClientQueueDepth;
     Mutex mutex_;
 
     Runner() {
       port = 0;
+      maxPipelinedRequests = 1;
+      pipelineOrder = server::T_PIPELINE_IN_ORDER;
+      writeCoalescingDelay = 0;
+      fairQueuing = false;
+      maxClientTasksInFlight = 0;
+      maxClientQueueDepth = 0;
       listenHandler.reset(new ListenEventHandler(&mutex_));
     }
 
@@ -106,6 +131,19 @@ private:
         socket.reset(new transport::TNonblockingServerSocket(port));
         server.reset(new server::TNonblockingServer(processor, socket));
         server->setServerEventHandler(listenHandler);
+        if (maxPipelinedRequests > 1 || !inlineMethods.empty() || fairQueuing) {
+          shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(4);
+          threadManager->threadFactory(make_shared<ThreadFactory>());
+          threadManager->start();
+          server->setThreadManager(threadManager);
+          server->setMaxPipelinedRequests(maxPipelinedRequests);
+          server->setPipelineOrder(pipelineOrder);
+          server->setInlineMethods(inlineMethods);
+          server->setFairQueuing(fairQueuing);
+          server->setMaxClientTasksInFlight(maxClientTasksInFlight);
+          server->setMaxClientQueueDepth(maxClientQueueDepth);
+        }
+        server->setWriteCoalescingDelay(writeCoalescingDelay);
         if (userEventBase) {
           server->registerEvents(userEventBase.get());
         }
@@ -126,7 +164,14 @@ private:
   };
 
 protected:
-  Fixture() : processor(new test::ParentServiceProcessor(make_shared<Handler>())) {}
+  Fixture()
+    : maxPipelinedRequests_(1),
+      pipelineOrder_(server::T_PIPELINE_IN_ORDER),
+      writeCoalescingDelay_(0),
+      fairQueuing_(false),
+      maxClientTasksInFlight_(0),
+      maxClientQueueDepth_(0),
+      processor(new test::ParentServiceProcessor(make_shared<Handler>())) {}
 
   ~Fixture() {
     if (server) {
@@ -141,11 +186,32 @@ protected:
     userEventBase_.reset(user_event_base, EventDeleter());
   }
 
+  void setMaxPipelinedRequests(size_t count) { maxPipelinedRequests_ = count; }
+
+  void setPipelineOrder(server::TPipelineOrder order) { pipelineOrder_ = order; }
+
+  void setInlineMethods(const std::vector<std::string>& methods) { inlineMethods_ = methods; }
+
+  void setWriteCoalescingDelay(int64_t micros) { writeCoalescingDelay_ = micros; }
+
+  void setFairQueuing(size_t maxClientTasksInFlight, size_t maxClientQueueDepth) {
+    fairQueuing_ = true;
+    maxClientTasksInFlight_ = maxClientTasksInFlight;
+    maxClientQueueDepth_ = maxClientQueueDepth;
+  }
+
   int startServer(int port) {
     shared_ptr<Runner> runner(new Runner);
     runner->port = port;
     runner->processor = processor;
     runner->userEventBase = userEventBase_;
+    runner->maxPipelinedRequests = maxPipelinedRequests_;
+    runner->pipelineOrder = pipelineOrder_;
+    runner->inlineMethods = inlineMethods_;
+    runner->writeCoalescingDelay = writeCoalescingDelay_;
+    runner->fairQueuing = fairQueuing_;
+    runner->maxClientTasksInFlight = maxClientTasksInFlight_;
+    runner->maxClientQueueDepth = maxClientQueueDepth_;
 
     shared_ptr<ThreadFactory> threadFactory(
         new ThreadFactory(false));
@@ -170,6 +236,13 @@ protected:
 
 private:
   shared_ptr<event_base> userEventBase_;
+  size_t maxPipelinedRequests_;
+  server::TPipelineOrder pipelineOrder_;
+  int64_t writeCoalescingDelay_;
+  std::vector<std::string> inlineMethods_;
+  bool fairQueuing_;
+  size_t maxClientTasksInFlight_;
+  size_t maxClientQueueDepth_;
   shared_ptr<test::ParentServiceProcessor> processor;
 protected:
   shared_ptr<server::TNonblockingServer> server;
@@ -212,4 +285,212 @@ BOOST_FIXTURE_TEST_CASE(provide_event_base, Fixture) {
 #endif
 }
 
+BOOST_FIXTURE_TEST_CASE(idle_connection_buffers, Fixture) {
+  startServer(0);
+  BOOST_CHECK(canCommunicate(server->getListenPort()));
+
+  // buffers go back to the pool once the response has been written
+  for (int i = 0; i < 100 && server->getBufferMemoryInUse() > 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  BOOST_CHECK_EQUAL(server->getBufferMemoryInUse(), 0u);
+  BOOST_CHECK_GT(server->getBufferMemoryCached(), 0u);
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined_requests, Fixture) {
+  setMaxPipelinedRequests(4);
+  startServer(0);
+  int port = server->getListenPort();
+
+  shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port));
+  socket->open();
+  test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket)));
+
+  // send more requests than may be in flight before reading any response
+  const int32_t count = 16;
+  for (int32_t i = 0; i < count; ++i) {
+    client.send_getDataWait(i);
+  }
+  for (int32_t i = 0; i < count; ++i) {
+    std::string data;
+    client.recv_getDataWait(data);
+    BOOST_CHECK_EQUAL(data.size(), static_cast<size_t>(i));
+  }
+
+  BOOST_CHECK(canCommunicate(port));
+}
+
+// The generated client always sends seqid 0, so these write and read
+// getDataWait() messages themselves
+static void sendGetDataWait(protocol::TProtocol& out, int32_t seqid, int32_t length) {
+  out.writeMessageBegin("getDataWait", protocol::T_CALL, seqid);
+  out.writeStructBegin("ParentService_getDataWait_args");
+  out.writeFieldBegin("length", protocol::T_I32, 1);
+  out.writeI32(length);
+  out.writeFieldEnd();
+  out.writeFieldStop();
+  out.writeStructEnd();
+  out.writeMessageEnd();
+  out.getTransport()->writeEnd();
+  out.getTransport()->flush();
+}
+
+static int32_t recvGetDataWait(protocol::TProtocol& in, std::string& data) {
+  std::string name;
+  protocol::TMessageType type;
+  int32_t seqid;
+  in.readMessageBegin(name, type, seqid);
+  BOOST_CHECK_EQUAL(name, "getDataWait");
+  BOOST_CHECK_EQUAL(type, protocol::T_REPLY);
+  std::string structName;
+  in.readStructBegin(structName);
+  protocol::TType fieldType;
+  int16_t fieldId;
+  in.readFieldBegin(name, fieldType, fieldId);
+  BOOST_CHECK_EQUAL(fieldId, 0);
+  BOOST_CHECK_EQUAL(fieldType, protocol::T_STRING);
+  in.readBinary(data);
+  in.readFieldEnd();
+  in.readFieldBegin(name, fieldType, fieldId);
+  BOOST_CHECK_EQUAL(fieldType, protocol::T_STOP);
+  in.readStructEnd();
+  in.readMessageEnd();
+  in.getTransport()->readEnd();
+  return seqid;
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined_requests_any_order, Fixture) {
+  setMaxPipelinedRequests(4);
+  setPipelineOrder(server::T_PIPELINE_ANY_ORDER);
+  startServer(0);
+  int port = server->getListenPort();
+
+  shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port));
+  socket->open();
+  protocol::TBinaryProtocol proto(make_shared<transport::TFramedTransport>(socket));
+
+  // the fast request overtakes the slow one sent before it
+  sendGetDataWait(proto, 1, SLOW_DATA_LENGTH);
+  sendGetDataWait(proto, 2, 3);
+  std::string data;
+  BOOST_CHECK_EQUAL(recvGetDataWait(proto, data), 2);
+  BOOST_CHECK_EQUAL(data.size(), 3u);
+  BOOST_CHECK_EQUAL(recvGetDataWait(proto, data), 1);
+  BOOST_CHECK_EQUAL(data.size(), static_cast<size_t>(SLOW_DATA_LENGTH));
+
+  BOOST_CHECK(canCommunicate(port));
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined_write_coalescing, Fixture) {
+  setMaxPipelinedRequests(16);
+  setWriteCoalescingDelay(100000);
+  startServer(0);
+
+  shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", server->getListenPort()));
+  socket->open();
+  test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket)));
+
+  const int32_t count = 16;
+  for (int32_t i = 0; i < count; ++i) {
+    client.send_getDataWait(i);
+  }
+  for (int32_t i = 0; i < count; ++i) {
+    std::string data;
+    client.recv_getDataWait(data);
+    BOOST_CHECK_EQUAL(data.size(), static_cast<size_t>(i));
+  }
+
+  // the IO thread counts the writes right after making them
+  for (int i = 0; i < 100 && server->getNumResponsesWritten() < static_cast<uint64_t>(count); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  // responses held back for each other go out in fewer writes
+  BOOST_CHECK_EQUAL(server->getNumResponsesWritten(), static_cast<uint64_t>(count));
+  BOOST_CHECK_LT(server->getNumResponseWrites(), server->getNumResponsesWritten());
+}
+
+BOOST_FIXTURE_TEST_CASE(inline_methods, Fixture) {
+  std::vector<std::string> methods;
+  methods.push_back("getStrings");
+  setInlineMethods(methods);
+  startServer(0);
+
+  // addString goes to the thread pool, getStrings runs on the IO thread
+  BOOST_CHECK(canCommunicate(server->getListenPort()));
+  BOOST_CHECK(server->isInlineMethod("getStrings"));
+  BOOST_CHECK(!server->isInlineMethod("addString"));
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined_inline_methods, Fixture) {
+  std::vector<std::string> methods;
+  methods.push_back("getDataWait");
+  setInlineMethods(methods);
+  setMaxPipelinedRequests(4);
+  startServer(0);
+
+  shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", server->getListenPort()));
+  socket->open();
+  test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket)));
+
+  // inline calls interleaved with pooled ones still answer in order
+  client.send_getDataWait(3);
+  client.send_addString("foo");
+  client.send_getDataWait(5);
+  std::string data;
+  client.recv_getDataWait(data);
+  BOOST_CHECK_EQUAL(data.size(), 3u);
+  client.recv_addString();
+  client.recv_getDataWait(data);
+  BOOST_CHECK_EQUAL(data.size(), 5u);
+}
+
+BOOST_FIXTURE_TEST_CASE(fair_queuing, Fixture) {
+  setFairQueuing(0, 0);
+  startServer(0);
+
+  BOOST_CHECK(canCommunicate(server->getListenPort()));
+  BOOST_CHECK_EQUAL(server->getNumRejectedRequests(), 0u);
+}
+
+BOOST_FIXTURE_TEST_CASE(fair_queuing_rejects_flood, Fixture) {
+  setMaxPipelinedRequests(16);
+  setFairQueuing(1, 1);
+  startServer(0);
+  int port = server->getListenPort();
+
+  shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port));
+  socket->open();
+  test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket)));
+
+  // requests beyond the client's queue are answered with an exception
+  const int32_t count = 16;
+  for (int32_t i = 0; i < count; ++i) {
+    client.send_getDataWait(i);
+  }
+  uint64_t rejected = 0;
+  for (int32_t i = 0; i < count; ++i) {
+    try {
+      std::string data;
+      client.recv_getDataWait(data);
+      BOOST_CHECK_EQUAL(data.size(), static_cast<size_t>(i));
+    } catch (const TApplicationException& x) {
+      BOOST_CHECK_EQUAL(x.getType(), TApplicationException::INTERNAL_ERROR);
+      ++rejected;
+    }
+  }
+  BOOST_CHECK_EQUAL(server->getNumRejectedRequests(), rejected);
+  BOOST_CHECK(canCommunicate(port));
+
+  // clients are forgotten once they have nothing queued or in flight
+  for (int i = 0; i < 100 && !server->getClientQueueStats().empty(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  BOOST_CHECK(server->getClientQueueStats().empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,333 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define BOOST_TEST_MODULE TSSLSessionTest
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <memory>
+#include <thread>
+#include <thrift/transport/TSSLServerSocket.h>
+#include <thrift/transport/TSSLSocket.h>
+#include <thrift/transport/TTransportException.h>
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+
+using apache::thrift::transport::SSLProtocol;
+using apache::thrift::transport::SSLTLS;
+using apache::thrift::transport::TLSv1_2;
+using apache::thrift::transport::TSSLServerSocket;
+using apache::thrift::transport::TSSLSessionCache;
+using apache::thrift::transport::TSSLSocket;
+using apache::thrift::transport::TSSLSocketFactory;
+using apache::thrift::transport::TTransport;
+using apache::thrift::transport::TTransportException;
+
+using std::shared_ptr;
+
+boost::filesystem::path keyDir;
+boost::filesystem::path certFile(const std::string& filename) {
+  return keyDir / filename;
+}
+
+struct GlobalFixture {
+  GlobalFixture() {
+    using namespace boost::unit_test::framework;
+#ifdef __linux__
+    // OpenSSL calls send() without MSG_NOSIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    keyDir = boost::filesystem::current_path().parent_path().parent_path().parent_path() / "test" / "keys";
+    if (!boost::filesystem::exists(certFile("server.crt"))) {
+      keyDir = boost::filesystem::path(master_test_suite().argv[master_test_suite().argc - 1]);
+      if (!boost::filesystem::exists(certFile("server.crt"))) {
+        throw std::invalid_argument("The last argument to this test must be the directory containing the test certificate(s).");
+      }
+    }
+  }
+
+  virtual ~GlobalFixture() {
+#ifdef __linux__
+    signal(SIGPIPE, SIG_DFL);
+#endif
+  }
+};
+
+#if (BOOST_VERSION >= 105900)
+BOOST_GLOBAL_FIXTURE(GlobalFixture);
+#else
+BOOST_GLOBAL_FIXTURE(GlobalFixture)
+#endif
+
+shared_ptr<TSSLSocketFactory> createServerFactory(SSLProtocol protocol = SSLTLS) {
+  shared_ptr<TSSLSocketFactory> factory(new TSSLSocketFactory(protocol));
+  factory->loadCertificate(certFile("server.crt").string().c_str());
+  factory->loadPrivateKey(certFile("server.key").string().c_str());
+  factory->server(true);
+  return factory;
+}
+
+shared_ptr<TSSLSocketFactory> createClientFactory(SSLProtocol protocol = SSLTLS) {
+  shared_ptr<TSSLSocketFactory> factory(new TSSLSocketFactory(protocol));
+  factory->authenticate(true);
+  factory->loadTrustedCertificates(certFile("CA.pem").string().c_str());
+  return factory;
+}
+
+/**
+ * Echoes every byte on the connections it accepts, one at a time.
+ */
+class EchoServer {
+public:
+  EchoServer(shared_ptr<TSSLSocketFactory> factory)
+    : socket_(new TSSLServerSocket("localhost", 0, factory)) {
+    socket_->listen();
+    thread_ = std::thread([this] { serve(); });
+  }
+
+  ~EchoServer() {
+    socket_->interrupt();
+    thread_.join();
+    socket_->close();
+  }
+
+  int getPort() { return socket_->getPort(); }
+
+private:
+  void serve() {
+    for (;;) {
+      shared_ptr<TTransport> client;
+      try {
+        client = socket_->accept();
+      } catch (TTransportException&) {
+        return;
+      }
+      try {
+        uint8_t byte;
+        while (client->read(&byte, 1) == 1) {
+          client->write(&byte, 1);
+          client->flush();
+        }
+      } catch (TTransportException&) {
+      }
+      client->close();
+    }
+  }
+
+  shared_ptr<TSSLServerSocket> socket_;
+  std::thread thread_;
+};
+
+/**
+ * Connects, makes a round trip, and returns whether the session was resumed.
+ */
+bool roundTrip(shared_ptr<TSSLSocketFactory> factory, int port) {
+  shared_ptr<TSSLSocket> socket = factory->createSocket("localhost", port);
+  socket->open();
+  uint8_t byte = 'x';
+  socket->write(&byte, 1);
+  socket->flush();
+  BOOST_CHECK_EQUAL(1u, socket->read(&byte, 1));
+  BOOST_CHECK_EQUAL('x', byte);
+  bool reused = socket->sessionReused();
+  socket->close();
+  return reused;
+}
+
+BOOST_AUTO_TEST_CASE(test_no_cache_makes_full_handshakes) {
+  shared_ptr<TSSLSocketFactory> serverFactory = createServerFactory();
+  EchoServer server(serverFactory);
+  shared_ptr<TSSLSocketFactory> clientFactory = createClientFactory();
+
+  BOOST_CHECK(!roundTrip(clientFactory, server.getPort()));
+  BOOST_CHECK(!roundTrip(clientFactory, server.getPort()));
+  BOOST_CHECK_EQUAL(2u, clientFactory->getNumFullHandshakes());
+  BOOST_CHECK_EQUAL(0u, clientFactory->getNumResumedHandshakes());
+}
+
+BOOST_AUTO_TEST_CASE(test_resume_tls13) {
+  shared_ptr<TSSLSocketFactory> serverFactory = createServerFactory();
+  serverFactory->enableSessionTickets();
+  EchoServer server(serverFactory);
+  shared_ptr<TSSLSocketFactory> clientFactory = createClientFactory();
+  shared_ptr<TSSLSessionCache> cache(new TSSLSessionCache);
+  clientFactory->setSessionCache(cache);
+
+  BOOST_CHECK(!roundTrip(clientFactory, server.getPort()));
+  BOOST_CHECK_EQUAL(1u, cache->size());
+  for (int i = 0; i < 3; ++i) {
+    BOOST_CHECK(roundTrip(clientFactory, server.getPort()));
+  }
+  BOOST_CHECK_EQUAL(1u, clientFactory->getNumFullHandshakes());
+  BOOST_CHECK_EQUAL(3u, clientFactory->getNumResumedHandshakes());
+  BOOST_CHECK_EQUAL(1u, serverFactory->getNumFullHandshakes());
+  BOOST_CHECK_EQUAL(3u, serverFactory->getNumResumedHandshakes());
+  BOOST_CHECK_EQUAL(3u, cache->getNumHits());
+  BOOST_CHECK_EQUAL(1u, cache->getNumMisses());
+
+  // TLS 1.3 tickets are used once, and new ones sent on every connection
+  SSL_SESSION* session = cache->get("localhost", server.getPort());
+  BOOST_REQUIRE(session != nullptr);
+  BOOST_CHECK_EQUAL(0u, cache->size());
+  SSL_SESSION_free(session);
+}
+
+BOOST_AUTO_TEST_CASE(test_resume_tls12) {
+  shared_ptr<TSSLSocketFactory> serverFactory = createServerFactory(TLSv1_2);
+  serverFactory->enableSessionTickets();
+  EchoServer server(serverFactory);
+  shared_ptr<TSSLSocketFactory> clientFactory = createClientFactory(TLSv1_2);
+  shared_ptr<TSSLSessionCache> cache(new TSSLSessionCache);
+  clientFactory->setSessionCache(cache);
+
+  BOOST_CHECK(!roundTrip(clientFactory, server.getPort()));
+  BOOST_CHECK(roundTrip(clientFactory, server.getPort()));
+  BOOST_CHECK(roundTrip(clientFactory, server.getPort()));
+  BOOST_CHECK_EQUAL(1u, cache->size());
+  BOOST_CHECK_EQUAL(2u, serverFactory->getNumResumedHandshakes());
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_cache) {
+  shared_ptr<TSSLSocketFactory> serverFactory = createServerFactory();
+  EchoServer server(serverFactory);
+  shared_ptr<TSSLSessionCache> cache(new TSSLSessionCache);
+  shared_ptr<TSSLSocketFactory> clientFactory1 = createClientFactory();
+  clientFactory1->setSessionCache(cache);
+  shared_ptr<TSSLSocketFactory> clientFactory2 = createClientFactory();
+  clientFactory2->setSessionCache(cache);
+
+  // the tickets OpenSSL issues by default resume as well
+  BOOST_CHECK(!roundTrip(clientFactory1, server.getPort()));
+  BOOST_CHECK(roundTrip(clientFactory2, server.getPort()));
+  BOOST_CHECK_EQUAL(1u, clientFactory2->getNumResumedHandshakes());
+
+  clientFactory2->setSessionCache(nullptr);
+  BOOST_CHECK(!roundTrip(clientFactory2, server.getPort()));
+}
+
+BOOST_AUTO_TEST_CASE(test_ticket_key_rotation) {
+  shared_ptr<TSSLSocketFactory> serverFactory = createServerFactory();
+  serverFactory->enableSessionTickets();
+  EchoServer server(serverFactory);
+  shared_ptr<TSSLSocketFactory> clientFactory = createClientFactory();
+  shared_ptr<TSSLSessionCache> cache(new TSSLSessionCache);
+  clientFactory->setSessionCache(cache);
+
+  BOOST_CHECK(!roundTrip(clientFactory, server.getPort()));
+  // an older key still decrypts the ticket, which gets replaced
+  serverFactory->rotateSessionTicketKey();
+  BOOST_CHECK(roundTrip(clientFactory, server.getPort()));
+  for (size_t i = 0; i < TSSLSocketFactory::MAX_TICKET_KEYS; ++i) {
+    serverFactory->rotateSessionTicketKey();
+  }
+  BOOST_CHECK(!roundTrip(clientFactory, server.getPort()));
+  BOOST_CHECK(roundTrip(clientFactory, server.getPort()));
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_ticket_key) {
+  uint8_t key[TSSLSocketFactory::TICKET_KEY_SIZE];
+  for (size_t i = 0; i < sizeof(key); ++i) {
+    key[i] = static_cast<uint8_t>(i * 7);
+  }
+  shared_ptr<TSSLSocketFactory> serverFactory1 = createServerFactory();
+  serverFactory1->rotateSessionTicketKey(key, sizeof(key));
+  serverFactory1->enableSessionTickets();
+  EchoServer server1(serverFactory1);
+  shared_ptr<TSSLSocketFactory> serverFactory2 = createServerFactory();
+  serverFactory2->rotateSessionTicketKey(key, sizeof(key));
+  serverFactory2->enableSessionTickets();
+  EchoServer server2(serverFactory2);
+
+  shared_ptr<TSSLSocketFactory> clientFactory = createClientFactory();
+  shared_ptr<TSSLSessionCache> cache(new TSSLSessionCache);
+  clientFactory->setSessionCache(cache);
+  BOOST_CHECK(!roundTrip(clientFactory, server1.getPort()));
+
+  // as if both servers were behind one address
+  SSL_SESSION* session = cache->get("localhost", server1.getPort());
+  BOOST_REQUIRE(session != nullptr);
+  cache->put("localhost", server2.getPort(), session);
+  SSL_SESSION_free(session);
+  BOOST_CHECK(roundTrip(clientFactory, server2.getPort()));
+  BOOST_CHECK_EQUAL(1u, serverFactory2->getNumResumedHandshakes());
+
+  BOOST_CHECK_THROW(serverFactory1->rotateSessionTicketKey(key, sizeof(key) - 1),
+                    TTransportException);
+}
+
+BOOST_AUTO_TEST_CASE(test_tickets_outlive_factory) {
+  shared_ptr<TSSLSocketFactory> serverFactory = createServerFactory();
+  serverFactory->enableSessionTickets();
+  shared_ptr<TSSLServerSocket> listener(new TSSLServerSocket("localhost", 0, serverFactory));
+  listener->listen();
+  int port = listener->getPort();
+  shared_ptr<TSSLSocketFactory> clientFactory = createClientFactory();
+  shared_ptr<TSSLSessionCache> cache(new TSSLSessionCache);
+  clientFactory->setSessionCache(cache);
+  shared_ptr<TSSLSocket> clientSocket = clientFactory->createSocket("localhost", port);
+  clientSocket->setRecvTimeout(5000);
+  clientSocket->open();
+  shared_ptr<TTransport> serverSocket = listener->accept();
+
+  // the factory goes with the server socket, and the accepted socket still
+  // issues tickets with the keys of its context
+  listener->close();
+  listener.reset();
+  serverFactory.reset();
+  std::thread echo([serverSocket] {
+    try {
+      uint8_t byte;
+      serverSocket->read(&byte, 1);
+      serverSocket->write(&byte, 1);
+      serverSocket->flush();
+    } catch (TTransportException&) {
+    }
+  });
+  uint8_t byte = 'x';
+  clientSocket->write(&byte, 1);
+  clientSocket->flush();
+  BOOST_CHECK_EQUAL(1u, clientSocket->read(&byte, 1));
+  echo.join();
+  SSL_SESSION* session = cache->get("localhost", port);
+  BOOST_REQUIRE(session != nullptr);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  BOOST_CHECK(SSL_SESSION_has_ticket(session));
+#endif
+  SSL_SESSION_free(session);
+  clientSocket->close();
+  serverSocket->close();
+}
+
+BOOST_AUTO_TEST_CASE(test_cache_evicts_oldest) {
+  shared_ptr<TSSLSocketFactory> serverFactory = createServerFactory(TLSv1_2);
+  EchoServer server1(serverFactory);
+  EchoServer server2(serverFactory);
+  shared_ptr<TSSLSocketFactory> clientFactory = createClientFactory(TLSv1_2);
+  shared_ptr<TSSLSessionCache> cache(new TSSLSessionCache(1));
+  clientFactory->setSessionCache(cache);
+
+  BOOST_CHECK(!roundTrip(clientFactory, server1.getPort()));
+  BOOST_CHECK(!roundTrip(clientFactory, server2.getPort()));
+  BOOST_CHECK_EQUAL(1u, cache->size());
+  BOOST_CHECK(roundTrip(clientFactory, server2.getPort()));
+  BOOST_CHECK(!roundTrip(clientFactory, server1.getPort()));
+
+  cache->invalidate("localhost", server1.getPort());
+  BOOST_CHECK_EQUAL(0u, cache->size());
+}
@@ -0,0 +1,186 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Measures the throughput of TSSLSocket over loopback, with encryption in
+ * user space and with kernel TLS, in each direction.  Kernel TLS falls back
+ * to user space where the kernel lacks the tls module, which the kTLS
+ * columns show.
+ *
+ * Usage: TSSLThroughputBenchmark <key directory> [megabytes] [write size]
+ */
+
+#include <thrift/transport/TSSLServerSocket.h>
+#include <thrift/transport/TSSLSocket.h>
+#include <thrift/transport/TTransportException.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+
+using namespace apache::thrift;
+using namespace apache::thrift::transport;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+std::string keyDir;
+
+void quiet(const char* message) {
+  (void)message;
+}
+
+std::shared_ptr<TSSLSocketFactory> createServerFactory(bool kernelTls) {
+  std::shared_ptr<TSSLSocketFactory> factory(new TSSLSocketFactory());
+  factory->loadCertificate((keyDir + "/server.crt").c_str());
+  factory->loadPrivateKey((keyDir + "/server.key").c_str());
+  factory->server(true);
+  factory->setKernelTls(kernelTls);
+  return factory;
+}
+
+std::shared_ptr<TSSLSocketFactory> createClientFactory(bool kernelTls) {
+  std::shared_ptr<TSSLSocketFactory> factory(new TSSLSocketFactory());
+  factory->authenticate(true);
+  factory->loadTrustedCertificates((keyDir + "/CA.pem").c_str());
+  factory->setKernelTls(kernelTls);
+  return factory;
+}
+
+/**
+ * Reads total bytes from one side and writes them with writes of writeSize
+ * bytes on the other, then has the reader answer with one byte.
+ */
+double transfer(std::shared_ptr<TSSLSocket> writer,
+                std::shared_ptr<TSSLSocket> reader,
+                uint64_t total,
+                uint32_t writeSize) {
+  std::thread readThread([reader, total] {
+    std::vector<uint8_t> buf(64 * 1024);
+    uint64_t left = total;
+    try {
+      while (left > 0) {
+        uint32_t want = static_cast<uint32_t>(std::min<uint64_t>(left, buf.size()));
+        uint32_t got = reader->read(&buf[0], want);
+        if (got == 0) {
+          break;
+        }
+        left -= got;
+      }
+      // the writer fails to read the answer if anything is missing
+      if (left == 0) {
+        uint8_t ack = 1;
+        reader->write(&ack, 1);
+        reader->flush();
+      } else {
+        reader->close();
+      }
+    } catch (TTransportException& e) {
+      std::cerr << "read: " << e.what() << std::endl;
+      reader->close();
+    }
+  });
+
+  std::vector<uint8_t> buf(writeSize, 'x');
+  Clock::time_point start = Clock::now();
+  for (uint64_t sent = 0; sent < total; sent += writeSize) {
+    writer->write(&buf[0], static_cast<uint32_t>(std::min<uint64_t>(writeSize, total - sent)));
+  }
+  writer->flush();
+  uint8_t ack = 0;
+  writer->readAll(&ack, 1);
+  Clock::duration elapsed = Clock::now() - start;
+  readThread.join();
+  return total / (1024.0 * 1024.0)
+         / std::chrono::duration_cast<std::chrono::duration<double> >(elapsed).count();
+}
+
+void run(const std::string& name, bool kernelTls, uint64_t total, uint32_t writeSize) {
+  std::shared_ptr<TSSLSocketFactory> serverFactory = createServerFactory(kernelTls);
+  TSSLServerSocket serverSocket("localhost", 0, serverFactory);
+  serverSocket.listen();
+
+  std::shared_ptr<TSSLSocketFactory> clientFactory = createClientFactory(kernelTls);
+  std::shared_ptr<TSSLSocket> client = clientFactory->createSocket("localhost",
+                                                                   serverSocket.getPort());
+  std::shared_ptr<TSSLSocket> server;
+  std::thread acceptThread([&serverSocket, &server] {
+    server = std::static_pointer_cast<TSSLSocket>(serverSocket.accept());
+    uint8_t hello = 0;
+    server->readAll(&hello, 1);
+  });
+  client->open();
+  // the client speaks first, so that the server accepts and both handshake
+  uint8_t hello = 0;
+  client->write(&hello, 1);
+  client->flush();
+  acceptThread.join();
+
+  double upload = transfer(client, server, total, writeSize);
+  double download = transfer(server, client, total, writeSize);
+
+  std::cout << std::left << std::setw(12) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12) << upload << std::setw(12) << download
+            << std::setw(8) << (client->isKernelTlsSend() ? "yes" : "no") << std::setw(8)
+            << (client->isKernelTlsRecv() ? "yes" : "no") << std::endl;
+
+  client->close();
+  server->close();
+  serverSocket.close();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  uint64_t megabytes = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 512;
+  uint32_t writeSize = argc > 3 ? static_cast<uint32_t>(std::atoi(argv[3])) : 16 * 1024;
+  if (argc < 2 || megabytes == 0 || writeSize == 0) {
+    std::cerr << "Usage: " << argv[0] << " <key directory> [megabytes] [write size]" << std::endl;
+    return 1;
+  }
+  keyDir = argv[1];
+#ifdef HAVE_SIGNAL_H
+  signal(SIGPIPE, SIG_IGN);
+#endif
+  TOutput::instance().setOutputFunction(quiet);
+
+  uint64_t total = megabytes * 1024 * 1024;
+  std::cout << megabytes << " MB each way in writes of " << writeSize << " bytes" << std::endl;
+  std::cout << std::left << std::setw(12) << "mode" << std::right << std::setw(12) << "up MB/s"
+            << std::setw(12) << "down MB/s" << std::setw(8) << "kTLS tx" << std::setw(8)
+            << "kTLS rx" << std::endl;
+  try {
+    run("user space", false, total, writeSize);
+    run("kernel TLS", true, total, writeSize);
+  } catch (TTransportException& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -144,4 +144,33 @@ BOOST_AUTO_TEST_CASE(test_non_interruptable_child_peek) {
   sock1.close();
 }
 
+BOOST_AUTO_TEST_CASE(test_interrupted_child_still_writes) {
+  TServerSocket sock1("localhost", 0);
+  sock1.listen();
+  int port = sock1.getPort();
+  TSocket clientSock("localhost", port);
+  clientSock.open();
+  uint8_t buf[4] = {'a', 'b', 'c', 'd'};
+  clientSock.write(buf, 4);
+  std::shared_ptr<TTransport> accepted = sock1.accept();
+  BOOST_CHECK_EQUAL(4u, accepted->read(buf, 4));
+  clientSock.write(buf, 4);
+  sock1.interruptChildren();
+  // Reads fail even with data waiting, while the response goes out
+  readerWorkerMustThrow(accepted);
+  accepted->write(buf, 4);
+  BOOST_CHECK_EQUAL(4u, clientSock.read(buf, 4));
+  // as do reads of the children accepted later
+  TSocket clientSock2("localhost", port);
+  clientSock2.open();
+  clientSock2.write(buf, 4);
+  std::shared_ptr<TTransport> accepted2 = sock1.accept();
+  readerWorkerMustThrow(accepted2);
+  clientSock.close();
+  clientSock2.close();
+  accepted->close();
+  accepted2->close();
+  sock1.close();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
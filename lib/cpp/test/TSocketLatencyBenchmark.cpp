@@ -0,0 +1,209 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Measures the round trip latency of small messages between a TSocket and
+ * a TServerSocket over loopback, and the time to open connections, with
+ * each of the options of TSocketTuning set on both ends.
+ *
+ * Usage: TSocketLatencyBenchmark [round trips] [message size] [connections]
+ */
+
+#include <thrift/transport/TServerSocket.h>
+#include <thrift/transport/TSocket.h>
+#include <thrift/transport/TSocketTuning.h>
+#include <thrift/transport/TTransportException.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace apache::thrift;
+using namespace apache::thrift::transport;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+void quiet(const char* message) {
+  (void)message;
+}
+
+/// Sends every message it gets back, on one thread per connection.
+class EchoServer {
+public:
+  EchoServer(const TSocketTuning& tuning, uint32_t messageSize)
+    : socket_(new TServerSocket("localhost", 0)), messageSize_(messageSize) {
+    socket_->setSocketTuning(tuning);
+    socket_->listen();
+    thread_ = std::thread([this] { serve(); });
+  }
+
+  ~EchoServer() {
+    socket_->interrupt();
+    thread_.join();
+    socket_->interruptChildren();
+    for (std::thread& thread : connections_) {
+      thread.join();
+    }
+    socket_->close();
+  }
+
+  int getPort() { return socket_->getPort(); }
+
+private:
+  void serve() {
+    for (;;) {
+      std::shared_ptr<TTransport> client;
+      try {
+        client = socket_->accept();
+      } catch (TTransportException&) {
+        return;
+      }
+      connections_.push_back(std::thread([this, client] { echo(client); }));
+    }
+  }
+
+  void echo(std::shared_ptr<TTransport> client) {
+    std::vector<uint8_t> buf(messageSize_);
+    try {
+      for (;;) {
+        client->readAll(&buf[0], messageSize_);
+        client->write(&buf[0], messageSize_);
+      }
+    } catch (TTransportException&) {
+    }
+  }
+
+  std::shared_ptr<TServerSocket> socket_;
+  uint32_t messageSize_;
+  std::thread thread_;
+  std::vector<std::thread> connections_;
+};
+
+int64_t micros(Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+double toMicros(Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1000.0;
+}
+
+void run(const std::string& name,
+         const TSocketTuning& tuning,
+         int roundTrips,
+         uint32_t messageSize,
+         int connections) {
+  EchoServer server(tuning, messageSize);
+
+  // Connection setup, including the first round trip
+  std::vector<uint8_t> buf(messageSize, 'x');
+  Clock::duration connectTotal(0);
+  for (int i = 0; i < connections; ++i) {
+    Clock::time_point start = Clock::now();
+    TSocket socket("localhost", server.getPort());
+    socket.setSocketTuning(tuning);
+    socket.open();
+    socket.write(&buf[0], messageSize);
+    socket.readAll(&buf[0], messageSize);
+    connectTotal += Clock::now() - start;
+  }
+
+  TSocket socket("localhost", server.getPort());
+  socket.setSocketTuning(tuning);
+  socket.open();
+  std::vector<Clock::duration> samples;
+  samples.reserve(roundTrips);
+  for (int i = 0; i < roundTrips; ++i) {
+    Clock::time_point start = Clock::now();
+    socket.write(&buf[0], messageSize);
+    socket.readAll(&buf[0], messageSize);
+    samples.push_back(Clock::now() - start);
+  }
+  socket.close();
+
+  std::sort(samples.begin(), samples.end());
+  Clock::duration total(0);
+  for (const Clock::duration& sample : samples) {
+    total += sample;
+  }
+  std::cout << std::left << std::setw(24) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(10) << toMicros(total / roundTrips)
+            << std::setw(10) << toMicros(samples[samples.size() / 2]) << std::setw(10)
+            << toMicros(samples[samples.size() * 99 / 100]) << std::setw(12)
+            << (connections > 0 ? micros(connectTotal) / connections : 0) << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  int roundTrips = argc > 1 ? std::atoi(argv[1]) : 20000;
+  uint32_t messageSize = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 64;
+  int connections = argc > 3 ? std::atoi(argv[3]) : 200;
+  if (roundTrips <= 0 || messageSize == 0 || connections < 0) {
+    std::cerr << "Usage: " << argv[0] << " [round trips] [message size] [connections]"
+              << std::endl;
+    return 1;
+  }
+  TOutput::instance().setOutputFunction(quiet);
+
+  std::cout << roundTrips << " round trips of " << messageSize << " bytes, " << connections
+            << " connections" << std::endl;
+  std::cout << std::left << std::setw(24) << "option" << std::right << std::setw(10)
+            << "mean us" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+            << std::setw(12) << "connect us" << std::endl;
+
+  std::vector<std::pair<std::string, TSocketTuning> > configs;
+  configs.push_back(std::make_pair("none", TSocketTuning()));
+  TSocketTuning tuning;
+  tuning.busyPollMicros = 50;
+  configs.push_back(std::make_pair("SO_BUSY_POLL 50", tuning));
+  tuning = TSocketTuning();
+  tuning.fastOpen = 256;
+  configs.push_back(std::make_pair("TCP_FASTOPEN", tuning));
+  tuning = TSocketTuning();
+  tuning.quickAck = true;
+  configs.push_back(std::make_pair("TCP_QUICKACK", tuning));
+  tuning = TSocketTuning();
+  tuning.notSentLowat = 16 * 1024;
+  configs.push_back(std::make_pair("TCP_NOTSENT_LOWAT 16k", tuning));
+  tuning = TSocketTuning();
+  tuning.incomingCpu = 0;
+  configs.push_back(std::make_pair("SO_INCOMING_CPU 0", tuning));
+  tuning = TSocketTuning();
+  tuning.tos = 0x10; // IPTOS_LOWDELAY
+  configs.push_back(std::make_pair("IP_TOS lowdelay", tuning));
+  tuning.busyPollMicros = 50;
+  tuning.fastOpen = 256;
+  tuning.quickAck = true;
+  tuning.notSentLowat = 16 * 1024;
+  tuning.incomingCpu = 0;
+  configs.push_back(std::make_pair("all", tuning));
+
+  for (size_t i = 0; i < configs.size(); ++i) {
+    run(configs[i].first, configs[i].second, roundTrips, messageSize, connections);
+  }
+  return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define BOOST_TEST_MODULE TWebSocketServerTest
+#include <boost/test/unit_test.hpp>
+#include <thrift/transport/TWebSocketServer.h>
+#include <memory>
+#include <string>
+
+#include "TestServers.h"
+
+using apache::thrift::test::TrickleTransport;
+using apache::thrift::transport::TTransport;
+using apache::thrift::transport::TWebSocketServer;
+using apache::thrift::transport::webSocketUnmask;
+using std::shared_ptr;
+using std::string;
+
+namespace {
+
+const uint8_t MASK[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+string handshake() {
+  return "GET /chat HTTP/1.1\r\nHost: server.example.com\r\nUpgrade: websocket\r\n"
+         "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+         "Sec-WebSocket-Version: 13\r\n\r\n";
+}
+
+// A frame as a client sends it, masked
+string frame(uint8_t opcode, bool fin, const string& payload) {
+  string f(1, static_cast<char>((fin ? 0x80 : 0) | opcode));
+  if (payload.size() < 126) {
+    f += static_cast<char>(0x80 | payload.size());
+  } else if (payload.size() < 65536) {
+    f += static_cast<char>(0x80 | 126);
+    f += static_cast<char>(payload.size() >> 8);
+    f += static_cast<char>(payload.size());
+  } else {
+    f += static_cast<char>(0x80 | 127);
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      f += static_cast<char>(static_cast<uint64_t>(payload.size()) >> shift);
+    }
+  }
+  f.append((const char*)MASK, 4);
+  for (size_t i = 0; i < payload.size(); ++i) {
+    f += static_cast<char>(payload[i] ^ MASK[i % 4]);
+  }
+  return f;
+}
+
+string payload(size_t len) {
+  string p(len, '\0');
+  for (size_t i = 0; i < len; ++i) {
+    p[i] = static_cast<char>(i * 131 + i / 512);
+  }
+  return p;
+}
+
+// Protocols reach the server through TTransport, as here
+string readAll(TTransport& server, uint32_t len) {
+  string got(len, '\0');
+  if (server.readAll((uint8_t*)&got[0], len) != len) {
+    return "<eof>";
+  }
+  return got;
+}
+
+const uint32_t STEPS[] = {1, 3, 4096};
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(test_websocket_unmask) {
+  string data = payload(200);
+  for (uint32_t offset = 0; offset < 8; ++offset) {
+    for (uint32_t len = 0; len + offset <= data.size(); ++len) {
+      string masked = data;
+      webSocketUnmask((uint8_t*)&masked[offset], len, MASK);
+      for (uint32_t i = 0; i < data.size(); ++i) {
+        bool inside = i >= offset && i < offset + len;
+        uint8_t want = inside ? data[i] ^ MASK[(i - offset) % 4] : data[i];
+        BOOST_REQUIRE_EQUAL(static_cast<uint8_t>(masked[i]), want);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_websocket_fragmented_message) {
+  for (uint32_t step : STEPS) {
+    // The frames may well arrive with the handshake
+    shared_ptr<TrickleTransport> trans(
+        new TrickleTransport(handshake() + frame(0x2, false, "hel") + frame(0x9, true, "ping")
+                                 + frame(0x0, false, "") + frame(0x0, true, "lo world")
+                                 + frame(0x2, true, "second message"),
+                             step));
+    TWebSocketServer<true> websocket(trans);
+    TTransport& server = websocket;
+
+    BOOST_CHECK_EQUAL(readAll(server, 11), "hello world");
+    string output = trans->output();
+    BOOST_CHECK_EQUAL(output.compare(0, 34, "HTTP/1.1 101 Switching Protocols\r\n"), 0);
+    BOOST_CHECK(output.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n")
+                != string::npos);
+    // Unmasked pong with the payload of the ping
+    BOOST_CHECK_EQUAL(output.substr(output.size() - 6), "\x8a\x04ping");
+
+    BOOST_CHECK(server.peek());
+    BOOST_CHECK_EQUAL(readAll(server, 6), "second");
+    BOOST_CHECK(server.peek());
+    BOOST_CHECK_EQUAL(readAll(server, 8), " message");
+    BOOST_CHECK(!server.peek());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_websocket_large_frames) {
+  const string data = payload(300000);
+  for (uint32_t step : STEPS) {
+    if (step == 1) {
+      continue;
+    }
+    // Frames of each length encoding, one message spanning them
+    shared_ptr<TrickleTransport> trans(new TrickleTransport(
+        handshake() + frame(0x2, false, data.substr(0, 100))
+            + frame(0x0, false, data.substr(100, 60000))
+            + frame(0x0, true, data.substr(60100)),
+        step));
+    TWebSocketServer<true> websocket(trans);
+    TTransport& server = websocket;
+
+    BOOST_CHECK(readAll(server, 10) == data.substr(0, 10));
+    // The rest of the first frame can be borrowed in place
+    uint32_t len = 90;
+    const uint8_t* borrowed = server.borrow(nullptr, &len);
+    BOOST_REQUIRE(borrowed != nullptr);
+    BOOST_CHECK_EQUAL(len, 90u);
+    BOOST_CHECK(string((const char*)borrowed, len) == data.substr(10, 90));
+    server.consume(40);
+    BOOST_CHECK(readAll(server, 200000) == data.substr(50, 200000));
+    BOOST_CHECK(readAll(server, 99950) == data.substr(200050));
+    BOOST_CHECK(!server.peek());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_websocket_close) {
+  for (uint32_t step : STEPS) {
+    shared_ptr<TrickleTransport> trans(new TrickleTransport(
+        handshake() + frame(0x2, true, "abc") + frame(0x8, true, string("\x03\xe8", 2) + "bye"),
+        step));
+    TWebSocketServer<true> websocket(trans);
+    TTransport& server = websocket;
+
+    BOOST_CHECK_EQUAL(readAll(server, 3), "abc");
+    BOOST_CHECK_EQUAL(readAll(server, 1), "<eof>");
+    BOOST_CHECK(!trans->isOpen());
+  }
+}
@@ -0,0 +1,203 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TEST_TESTSERVERS_H_
+#define _THRIFT_TEST_TESTSERVERS_H_ 1
+
+#include <thrift/TApplicationException.h>
+#include <thrift/TProcessor.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TThreadedServer.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TServerSocket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+/*
+ * Servers and transports shared by the transport and client tests.  A call
+ * to an EchoServer is a message holding a single string, and so is its reply.
+ */
+
+namespace apache {
+namespace thrift {
+namespace test {
+
+/// Payloads that have stalled a server already
+struct EchoStalls {
+  std::mutex mutex;
+  std::set<std::string> seen;
+};
+
+/// How an EchoProcessor answers
+struct EchoOptions {
+  EchoOptions() : failing(false), exceptions(false) {}
+
+  /// Drop every connection instead of answering
+  bool failing;
+
+  /// Answer "fail" with a TApplicationException
+  bool exceptions;
+
+  /// A payload starting with "slow" stalls every server, unless the servers
+  /// share these; then only the first of them to get it stalls, as a server
+  /// having a hiccup would, and the next one answers it right away
+  std::shared_ptr<EchoStalls> stalls;
+};
+
+/// Echoes its argument, as EchoOptions says
+class EchoProcessor : public TProcessor {
+public:
+  EchoProcessor(const EchoOptions& options = EchoOptions()) : options_(options) {}
+
+  bool process(std::shared_ptr<protocol::TProtocol> in,
+               std::shared_ptr<protocol::TProtocol> out,
+               void*) override {
+    std::string name;
+    protocol::TMessageType type;
+    int32_t seqid;
+    std::string payload;
+    in->readMessageBegin(name, type, seqid);
+    in->readString(payload);
+    in->readMessageEnd();
+    in->getTransport()->readEnd();
+    if (options_.failing) {
+      return false;
+    }
+    if (payload.compare(0, 4, "slow") == 0 && stall(payload)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    if (options_.exceptions && payload == "fail") {
+      TApplicationException x(TApplicationException::INTERNAL_ERROR, "failed");
+      out->writeMessageBegin(name, protocol::T_EXCEPTION, seqid);
+      x.write(out.get());
+    } else {
+      out->writeMessageBegin(name, protocol::T_REPLY, seqid);
+      out->writeString(payload);
+    }
+    out->writeMessageEnd();
+    out->getTransport()->writeEnd();
+    out->getTransport()->flush();
+    return true;
+  }
+
+private:
+  bool stall(const std::string& payload) {
+    if (!options_.stalls) {
+      return true;
+    }
+    std::lock_guard<std::mutex> lock(options_.stalls->mutex);
+    return options_.stalls->seen.insert(payload).second;
+  }
+
+  EchoOptions options_;
+};
+
+/// Counts the connections a server has accepted
+class ConnectionCounter : public server::TServerEventHandler {
+public:
+  ConnectionCounter() : connections(0) {}
+
+  void* createContext(std::shared_ptr<protocol::TProtocol>,
+                      std::shared_ptr<protocol::TProtocol>) override {
+    ++connections;
+    return nullptr;
+  }
+
+  std::atomic<int> connections;
+};
+
+/// Serves a processor on a port of its own until destroyed, framed and
+/// binary unless told otherwise
+struct EchoServer {
+  EchoServer(const EchoOptions& options = EchoOptions(),
+             std::shared_ptr<transport::TTransportFactory> transportFactory
+             = std::make_shared<transport::TFramedTransportFactory>(),
+             std::shared_ptr<protocol::TProtocolFactory> protocolFactory
+             = std::make_shared<protocol::TBinaryProtocolFactory>())
+    : EchoServer(std::make_shared<EchoProcessor>(options), transportFactory, protocolFactory) {}
+
+  EchoServer(std::shared_ptr<TProcessor> processor,
+             std::shared_ptr<transport::TTransportFactory> transportFactory
+             = std::make_shared<transport::TFramedTransportFactory>(),
+             std::shared_ptr<protocol::TProtocolFactory> protocolFactory
+             = std::make_shared<protocol::TBinaryProtocolFactory>())
+    : counter(new ConnectionCounter) {
+    std::shared_ptr<transport::TServerSocket> socket(
+        new transport::TServerSocket("localhost", 0));
+    server.reset(new server::TThreadedServer(processor, socket, transportFactory, protocolFactory));
+    server->setServerEventHandler(counter);
+    thread = std::thread([this] { server->serve(); });
+    while (socket->getPort() == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    port = socket->getPort();
+  }
+
+  ~EchoServer() {
+    server->stop();
+    thread.join();
+  }
+
+  std::shared_ptr<ConnectionCounter> counter;
+  std::shared_ptr<server::TThreadedServer> server;
+  std::thread thread;
+  int port;
+};
+
+/// Hands out its input at most step bytes per read, and keeps what is written
+class TrickleTransport : public transport::TVirtualTransport<TrickleTransport> {
+public:
+  TrickleTransport(const std::string& input, uint32_t step)
+    : in_((uint8_t*)input.data(),
+          static_cast<uint32_t>(input.size()),
+          transport::TMemoryBuffer::COPY),
+      step_(step),
+      open_(true) {}
+
+  bool isOpen() const override { return open_; }
+
+  bool peek() override { return in_.peek(); }
+
+  void close() override { open_ = false; }
+
+  uint32_t read(uint8_t* buf, uint32_t len) { return in_.read(buf, (std::min)(len, step_)); }
+
+  void write(const uint8_t* buf, uint32_t len) { out_.write(buf, len); }
+
+  std::string output() { return out_.getBufferAsString(); }
+
+private:
+  transport::TMemoryBuffer in_;
+  transport::TMemoryBuffer out_;
+  uint32_t step_;
+  bool open_;
+};
+
+} // namespace test
+} // namespace thrift
+} // namespace apache
+
+#endif // #ifndef _THRIFT_TEST_TESTSERVERS_H_
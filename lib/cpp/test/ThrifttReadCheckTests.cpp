@@ -397,8 +397,7 @@ BOOST_AUTO_TEST_CASE(test_theadertransport_zlib_roundtrip) {
   // A run of identical bytes compresses to far fewer bytes than it occupies
   // once expanded again, so the result of the zlib transform is much larger
   // than the frame section it is read from.  This drives the full write/read
-  // round trip through the zlib transform path.  Keep the payload small enough
-  // to stay within the transform buffer the reader sizes from its write buffer.
+  // round trip through the zlib transform path.
   const std::size_t N = 700;
   std::vector<uint8_t> payload(N, 0x42);
 
@@ -415,4 +414,239 @@ BOOST_AUTO_TEST_CASE(test_theadertransport_zlib_roundtrip) {
   BOOST_CHECK(out == payload);
 }
 
+BOOST_AUTO_TEST_CASE(test_theadertransport_zlib_large_frame) {
+  using apache::thrift::transport::THeaderTransport;
+  // Inflates to far more than the buffers of a fresh reader hold
+  std::vector<uint8_t> payload;
+  for (uint32_t i = 0; payload.size() < 256 * 1024; ++i) {
+    std::string line = "line " + std::to_string(i) + "\n";
+    payload.insert(payload.end(), line.begin(), line.end());
+  }
+
+  std::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  std::shared_ptr<THeaderTransport> writer(new THeaderTransport(buffer));
+  writer->setTransform(THeaderTransport::ZLIB_TRANSFORM);
+  std::shared_ptr<THeaderTransport> reader(new THeaderTransport(buffer));
+  for (int i = 0; i < 2; ++i) {
+    writer->write(payload.data(), static_cast<uint32_t>(payload.size()));
+    writer->flush();
+    std::vector<uint8_t> out(payload.size(), 0x00);
+    reader->readAll(out.data(), static_cast<uint32_t>(out.size()));
+    BOOST_CHECK(out == payload);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_theadermap) {
+  using apache::thrift::transport::THeaderMap;
+  THeaderMap headers;
+  headers["a"] = "1";
+  headers["b"] = "2";
+  headers["a"] = "3";
+  BOOST_CHECK_EQUAL(headers.size(), 2u);
+  BOOST_CHECK_EQUAL(headers.find("a")->second, "3");
+  BOOST_CHECK_EQUAL(headers.count("c"), 0u);
+  BOOST_CHECK(headers.find("c") == headers.end());
+
+  // erasing keeps the order the others were set in
+  headers["c"] = "4";
+  BOOST_CHECK_EQUAL(headers.erase("a"), 1u);
+  BOOST_CHECK_EQUAL(headers.erase("a"), 0u);
+  BOOST_CHECK_EQUAL(headers.size(), 2u);
+  BOOST_CHECK_EQUAL(headers.begin()->first, "b");
+  BOOST_CHECK_EQUAL((headers.begin() + 1)->first, "c");
+  headers["a"] = "5";
+  BOOST_CHECK_EQUAL((headers.begin() + 2)->first, "a");
+  BOOST_CHECK_EQUAL(headers.find("a")->second, "5");
+
+  headers.clear();
+  BOOST_CHECK(headers.empty());
+  headers.assign("key", 3, "value", 5);
+  BOOST_CHECK_EQUAL(headers.size(), 1u);
+  BOOST_CHECK_EQUAL(headers["key"], "value");
+  BOOST_CHECK(headers["new"].empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_theadertransport_headers) {
+  using apache::thrift::transport::THeaderTransport;
+  uint8_t byte = 0x42;
+
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  shared_ptr<THeaderTransport> writer(new THeaderTransport(buffer));
+  shared_ptr<THeaderTransport> reader(new THeaderTransport(buffer));
+
+  writer->setHeader("first", "1");
+  writer->setHeader("second", "2");
+  writer->write(&byte, 1);
+  writer->flush();
+  BOOST_CHECK(writer->getWriteHeaders().empty());
+  reader->readAll(&byte, 1);
+  BOOST_CHECK_EQUAL(reader->getHeaders().size(), 2u);
+  BOOST_CHECK_EQUAL(reader->getHeaders().find("second")->second, "2");
+  BOOST_CHECK_EQUAL(reader->getHeaderMap().begin()->first, "first");
+
+  // the headers of one frame do not linger into the next
+  writer->setHeader("third", "3");
+  writer->write(&byte, 1);
+  writer->flush();
+  reader->readAll(&byte, 1);
+  BOOST_CHECK_EQUAL(reader->getHeaders().size(), 1u);
+  BOOST_CHECK_EQUAL(reader->getHeaderMap().size(), 1u);
+  BOOST_CHECK_EQUAL(reader->getHeaders().count("first"), 0u);
+  BOOST_CHECK_EQUAL(reader->getHeaders().find("third")->second, "3");
+
+  // more header than fits in front of the payload
+  std::string value(THeaderTransport::FRAME_HEADROOM * 4, 'v');
+  for (int i = 0; i < 8; ++i) {
+    writer->setHeader("key" + std::to_string(i), value);
+  }
+  writer->write(&byte, 1);
+  writer->flush();
+  byte = 0;
+  reader->readAll(&byte, 1);
+  BOOST_CHECK_EQUAL(byte, 0x42);
+  BOOST_CHECK_EQUAL(reader->getHeaders().size(), 8u);
+  BOOST_CHECK_EQUAL(reader->getHeaders().find("key7")->second, value);
+}
+
+// The transform ids of the header frame in a buffer, which must have
+// protocol id 2 (compact) and at most 127 transforms
+static std::vector<uint16_t> headerFrameTransforms(const shared_ptr<TMemoryBuffer>& buffer) {
+  uint8_t* frame = nullptr;
+  uint32_t size = 0;
+  buffer->getBuffer(&frame, &size);
+  BOOST_REQUIRE_GT(size, 16u);
+  // size (4), magic and flags (4), seqId (4), header size (2), protocol id (1)
+  return std::vector<uint16_t>(frame + 16, frame + 16 + frame[15]);
+}
+
+BOOST_AUTO_TEST_CASE(test_theadertransport_min_compress_size) {
+  using apache::thrift::transport::THeaderTransport;
+  std::vector<uint8_t> small(64, 0x42);
+  std::vector<uint8_t> large(512, 0x42);
+
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  shared_ptr<THeaderTransport> writer(new THeaderTransport(buffer));
+  shared_ptr<THeaderTransport> reader(new THeaderTransport(buffer));
+  writer->setTransform(THeaderTransport::ZLIB_TRANSFORM);
+  writer->setMinCompressSize(128);
+  std::vector<uint8_t> out;
+
+  writer->write(small.data(), static_cast<uint32_t>(small.size()));
+  writer->flush();
+  BOOST_CHECK(headerFrameTransforms(buffer).empty());
+  out.assign(small.size(), 0);
+  reader->readAll(out.data(), static_cast<uint32_t>(out.size()));
+  BOOST_CHECK(out == small);
+
+  writer->write(large.data(), static_cast<uint32_t>(large.size()));
+  writer->flush();
+  BOOST_CHECK_EQUAL(headerFrameTransforms(buffer).size(), 1u);
+  out.assign(large.size(), 0);
+  reader->readAll(out.data(), static_cast<uint32_t>(out.size()));
+  BOOST_CHECK(out == large);
+}
+
+BOOST_AUTO_TEST_CASE(test_theadertransport_answers_in_kind) {
+  using apache::thrift::transport::THeaderTransport;
+  std::vector<uint8_t> payload(256, 0x42);
+  std::vector<uint8_t> out(payload.size(), 0);
+
+  shared_ptr<TMemoryBuffer> requests(new TMemoryBuffer());
+  shared_ptr<TMemoryBuffer> responses(new TMemoryBuffer());
+  shared_ptr<THeaderTransport> client(new THeaderTransport(responses, requests));
+  shared_ptr<THeaderTransport> server(new THeaderTransport(requests, responses));
+  client->setTransform(THeaderTransport::ZLIB_TRANSFORM);
+
+  client->write(payload.data(), static_cast<uint32_t>(payload.size()));
+  client->flush();
+  server->readAll(out.data(), static_cast<uint32_t>(out.size()));
+  BOOST_CHECK(out == payload);
+
+  // the server has no transforms of its own and answers with the client's
+  server->write(payload.data(), static_cast<uint32_t>(payload.size()));
+  server->flush();
+  std::vector<uint16_t> transforms = headerFrameTransforms(responses);
+  BOOST_REQUIRE_EQUAL(transforms.size(), 1u);
+  BOOST_CHECK_EQUAL(transforms[0], THeaderTransport::ZLIB_TRANSFORM);
+  out.assign(payload.size(), 0);
+  client->readAll(out.data(), static_cast<uint32_t>(out.size()));
+  BOOST_CHECK(out == payload);
+}
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+// Sends a payload far larger than the buffers of a fresh reader through the
+// given transform, and one that does not compress
+static void checkCompressionTransform(uint16_t transId,
+                                      std::shared_ptr<const apache::thrift::transport::TZstdDictionary>
+                                          dictionary = nullptr) {
+  using apache::thrift::transport::THeaderTransport;
+  BOOST_REQUIRE(THeaderTransport::isTransformSupported(transId));
+  std::vector<uint8_t> payload;
+  for (uint32_t i = 0; payload.size() < 256 * 1024; ++i) {
+    std::string line = "field " + std::to_string(i % 97) + " = value " + std::to_string(i) + ";";
+    payload.insert(payload.end(), line.begin(), line.end());
+  }
+  std::vector<uint8_t> noise(4096);
+  uint32_t x = 2463534242u;
+  for (size_t i = 0; i < noise.size(); ++i) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    noise[i] = static_cast<uint8_t>(x);
+  }
+
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  shared_ptr<THeaderTransport> writer(new THeaderTransport(buffer));
+  shared_ptr<THeaderTransport> reader(new THeaderTransport(buffer));
+  writer->setTransform(transId);
+  if (dictionary) {
+    writer->setZstdDictionary(dictionary);
+    reader->setZstdDictionary(dictionary);
+  }
+
+  writer->write(payload.data(), static_cast<uint32_t>(payload.size()));
+  writer->flush();
+  uint8_t* frame = nullptr;
+  uint32_t size = 0;
+  buffer->getBuffer(&frame, &size);
+  BOOST_CHECK_LT(size, payload.size() / 2);
+  std::vector<uint16_t> transforms = headerFrameTransforms(buffer);
+  BOOST_REQUIRE_EQUAL(transforms.size(), 1u);
+  BOOST_CHECK_EQUAL(transforms[0], transId);
+  std::vector<uint8_t> out(payload.size(), 0);
+  reader->readAll(out.data(), static_cast<uint32_t>(out.size()));
+  BOOST_CHECK(out == payload);
+
+  // sent as is since compressing would make it larger
+  writer->write(noise.data(), static_cast<uint32_t>(noise.size()));
+  writer->flush();
+  BOOST_CHECK(headerFrameTransforms(buffer).empty());
+  out.assign(noise.size(), 0);
+  reader->readAll(out.data(), static_cast<uint32_t>(out.size()));
+  BOOST_CHECK(out == noise);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+BOOST_AUTO_TEST_CASE(test_theadertransport_zstd_roundtrip) {
+  checkCompressionTransform(apache::thrift::transport::THeaderTransport::ZSTD_TRANSFORM);
+}
+
+BOOST_AUTO_TEST_CASE(test_theadertransport_zstd_dictionary) {
+  using apache::thrift::transport::TZstdDictionary;
+  std::string content;
+  for (int i = 0; i < 97; ++i) {
+    content += "field " + std::to_string(i) + " = value ";
+  }
+  checkCompressionTransform(apache::thrift::transport::THeaderTransport::ZSTD_TRANSFORM,
+                            std::make_shared<TZstdDictionary>(content));
+}
+#endif
+
+#ifdef HAVE_LZ4
+BOOST_AUTO_TEST_CASE(test_theadertransport_lz4_roundtrip) {
+  checkCompressionTransform(apache::thrift::transport::THeaderTransport::LZ4_TRANSFORM);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
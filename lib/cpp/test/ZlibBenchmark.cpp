@@ -0,0 +1,200 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Measures zlib compression in the C++ library, with the data of ZlibTest:
+ * - TZlibTransports that carry one message each, as on short-lived
+ *   connections, with streams of their own and from a TZlibStreamPool
+ * - TZlibTransport streaming at several compression levels and strategies
+ * - whole frames through the ZLIB_TRANSFORM of THeaderTransport, which
+ *   uses libdeflate where built with it
+ *
+ * Usage: ZlibBenchmark [megabytes]
+ */
+
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/THeaderTransport.h>
+#include <thrift/transport/TZlibTransport.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace apache::thrift::transport;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds(Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::duration<double> >(d).count();
+}
+
+// Small runs of alternately increasing and decreasing bytes, as in ZlibTest
+std::vector<uint8_t> compressibleBuffer(size_t len) {
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<uint32_t> runLength(1, 64);
+  std::uniform_int_distribution<uint32_t> byteValue(0, 255);
+  std::vector<uint8_t> buf(len);
+  size_t idx = 0;
+  int step = 1;
+  while (idx < len) {
+    uint32_t run = runLength(rng);
+    auto byte = static_cast<uint8_t>(byteValue(rng));
+    for (uint32_t n = 0; n < run && idx < len; ++n) {
+      buf[idx++] = byte;
+      byte = static_cast<uint8_t>(byte + step);
+    }
+    step = -step;
+  }
+  return buf;
+}
+
+void shortLived(const std::vector<uint8_t>& message, int connections) {
+  std::cout << "one " << message.size() << " byte message per transport" << std::endl;
+  std::cout << std::left << std::setw(20) << "streams" << std::right << std::setw(14)
+            << "us/transport" << std::endl;
+  for (int pooled = 0; pooled < 2; ++pooled) {
+    std::shared_ptr<TZlibStreamPool> pool(pooled ? new TZlibStreamPool() : nullptr);
+    TZlibTransportFactory factory;
+    factory.setStreamPool(pool);
+    std::vector<uint8_t> mirror(message.size());
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < connections; ++i) {
+      std::shared_ptr<TMemoryBuffer> membuf(new TMemoryBuffer());
+      std::shared_ptr<TTransport> writer = factory.getTransport(membuf);
+      writer->write(&message[0], static_cast<uint32_t>(message.size()));
+      writer->flush();
+      std::shared_ptr<TTransport> reader = factory.getTransport(membuf);
+      reader->readAll(&mirror[0], static_cast<uint32_t>(mirror.size()));
+    }
+    Clock::duration elapsed = Clock::now() - start;
+    std::cout << std::left << std::setw(20) << (pooled ? "TZlibStreamPool" : "own")
+              << std::right << std::fixed << std::setprecision(1) << std::setw(14)
+              << seconds(elapsed) * 1e6 / connections << std::endl;
+  }
+}
+
+void streaming(const std::vector<uint8_t>& data, size_t total) {
+  struct Setting {
+    const char* name;
+    int level;
+    int strategy;
+  };
+  const Setting settings[] = {{"level 1", 1, Z_DEFAULT_STRATEGY},
+                              {"level 6", 6, Z_DEFAULT_STRATEGY},
+                              {"level 9", 9, Z_DEFAULT_STRATEGY},
+                              {"level 6 filtered", 6, Z_FILTERED},
+                              {"level 6 rle", 6, Z_RLE},
+                              {"huffman only", 6, Z_HUFFMAN_ONLY}};
+
+  std::cout << std::endl << total / (1024 * 1024) << " MB streamed in " << data.size()
+            << " byte writes" << std::endl;
+  std::cout << std::left << std::setw(20) << "setting" << std::right << std::setw(12)
+            << "ratio" << std::setw(12) << "write MB/s" << std::setw(12) << "read MB/s"
+            << std::endl;
+  for (const Setting& setting : settings) {
+    std::shared_ptr<TMemoryBuffer> membuf(new TMemoryBuffer());
+    TZlibTransportFactory factory;
+    factory.setCompressionLevel(setting.level);
+    factory.setCompressionStrategy(setting.strategy);
+    factory.setBufferSizes(64 * 1024, 64 * 1024, 64 * 1024, 64 * 1024);
+    std::shared_ptr<TTransport> writer = factory.getTransport(membuf);
+    Clock::time_point start = Clock::now();
+    for (size_t sent = 0; sent < total; sent += data.size()) {
+      writer->write(&data[0], static_cast<uint32_t>(data.size()));
+    }
+    std::static_pointer_cast<TZlibTransport>(writer)->finish();
+    Clock::duration writeTime = Clock::now() - start;
+    uint32_t compressed = membuf->available_read();
+
+    std::shared_ptr<TTransport> reader = factory.getTransport(membuf);
+    std::vector<uint8_t> mirror(data.size());
+    start = Clock::now();
+    for (size_t got = 0; got < total; got += mirror.size()) {
+      reader->readAll(&mirror[0], static_cast<uint32_t>(mirror.size()));
+    }
+    Clock::duration readTime = Clock::now() - start;
+
+    double megabytes = total / (1024.0 * 1024.0);
+    std::cout << std::left << std::setw(20) << setting.name << std::right << std::fixed
+              << std::setprecision(2) << std::setw(12)
+              << static_cast<double>(total) / compressed << std::setprecision(1)
+              << std::setw(12) << megabytes / seconds(writeTime) << std::setw(12)
+              << megabytes / seconds(readTime) << std::endl;
+  }
+}
+
+void headerFrames(const std::vector<uint8_t>& data, size_t total) {
+  std::cout << std::endl << "THeaderTransport zlib frames"
+#ifdef HAVE_LIBDEFLATE
+            << " (libdeflate)"
+#else
+            << " (zlib)"
+#endif
+            << std::endl;
+  std::cout << std::left << std::setw(20) << "frame" << std::right << std::setw(12) << "ratio"
+            << std::setw(12) << "MB/s" << std::endl;
+  const uint32_t sizes[] = {1024, 16 * 1024, 256 * 1024};
+  for (uint32_t size : sizes) {
+    std::shared_ptr<TMemoryBuffer> membuf(new TMemoryBuffer());
+    THeaderTransport writer(membuf);
+    THeaderTransport reader(membuf);
+    writer.setTransform(THeaderTransport::ZLIB_TRANSFORM);
+    std::vector<uint8_t> mirror(size);
+    uint64_t compressed = 0;
+    size_t frames = total / size;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < frames; ++i) {
+      writer.write(&data[0], size);
+      writer.flush();
+      compressed += membuf->available_read();
+      reader.readAll(&mirror[0], size);
+      membuf->resetBuffer();
+    }
+    Clock::duration elapsed = Clock::now() - start;
+    std::cout << std::left << std::setw(20) << (std::to_string(size) + " bytes") << std::right
+              << std::fixed << std::setprecision(2) << std::setw(12)
+              << static_cast<double>(frames) * size / compressed << std::setprecision(1)
+              << std::setw(12) << frames * size / (1024.0 * 1024.0) / seconds(elapsed)
+              << std::endl;
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  size_t megabytes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+  if (megabytes == 0) {
+    std::cerr << "Usage: " << argv[0] << " [megabytes]" << std::endl;
+    return 1;
+  }
+  std::vector<uint8_t> data = compressibleBuffer(256 * 1024);
+
+  shortLived(std::vector<uint8_t>(data.begin(), data.begin() + 256), 20000);
+  streaming(std::vector<uint8_t>(data.begin(), data.begin() + 32 * 1024),
+            megabytes * 1024 * 1024);
+  headerFrames(data, megabytes * 1024 * 1024);
+  return 0;
+}
@@ -372,6 +372,89 @@ void test_message_size_limit() {
   }
 }
 
+void test_stream_pool() {
+  const uint32_t buf_len = 1024 * 32;
+  boost::shared_array<uint8_t> buf = gen_compressible_buffer(buf_len);
+  shared_ptr<TZlibStreamPool> pool(new TZlibStreamPool(2));
+
+  // Streams go back to the pool with whatever state they were in
+  for (int i = 0; i < 3; ++i) {
+    shared_ptr<TMemoryBuffer> membuf(new TMemoryBuffer());
+    {
+      TZlibTransport writer(membuf,
+                            TZlibTransport::DEFAULT_URBUF_SIZE,
+                            TZlibTransport::DEFAULT_CRBUF_SIZE,
+                            TZlibTransport::DEFAULT_UWBUF_SIZE,
+                            TZlibTransport::DEFAULT_CWBUF_SIZE,
+                            Z_DEFAULT_COMPRESSION,
+                            nullptr,
+                            Z_DEFAULT_STRATEGY,
+                            pool);
+      writer.write(buf.get(), buf_len);
+      writer.finish();
+    }
+    {
+      TZlibTransport reader(membuf,
+                            TZlibTransport::DEFAULT_URBUF_SIZE,
+                            TZlibTransport::DEFAULT_CRBUF_SIZE,
+                            TZlibTransport::DEFAULT_UWBUF_SIZE,
+                            TZlibTransport::DEFAULT_CWBUF_SIZE,
+                            Z_DEFAULT_COMPRESSION,
+                            nullptr,
+                            Z_DEFAULT_STRATEGY,
+                            pool);
+      // read only part of it, so that the stream is returned midway
+      boost::shared_array<uint8_t> mirror(new uint8_t[buf_len]);
+      uint32_t len = i == 1 ? buf_len / 2 : buf_len;
+      BOOST_REQUIRE_EQUAL(reader.readAll(mirror.get(), len), len);
+      BOOST_CHECK_EQUAL(memcmp(mirror.get(), buf.get(), len), 0);
+      if (len == buf_len) {
+        reader.verifyChecksum();
+      }
+    }
+    BOOST_CHECK_EQUAL(pool->getIdleCount(), 2u);
+  }
+
+  // Streams of another level are not shared, and no more than 2 of each
+  // kind are kept
+  {
+    shared_ptr<TZlibTransportFactory> factory(new TZlibTransportFactory());
+    factory->setStreamPool(pool);
+    shared_ptr<TTransport> a = factory->getTransport(shared_ptr<TMemoryBuffer>(new TMemoryBuffer()));
+    BOOST_CHECK_EQUAL(pool->getIdleCount(), 0u);
+    factory->setCompressionLevel(1);
+    shared_ptr<TTransport> b = factory->getTransport(shared_ptr<TMemoryBuffer>(new TMemoryBuffer()));
+    shared_ptr<TTransport> c = factory->getTransport(shared_ptr<TMemoryBuffer>(new TMemoryBuffer()));
+    BOOST_CHECK_EQUAL(std::static_pointer_cast<TZlibTransport>(b)->getCompressionLevel(), 1);
+  }
+  BOOST_CHECK_EQUAL(pool->getIdleCount(), 4u);
+}
+
+void test_compression_strategy() {
+  const uint32_t buf_len = 1024 * 32;
+  boost::shared_array<uint8_t> buf = gen_compressible_buffer(buf_len);
+  const int strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED};
+  for (int strategy : strategies) {
+    shared_ptr<TMemoryBuffer> membuf(new TMemoryBuffer());
+    shared_ptr<TZlibTransportFactory> factory(new TZlibTransportFactory());
+    factory->setCompressionLevel(1);
+    factory->setCompressionStrategy(strategy);
+    factory->setBufferSizes(4096, 4096, 4096, 4096);
+    shared_ptr<TZlibTransport> zlib_trans
+        = std::static_pointer_cast<TZlibTransport>(factory->getTransport(membuf));
+    BOOST_CHECK_EQUAL(zlib_trans->getCompressionStrategy(), strategy);
+    zlib_trans->write(buf.get(), buf_len);
+    zlib_trans->finish();
+    BOOST_CHECK_LT(membuf->available_read(), buf_len);
+
+    boost::shared_array<uint8_t> mirror(new uint8_t[buf_len]);
+    uint32_t got = zlib_trans->readAll(mirror.get(), buf_len);
+    BOOST_REQUIRE_EQUAL(got, buf_len);
+    BOOST_CHECK_EQUAL(memcmp(mirror.get(), buf.get(), buf_len), 0);
+    zlib_trans->verifyChecksum();
+  }
+}
+
 /*
  * Initialization
  */
@@ -476,6 +559,8 @@ bool init_unit_test_suite() {
   suite->add(BOOST_TEST_CASE(test_no_write));
   suite->add(BOOST_TEST_CASE(test_get_underlying_transport));
   suite->add(BOOST_TEST_CASE(test_message_size_limit));
+  suite->add(BOOST_TEST_CASE(test_stream_pool));
+  suite->add(BOOST_TEST_CASE(test_compression_strategy));
 
   return true;
 }
@@ -504,6 +589,8 @@ boost::unit_test::test_suite* init_unit_test_suite(int argc, char* argv[]) {
   suite->add(BOOST_TEST_CASE(test_no_write));
   suite->add(BOOST_TEST_CASE(test_get_underlying_transport));
   suite->add(BOOST_TEST_CASE(test_message_size_limit));
+  suite->add(BOOST_TEST_CASE(test_stream_pool));
+  suite->add(BOOST_TEST_CASE(test_compression_strategy));
 
   return nullptr;
 }